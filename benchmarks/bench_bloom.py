@@ -0,0 +1,60 @@
+"""Matching over many archived files, with and without bloom filters
+
+Opens the journal and reads the entries of one _SYSTEMD_UNIT, of a rare
+unit found in few of the files and of a common one found in all: without
+bloom filters, with filters built on opening, and with filters loaded
+from the sidecar files kept by an earlier opening.  With --cold, files
+are evicted from the page cache before each run, as for archives not
+read since boot.
+"""
+
+import atexit
+import shutil
+import tempfile
+
+import pyjournalctl
+
+import common
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--files", type=int, default=100,
+                        help="number of journal files generated "
+                             "(default 100)")
+    parser.add_argument("--cold", action="store_true",
+                        help="evict journal files from the page cache "
+                             "before each run")
+    args = parser.parse_args()
+    path = common.journal_dir(args, files=args.files)
+    sidecars = tempfile.mkdtemp(prefix="pyjournalctl-bench-bloom-")
+    atexit.register(shutil.rmtree, sidecars, True)
+    setup = (lambda: common.drop_cache(path)) if args.cold else None
+
+    for unit in (common.RARE_UNIT, common.UNITS[0]):
+        def read(**kwargs):
+            journal = pyjournalctl.Journal(path=path, **kwargs)
+            journal.add_match(_SYSTEMD_UNIT=unit)
+            return len(list(journal)), journal.bloom_info()
+
+        def built():
+            # A new sidecar directory for each run, so filters are built
+            fresh = tempfile.mkdtemp(dir=sidecars)
+            return read(bloom=fresh)
+
+        seconds, (n, _) = common.best(read, args.repeat, setup)
+        rows = [("no bloom", seconds, "%d entries" % n)]
+        for name, func in (("bloom, filters built", built),
+                           ("bloom, sidecars loaded",
+                            lambda: read(bloom=sidecars))):
+            seconds, (n, info) = common.best(func, args.repeat, setup)
+            rows.append((name, seconds,
+                         "%d entries, %d of %d files pruned, %d built" % (
+                             n, info["pruned"], info["files"],
+                             info["built"])))
+        common.report("Entries of %s%s" % (unit, ", cold" if args.cold else ""),
+                      rows)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+"""Fetching entries by cursor with get_by_cursors(), against seeking
+
+Reads the entries at randomly chosen cursors, as saved by an
+application, with seek_cursor() and get_next() for each, and with
+get_by_cursors().  Each run opens the journal anew; with --cold, journal
+files are evicted from the page cache before it.
+
+After seek_cursor(), get_next() finds the entry by looking up the
+position in every file, whereas get_by_cursors() reads the entries of
+each file from a handle on it alone, in file order: the gain grows with
+the number of files, as of a journal kept for months, rotated daily.
+With few files the time taken is mostly that of converting entries,
+the same both ways.
+"""
+
+import random
+
+import pyjournalctl
+
+import common
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--cursors", type=int, nargs="+", default=[100, 1000],
+                        help="numbers of cursors (default 100 and 1000)")
+    parser.add_argument("--files", type=int, default=64,
+                        help="number of journal files generated "
+                             "(default 64)")
+    parser.add_argument("--cold", action="store_true",
+                        help="evict journal files from the page cache "
+                             "before each run")
+    args = parser.parse_args()
+    path = common.journal_dir(args, files=args.files)
+    setup = (lambda: common.drop_cache(path)) if args.cold else None
+    cursors = [e["__CURSOR"] for e in pyjournalctl.Journal(path=path).entries(
+        fields=["__CURSOR"])]
+    rng = random.Random(1)
+
+    for n in args.cursors:
+        chosen = rng.sample(cursors, min(n, len(cursors)))
+
+        def seek():
+            journal = pyjournalctl.Journal(path=path)
+            entries = []
+            for cursor in chosen:
+                journal.seek_cursor(cursor)
+                entries.append(journal.get_next())
+            return entries
+        seconds, expected = common.best(seek, args.repeat, setup)
+        rows = [("seek_cursor() and get_next()", seconds,
+                 "%d entries" % len(expected))]
+        seconds, entries = common.best(
+            lambda: pyjournalctl.Journal(path=path).get_by_cursors(chosen),
+            args.repeat, setup)
+        rows.append(("get_by_cursors()", seconds,
+                     "same entries" if entries == expected
+                     else "DIFFERENT ENTRIES"))
+        common.report("Entries at %d random cursors of %d%s" % (
+            len(chosen), len(cursors), ", cold" if args.cold else ""), rows)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,62 @@
+"""Scaling of parallel_scan() over workers, against a Python loop
+
+Counts entries by _SYSTEMD_UNIT over the journal, and over its middle
+half by time, with a loop over entries() and with the native count_by
+aggregate of parallel_scan() on 1 to N workers.
+"""
+
+import collections
+import os
+
+import pyjournalctl
+
+import common
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--workers", type=int, nargs="+",
+                        default=sorted({1, 2, 4, os.cpu_count() or 1}),
+                        help="numbers of workers (default 1, 2, 4 and the "
+                             "number of CPUs)")
+    args = parser.parse_args()
+    path = common.journal_dir(args)
+    journal = pyjournalctl.Journal(path=path)
+    journal.seek_head()
+    first = journal.get_next()["__REALTIME_TIMESTAMP"]
+    journal.seek_tail()
+    last = journal.get_previous()["__REALTIME_TIMESTAMP"]
+
+    for since, until, title in (
+            (None, None, "whole journal"),
+            (first + (last - first) / 4, last - (last - first) / 4,
+             "middle half by time")):
+        def loop():
+            if since is None:
+                journal.seek_head()
+            else:
+                journal.seek_realtime(since)
+            counts = collections.Counter()
+            for e in journal.entries(fields=["_SYSTEMD_UNIT",
+                                             "__REALTIME_TIMESTAMP"]):
+                if until is not None and e["__REALTIME_TIMESTAMP"] >= until:
+                    break
+                counts[e.get("_SYSTEMD_UNIT")] += 1
+            counts.pop(None, None)
+            return counts
+        seconds, expected = common.best(loop, args.repeat)
+        rows = [("entries() loop", seconds,
+                 "%d entries" % sum(expected.values()))]
+        for workers in args.workers:
+            seconds, counts = common.best(
+                lambda: journal.parallel_scan(
+                    ("count_by", "_SYSTEMD_UNIT"), since=since, until=until,
+                    workers=workers), args.repeat)
+            rows.append(("parallel_scan, %d workers" % workers, seconds,
+                         "same counts" if counts == expected
+                         else "DIFFERENT COUNTS"))
+        common.report("Counting by _SYSTEMD_UNIT, %s" % title, rows)
+
+
+if __name__ == "__main__":
+    main()
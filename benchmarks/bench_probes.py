@@ -0,0 +1,85 @@
+"""Overhead of the USDT probes, not attached, on per-entry calls
+
+Times loops of get_next(), of get_next() with a converter in call_dict
+and of seek_realtime() with the module built in each --build directory,
+such as one built with PYJOURNALCTL_USDT set and one without, each in its
+own process.  With no --build, the module found on the path is timed.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+import common
+
+
+def child(build, path, repeat):
+    """Prints timings of the module in directory build"""
+    if build:
+        sys.path.insert(0, build)
+    import pyjournalctl
+
+    journal = pyjournalctl.Journal(path=path)
+    journal.seek_head()
+    first = journal.get_next()["__REALTIME_TIMESTAMP"]
+    journal.seek_tail()
+    last = journal.get_previous()["__REALTIME_TIMESTAMP"]
+
+    def next_loop(journal):
+        journal.seek_head()
+        n = 0
+        while journal.get_next():
+            n += 1
+        return n
+
+    def seek_loop():
+        step = (last - first) / 1000
+        for i in range(1000):
+            journal.seek_realtime(first + i * step)
+        return 1000
+
+    converted = pyjournalctl.Journal(
+        path=path, call_dict={"_PID": lambda v: int(v)})
+    timings = {}
+    for name, func in (("get_next()", lambda: next_loop(journal)),
+                       ("get_next(), converting _PID",
+                        lambda: next_loop(converted)),
+                       ("seek_realtime()", seek_loop)):
+        seconds, n = common.best(func, repeat)
+        timings[name] = (seconds, n)
+    print(json.dumps({"build": os.path.dirname(pyjournalctl.__file__),
+                      "timings": timings}))
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--build", action="append", default=[],
+                        help="directory of a built module, may be repeated")
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+    if args.child is not None:
+        child(args.child, args.path, args.repeat)
+        return
+    path = common.journal_dir(args)
+
+    results = []
+    for build in args.build or [""]:
+        output = subprocess.run(
+            [sys.executable, os.path.abspath(__file__), "--path", path,
+             "--repeat", str(args.repeat),
+             "--child", os.path.abspath(build) if build else ""],
+            check=True, stdout=subprocess.PIPE, text=True).stdout
+        results.append(json.loads(output))
+    for name in results[0]["timings"]:
+        rows = []
+        for result in results:
+            seconds, n = result["timings"][name]
+            rows.append((result["build"], seconds,
+                         "%.0f ns per call" % (seconds / n * 1e9)))
+        common.report("%s loop" % name, rows)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,43 @@
+"""Cost of sampling entries, against reading all of them
+
+Sampling in Python still reads and converts every entry to drop most of
+them; sample() and reservoir() pass over entries not kept without
+reading them, so their time follows the size of the sample.
+"""
+
+import random
+
+import pyjournalctl
+
+import common
+
+
+def main():
+    args = common.parser(__doc__.split("\n")[0]).parse_args()
+    path = common.journal_dir(args)
+
+    def run(func):
+        def timed():
+            journal = pyjournalctl.Journal(path=path)
+            return len(func(journal))
+        seconds, n = common.best(timed, args.repeat)
+        return seconds, "%d entries" % n
+
+    rows = [("all entries",) + run(list)]
+    rng = random.Random(1)
+    rows.append(("rate=0.01 in Python",) + run(
+        lambda journal: [e for e in journal if rng.random() < 0.01]))
+    for rate in (0.1, 0.01, 0.001):
+        rows.append(("sample(rate=%g)" % rate,) + run(
+            lambda journal: list(journal.sample(rate=rate, seed=1))))
+    for every in (10, 100, 1000):
+        rows.append(("sample(every=%d)" % every,) + run(
+            lambda journal: list(journal.sample(every=every))))
+    for k in (10000, 1000, 100):
+        rows.append(("reservoir(%d)" % k,) + run(
+            lambda journal: journal.reservoir(k, seed=1)))
+    common.report("Sampling entries, as against reading all", rows)
+
+
+if __name__ == "__main__":
+    main()
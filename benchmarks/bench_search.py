@@ -0,0 +1,59 @@
+"""Word search of MESSAGE through the index, against a linear scan
+
+Builds the word index with update_index(), then finds the entries whose
+MESSAGE has a rare word, and a common one, with search() and with a scan
+of MESSAGE over all entries.
+"""
+
+import atexit
+import os
+import re
+import shutil
+import tempfile
+
+import pyjournalctl
+
+import common
+
+
+def main():
+    args = common.parser(__doc__.split("\n")[0]).parse_args()
+    path = common.journal_dir(args)
+    directory = tempfile.mkdtemp(prefix="pyjournalctl-bench-index-")
+    atexit.register(shutil.rmtree, directory, True)
+    journal = pyjournalctl.Journal(path=path)
+
+    def build():
+        # A new index for each run, so all entries are added
+        index = os.path.join(tempfile.mkdtemp(dir=directory), "index")
+        return index, journal.update_index(index)
+    seconds, (index, n) = common.best(build, args.repeat)
+    updated, _ = common.best(lambda: journal.update_index(index), args.repeat)
+    common.report("Index of MESSAGE words", [
+        ("update_index(), new", seconds, "%d entries, %.1f MiB" % (
+            n, os.path.getsize(index) / 2**20)),
+        ("update_index(), up to date", updated, "0 entries")])
+
+    for word in (common.RARE_WORD, common.WORDS[2]):
+        pattern = re.compile(r"\b%s\b" % re.escape(word), re.IGNORECASE)
+
+        def scan():
+            journal.seek_head()
+            return [e for e in journal.entries(fields=["MESSAGE"])
+                    if pattern.search(e["MESSAGE"])]
+        seconds, expected = common.best(scan, args.repeat)
+        rows = [("scan of MESSAGE", seconds, "%d entries" % len(expected))]
+        seconds, found = common.best(
+            lambda: journal.search(word, fields=["MESSAGE"]), args.repeat)
+        rows.append(("search()", seconds, "same entries" if found == expected
+                     else "DIFFERENT ENTRIES"))
+        seconds, found = common.best(
+            lambda: journal.search(word, 100, fields=["MESSAGE"]),
+            args.repeat)
+        rows.append(("search(), limit 100", seconds,
+                     "%d entries" % len(found)))
+        common.report("Entries with %r" % word, rows)
+
+
+if __name__ == "__main__":
+    main()
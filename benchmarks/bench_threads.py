@@ -0,0 +1,113 @@
+"""Scaling of journal scans over threads and sub-interpreters
+
+Each worker reads the whole journal through its own Journal and counts
+entries by _SYSTEMD_UNIT in Python, so N workers do N times the work:
+with perfect scaling the time stays flat as workers are added.  Threads
+share the GIL unless Python is a free-threaded build; sub-interpreters
+each have their own GIL, on Python versions providing them.
+"""
+
+import os
+import sys
+import threading
+
+import common
+
+SCAN = """
+import collections
+import sys
+sys.path[:0] = %r
+import pyjournalctl
+journal = pyjournalctl.Journal(path=%r)
+counts = collections.Counter(
+    e["_SYSTEMD_UNIT"] for e in journal.entries(fields=["_SYSTEMD_UNIT"]))
+"""
+
+
+def interpreter_runner():
+    """Function running code in a new interpreter with its own GIL, or
+    None if not available"""
+    try:
+        from concurrent import interpreters
+    except ImportError:
+        pass
+    else:
+        def run(code):
+            interp = interpreters.create()
+            try:
+                interp.exec(code)
+            finally:
+                interp.close()
+        return run
+    try:
+        import _interpreters
+    except ImportError:
+        pass
+    else:
+        def run(code):
+            interp = _interpreters.create()
+            try:
+                error = _interpreters.exec(interp, code)
+                if error is not None:
+                    raise RuntimeError(error)
+            finally:
+                _interpreters.destroy(interp)
+        return run
+    if sys.version_info >= (3, 12):
+        try:
+            import _xxsubinterpreters
+        except ImportError:
+            return None
+
+        def run(code):
+            interp = _xxsubinterpreters.create(isolated=True)
+            try:
+                _xxsubinterpreters.run_string(interp, code)
+            finally:
+                _xxsubinterpreters.destroy(interp)
+        return run
+    return None
+
+
+def run_workers(workers, func, code):
+    threads = [threading.Thread(target=func, args=(code,))
+               for _ in range(workers)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--workers", type=int, nargs="+",
+                        default=sorted({1, 2, 4, os.cpu_count() or 1}),
+                        help="numbers of workers (default 1, 2, 4 and the "
+                             "number of CPUs)")
+    args = parser.parse_args()
+    path = common.journal_dir(args)
+    code = SCAN % (sys.path[:2], path)
+
+    gil = getattr(sys, "_is_gil_enabled", lambda: True)()
+    models = [("threads, GIL %s" % ("enabled" if gil else "disabled"),
+               lambda code: exec(code, {}))]
+    runner = interpreter_runner()
+    if runner:
+        models.append(("sub-interpreters", runner))
+    else:
+        print("Sub-interpreters with their own GIL are not available on "
+              "Python %d.%d" % sys.version_info[:2])
+
+    for name, func in models:
+        rows = []
+        for workers in args.workers:
+            seconds, _ = common.best(
+                lambda: run_workers(workers, func, code), args.repeat)
+            rows.append(("%d workers" % workers, seconds / workers,
+                         "%.4fs for all" % seconds))
+        common.report("%s: time per scan of the journal, and scaling"
+                      % name, rows)
+
+
+if __name__ == "__main__":
+    main()
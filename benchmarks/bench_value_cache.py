@@ -0,0 +1,70 @@
+"""Time and memory of holding all entries, with and without value_cache
+
+Reads every entry into a list, as an in-memory buffer would, without the
+value cache and with it at several sizes.  Each size is measured in its
+own process, for the growth in resident memory of holding the entries.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+import pyjournalctl
+
+import common
+
+
+def rss():
+    with open("/proc/self/statm") as f:
+        return int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+
+
+def child(path, value_cache, repeat):
+    """Prints timing, memory and hit rate of one value_cache size"""
+    seconds, _ = common.best(
+        lambda: list(pyjournalctl.Journal(path=path,
+                                          value_cache=value_cache)),
+        repeat)
+    before = rss()
+    journal = pyjournalctl.Journal(path=path, value_cache=value_cache)
+    entries = list(journal)
+    grown = rss() - before
+    info = journal.value_cache_info()
+    lookups = info["hits"] + info["misses"]
+    print(json.dumps({"seconds": seconds, "rss": grown,
+                      "entries": len(entries),
+                      "hits": info["hits"] / lookups if lookups else 0}))
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--sizes", type=int, nargs="+",
+                        default=[0, 16, 256, 4096],
+                        help="value_cache sizes, 0 for none (default 0, 16, "
+                             "256 and 4096)")
+    parser.add_argument("--child", type=int, help=argparse.SUPPRESS)
+    args = parser.parse_args()
+    if args.child is not None:
+        child(args.path, args.child, args.repeat)
+        return
+    path = common.journal_dir(args)
+
+    rows = []
+    for size in args.sizes:
+        output = subprocess.run(
+            [sys.executable, os.path.abspath(__file__), "--path", path,
+             "--repeat", str(args.repeat), "--child", str(size)],
+            check=True, stdout=subprocess.PIPE, text=True).stdout
+        result = json.loads(output)
+        rows.append(("value_cache=%d" % size if size else "no value_cache",
+                     result["seconds"],
+                     "%d entries held in %+.1f MiB, %.0f%% hits" % (
+                         result["entries"], result["rss"] / 2**20,
+                         100 * result["hits"])))
+    common.report("Reading all entries into a list", rows)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,119 @@
+"""Rate of writing entries with JournalWriter, against Python sends
+
+Sends entries by journald's native protocol with JournalWriter at
+several batch sizes, and with a datagram built and sent per entry in
+Python, as systemd.journal.send() does, which is also timed if
+installed.  Entries go to a socket like journald's, drained by a thread,
+or with --journald to journald itself.
+"""
+
+import os
+import socket
+import tempfile
+import threading
+
+import pyjournalctl
+
+import common
+
+JOURNALD = "/run/systemd/journal/socket"
+
+
+class Drain:
+    """Counts datagrams received on a socket at path, in a thread"""
+
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        self.sock.bind(path)
+        self.sock.settimeout(0.05)
+        self.received = 0
+        self.stopping = False
+        self.thread = threading.Thread(target=self.run)
+        self.thread.start()
+
+    def run(self):
+        buf = bytearray(1 << 16)
+        while True:
+            try:
+                self.sock.recv_into(buf)
+            except socket.timeout:
+                # Stopped once all sent have been received
+                if self.stopping:
+                    break
+                continue
+            self.received += 1
+
+    def close(self):
+        self.stopping = True
+        self.thread.join()
+        self.sock.close()
+
+
+def python_send(path, entries):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    try:
+        for fields in entries:
+            sock.sendto(b"".join(
+                b"%s=%s\n" % (name.encode(), str(value).encode())
+                for name, value in fields.items()), path)
+    finally:
+        sock.close()
+
+
+def writer_send(path, entries, batch_size):
+    with pyjournalctl.JournalWriter(path=path,
+                                    batch_size=batch_size) as writer:
+        for fields in entries:
+            writer.send(fields)
+
+
+def main():
+    parser = common.parser(__doc__.split("\n")[0])
+    parser.add_argument("--journald", action="store_true",
+                        help="send to journald at %s" % JOURNALD)
+    args = parser.parse_args()
+    # Fields which may be sent, not those set by journald
+    entries = [{name: value for name, value in fields.items()
+                if not name.startswith("_")}
+               for fields, _ in common.make_entries(args.entries)]
+    drain = None
+    if args.journald:
+        path = JOURNALD
+    else:
+        directory = tempfile.TemporaryDirectory(prefix="pyjournalctl-bench-")
+        path = os.path.join(directory.name, "socket")
+        drain = Drain(path)
+
+    senders = [("Python sendto() per entry",
+                lambda: python_send(path, entries))]
+    if args.journald:
+        try:
+            from systemd import journal
+        except ImportError:
+            print("systemd.journal is not installed")
+        else:
+            senders.append(("systemd.journal.send()",
+                            lambda: [journal.send(**fields)
+                                     for fields in entries]))
+    for batch_size in (1, 8, 64):
+        senders.append(("JournalWriter, batch_size=%d" % batch_size,
+                        lambda: writer_send(path, entries, batch_size)))
+
+    rows = []
+    try:
+        for name, func in senders:
+            seconds, _ = common.best(func, args.repeat)
+            rows.append((name, seconds,
+                         "%.0f entries/s" % (len(entries) / seconds)))
+    finally:
+        if drain:
+            drain.close()
+            directory.cleanup()
+    common.report("Sending %d entries to %s" % (len(entries), path), rows)
+    if drain:
+        print("%d of %d entries received" % (
+            drain.received, len(entries) * len(senders) * args.repeat))
+
+
+if __name__ == "__main__":
+    main()
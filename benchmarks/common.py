@@ -0,0 +1,117 @@
+"""Shared setup of the benchmarks: a journal directory, and timings
+
+Each benchmark reads the journal directory given by --path, or else one
+of --entries generated entries written to a temporary directory by the
+journal file writer of the tests.  Timings are the best of --repeat runs.
+"""
+
+import argparse
+import atexit
+import os
+import random
+import shutil
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+# The module as built in place, and the journal file writer
+sys.path[:0] = [ROOT, os.path.join(ROOT, "tests")]
+
+from journalfile import write_journal  # noqa: E402
+
+BASE = 1700000000000000
+UNITS = ["unit%d.service" % n for n in range(200)]
+WORDS = ["accepted", "closed", "connection", "from", "session", "opened",
+         "started", "stopped", "request", "timeout", "retrying", "user",
+         "failed", "reset", "by", "peer", "reload", "config", "done"]
+# In one entry of RARE_EVERY
+RARE_WORD = "overheated"
+RARE_UNIT = "rare.service"
+RARE_EVERY = 10000
+
+
+def make_entries(n, seed=1, start=BASE, step=1000):
+    """Entries as of a busy host: a few hundred units, most entries from
+    a few of them, and messages of common words with numbers
+    """
+    rng = random.Random(seed)
+    for i in range(n):
+        unit = UNITS[min(int(rng.expovariate(0.05)), len(UNITS) - 1)]
+        words = rng.sample(WORDS, 4)
+        if i % RARE_EVERY == RARE_EVERY // 2:
+            words[0], unit = RARE_WORD, RARE_UNIT
+        yield ({"MESSAGE": "%s %s %s %s %d in %d ms" % (
+                    tuple(words) + (i, rng.randrange(1000))),
+                "PRIORITY": str(rng.choice((3, 4, 5, 6, 6, 6, 7))),
+                "_SYSTEMD_UNIT": unit,
+                "SYSLOG_IDENTIFIER": unit.split(".")[0],
+                "_PID": str(1000 + UNITS.index(unit) if unit in UNITS
+                            else 999),
+                "_HOSTNAME": "host%d" % rng.randrange(4),
+                "_TRANSPORT": rng.choice(("journal", "stdout", "syslog"))},
+               start + i * step)
+
+
+def parser(description, entries=100000):
+    parser = argparse.ArgumentParser(description=description)
+    parser.add_argument("--path",
+                        help="journal directory to read, rather than one "
+                             "generated")
+    parser.add_argument("--entries", type=int, default=entries,
+                        help="number of entries generated (default %d)"
+                             % entries)
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs of each timing, the best taken "
+                             "(default 3)")
+    return parser
+
+
+def journal_dir(args, files=8, entries=None):
+    """Directory of args.path, or of generated entries in `files` files"""
+    if args.path:
+        return args.path
+    path = tempfile.mkdtemp(prefix="pyjournalctl-bench-")
+    atexit.register(shutil.rmtree, path, True)
+    print("Writing %d entries to %s" % (args.entries, path), file=sys.stderr)
+    write_journal(path, entries if entries is not None
+                  else make_entries(args.entries), files=files)
+    return path
+
+
+def drop_cache(path):
+    """Evict the journal files under path from the page cache, as if not
+    read since boot"""
+    for directory, _, names in os.walk(path):
+        for name in names:
+            fd = os.open(os.path.join(directory, name), os.O_RDONLY)
+            try:
+                os.fdatasync(fd)
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+            finally:
+                os.close(fd)
+
+
+def best(func, repeat=3, setup=None):
+    """Best time of `repeat` calls of func, each after any setup, and the
+    result of the last"""
+    times = []
+    for _ in range(repeat):
+        if setup is not None:
+            setup()
+        start = time.perf_counter()
+        result = func()
+        times.append(time.perf_counter() - start)
+    return min(times), result
+
+
+def report(title, rows):
+    """Print rows of (name, seconds[, note]), as against the first"""
+    print(title)
+    width = max(len(row[0]) for row in rows)
+    for row in rows:
+        name, seconds = row[:2]
+        note = row[2] if len(row) > 2 else ""
+        print("  %-*s %10.6fs %8.2fx  %s" % (
+            width, name, seconds, rows[0][1] / seconds if seconds else 0,
+            note))
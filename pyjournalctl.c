@@ -16,1149 +16,11353 @@ You should have received a copy of the GNU Lesser General Public
 License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
-#include <systemd/sd-journal.h>
-
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <structmember.h>
-#include <datetime.h>
-
-typedef struct {
-    PyObject_HEAD
-    sd_journal *j;
-    PyObject *default_call;
-    PyObject *call_dict;
-} Journal;
-static PyTypeObject JournalType;
 
-static void
-Journal_dealloc(Journal* self)
-{
-    sd_journal_close(self->j);
-    Py_XDECREF(self->default_call);
-    Py_XDECREF(self->call_dict);
-    Py_TYPE(self)->tp_free((PyObject*)self);
-}
+#include <dirent.h>
+#include <dlfcn.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
-static PyObject *
-Journal_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    Journal *self;
+#include <systemd/sd-journal.h>
 
-    self = (Journal *)type->tp_alloc(type, 0);
-    if (self != NULL) {
-        PyObject *globals, *temp;
+#define PYJOURNALCTL_MODULE
+#include "pyjournalctl.h"
 
-        globals = PyEval_GetBuiltins();
-        temp = PyImport_ImportModule("functools");
-        PyDict_SetItemString(globals, "functools", temp);
-        Py_DECREF(temp);
-        temp = PyImport_ImportModule("datetime");
-        PyDict_SetItemString(globals, "datetime", temp);
-        Py_DECREF(temp);
+#if PY_VERSION_HEX < 0x03090000
+#error "pyjournalctl requires python >= 3.9"
+#endif
 
-#if PY_MAJOR_VERSION >=3
-        self->default_call = PyRun_String("functools.partial(str, encoding='utf-8')", Py_eval_input, globals, NULL);
+/* USDT probes, built when WITH_USDT is defined, with arguments:
+ *   entry__start(journal, int64 skip)
+ *   entry__done(journal, int result)      entries moved, or -1 on error
+ *   convert__start(journal, char *field)
+ *   convert__done(journal, char *field, int fallback)
+ *                                         0 converted, 1 bytes, 2 None
+ *   convert__fail(journal, char *field, int converter)
+ *                                         0 call_dict, 1 default_call
+ *   wait__start(journal, int64 timeout)   usecs, or -1 for no timeout
+ *   wait__done(journal, int result)       NOP, APPEND or INVALIDATE
+ *   seek__start(journal, int kind)        PROBE_SEEK_*
+ *   seek__done(journal, int kind, int result)
+ *   match__change(journal, int kind, char *data, size_t len)
+ *                                         PROBE_MATCH_*
+ * Semaphores are used so that the field name is only looked up while
+ * the convert probes are attached. */
+#ifdef WITH_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+/* Defined by systemtap's header, which records probes as ELF notes; other
+ * headers of the name may build probes tracers cannot find */
+#if !defined(_SDT_NOTE_TYPE) || _SDT_NOTE_TYPE != 3
+#error "WITH_USDT requires sys/sdt.h of systemtap, as in systemtap-sdt-dev"
+#endif
+#define PROBE_SEMAPHORE(name) \
+    static volatile unsigned short pyjournalctl_##name##_semaphore __attribute__((section(".probes"), used))
+PROBE_SEMAPHORE(entry__start);
+PROBE_SEMAPHORE(entry__done);
+PROBE_SEMAPHORE(convert__start);
+PROBE_SEMAPHORE(convert__done);
+PROBE_SEMAPHORE(convert__fail);
+PROBE_SEMAPHORE(wait__start);
+PROBE_SEMAPHORE(wait__done);
+PROBE_SEMAPHORE(seek__start);
+PROBE_SEMAPHORE(seek__done);
+PROBE_SEMAPHORE(match__change);
+#define PROBE_ENABLED(name) __builtin_expect(pyjournalctl_##name##_semaphore != 0, 0)
+#define PROBE2(name, a, b) STAP_PROBE2(pyjournalctl, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(pyjournalctl, name, a, b, c)
+#define PROBE4(name, a, b, c, d) STAP_PROBE4(pyjournalctl, name, a, b, c, d)
 #else
-        self->default_call = PyRun_String("functools.partial(unicode, encoding='utf-8')", Py_eval_input, globals, NULL);
+#define PROBE_ENABLED(name) 0
+#define PROBE2(name, a, b) ((void) (a), (void) (b))
+#define PROBE3(name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#define PROBE4(name, a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d))
 #endif
 
-        self->call_dict = PyRun_String("{"
-            "'PRIORITY': int,"
-            "'LEADER': int,"
-            "'SESSION_ID': int,"
-            "'USERSPACE_USEC': int,"
-            "'INITRD_USEC': int,"
-            "'KERNEL_USEC': int,"
-            "'_UID': int,"
-            "'_GID': int,"
-            "'_PID': int,"
-            "'SYSLOG_FACILITY': int,"
-            "'SYSLOG_PID': int,"
-            "'_AUDIT_SESSION': int,"
-            "'_AUDIT_LOGINUID': int,"
-            "'_SYSTEMD_SESSION': int,"
-            "'_SYSTEMD_OWNER_UID': int,"
-            "'CODE_LINE': int,"
-            "'ERRNO': int,"
-            "'EXIT_STATUS': int,"
-            "'_SOURCE_REALTIME_TIMESTAMP': lambda x: datetime.datetime.fromtimestamp(float(x)/1E6),"
-            "'__REALTIME_TIMESTAMP': lambda x: datetime.datetime.fromtimestamp(float(x)/1E6),"
-            "'_SOURCE_MONOTONIC_TIMESTAMP': lambda x: datetime.timedelta(microseconds=float(x)),"
-            "'__MONOTONIC_TIMESTAMP': lambda x: datetime.timedelta(microseconds=float(x)),"
-#if PY_MAJOR_VERSION >=3
-            "'COREDUMP': bytes,"
+enum {
+    PROBE_SEEK_HEAD,
+    PROBE_SEEK_TAIL,
+    PROBE_SEEK_OFFSET,
+    PROBE_SEEK_REALTIME,
+    PROBE_SEEK_MONOTONIC,
+    PROBE_SEEK_CURSOR,
+};
+
+/* After JOURNAL_MATCH, JOURNAL_DISJUNCTION and JOURNAL_CONJUNCTION */
+enum {
+    PROBE_MATCH_FLUSH = 3,
+    PROBE_MATCH_FILTER,
+};
+
+/* Per-module state, so that each (sub-)interpreter has its own copy */
+typedef struct {
+    PyTypeObject *JournalType;
+    PyTypeObject *JournalIteratorType;
+    PyTypeObject *JournalWriterType;
+    PyTypeObject *JournalSketchType;
+    PyTypeObject *JournalSessionsType;
+    PyObject *datetime_type;
+    PyObject *timedelta_type;
+    PyObject *default_call;
+    PyObject *call_dict;
+} pyjournalctl_state;
+
+static struct PyModuleDef pyjournalctl_module;
+
+/* Journal objects are locked whenever `j` is used, as sd_journal is not
+ * thread safe and the GIL is released (or absent) around journal calls */
+#if PY_VERSION_HEX >= 0x030D0000
+typedef PyMutex journal_lock_t;
 #else
-            "'COREDUMP': str,"
+typedef PyThread_type_lock journal_lock_t;
 #endif
-            "'COREDUMP_PID': int,"
-            "'COREDUMP_UID': int,"
-            "'COREDUMP_GID': int,"
-            "'COREDUMP_SESSION': int,"
-            "'COREDUMP_SIGNAL': int,"
-            "'COREDUMP_TIMESTAMP': lambda x: datetime.datetime.fromtimestamp(float(x)/1E6),"
-            "}", Py_eval_input, globals, NULL);
-    }
 
-    return (PyObject *) self;
+/* Open addressing hash table keyed on byte strings. Raw allocators are
+ * used so that it may be used without the GIL. Entry pointers are only
+ * valid until the next insertion. */
+typedef struct {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    uint64_t count;
+    void *data;
+} hashtable_entry;
+
+typedef struct {
+    hashtable_entry *entries;
+    size_t size;
+    size_t n;
+} hashtable;
+
+static uint64_t
+hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
-PyDoc_STRVAR(Journal__doc__,
-"Journal([flags][, default_call][, call_dict][,path]) -> ...\n"
-"Journal instance\n\n"
-"Returns instance of Journal, which allows filtering and return\n"
-"of journal entries.\n"
-"Argument `flags` sets open flags of the journal, which can be one\n"
-"of, or ORed combination of constants: LOCAL_ONLY (default) opens\n"
-"journal on local machine only; RUNTIME_ONLY opens only\n"
-"volatile journal files; and SYSTEM_ONLY opens only\n"
-"journal files of system services and the kernel.\n"
-"Argument `default_call` must be a callable that accepts one\n"
-"argument which is string/bytes value of a field and returns\n"
-"python object.\n"
-"Argument `call_dict` is a dictionary where the key represents\n"
-"a field name, and value is a callable as per `default_call`.\n"
-"A set of sane defaults for `default_call` and `call_dict` are\n"
-"present.\n"
-"Argument `path` is the directory of journal files. Note that\n"
-"currently flags are ignored when `path` is present as they are\n"
-" not relevant.");
 static int
-Journal_init(Journal *self, PyObject *args, PyObject *keywds)
+hashtable_init(hashtable *t, size_t size)
 {
-    int flags=SD_JOURNAL_LOCAL_ONLY;
-    char *path=NULL;
-    PyObject *default_call=NULL, *call_dict=NULL;
+    size_t n = 16;
+    while (n < size)
+        n <<= 1;
+    t->entries = PyMem_RawCalloc(n, sizeof(hashtable_entry));
+    t->size = t->entries ? n : 0;
+    t->n = 0;
+    return t->entries ? 0 : -ENOMEM;
+}
 
-    static char *kwlist[] = {"flags", "default_call", "call_dict", "path", NULL};
-    if (! PyArg_ParseTupleAndKeywords(args, keywds, "|iOOs", kwlist,
-                                      &flags, &default_call, &call_dict, &path))
-        return 1;
+static void
+hashtable_free(hashtable *t)
+{
+    size_t i;
+    for (i = 0; i < t->size; i++)
+        PyMem_RawFree(t->entries[i].key);
+    PyMem_RawFree(t->entries);
+    t->entries = NULL;
+    t->size = t->n = 0;
+}
 
-    if (default_call) {
-        if (PyCallable_Check(default_call) || default_call == Py_None) {
-            Py_DECREF(self->default_call);
-            self->default_call = default_call;
-            Py_INCREF(self->default_call);
-        }else{
-            PyErr_SetString(PyExc_TypeError, "Default call not callable");
-            return 1;
-        }
+static hashtable_entry *
+hashtable_find(const hashtable *t, const void *key, size_t key_len, uint64_t hash)
+{
+    size_t i;
+    if (t->size == 0)
+        return NULL;
+    for (i = hash & (t->size - 1); t->entries[i].key; i = (i + 1) & (t->size - 1)) {
+        hashtable_entry *e = &t->entries[i];
+        if (e->hash == hash && e->key_len == key_len && memcmp(e->key, key, key_len) == 0)
+            return e;
     }
+    return NULL;
+}
 
-    if (call_dict) {
-        if (PyDict_Check(call_dict)) {
-            Py_DECREF(self->call_dict);
-            self->call_dict = call_dict;
-            Py_INCREF(self->call_dict);
-        }else if (call_dict == Py_None) {
-            Py_DECREF(self->call_dict);
-            self->call_dict = PyDict_New();
-        }else{
-            PyErr_SetString(PyExc_TypeError, "Call dictionary must be dict type");
-            return 1;
-        }
-    }
+static int
+hashtable_resize(hashtable *t, size_t size)
+{
+    hashtable_entry *old = t->entries;
+    size_t old_size = t->size, i, k;
 
-    int r;
-    if (path) {
-        r = sd_journal_open_directory(&self->j, path, 0);
-    }else{
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_open(&self->j, flags);
-        Py_END_ALLOW_THREADS
+    t->entries = PyMem_RawCalloc(size, sizeof(hashtable_entry));
+    if (t->entries == NULL) {
+        t->entries = old;
+        return -ENOMEM;
     }
-    if (r == -EINVAL) {
-        PyErr_SetString(PyExc_ValueError, "Invalid flags or path");
-        return -1;
-    }else if (r == -ENOMEM) {
-        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
-        return 1;
-    }else if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error opening journal");
-        return 1;
+    t->size = size;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].key == NULL)
+            continue;
+        for (k = old[i].hash & (size - 1); t->entries[k].key; k = (k + 1) & (size - 1));
+        t->entries[k] = old[i];
     }
-
+    PyMem_RawFree(old);
     return 0;
 }
 
-static PyObject *
-Journal___process_field(Journal *self, PyObject *key, const void *value, ssize_t value_len)
+/* Returns existing entry for `key`, or a new one with zeroed values */
+static hashtable_entry *
+hashtable_insert(hashtable *t, const void *key, size_t key_len, uint64_t hash)
 {
-    PyObject *callable=NULL, *return_value=NULL;
-    if (PyDict_Check(self->call_dict))
-        callable = PyDict_GetItem(self->call_dict, key);
+    hashtable_entry *e;
+    size_t i;
 
-    if (PyCallable_Check(callable)) {
-#if PY_MAJOR_VERSION >=3
-        return_value = PyObject_CallFunction(callable, "y#", value, value_len);
-#else
-        return_value = PyObject_CallFunction(callable, "s#", value, value_len);
-#endif
-        if (!return_value)
-            PyErr_Clear();
-    }
-    if (!return_value && PyCallable_Check(self->default_call))
-#if PY_MAJOR_VERSION >=3
-        return_value = PyObject_CallFunction(self->default_call, "y#", value, value_len);
-#else
-        return_value = PyObject_CallFunction(self->default_call, "s#", value, value_len);
-#endif
-    if (!return_value) {
-        PyErr_Clear();
-#if PY_MAJOR_VERSION >=3
-        return_value = PyBytes_FromStringAndSize(value, value_len);
-#else
-        return_value = PyString_FromStringAndSize(value, value_len);
-#endif
-    }
-    if (!return_value) {
-        return_value = Py_None;
-    }
-    return return_value;
+    e = hashtable_find(t, key, key_len, hash);
+    if (e)
+        return e;
+    if ((t->n + 1) * 4 > t->size * 3 &&
+        hashtable_resize(t, t->size ? t->size * 2 : 16) < 0)
+        return NULL;
+
+    for (i = hash & (t->size - 1); t->entries[i].key; i = (i + 1) & (t->size - 1));
+    e = &t->entries[i];
+    e->key = PyMem_RawMalloc(key_len ? key_len : 1);
+    if (e->key == NULL)
+        return NULL;
+    memcpy(e->key, key, key_len);
+    e->key_len = key_len;
+    e->hash = hash;
+    e->count = 0;
+    e->data = NULL;
+    t->n++;
+    return e;
 }
 
-PyDoc_STRVAR(Journal_get_next__doc__,
-"get_next([skip]) -> dict\n\n"
-"Return dictionary of the next log entry. Optional skip value will\n"
-"return the `skip`th log entry.");
-static PyObject *
-Journal_get_next(Journal *self, PyObject *args)
+/* Removes entry, moving back later entries of its probe sequence such
+ * that none are separated from their home slot by an empty one */
+static void
+hashtable_remove(hashtable *t, hashtable_entry *e)
 {
-    int64_t skip=1LL;
-    if (! PyArg_ParseTuple(args, "|L", &skip))
-        return NULL;
+    size_t mask = t->size - 1, i = e - t->entries, k, home;
 
-    int r;
-    if (skip == 1LL) {
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_next(self->j);
-        Py_END_ALLOW_THREADS
-    }else if (skip == -1LL) {
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_previous(self->j);
-        Py_END_ALLOW_THREADS
-    }else if (skip > 1LL) {
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_next_skip(self->j, skip);
-        Py_END_ALLOW_THREADS
-    }else if (skip < -1LL) {
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_previous_skip(self->j, -skip);
-        Py_END_ALLOW_THREADS
-    }else{
-        PyErr_SetString(PyExc_ValueError, "Skip number must positive/negative integer");
-        return NULL;
+    PyMem_RawFree(e->key);
+    for (k = (i + 1) & mask; t->entries[k].key; k = (k + 1) & mask) {
+        home = t->entries[k].hash & mask;
+        if (((k - home) & mask) >= ((k - i) & mask)) {
+            t->entries[i] = t->entries[k];
+            i = k;
+        }
     }
+    memset(&t->entries[i], 0, sizeof(t->entries[i]));
+    t->n--;
+}
 
-    if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error getting next message");
-        return NULL;
-    }else if ( r == 0) { //EOF
-        return PyDict_New();
-    }
+/* Converted values of fields, keyed on raw "FIELD=value" data, with at
+ * most max_values distinct values held per field */
+typedef struct {
+    Py_ssize_t max_values;
+    hashtable values;
+    hashtable fields;
+    uint64_t hits;
+    uint64_t misses;
+} value_cache;
 
-    PyObject *dict;
-    dict = PyDict_New();
+/* Bloom filter of an archived journal file, `bits` is NULL for files
+ * without one */
+typedef struct {
+    char *name;
+    uint64_t *bits;
+    uint64_t m;
+    uint32_t k;
+} bloom_file;
 
-    const void *msg;
-    size_t msg_len;
-    const char *delim_ptr;
-    PyObject *key, *value, *cur_value, *tmp_list;
+typedef struct {
+    char *sidecar_dir;
+    bloom_file *files;
+    size_t n_files;
+    char **paths;
+    char *cursor;
+    int pending;
+    uint64_t built;
+    uint64_t pruned;
+} bloom_index;
 
-    SD_JOURNAL_FOREACH_DATA(self->j, msg, msg_len) {
-        delim_ptr = memchr(msg, '=', msg_len);
-#if PY_MAJOR_VERSION >=3
-        key = PyUnicode_FromStringAndSize(msg, delim_ptr - (const char*) msg);
-#else
-        key = PyString_FromStringAndSize(msg, delim_ptr - (const char*) msg);
-#endif
-        value = Journal___process_field(self, key, delim_ptr + 1, (const char*) msg + msg_len - (delim_ptr + 1) );
-        if (PyDict_Contains(dict, key)) {
-            cur_value = PyDict_GetItem(dict, key);
-            if (PyList_CheckExact(cur_value) && PyList_Size(cur_value) > 1) {
-                PyList_Append(cur_value, value);
-            }else{
-                tmp_list = PyList_New(0);
-                PyList_Append(tmp_list, cur_value);
-                PyList_Append(tmp_list, value);
-                PyDict_SetItem(dict, key, tmp_list);
-                Py_DECREF(tmp_list);
-            }
-        }else{
-            PyDict_SetItem(dict, key, value);
-        }
-        Py_DECREF(key);
-        Py_DECREF(value);
-    }
+typedef struct journal_filter journal_filter;
+typedef struct result_cache result_cache;
+typedef struct journal_reader journal_reader;
+typedef struct journal_index journal_index;
+typedef struct continuous_query continuous_query;
+typedef struct boot_index boot_index;
 
-    uint64_t realtime;
-    if (sd_journal_get_realtime_usec(self->j, &realtime) == 0) {
-        char realtime_str[20];
-        sprintf(realtime_str, "%llu", (long long unsigned) realtime);
+/* Continuous queries share a handle following the tail of the journal,
+ * with a lock of their own such that values can be read while `wait`
+ * holds the lock of the Journal */
+typedef struct {
+    journal_lock_t lock;
+    sd_journal *j;
+    continuous_query **queries;
+    size_t n_queries;
+} journal_continuous;
 
-#if PY_MAJOR_VERSION >=3
-        key = PyUnicode_FromString("__REALTIME_TIMESTAMP");
-#else
-        key = PyString_FromString("__REALTIME_TIMESTAMP");
-#endif
-        value = Journal___process_field(self, key, realtime_str, strlen(realtime_str));
-        PyDict_SetItem(dict, key, value);
-        Py_DECREF(key);
-        Py_DECREF(value);
-    }
+/* Matches are recorded, so that further handles can be opened with them */
+enum {
+    JOURNAL_MATCH,
+    JOURNAL_DISJUNCTION,
+    JOURNAL_CONJUNCTION,
+};
 
-    sd_id128_t sd_id;
-    uint64_t monotonic;
-    if (sd_journal_get_monotonic_usec(self->j, &monotonic, &sd_id) == 0) {
-        char monotonic_str[20];
-        sprintf(monotonic_str, "%llu", (long long unsigned) monotonic);
-#if PY_MAJOR_VERSION >=3
-        key = PyUnicode_FromString("__MONOTONIC_TIMESTAMP");
-#else
-        key = PyString_FromString("__MONOTONIC_TIMESTAMP");
-#endif
-        value = Journal___process_field(self, key, monotonic_str, strlen(monotonic_str));
+typedef struct {
+    int kind;
+    char *data;
+    size_t len;
+} journal_match;
 
-        PyDict_SetItem(dict, key, value);
-        Py_DECREF(key);
-        Py_DECREF(value);
-    }
+/* A thread in wait(), polling the journal with its lock released. It is
+ * woken through `wake_fd` should the handle it polls be replaced. */
+typedef struct journal_waiter {
+    int wake_fd;
+    int replaced;
+    struct journal_waiter *next;
+} journal_waiter;
 
-    char *cursor;
-    if (sd_journal_get_cursor(self->j, &cursor) > 0) { //Should return 0...
-#if PY_MAJOR_VERSION >=3
-        key = PyUnicode_FromString("__CURSOR");
-#else
-        key = PyString_FromString("__CURSOR");
-#endif
-        value = Journal___process_field(self, key, cursor, strlen(cursor));
-        PyDict_SetItem(dict, key, value);
-        free(cursor);
-        Py_DECREF(key);
-        Py_DECREF(value);
-    }
+typedef struct {
+    PyObject_HEAD
+    sd_journal *j;
+    PyObject *default_call;
+    PyObject *call_dict;
+    journal_lock_t lock;
+    /* Thread holding `lock`, so that using the journal from a converter
+     * of its entries raises rather than deadlocks */
+    _Atomic unsigned long lock_owner;
+    journal_filter *filter;
+    int flags;
+    char *path;
+    journal_match *matches;
+    size_t n_matches;
+    value_cache cache;
+    journal_reader *reader;
+    int reader_active;
+    bloom_index *bloom;
+    int at_head;
+    int positioned;
+    journal_index *index;
+    journal_continuous continuous;
+    result_cache *results;
+    boot_index *boots;
+    int watching;
+    journal_waiter *waiters;
+} Journal;
 
-    return dict;
+static void Journal___filter_free(journal_filter *filter);
+static void continuous_free(journal_continuous *cq);
+static void result_cache_free(result_cache *cache);
+static void boot_index_free(boot_index *index);
+static int Journal___continuous_update(journal_continuous *cq);
+
+static void
+value_cache_free(value_cache *cache)
+{
+    size_t i;
+    for (i = 0; i < cache->values.size; i++) {
+        if (cache->values.entries[i].key)
+            Py_DECREF((PyObject *) cache->values.entries[i].data);
+    }
+    hashtable_free(&cache->values);
+    hashtable_free(&cache->fields);
 }
 
-PyDoc_STRVAR(Journal_get_previous__doc__,
-"get_previous([skip]) -> dict\n\n"
-"Return dictionary of the previous log entry. Optional skip value\n"
-"will return the -`skip`th log entry. Equivalent to get_next(-skip).");
-static PyObject *
-Journal_get_previous(Journal *self, PyObject *args)
+/* Empties the cache, moving its contents to `old` to be freed once
+ * `self` is unlocked, as releasing values may run arbitrary code */
+static void
+Journal___cache_detach(Journal *self, value_cache *old)
 {
-    int64_t skip=1LL;
-    if (! PyArg_ParseTuple(args, "|L", &skip))
-        return NULL;
+    *old = self->cache;
+    memset(&self->cache.values, 0, sizeof(hashtable));
+    memset(&self->cache.fields, 0, sizeof(hashtable));
+}
 
-    PyObject *dict, *arg;
-    arg = Py_BuildValue("(L)", -skip);
-    dict = Journal_get_next(self, arg);
-    Py_DECREF(arg);
-    return dict;
+static void
+Journal___flush_recorded_matches(Journal *self)
+{
+    size_t i;
+    for (i = 0; i < self->n_matches; i++)
+        PyMem_Free(self->matches[i].data);
+    PyMem_Free(self->matches);
+    self->matches = NULL;
+    self->n_matches = 0;
+    if (self->bloom)
+        self->bloom->pending = 1;
 }
 
-PyDoc_STRVAR(Journal_add_match__doc__,
-"add_match(match, ..., field=value, ...) -> None\n\n"
-"Add a match to filter journal log entries. All matches of different\n"
-"field are combined in logical AND, and matches of the same field\n"
-"are automatically combined in logical OR.\n"
-"Matches can be passed as strings \"field=value\", or keyword\n"
-"arguments field=\"value\".");
-static PyObject *
-Journal_add_match(Journal *self, PyObject *args, PyObject *keywds)
+static int
+Journal___record_match(Journal *self, int kind, const void *data, size_t len)
 {
-    Py_ssize_t arg_match_len;
-    char *arg_match;
-    int i, r;
-    for (i = 0; i < PySequence_Size(args); i++) {
-#if PY_MAJOR_VERSION >=3
-        PyObject *arg;
-        arg = PySequence_Fast_GET_ITEM(args, i);
-        if (PyUnicode_Check(arg)) {
-#if PY_MINOR_VERSION >=3
-            arg_match = PyUnicode_AsUTF8AndSize(arg, &arg_match_len);
-#else
-            PyObject *temp;
-            temp = PyUnicode_AsUTF8String(arg);
-            PyBytes_AsStringAndSize(temp, &arg_match, &arg_match_len);
-            Py_DECREF(temp);
-#endif
-        }else if (PyBytes_Check(arg)) {
-            PyBytes_AsStringAndSize(arg, &arg_match, &arg_match_len);
-        }else{
-            PyErr_SetString(PyExc_TypeError, "expected bytes or string");
-        }
-#else
-        PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(args, i), &arg_match, &arg_match_len);
-#endif
-        if (PyErr_Occurred())
-            return NULL;
-        r = sd_journal_add_match(self->j, arg_match, arg_match_len);
-        if (r == -EINVAL) {
-            PyErr_SetString(PyExc_ValueError, "Invalid match");
-            return NULL;
-        }else if (r == -ENOMEM) {
-            PyErr_SetString(PyExc_MemoryError, "Not enough memory");
-            return NULL;
-        }else if (r < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Error adding match");
-            return NULL;
-        }
-    }
+    journal_match *matches;
+    char *copy=NULL;
 
-    if (! keywds)
+    matches = PyMem_Realloc(self->matches, (self->n_matches + 1) * sizeof(journal_match));
+    if (matches == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->matches = matches;
+    if (data) {
+        copy = PyMem_Malloc(len ? len : 1);
+        if (copy == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(copy, data, len);
+    }
+    matches[self->n_matches].kind = kind;
+    matches[self->n_matches].data = copy;
+    matches[self->n_matches].len = len;
+    self->n_matches++;
+    PROBE4(match__change, self, kind, data, len);
+    if (self->bloom)
+        self->bloom->pending = 1;
+    return 0;
+}
+
+/* Opens a handle on the journal files of `self`, or `paths` if given,
+ * without matches */
+static int
+Journal___open_unfiltered(Journal *self, char **paths, sd_journal **ret)
+{
+    if (paths)
+        return sd_journal_open_files(ret, (const char **) paths, 0);
+    else if (self->path)
+        return sd_journal_open_directory(ret, self->path, 0);
+    else
+        return sd_journal_open(ret, self->flags);
+}
+
+/* Opens a handle on the journal files of `self`, or `paths` if given,
+ * with the same matches. Does not require the GIL, but `self` must be
+ * locked. */
+static int
+Journal___open_handle(Journal *self, char **paths, sd_journal **ret)
+{
+    sd_journal *j=NULL;
+    size_t i;
+    int r;
+
+    r = Journal___open_unfiltered(self, paths, &j);
+    for (i = 0; r >= 0 && i < self->n_matches; i++) {
+        const journal_match *m = &self->matches[i];
+        if (m->kind == JOURNAL_MATCH)
+            r = sd_journal_add_match(j, m->data, m->len);
+        else if (m->kind == JOURNAL_DISJUNCTION)
+            r = sd_journal_add_disjunction(j);
+        else
+            r = sd_journal_add_conjunction(j);
+    }
+    if (r < 0) {
+        if (j)
+            sd_journal_close(j);
+        return r;
+    }
+    *ret = j;
+    return 0;
+}
+
+/* Opens another handle on the same journal files with the same matches */
+static int
+Journal___open_copy(Journal *self, sd_journal **ret)
+{
+    return Journal___open_handle(self, self->bloom ? self->bloom->paths : NULL, ret);
+}
+
+/* Reader for journal files by mmap, walking the entry arrays directly.
+ * It covers forward reading of uncompressed objects without matches;
+ * anything else is left to libsystemd. Layout as per systemd's
+ * journal-def.h; all integers are little endian. */
+#define JOURNAL_HEADER_MIN_SIZE   208
+#define JOURNAL_OBJECT_HEADER     16
+#define JOURNAL_ENTRY_HEADER      64
+#define JOURNAL_ARRAY_HEADER      24
+#define JOURNAL_DATA_PAYLOAD      64
+#define JOURNAL_DATA_PAYLOAD_COMPACT 72
+
+#define JOURNAL_OBJECT_DATA        1
+#define JOURNAL_OBJECT_ENTRY       3
+#define JOURNAL_OBJECT_ENTRY_ARRAY 6
+
+#define JOURNAL_INCOMPATIBLE_COMPACT   (1 << 4)
+#define JOURNAL_INCOMPATIBLE_SUPPORTED 0x1f
+#define JOURNAL_OBJECT_COMPRESSED      0x07
+#define JOURNAL_OBJECT_COMPRESSED_LZ4  0x02
+#define JOURNAL_OBJECT_COMPRESSED_ZSTD 0x04
+/* As DATA_SIZE_MAX of journald */
+#define JOURNAL_DATA_SIZE_MAX (768ULL * 1024 * 1024)
+
+typedef struct {
+    char *path;
+    const uint8_t *map;
+    size_t size;
+    uint64_t header_size;
+    int compact;
+    uint8_t seqnum_id[16];
+    uint64_t *entries;
+    uint64_t n_entries;
+    uint64_t pos;
+} journal_reader_file;
+
+struct journal_reader {
+    journal_reader_file *files;
+    size_t n_files;
+    journal_reader_file *current;
+    const uint8_t *entry;
+    uint64_t n_items;
+    uint64_t item;
+    /* Decompressed data, valid until the next field */
+    uint8_t *buf;
+    size_t buf_size;
+};
+
+static uint64_t
+read_le64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static uint32_t
+read_le32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+/* Returns object of `type` at `offset`, checked to lie within the file */
+static const uint8_t *
+reader_object(const journal_reader_file *f, uint64_t offset, int type, uint64_t min_size)
+{
+    const uint8_t *o;
+    uint64_t size;
+
+    if (offset % 8 || offset < f->header_size || offset > f->size - JOURNAL_OBJECT_HEADER)
+        return NULL;
+    o = f->map + offset;
+    size = read_le64(o + 8);
+    if (o[0] != type || size < min_size || size > f->size - offset)
+        return NULL;
+    return o;
+}
+
+/* Maps journal file `name` and checks its header */
+static int
+reader_file_map(journal_reader_file *f, int dir_fd, const char *name)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -errno;
+    }
+    if (st.st_size < JOURNAL_HEADER_MIN_SIZE) {
+        close(fd);
+        return -EBADMSG;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+    f->map = map;
+    f->size = st.st_size;
+
+    if (memcmp(f->map, "LPKSHHRH", 8) != 0)
+        return -EBADMSG;
+    if (read_le32(f->map + 12) & ~JOURNAL_INCOMPATIBLE_SUPPORTED)
+        return -EPROTONOSUPPORT;
+    f->compact = !!(read_le32(f->map + 12) & JOURNAL_INCOMPATIBLE_COMPACT);
+    memcpy(f->seqnum_id, f->map + 72, 16);
+    f->header_size = read_le64(f->map + 88);
+    if (f->header_size < JOURNAL_HEADER_MIN_SIZE || f->header_size > f->size)
+        return -EBADMSG;
+    return 0;
+}
+
+static int
+reader_file_open(journal_reader_file *f, int dir_fd, const char *name)
+{
+    const uint8_t *array;
+    uint64_t offset, remaining, n, i, item_size;
+    int r;
+
+    r = reader_file_map(f, dir_fd, name);
+    if (r < 0)
+        return r;
+
+    /* Offsets of all entries, in order, from the chain of entry arrays */
+    remaining = read_le64(f->map + 152);
+    if (remaining > f->size / JOURNAL_ENTRY_HEADER)
+        return -EBADMSG;
+    f->entries = PyMem_RawMalloc((remaining ? remaining : 1) * sizeof(uint64_t));
+    if (f->entries == NULL)
+        return -ENOMEM;
+    item_size = f->compact ? 4 : 8;
+    offset = read_le64(f->map + 176);
+    while (remaining > 0 && offset) {
+        array = reader_object(f, offset, JOURNAL_OBJECT_ENTRY_ARRAY, JOURNAL_ARRAY_HEADER);
+        if (array == NULL)
+            return -EBADMSG;
+        n = (read_le64(array + 8) - JOURNAL_ARRAY_HEADER) / item_size;
+        for (i = 0; i < n && remaining > 0; i++, remaining--) {
+            const uint8_t *p = array + JOURNAL_ARRAY_HEADER + i * item_size;
+            uint64_t entry = f->compact ? read_le32(p) : read_le64(p);
+            if (entry == 0)
+                break;
+            f->entries[f->n_entries++] = entry;
+        }
+        if (i < n || i == 0)
+            break;
+        offset = read_le64(array + 16);
+    }
+    return 0;
+}
+
+static void
+reader_close(journal_reader *r)
+{
+    size_t i;
+    if (r == NULL)
+        return;
+    for (i = 0; i < r->n_files; i++) {
+        if (r->files[i].map)
+            munmap((void *) r->files[i].map, r->files[i].size);
+        PyMem_RawFree(r->files[i].entries);
+        free(r->files[i].path);
+    }
+    PyMem_RawFree(r->files);
+    PyMem_RawFree(r->buf);
+    PyMem_RawFree(r);
+}
+
+/* Calls `func` with each journal file in `dir`, and in its machine
+ * subdirectories down to `depth`, as per libsystemd */
+typedef void (*journal_file_func)(const char *dir, int dir_fd, const char *name, void *arg);
+
+static void
+journal_dir_walk(const char *dir, int depth, journal_file_func func, void *arg)
+{
+    struct dirent *de;
+    DIR *d;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return;
+    while ((de = readdir(d))) {
+        size_t len = strlen(de->d_name);
+        sd_id128_t id;
+        if (depth > 0 && (de->d_type == DT_DIR || de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) &&
+            sd_id128_from_string(de->d_name, &id) >= 0) {
+            char *sub;
+            if (asprintf(&sub, "%s/%s", dir, de->d_name) >= 0) {
+                journal_dir_walk(sub, depth - 1, func, arg);
+                free(sub);
+            }
+            continue;
+        }
+        if ((len > 8 && strcmp(de->d_name + len - 8, ".journal") == 0) ||
+            (len > 9 && strcmp(de->d_name + len - 9, ".journal~") == 0))
+            func(dir, dirfd(d), de->d_name, arg);
+    }
+    closedir(d);
+}
+
+typedef struct {
+    journal_reader *reader;
+    int err;
+} reader_walk;
+
+static void
+reader_add_file(const char *dir, int dir_fd, const char *name, void *arg)
+{
+    reader_walk *w = arg;
+    journal_reader *r = w->reader;
+    journal_reader_file *files;
+
+    if (w->err < 0)
+        return;
+    files = PyMem_RawRealloc(r->files, (r->n_files + 1) * sizeof(journal_reader_file));
+    if (files == NULL) {
+        w->err = -ENOMEM;
+        return;
+    }
+    r->files = files;
+    memset(&files[r->n_files], 0, sizeof(journal_reader_file));
+    if (asprintf(&files[r->n_files].path, "%s/%s", dir, name) < 0) {
+        files[r->n_files].path = NULL;
+        w->err = -ENOMEM;
+        return;
+    }
+    w->err = reader_file_open(&files[r->n_files++], dir_fd, name);
+}
+
+/* Opens the journal files in directory `path` and its machine
+ * subdirectories, as per sd_journal_open_directory, returning
+ * -EPROTONOSUPPORT for files the reader cannot handle */
+static int
+reader_open(const char *path, journal_reader **ret)
+{
+    reader_walk w = {NULL, 0};
+
+    w.reader = PyMem_RawCalloc(1, sizeof(journal_reader));
+    if (w.reader == NULL)
+        return -ENOMEM;
+    journal_dir_walk(path, 1, reader_add_file, &w);
+    if (w.err < 0) {
+        reader_close(w.reader);
+        return w.err;
+    }
+    *ret = w.reader;
+    return 0;
+}
+
+/* Opens `j` on the files of the reader, so that both read the same */
+static int
+reader_open_journal(journal_reader *r, sd_journal **j)
+{
+    const char **paths;
+    size_t i;
+    int k;
+
+    paths = PyMem_RawMalloc((r->n_files + 1) * sizeof(char *));
+    if (paths == NULL)
+        return -ENOMEM;
+    for (i = 0; i < r->n_files; i++)
+        paths[i] = r->files[i].path;
+    paths[i] = NULL;
+    k = sd_journal_open_files(j, paths, 0);
+    PyMem_RawFree(paths);
+    return k;
+}
+
+static void
+reader_seek_head(journal_reader *r)
+{
+    size_t i;
+    for (i = 0; i < r->n_files; i++)
+        r->files[i].pos = 0;
+    r->current = NULL;
+    r->entry = NULL;
+}
+
+/* Orders entries as libsystemd does when interleaving files */
+static int
+reader_compare(const journal_reader_file *fa, const uint8_t *a,
+               const journal_reader_file *fb, const uint8_t *b)
+{
+    uint64_t va, vb;
+    if (memcmp(fa->seqnum_id, fb->seqnum_id, 16) == 0) {
+        va = read_le64(a + 16), vb = read_le64(b + 16);
+        if (va != vb)
+            return va < vb ? -1 : 1;
+    }
+    if (memcmp(a + 40, b + 40, 16) == 0) {
+        va = read_le64(a + 32), vb = read_le64(b + 32);
+        if (va != vb)
+            return va < vb ? -1 : 1;
+    }
+    va = read_le64(a + 24), vb = read_le64(b + 24);
+    if (va != vb)
+        return va < vb ? -1 : 1;
+    va = read_le64(a + 56), vb = read_le64(b + 56);
+    return va < vb ? -1 : va > vb;
+}
+
+static const uint8_t *
+reader_file_peek(const journal_reader_file *f)
+{
+    if (f->pos >= f->n_entries)
+        return NULL;
+    return reader_object(f, f->entries[f->pos], JOURNAL_OBJECT_ENTRY, JOURNAL_ENTRY_HEADER);
+}
+
+/* Moves to the next entry across all files; as per sd_journal_next */
+static int
+reader_next(journal_reader *r)
+{
+    journal_reader_file *best = NULL;
+    const uint8_t *best_entry = NULL, *entry;
+    size_t i;
+
+    for (i = 0; i < r->n_files; i++) {
+        journal_reader_file *f = &r->files[i];
+        if (f->pos >= f->n_entries)
+            continue;
+        entry = reader_file_peek(f);
+        if (entry == NULL)
+            return -EBADMSG;
+        if (best == NULL || reader_compare(f, entry, best, best_entry) < 0) {
+            best = f;
+            best_entry = entry;
+        }
+    }
+    if (best == NULL)
+        return 0;
+    /* The same entry may be present in several files */
+    for (i = 0; i < r->n_files; i++) {
+        journal_reader_file *f = &r->files[i];
+        if (f == best || ((entry = reader_file_peek(f)) &&
+                          reader_compare(f, entry, best, best_entry) == 0))
+            f->pos++;
+    }
+    r->current = best;
+    r->entry = best_entry;
+    r->n_items = (read_le64(best_entry + 8) - JOURNAL_ENTRY_HEADER) / (best->compact ? 4 : 16);
+    r->item = 0;
+    return 1;
+}
+
+/* Decompressors of libzstd and liblz4, loaded when first needed as
+ * libsystemd does, so that neither is required to build or import */
+static struct {
+    pthread_once_t once;
+    unsigned long long (*zstd_content_size)(const void *src, size_t src_size);
+    size_t (*zstd_decompress)(void *dst, size_t dst_size, const void *src, size_t src_size);
+    unsigned (*zstd_is_error)(size_t code);
+    int (*lz4_decompress)(const char *src, char *dst, int src_size, int dst_size);
+} decompressors = {PTHREAD_ONCE_INIT};
+
+static void
+decompressors_load(void)
+{
+    void *lib;
+
+    if ((lib = dlopen("libzstd.so.1", RTLD_NOW))) {
+        *(void **) &decompressors.zstd_content_size = dlsym(lib, "ZSTD_getFrameContentSize");
+        *(void **) &decompressors.zstd_decompress = dlsym(lib, "ZSTD_decompress");
+        *(void **) &decompressors.zstd_is_error = dlsym(lib, "ZSTD_isError");
+        if (!decompressors.zstd_content_size || !decompressors.zstd_decompress || !decompressors.zstd_is_error)
+            decompressors.zstd_decompress = NULL;
+    }
+    if ((lib = dlopen("liblz4.so.1", RTLD_NOW)))
+        *(void **) &decompressors.lz4_decompress = dlsym(lib, "LZ4_decompress_safe");
+}
+
+static int
+reader_buffer(journal_reader *r, uint64_t size)
+{
+    uint8_t *buf;
+
+    if (size > JOURNAL_DATA_SIZE_MAX)
+        return -EBADMSG;
+    if (size <= r->buf_size)
+        return 0;
+    buf = PyMem_RawRealloc(r->buf, size ? size : 1);
+    if (buf == NULL)
+        return -ENOMEM;
+    r->buf = buf;
+    r->buf_size = size;
+    return 0;
+}
+
+/* Decompresses `src` of data object flags `flags` into the reader's
+ * buffer, returning -EPROTONOSUPPORT for XZ or a library not found */
+static int
+reader_decompress(journal_reader *r, int flags, const uint8_t *src, uint64_t src_size, size_t *len)
+{
+    unsigned long long size;
+    size_t n;
+    int k;
+
+    pthread_once(&decompressors.once, decompressors_load);
+    if ((flags & JOURNAL_OBJECT_COMPRESSED) == JOURNAL_OBJECT_COMPRESSED_ZSTD) {
+        if (decompressors.zstd_decompress == NULL)
+            return -EPROTONOSUPPORT;
+        /* Frames of journald record their size */
+        size = decompressors.zstd_content_size(src, src_size);
+        if (size >= (unsigned long long) -2)
+            return size == (unsigned long long) -1 ? -EPROTONOSUPPORT : -EBADMSG;
+        if ((k = reader_buffer(r, size)) < 0)
+            return k;
+        n = decompressors.zstd_decompress(r->buf, size, src, src_size);
+        if (decompressors.zstd_is_error(n) || n != size)
+            return -EBADMSG;
+    }else if ((flags & JOURNAL_OBJECT_COMPRESSED) == JOURNAL_OBJECT_COMPRESSED_LZ4) {
+        if (decompressors.lz4_decompress == NULL)
+            return -EPROTONOSUPPORT;
+        /* Size, then the LZ4 block */
+        if (src_size < 8 || src_size - 8 > INT_MAX)
+            return -EBADMSG;
+        size = read_le64(src);
+        if (size > INT_MAX)
+            return -EBADMSG;
+        if ((k = reader_buffer(r, size)) < 0)
+            return k;
+        if (decompressors.lz4_decompress((const char *) src + 8, (char *) r->buf, src_size - 8, size) != (int) size)
+            return -EBADMSG;
+    }else{
+        return -EPROTONOSUPPORT;
+    }
+    *len = size;
+    return 0;
+}
+
+/* As per sd_journal_enumerate_data, returning -EPROTONOSUPPORT for data
+ * compressed by XZ, or without the library to decompress it. Compressed
+ * data is valid until the next call. */
+static int
+reader_enumerate_data(journal_reader *r, const void **data, size_t *len)
+{
+    const journal_reader_file *f = r->current;
+    const uint8_t *p, *o;
+    uint64_t offset, payload;
+    int k;
+
+    if (r->entry == NULL)
+        return -EADDRNOTAVAIL;
+    if (r->item >= r->n_items)
+        return 0;
+    p = r->entry + JOURNAL_ENTRY_HEADER + r->item * (f->compact ? 4 : 16);
+    offset = f->compact ? read_le32(p) : read_le64(p);
+    payload = f->compact ? JOURNAL_DATA_PAYLOAD_COMPACT : JOURNAL_DATA_PAYLOAD;
+    o = reader_object(f, offset, JOURNAL_OBJECT_DATA, payload);
+    if (o == NULL)
+        return -EBADMSG;
+    if (o[1] & JOURNAL_OBJECT_COMPRESSED) {
+        k = reader_decompress(r, o[1], o + payload, read_le64(o + 8) - payload, len);
+        if (k < 0)
+            return k;
+        *data = r->buf;
+    }else{
+        *data = o + payload;
+        *len = read_le64(o + 8) - payload;
+    }
+    r->item++;
+    return 1;
+}
+
+static void
+reader_restart_data(journal_reader *r)
+{
+    r->item = 0;
+}
+
+static int
+reader_get_realtime_usec(journal_reader *r, uint64_t *ret)
+{
+    if (r->entry == NULL)
+        return -EADDRNOTAVAIL;
+    *ret = read_le64(r->entry + 24);
+    return 0;
+}
+
+static int
+reader_get_monotonic_usec(journal_reader *r, uint64_t *ret, sd_id128_t *boot_id)
+{
+    if (r->entry == NULL)
+        return -EADDRNOTAVAIL;
+    *ret = read_le64(r->entry + 32);
+    if (boot_id)
+        memcpy(boot_id->bytes, r->entry + 40, 16);
+    return 0;
+}
+
+/* Cursor in the format of sd_journal_get_cursor, freed with free() */
+static int
+reader_get_cursor(journal_reader *r, char **ret)
+{
+    char seqnum_id[33], boot_id[33];
+    sd_id128_t id;
+
+    if (r->entry == NULL)
+        return -EADDRNOTAVAIL;
+    memcpy(id.bytes, r->current->seqnum_id, 16);
+    sd_id128_to_string(id, seqnum_id);
+    memcpy(id.bytes, r->entry + 40, 16);
+    sd_id128_to_string(id, boot_id);
+    if (asprintf(ret, "s=%s;i=%llx;b=%s;m=%llx;t=%llx;x=%llx",
+                 seqnum_id, (unsigned long long) read_le64(r->entry + 16),
+                 boot_id, (unsigned long long) read_le64(r->entry + 32),
+                 (unsigned long long) read_le64(r->entry + 24),
+                 (unsigned long long) read_le64(r->entry + 56)) < 0)
+        return -ENOMEM;
+    return 0;
+}
+
+/* As per reader_get_cursor, but as binary values */
+static int
+reader_get_cursor_values(journal_reader *r, PyJournalctl_Cursor *cursor)
+{
+    if (r->entry == NULL)
+        return -EADDRNOTAVAIL;
+    memcpy(cursor->seqnum_id.bytes, r->current->seqnum_id, 16);
+    cursor->seqnum = read_le64(r->entry + 16);
+    memcpy(cursor->boot_id.bytes, r->entry + 40, 16);
+    cursor->monotonic = read_le64(r->entry + 32);
+    cursor->realtime = read_le64(r->entry + 24);
+    cursor->xor_hash = read_le64(r->entry + 56);
+    return 0;
+}
+
+/* Positions `j` on the reader's current entry */
+static int
+reader_sync(journal_reader *r, sd_journal *j)
+{
+    char *cursor;
+    int k;
+
+    if (r->entry == NULL)
+        return sd_journal_seek_head(j);
+    k = reader_get_cursor(r, &cursor);
+    if (k < 0)
+        return k;
+    k = sd_journal_seek_cursor(j, cursor);
+    if (k >= 0)
+        k = sd_journal_next(j);
+    if (k >= 0)
+        k = sd_journal_test_cursor(j, cursor) > 0 ? 0 : -ESTALE;
+    free(cursor);
+    return k;
+}
+
+/* Bloom filters of the FIELD=value pairs of archived journal files, kept
+ * in sidecar files, so that files which cannot match are not opened.
+ * Fields with compressed values are added by name alone, matching any
+ * value. */
+#define BLOOM_MAGIC       "PJBLOOM1"
+#define BLOOM_HEADER_SIZE 48
+#define BLOOM_BITS_PER_ITEM 10
+#define BLOOM_HASHES      7
+
+#define JOURNAL_OBJECT_FIELD 2
+#define JOURNAL_FIELD_PAYLOAD 40
+#define JOURNAL_STATE_ARCHIVED 2
+
+static void
+bloom_hashes(const void *data, size_t len, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t z;
+    *h1 = hash_bytes(data, len);
+    /* Second hash derived by splitmix64 finaliser */
+    z = *h1 + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    *h2 = (z ^ (z >> 31)) | 1;
+}
+
+static void
+bloom_add(bloom_file *b, const void *data, size_t len)
+{
+    uint64_t h1, h2, bit;
+    uint32_t i;
+    bloom_hashes(data, len, &h1, &h2);
+    for (i = 0; i < b->k; i++) {
+        bit = (h1 + i * h2) % b->m;
+        b->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static int
+bloom_test(const bloom_file *b, const void *data, size_t len)
+{
+    uint64_t h1, h2, bit;
+    uint32_t i;
+    bloom_hashes(data, len, &h1, &h2);
+    for (i = 0; i < b->k; i++) {
+        bit = (h1 + i * h2) % b->m;
+        if (!(b->bits[bit / 64] & (1ULL << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+/* Whether file may contain `match`, a FIELD=value pair */
+static int
+bloom_may_match(const bloom_file *b, const char *match, size_t len)
+{
+    const char *delim;
+    if (b->bits == NULL)
+        return 1;
+    if (bloom_test(b, match, len))
+        return 1;
+    delim = memchr(match, '=', len);
+    return delim && bloom_test(b, match, delim - match);
+}
+
+static int
+bloom_alloc(bloom_file *b, uint64_t n_items)
+{
+    b->m = (n_items * BLOOM_BITS_PER_ITEM + 63) / 64 * 64;
+    if (b->m < 64)
+        b->m = 64;
+    b->k = BLOOM_HASHES;
+    b->bits = PyMem_RawCalloc(b->m / 64, sizeof(uint64_t));
+    return b->bits ? 0 : -ENOMEM;
+}
+
+/* Builds filter from the field hash table of mapped file `f`, following
+ * each field's chain of data objects */
+static int
+bloom_build(bloom_file *b, const journal_reader_file *f)
+{
+    uint64_t table, table_size, n_objects, n_data, bucket, offset, data_offset, guard = 0;
+    uint64_t payload = f->compact ? JOURNAL_DATA_PAYLOAD_COMPACT : JOURNAL_DATA_PAYLOAD;
+    const uint8_t *field, *data;
+    int r;
+
+    table = read_le64(f->map + 120);
+    table_size = read_le64(f->map + 128);
+    n_objects = read_le64(f->map + 144);
+    n_data = f->header_size >= 216 ? read_le64(f->map + 208) : n_objects;
+    if (table > f->size || table_size > f->size - table || n_data > f->size)
+        return -EBADMSG;
+    r = bloom_alloc(b, n_data + table_size / 16);
+    if (r < 0)
+        return r;
+
+    for (bucket = 0; bucket < table_size / 16; bucket++) {
+        offset = read_le64(f->map + table + bucket * 16);
+        while (offset) {
+            field = reader_object(f, offset, JOURNAL_OBJECT_FIELD, JOURNAL_FIELD_PAYLOAD);
+            if (field == NULL || guard++ > n_objects)
+                return -EBADMSG;
+            const char *name = (const char *) field + JOURNAL_FIELD_PAYLOAD;
+            size_t name_len = read_le64(field + 8) - JOURNAL_FIELD_PAYLOAD;
+
+            data_offset = read_le64(field + 32);
+            while (data_offset) {
+                data = reader_object(f, data_offset, JOURNAL_OBJECT_DATA, payload);
+                if (data == NULL || guard++ > n_objects)
+                    return -EBADMSG;
+                if (data[1] & JOURNAL_OBJECT_COMPRESSED)
+                    bloom_add(b, name, name_len);
+                else
+                    bloom_add(b, data + payload, read_le64(data + 8) - payload);
+                data_offset = read_le64(data + 32);
+            }
+            offset = read_le64(field + 24);
+        }
+    }
+    return 0;
+}
+
+/* Loads sidecar, if it is for the same file id and size */
+static int
+bloom_load(bloom_file *b, const char *sidecar, const journal_reader_file *f)
+{
+    uint8_t header[BLOOM_HEADER_SIZE];
+    uint64_t i, n;
+    int fd, r = 0;
+
+    fd = open(sidecar, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (read(fd, header, sizeof(header)) != sizeof(header) ||
+        memcmp(header, BLOOM_MAGIC, 8) != 0 ||
+        memcmp(header + 8, f->map + 24, 16) != 0 ||
+        read_le64(header + 24) != f->size) {
+        close(fd);
+        return -ESTALE;
+    }
+    b->m = read_le64(header + 32);
+    b->k = read_le32(header + 40);
+    n = b->m / 64;
+    if (b->m == 0 || b->m % 64 || b->m > f->size * 64 || b->k == 0 || b->k > 64) {
+        close(fd);
+        return -EBADMSG;
+    }
+    b->bits = PyMem_RawMalloc(n * sizeof(uint64_t));
+    if (b->bits == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    if (read(fd, b->bits, n * sizeof(uint64_t)) != (ssize_t) (n * sizeof(uint64_t)))
+        r = -EBADMSG;
+    close(fd);
+    for (i = 0; r == 0 && i < n; i++)
+        b->bits[i] = le64toh(b->bits[i]);
+    if (r < 0) {
+        PyMem_RawFree(b->bits);
+        b->bits = NULL;
+    }
+    return r;
+}
+
+/* Writes sidecar via a temporary file; failure leaves it to be rebuilt */
+static void
+bloom_save(const bloom_file *b, const char *sidecar, const journal_reader_file *f)
+{
+    uint8_t header[BLOOM_HEADER_SIZE];
+    uint64_t i, v, n = b->m / 64;
+    uint32_t v32;
+    char *tmp;
+    int fd, ok;
+
+    if (asprintf(&tmp, "%s.%d.tmp", sidecar, (int) getpid()) < 0)
+        return;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return;
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, BLOOM_MAGIC, 8);
+    memcpy(header + 8, f->map + 24, 16);
+    v = htole64(f->size);
+    memcpy(header + 24, &v, 8);
+    v = htole64(b->m);
+    memcpy(header + 32, &v, 8);
+    v32 = htole32(b->k);
+    memcpy(header + 40, &v32, 4);
+    ok = write(fd, header, sizeof(header)) == sizeof(header);
+    for (i = 0; ok && i < n; i++) {
+        v = htole64(b->bits[i]);
+        ok = write(fd, &v, 8) == 8;
+    }
+    if (close(fd) < 0)
+        ok = 0;
+    if (!ok || rename(tmp, sidecar) < 0)
+        unlink(tmp);
+    free(tmp);
+}
+
+/* Directory of sidecars by default: pyjournalctl in $XDG_CACHE_HOME, or
+ * ~/.cache, created as needed. NULL if there is no home directory, when
+ * sidecars are not kept. */
+static char *
+bloom_cache_dir(void)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    char *cache=NULL, *dir=NULL;
+
+    if (base && base[0] == '/') {
+        if (asprintf(&cache, "%s", base) < 0)
+            return NULL;
+    }else if ((base = getenv("HOME")) && base[0] == '/') {
+        if (asprintf(&cache, "%s/.cache", base) < 0)
+            return NULL;
+    }else{
+        return NULL;
+    }
+    if ((mkdir(cache, 0700) < 0 && errno != EEXIST) ||
+        asprintf(&dir, "%s/pyjournalctl", cache) < 0 ||
+        (mkdir(dir, 0700) < 0 && errno != EEXIST)) {
+        free(dir);
+        dir = NULL;
+    }
+    free(cache);
+    return dir;
+}
+
+/* Filter for journal file `name` in `dir`, loaded or built as needed,
+ * and kept in `sidecar_dir` if given. Files not yet archived are left
+ * without one, so always match. */
+static int
+bloom_file_open(bloom_file *b, const char *dir, const char *name, const char *sidecar_dir)
+{
+    journal_reader_file f;
+    char *sidecar;
+    int dir_fd, r;
+
+    memset(&f, 0, sizeof(f));
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return -errno;
+    r = reader_file_map(&f, dir_fd, name);
+    close(dir_fd);
+    if (r < 0 || f.map[16] != JOURNAL_STATE_ARCHIVED) {
+        if (f.map)
+            munmap((void *) f.map, f.size);
+        return r == -ENOMEM ? r : 0;
+    }
+
+    if (sidecar_dir == NULL) {
+        sidecar = NULL;
+    }else if (asprintf(&sidecar, "%s/%s.bloom", sidecar_dir, name) < 0) {
+        munmap((void *) f.map, f.size);
+        return -ENOMEM;
+    }
+    r = sidecar ? bloom_load(b, sidecar, &f) : -ENOENT;
+    if (r < 0 && r != -ENOMEM) {
+        r = bloom_build(b, &f);
+        if (r == 0) {
+            if (sidecar)
+                bloom_save(b, sidecar, &f);
+            r = 1;
+        }else if (r != -ENOMEM) {
+            PyMem_RawFree(b->bits);
+            b->bits = NULL;
+            r = 0;
+        }
+    }
+    free(sidecar);
+    munmap((void *) f.map, f.size);
+    return r;
+}
+
+/* Whether a file may have entries matching the term of matches between
+ * `start` and `end`: an AND over fields of an OR of their values */
+static int
+Journal___bloom_term(Journal *self, const bloom_file *b, size_t start, size_t end)
+{
+    size_t i, k, len;
+    const char *delim;
+    int seen, present;
+
+    for (i = start; i < end; i++) {
+        const journal_match *m = &self->matches[i];
+        delim = memchr(m->data, '=', m->len);
+        len = delim ? (size_t) (delim - m->data) + 1 : m->len;
+        for (seen = 0, k = start; k < i && !seen; k++)
+            seen = self->matches[k].len >= len && memcmp(self->matches[k].data, m->data, len) == 0;
+        if (seen)
+            continue;
+        for (present = 0, k = i; k < end && !present; k++) {
+            if (self->matches[k].len >= len && memcmp(self->matches[k].data, m->data, len) == 0)
+                present = bloom_may_match(b, self->matches[k].data, self->matches[k].len);
+        }
+        if (!present)
+            return 0;
+    }
+    return 1;
+}
+
+/* Recorded matches are an AND of groups split by conjunctions, each an OR
+ * of terms split by disjunctions */
+static int
+Journal___bloom_may_match(Journal *self, const bloom_file *b)
+{
+    int result = 1, group = 0, group_used = 0, kind;
+    size_t i, start = 0;
+
+    if (b->bits == NULL)
+        return 1;
+    for (i = 0; i <= self->n_matches && result; i++) {
+        kind = i < self->n_matches ? self->matches[i].kind : JOURNAL_CONJUNCTION;
+        if (kind == JOURNAL_MATCH)
+            continue;
+        if (i > start) {
+            group |= Journal___bloom_term(self, b, start, i);
+            group_used = 1;
+        }
+        start = i + 1;
+        if (kind == JOURNAL_CONJUNCTION) {
+            if (group_used && !group)
+                result = 0;
+            group = group_used = 0;
+        }
+    }
+    return result;
+}
+
+static void
+bloom_paths_free(char **paths)
+{
+    size_t i;
+    if (paths == NULL)
+        return;
+    for (i = 0; paths[i]; i++)
+        free(paths[i]);
+    PyMem_RawFree(paths);
+}
+
+static void
+bloom_index_free(bloom_index *bloom)
+{
+    size_t i;
+    if (bloom == NULL)
+        return;
+    for (i = 0; i < bloom->n_files; i++) {
+        PyMem_RawFree(bloom->files[i].name);
+        PyMem_RawFree(bloom->files[i].bits);
+    }
+    PyMem_RawFree(bloom->files);
+    bloom_paths_free(bloom->paths);
+    free(bloom->cursor);
+    PyMem_RawFree(bloom->sidecar_dir);
+    PyMem_RawFree(bloom);
+}
+
+/* Brings filters up to date with the files in `dir` */
+static int
+bloom_index_refresh(bloom_index *bloom, const char *dir)
+{
+    bloom_file *files=NULL, *temp;
+    size_t n = 0, i;
+    struct dirent *de;
+    DIR *d;
+    int r = 0;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return -errno;
+    while (r >= 0 && (de = readdir(d))) {
+        size_t len = strlen(de->d_name);
+        if (!(len > 8 && strcmp(de->d_name + len - 8, ".journal") == 0) &&
+            !(len > 9 && strcmp(de->d_name + len - 9, ".journal~") == 0))
+            continue;
+        temp = PyMem_RawRealloc(files, (n + 1) * sizeof(bloom_file));
+        if (temp == NULL) {
+            r = -ENOMEM;
+            break;
+        }
+        files = temp;
+        for (i = 0; i < bloom->n_files; i++) {
+            if (bloom->files[i].name && strcmp(bloom->files[i].name, de->d_name) == 0)
+                break;
+        }
+        if (i < bloom->n_files) {
+            files[n++] = bloom->files[i];
+            bloom->files[i].name = NULL;
+            bloom->files[i].bits = NULL;
+            continue;
+        }
+        memset(&files[n], 0, sizeof(bloom_file));
+        files[n].name = PyMem_RawMalloc(len + 1);
+        if (files[n].name == NULL) {
+            r = -ENOMEM;
+            break;
+        }
+        memcpy(files[n].name, de->d_name, len + 1);
+        r = bloom_file_open(&files[n], dir, de->d_name, bloom->sidecar_dir);
+        if (r > 0)
+            bloom->built++;
+        n++;
+    }
+    closedir(d);
+
+    for (i = 0; i < bloom->n_files; i++) {
+        PyMem_RawFree(bloom->files[i].name);
+        PyMem_RawFree(bloom->files[i].bits);
+    }
+    PyMem_RawFree(bloom->files);
+    bloom->files = files;
+    bloom->n_files = n;
+    return r < 0 ? r : 0;
+}
+
+/* Paths of files which may match, NULL-terminated, or NULL in `ret` if
+ * all of them may. Reopening costs about as much as opening all of the
+ * files once more, so is only worth it when at least half are pruned;
+ * otherwise all files are kept as if none were pruned. */
+static int
+Journal___bloom_candidates(Journal *self, char ***ret, size_t *n_pruned)
+{
+    bloom_index *bloom = self->bloom;
+    char **paths;
+    size_t i, n = 0;
+
+    *ret = NULL;
+    *n_pruned = 0;
+    paths = PyMem_RawCalloc(bloom->n_files + 1, sizeof(char *));
+    if (paths == NULL)
+        return -ENOMEM;
+    for (i = 0; i < bloom->n_files; i++) {
+        if (!Journal___bloom_may_match(self, &bloom->files[i]))
+            continue;
+        if (asprintf(&paths[n], "%s/%s", self->path, bloom->files[i].name) < 0) {
+            paths[n] = NULL;
+            goto fail;
+        }
+        n++;
+    }
+    if (n * 2 > bloom->n_files) {
+        bloom_paths_free(paths);
+        return 0;
+    }
+    *n_pruned = bloom->n_files - n;
+    *ret = paths;
+    return 0;
+
+fail:
+    bloom_paths_free(paths);
+    return -ENOMEM;
+}
+
+static int
+bloom_paths_equal(char **a, char **b)
+{
+    size_t i;
+    if (a == NULL || b == NULL)
+        return a == b;
+    for (i = 0; a[i] && b[i]; i++) {
+        if (strcmp(a[i], b[i]) != 0)
+            return 0;
+    }
+    return a[i] == b[i];
+}
+
+/* Replaces the handle of `self` by `j`, waking any threads in wait() on
+ * the old one, which poll a duplicate of its fd so that it may be closed */
+static void
+Journal___replace_handle(Journal *self, sd_journal *j)
+{
+    journal_waiter *waiter;
+    uint64_t one = 1;
+
+    for (waiter = self->waiters; waiter; waiter = waiter->next) {
+        waiter->replaced = 1;
+        if (write(waiter->wake_fd, &one, sizeof(one)) < 0)
+            continue;
+    }
+    self->waiters = NULL;
+    if (self->j)
+        sd_journal_close(self->j);
+    self->j = j;
+    self->watching = 0;
+}
+
+/* Reopens the journal on only the files which may match, once matches have
+ * changed. With `keep_position`, this is only done at the head; elsewhere
+ * all files are reopened if needed, keeping the position by cursor. */
+static int
+Journal___apply_bloom(Journal *self, int keep_position)
+{
+    bloom_index *bloom = self->bloom;
+    sd_journal *j=NULL;
+    char **paths=NULL, *cursor=NULL;
+    size_t n_pruned = 0;
+    int r = 0, transfer;
+
+    if (bloom == NULL || !bloom->pending)
+        return 0;
+    transfer = keep_position && !self->at_head;
+    if (transfer && bloom->paths == NULL)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (!transfer) {
+        r = bloom_index_refresh(bloom, self->path);
+        if (r >= 0)
+            r = Journal___bloom_candidates(self, &paths, &n_pruned);
+    }
+    if (r >= 0 && !bloom_paths_equal(paths, bloom->paths))
+        r = Journal___open_handle(self, paths, &j);
+    if (r >= 0 && j && transfer) {
+        cursor = bloom->cursor;
+        if (cursor || sd_journal_get_cursor(self->j, &cursor) >= 0) {
+            r = sd_journal_seek_cursor(j, cursor);
+            if (r >= 0 && sd_journal_next(j) > 0 && sd_journal_test_cursor(j, cursor) <= 0)
+                sd_journal_previous(j);
+        }
+        if (cursor != bloom->cursor)
+            free(cursor);
+    }
+    free(bloom->cursor);
+    bloom->cursor = NULL;
+    Py_END_ALLOW_THREADS
+
+    if (r < 0) {
+        bloom_paths_free(paths);
+        if (j)
+            sd_journal_close(j);
+        if (r == -ENOMEM)
+            PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        else
+            PyErr_SetString(PyExc_RuntimeError, "Error opening journal files");
+        return -1;
+    }
+    if (j) {
+        Journal___replace_handle(self, j);
+        bloom_paths_free(bloom->paths);
+        bloom->paths = paths;
+    }else{
+        bloom_paths_free(paths);
+    }
+    if (!transfer) {
+        bloom->pruned = n_pruned;
+        bloom->pending = 0;
+    }else{
+        bloom->pruned = 0;
+    }
+    return 0;
+}
+
+/* Inverted index of the words of MESSAGE, from words to the entries
+ * containing them. Entries are addressed by seqnum id and seqnum, which
+ * libsystemd can seek to as a partial cursor. */
+#define INDEX_MAGIC     "PJINDEX1"
+#define INDEX_MAX_TOKEN 64
+
+typedef struct {
+    uint32_t *items;
+    uint32_t n;
+    uint32_t size;
+} index_postings;
+
+typedef struct {
+    uint32_t id;
+    uint64_t seqnum;
+} index_entry;
+
+struct journal_index {
+    char *path;
+    sd_id128_t *ids;
+    uint32_t n_ids;
+    index_entry *entries;
+    uint64_t n_entries;
+    uint64_t size;
+    hashtable tokens;
+    char *last_cursor;
+    /* Tail handle, kept from update_index() to add entries on wait() */
+    sd_journal *j;
+    /* Entries added by wait() since last saved */
+    int unsaved;
+};
+
+static void
+journal_index_free(journal_index *index)
+{
+    size_t i;
+    if (index == NULL)
+        return;
+    for (i = 0; i < index->tokens.size; i++) {
+        index_postings *p = index->tokens.entries[i].data;
+        if (index->tokens.entries[i].key && p) {
+            PyMem_RawFree(p->items);
+            PyMem_RawFree(p);
+        }
+    }
+    hashtable_free(&index->tokens);
+    PyMem_RawFree(index->ids);
+    PyMem_RawFree(index->entries);
+    PyMem_RawFree(index->path);
+    free(index->last_cursor);
+    if (index->j)
+        sd_journal_close(index->j);
+    PyMem_RawFree(index);
+}
+
+static int
+index_is_word(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static unsigned char
+index_lower(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* Calls `func` with each lowercased word of `text`, truncated to
+ * INDEX_MAX_TOKEN bytes */
+static int
+index_tokenize(const char *text, size_t len, int (*func)(void *, const char *, size_t), void *arg)
+{
+    char token[INDEX_MAX_TOKEN];
+    size_t i = 0, n;
+    int r;
+
+    while (i < len) {
+        while (i < len && !index_is_word(text[i]))
+            i++;
+        for (n = 0; i < len && index_is_word(text[i]); i++) {
+            if (n < INDEX_MAX_TOKEN)
+                token[n++] = index_lower(text[i]);
+        }
+        if (n > 0 && (r = func(arg, token, n)) < 0)
+            return r;
+    }
+    return 0;
+}
+
+static int
+index_add_posting(journal_index *index, const char *token, size_t len, uint32_t entry)
+{
+    hashtable_entry *e;
+    index_postings *p;
+    uint32_t *items;
+
+    e = hashtable_insert(&index->tokens, token, len, hash_bytes(token, len));
+    if (e == NULL)
+        return -ENOMEM;
+    if (e->data == NULL && (e->data = PyMem_RawCalloc(1, sizeof(index_postings))) == NULL)
+        return -ENOMEM;
+    p = e->data;
+    if (p->n > 0 && p->items[p->n - 1] == entry)
+        return 0;
+    if (p->n == p->size) {
+        items = PyMem_RawRealloc(p->items, (p->size ? p->size * 2 : 4) * sizeof(uint32_t));
+        if (items == NULL)
+            return -ENOMEM;
+        p->items = items;
+        p->size = p->size ? p->size * 2 : 4;
+    }
+    p->items[p->n++] = entry;
+    return 0;
+}
+
+typedef struct {
+    journal_index *index;
+    uint32_t entry;
+} index_add_arg;
+
+static int
+index_add_token(void *arg, const char *token, size_t len)
+{
+    index_add_arg *a = arg;
+    return index_add_posting(a->index, token, len, a->entry);
+}
+
+/* Parses seqnum id and seqnum from a cursor */
+static int
+index_parse_cursor(const char *cursor, sd_id128_t *id, uint64_t *seqnum)
+{
+    const char *s = strstr(cursor, "s="), *i = strstr(cursor, ";i=");
+    char id_str[33];
+
+    if (s != cursor || i == NULL || i - s - 2 != 32)
+        return -EINVAL;
+    memcpy(id_str, s + 2, 32);
+    id_str[32] = '\0';
+    if (sd_id128_from_string(id_str, id) < 0)
+        return -EINVAL;
+    *seqnum = strtoull(i + 3, NULL, 16);
+    return 0;
+}
+
+/* Indexes the current entry of `j` */
+static int
+index_add_entry(journal_index *index, sd_journal *j)
+{
+    index_add_arg arg;
+    index_entry *entries;
+    const void *data;
+    size_t len;
+    char *cursor;
+    sd_id128_t id;
+    uint64_t seqnum;
+    uint32_t k;
+    int r;
+
+    r = sd_journal_get_cursor(j, &cursor);
+    if (r < 0)
+        return r;
+    r = index_parse_cursor(cursor, &id, &seqnum);
+    if (r < 0) {
+        free(cursor);
+        return r;
+    }
+    free(index->last_cursor);
+    index->last_cursor = cursor;
+
+    for (k = 0; k < index->n_ids && !sd_id128_equal(index->ids[k], id); k++);
+    if (k == index->n_ids) {
+        sd_id128_t *ids = PyMem_RawRealloc(index->ids, (index->n_ids + 1) * sizeof(sd_id128_t));
+        if (ids == NULL)
+            return -ENOMEM;
+        index->ids = ids;
+        ids[index->n_ids++] = id;
+    }
+    if (index->n_entries >= UINT32_MAX)
+        return -E2BIG;
+    if (index->n_entries == index->size) {
+        entries = PyMem_RawRealloc(index->entries, (index->size ? index->size * 2 : 1024) * sizeof(index_entry));
+        if (entries == NULL)
+            return -ENOMEM;
+        index->entries = entries;
+        index->size = index->size ? index->size * 2 : 1024;
+    }
+    index->entries[index->n_entries].id = k;
+    index->entries[index->n_entries].seqnum = seqnum;
+    arg.index = index;
+    arg.entry = index->n_entries++;
+
+    r = sd_journal_get_data(j, "MESSAGE", &data, &len);
+    if (r == -ENOENT)
+        return 0;
+    if (r < 0)
+        return r;
+    return index_tokenize((const char *) data + 8, len - 8, index_add_token, &arg);
+}
+
+/* Reads index file, as written by index_save */
+static int
+index_load(journal_index *index, const char *path)
+{
+    uint8_t *buf, *p, *end;
+    struct stat st;
+    uint64_t i, n_tokens, n;
+    uint32_t k, len;
+    int fd, r = -EBADMSG;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -errno;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -errno;
+    }
+    buf = PyMem_RawMalloc(st.st_size ? st.st_size : 1);
+    if (buf == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    if (read(fd, buf, st.st_size) != st.st_size) {
+        close(fd);
+        PyMem_RawFree(buf);
+        return -EIO;
+    }
+    close(fd);
+    p = buf;
+    end = buf + st.st_size;
+
+#define INDEX_NEED(n) if ((uint64_t) (end - p) < (uint64_t) (n)) goto finish
+    INDEX_NEED(32);
+    if (memcmp(p, INDEX_MAGIC, 8) != 0)
+        goto finish;
+    index->n_ids = read_le32(p + 8);
+    len = read_le32(p + 12);
+    index->n_entries = read_le64(p + 16);
+    n_tokens = read_le64(p + 24);
+    p += 32;
+
+    INDEX_NEED(len);
+    if (len > 0) {
+        index->last_cursor = malloc(len + 1);
+        if (index->last_cursor == NULL) {
+            r = -ENOMEM;
+            goto finish;
+        }
+        memcpy(index->last_cursor, p, len);
+        index->last_cursor[len] = '\0';
+        p += len;
+    }
+    INDEX_NEED((uint64_t) index->n_ids * 16);
+    index->ids = PyMem_RawMalloc((index->n_ids ? index->n_ids : 1) * sizeof(sd_id128_t));
+    if (index->ids == NULL) {
+        r = -ENOMEM;
+        goto finish;
+    }
+    for (k = 0; k < index->n_ids; k++, p += 16)
+        memcpy(index->ids[k].bytes, p, 16);
+
+    if (index->n_entries > (uint64_t) (end - p) / 12)
+        goto finish;
+    index->size = index->n_entries;
+    index->entries = PyMem_RawMalloc((index->size ? index->size : 1) * sizeof(index_entry));
+    if (index->entries == NULL) {
+        r = -ENOMEM;
+        goto finish;
+    }
+    for (i = 0; i < index->n_entries; i++, p += 12) {
+        index->entries[i].id = read_le32(p);
+        index->entries[i].seqnum = read_le64(p + 4);
+        if (index->entries[i].id >= index->n_ids)
+            goto finish;
+    }
+
+    if (hashtable_init(&index->tokens, n_tokens * 4 / 3) < 0) {
+        r = -ENOMEM;
+        goto finish;
+    }
+    for (i = 0; i < n_tokens; i++) {
+        hashtable_entry *e;
+        index_postings *postings;
+        INDEX_NEED(8);
+        len = read_le32(p);
+        n = read_le32(p + 4);
+        p += 8;
+        INDEX_NEED(len + n * 4);
+        if (len == 0 || len > INDEX_MAX_TOKEN || n == 0)
+            goto finish;
+        e = hashtable_insert(&index->tokens, p, len, hash_bytes(p, len));
+        postings = PyMem_RawCalloc(1, sizeof(index_postings));
+        if (e == NULL || postings == NULL || (postings->items = PyMem_RawMalloc(n * sizeof(uint32_t))) == NULL) {
+            PyMem_RawFree(postings);
+            r = -ENOMEM;
+            goto finish;
+        }
+        e->data = postings;
+        p += len;
+        for (postings->n = 0; postings->n < n; postings->n++, p += 4) {
+            postings->items[postings->n] = read_le32(p);
+            if (postings->items[postings->n] >= index->n_entries)
+                goto finish;
+        }
+        postings->size = n;
+    }
+    r = 0;
+#undef INDEX_NEED
+
+finish:
+    PyMem_RawFree(buf);
+    return r;
+}
+
+static int
+index_write(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -errno;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes index file via a temporary file, as: header, last cursor,
+ * seqnum ids, entries, then each word with its postings */
+static int
+index_save(const journal_index *index, const char *path)
+{
+    uint8_t header[32], item[12];
+    uint64_t v, i, n_tokens = 0;
+    uint32_t v32, k;
+    size_t cursor_len = index->last_cursor ? strlen(index->last_cursor) : 0;
+    char *tmp;
+    int fd, r = 0;
+
+    for (i = 0; i < index->tokens.size; i++)
+        n_tokens += index->tokens.entries[i].key != NULL;
+    if (asprintf(&tmp, "%s.%d.tmp", path, (int) getpid()) < 0)
+        return -ENOMEM;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        r = -errno;
+        free(tmp);
+        return r;
+    }
+
+    memcpy(header, INDEX_MAGIC, 8);
+    v32 = htole32(index->n_ids);
+    memcpy(header + 8, &v32, 4);
+    v32 = htole32(cursor_len);
+    memcpy(header + 12, &v32, 4);
+    v = htole64(index->n_entries);
+    memcpy(header + 16, &v, 8);
+    v = htole64(n_tokens);
+    memcpy(header + 24, &v, 8);
+    r = index_write(fd, header, sizeof(header));
+    if (r == 0 && cursor_len)
+        r = index_write(fd, index->last_cursor, cursor_len);
+    for (k = 0; r == 0 && k < index->n_ids; k++)
+        r = index_write(fd, index->ids[k].bytes, 16);
+    for (i = 0; r == 0 && i < index->n_entries; i++) {
+        v32 = htole32(index->entries[i].id);
+        v = htole64(index->entries[i].seqnum);
+        memcpy(item, &v32, 4);
+        memcpy(item + 4, &v, 8);
+        r = index_write(fd, item, sizeof(item));
+    }
+    for (i = 0; r == 0 && i < index->tokens.size; i++) {
+        const hashtable_entry *e = &index->tokens.entries[i];
+        const index_postings *p = e->data;
+        if (e->key == NULL)
+            continue;
+        v32 = htole32(e->key_len);
+        memcpy(item, &v32, 4);
+        v32 = htole32(p->n);
+        memcpy(item + 4, &v32, 4);
+        r = index_write(fd, item, 8);
+        if (r == 0)
+            r = index_write(fd, e->key, e->key_len);
+        for (k = 0; r == 0 && k < p->n; k++) {
+            v32 = htole32(p->items[k]);
+            r = index_write(fd, &v32, 4);
+        }
+    }
+    if (close(fd) < 0 && r == 0)
+        r = -errno;
+    if (r == 0 && rename(tmp, path) < 0)
+        r = -errno;
+    if (r < 0)
+        unlink(tmp);
+    free(tmp);
+    return r;
+}
+
+/* Brings index up to date with the entries of `j` after its last entry */
+static int
+index_update(journal_index *index, sd_journal *j, uint64_t *added)
+{
+    uint64_t n = index->n_entries;
+    int r;
+
+    *added = 0;
+    if (index->last_cursor) {
+        r = sd_journal_seek_cursor(j, index->last_cursor);
+        /* Skip the last entry indexed, if still present */
+        if (r >= 0 && (r = sd_journal_next(j)) > 0 && sd_journal_test_cursor(j, index->last_cursor) <= 0)
+            r = sd_journal_previous(j);
+    }else{
+        r = sd_journal_seek_head(j);
+    }
+    while (r >= 0 && (r = sd_journal_next(j)) > 0)
+        r = index_add_entry(index, j);
+    *added = index->n_entries - n;
+    return r;
+}
+
+/* Adds entries appended since the last added, through the tail handle */
+static int
+index_tail(journal_index *index, uint64_t *added)
+{
+    uint64_t n = index->n_entries;
+    int r;
+
+    *added = 0;
+    if (index->j == NULL)
+        return 0;
+    r = sd_journal_process(index->j);
+    while (r >= 0 && (r = sd_journal_next(index->j)) > 0)
+        r = index_add_entry(index, index->j);
+    *added = index->n_entries - n;
+    return r;
+}
+
+typedef struct {
+    journal_index *index;
+    const index_postings **postings;
+    size_t n;
+} index_query;
+
+static int
+index_query_token(void *arg, const char *token, size_t len)
+{
+    index_query *q = arg;
+    hashtable_entry *e = hashtable_find(&q->index->tokens, token, len, hash_bytes(token, len));
+    q->postings[q->n++] = e ? e->data : NULL;
+    return 0;
+}
+
+static int
+index_postings_compare(const void *a, const void *b)
+{
+    const index_postings *pa = *(const index_postings * const *) a;
+    const index_postings *pb = *(const index_postings * const *) b;
+    uint32_t na = pa ? pa->n : 0, nb = pb ? pb->n : 0;
+    return na < nb ? -1 : na > nb;
+}
+
+static int
+index_postings_contains(const index_postings *p, uint32_t entry)
+{
+    uint32_t lo = 0, hi = p->n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (p->items[mid] < entry)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < p->n && p->items[lo] == entry;
+}
+
+/* Whether `text` is in `message` ignoring ASCII case, starting and ending
+ * at word boundaries */
+static int
+index_match_text(const char *message, size_t message_len, const char *text, size_t text_len)
+{
+    size_t i, k;
+    if (text_len == 0 || text_len > message_len)
+        return 0;
+    for (i = 0; i + text_len <= message_len; i++) {
+        if (i > 0 && index_is_word(message[i - 1]) && index_is_word(text[0]))
+            continue;
+        for (k = 0; k < text_len && index_lower(message[i + k]) == index_lower(text[k]); k++);
+        if (k < text_len)
+            continue;
+        if (i + k < message_len && index_is_word(message[i + k]) && index_is_word(text[text_len - 1]))
+            continue;
+        return 1;
+    }
+    return 0;
+}
+
+/* Results of between(), keyed on the match set, filter, time range and
+ * projection. Held in memory as converted entries, sized by their
+ * unconverted form: for each entry the length of its items, then the
+ * items as per get_next_raw(blob=True), all lengths 64 bit little
+ * endian, which is also kept on disk for results only covering archived
+ * files. Others are live, dropped when wait() reports a change. Entries
+ * are most recently used last. Dropped entries are only released once
+ * the journal is unlocked, as converted values may run arbitrary code
+ * when released. */
+#define RESULT_CACHE_MAGIC "PJRCACHE"
+#define RESULT_CACHE_VERSION 1
+
+typedef struct {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    PyObject *entries;
+    size_t size;
+    int live;
+} result_cache_entry;
+
+struct result_cache {
+    size_t max_bytes;
+    size_t bytes;
+    char *dir;
+    result_cache_entry **entries;
+    size_t n_entries;
+    PyObject *dropped;
+    uint64_t hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+static void
+result_cache_entry_free(result_cache_entry *e)
+{
+    if (e == NULL)
+        return;
+    PyMem_RawFree(e->key);
+    Py_XDECREF(e->entries);
+    PyMem_Free(e);
+}
+
+static result_cache *
+result_cache_new(size_t max_bytes, const char *dir)
+{
+    result_cache *cache = PyMem_Calloc(1, sizeof(result_cache));
+    if (cache == NULL)
+        goto nomem;
+    cache->max_bytes = max_bytes;
+    if (dir) {
+        cache->dir = PyMem_Malloc(strlen(dir) + 1);
+        if (cache->dir == NULL)
+            goto nomem;
+        strcpy(cache->dir, dir);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, dir);
+            PyMem_Free(cache->dir);
+            PyMem_Free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+
+nomem:
+    PyMem_Free(cache);
+    PyErr_NoMemory();
+    return NULL;
+}
+
+static void
+result_cache_free(result_cache *cache)
+{
+    size_t i;
+    if (cache == NULL)
+        return;
+    for (i = 0; i < cache->n_entries; i++)
+        result_cache_entry_free(cache->entries[i]);
+    Py_XDECREF(cache->dropped);
+    PyMem_Free(cache->entries);
+    PyMem_Free(cache->dir);
+    PyMem_Free(cache);
+}
+
+static void
+result_cache_drop(result_cache *cache, result_cache_entry *e)
+{
+    if (e->entries && (cache->dropped || (cache->dropped = PyList_New(0))) &&
+        PyList_Append(cache->dropped, e->entries) == 0)
+        Py_CLEAR(e->entries);
+    else
+        PyErr_Clear();
+    result_cache_entry_free(e);
+}
+
+static void
+result_cache_remove(result_cache *cache, size_t i)
+{
+    cache->bytes -= cache->entries[i]->size;
+    result_cache_drop(cache, cache->entries[i]);
+    memmove(&cache->entries[i], &cache->entries[i + 1], (cache->n_entries - i - 1) * sizeof(result_cache_entry *));
+    cache->n_entries--;
+}
+
+/* Drops results which may include entries of active journal files */
+static void
+result_cache_invalidate(result_cache *cache)
+{
+    size_t i = 0;
+    while (i < cache->n_entries) {
+        if (cache->entries[i]->live) {
+            result_cache_remove(cache, i);
+            cache->invalidations++;
+        }else{
+            i++;
+        }
+    }
+}
+
+/* Drops all results held in memory */
+static void
+result_cache_clear(result_cache *cache)
+{
+    while (cache->n_entries)
+        result_cache_remove(cache, cache->n_entries - 1);
+}
+
+/* Returns results dropped since last called, to be released once the
+ * journal is unlocked */
+static PyObject *
+result_cache_dropped(result_cache *cache)
+{
+    PyObject *dropped;
+    if (cache == NULL)
+        return NULL;
+    dropped = cache->dropped;
+    cache->dropped = NULL;
+    return dropped;
+}
+
+static result_cache_entry *
+result_cache_find(result_cache *cache, const char *key, size_t key_len, uint64_t hash)
+{
+    result_cache_entry *e;
+    size_t i;
+
+    for (i = cache->n_entries; i-- > 0;) {
+        e = cache->entries[i];
+        if (e->hash != hash || e->key_len != key_len || memcmp(e->key, key, key_len) != 0)
+            continue;
+        memmove(&cache->entries[i], &cache->entries[i + 1], (cache->n_entries - i - 1) * sizeof(result_cache_entry *));
+        cache->entries[cache->n_entries - 1] = e;
+        return e;
+    }
+    return NULL;
+}
+
+/* Takes ownership of `e`, evicting least recently used results to fit.
+ * Results larger than the cache are not held. */
+static int
+result_cache_insert(result_cache *cache, result_cache_entry *e)
+{
+    result_cache_entry **entries;
+
+    if (e->size > cache->max_bytes) {
+        result_cache_drop(cache, e);
+        return 0;
+    }
+    while (cache->n_entries && cache->bytes + e->size > cache->max_bytes) {
+        result_cache_remove(cache, 0);
+        cache->evictions++;
+    }
+    entries = PyMem_Realloc(cache->entries, (cache->n_entries + 1) * sizeof(result_cache_entry *));
+    if (entries == NULL) {
+        result_cache_drop(cache, e);
+        PyErr_NoMemory();
+        return -1;
+    }
+    cache->entries = entries;
+    cache->entries[cache->n_entries++] = e;
+    cache->bytes += e->size;
+    return 0;
+}
+
+/* Reads result of `key` from disk, returning 1 if found */
+static int
+result_cache_load(const result_cache *cache, const char *key, size_t key_len, uint64_t hash,
+                  char **data, size_t *size)
+{
+    uint8_t header[24];
+    struct stat st;
+    char *path, *buf;
+    size_t n;
+    int fd, r = 0;
+
+    if (asprintf(&path, "%s/%016llx.cache", cache->dir, (unsigned long long) hash) < 0)
+        return -ENOMEM;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || (uint64_t) st.st_size < sizeof(header) + key_len ||
+        pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header, RESULT_CACHE_MAGIC, 8) != 0 ||
+        read_le64(header + 8) != RESULT_CACHE_VERSION || read_le64(header + 16) != key_len)
+        goto finish;
+    n = st.st_size - sizeof(header);
+    buf = PyMem_RawMalloc(n ? n : 1);
+    if (buf == NULL) {
+        r = -ENOMEM;
+        goto finish;
+    }
+    if (pread(fd, buf, n, sizeof(header)) != (ssize_t) n || memcmp(buf, key, key_len) != 0) {
+        PyMem_RawFree(buf);
+        goto finish;
+    }
+    *size = n - key_len;
+    memmove(buf, buf + key_len, *size);
+    *data = buf;
+    r = 1;
+
+finish:
+    close(fd);
+    return r;
+}
+
+/* Failure to save only means the result is not kept on disk */
+static void
+result_cache_save(const result_cache *cache, const char *key, size_t key_len, uint64_t hash,
+                  const char *data, size_t size)
+{
+    uint8_t header[24];
+    char *path, *tmp;
+    uint64_t v;
+    int fd, r;
+
+    if (asprintf(&path, "%s/%016llx.cache", cache->dir, (unsigned long long) hash) < 0)
+        return;
+    if (asprintf(&tmp, "%s.%d.tmp", path, (int) getpid()) < 0) {
+        free(path);
+        return;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        memcpy(header, RESULT_CACHE_MAGIC, 8);
+        v = htole64(RESULT_CACHE_VERSION);
+        memcpy(header + 8, &v, 8);
+        v = htole64(key_len);
+        memcpy(header + 16, &v, 8);
+        r = index_write(fd, header, sizeof(header));
+        if (r == 0)
+            r = index_write(fd, key, key_len);
+        if (r == 0)
+            r = index_write(fd, data, size);
+        if (close(fd) < 0)
+            r = -1;
+        if (r < 0 || rename(tmp, path) < 0)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+}
+
+static pyjournalctl_state *
+get_state_by_type(PyTypeObject *type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject *module = PyType_GetModuleByDef(type, &pyjournalctl_module);
+    if (module == NULL)
+        return NULL;
+    return (pyjournalctl_state *) PyModule_GetState(module);
+#else
+    PyObject *mro = type->tp_mro;
+    Py_ssize_t i;
+    for (i = 0; mro && i < PyTuple_GET_SIZE(mro); i++) {
+        PyTypeObject *base = (PyTypeObject *) PyTuple_GET_ITEM(mro, i);
+        PyObject *module;
+        if (!(base->tp_flags & Py_TPFLAGS_HEAPTYPE))
+            continue;
+        module = PyType_GetModule(base);
+        if (module && PyModule_GetDef(module) == &pyjournalctl_module)
+            return (pyjournalctl_state *) PyModule_GetState(module);
+        PyErr_Clear();
+    }
+    PyErr_SetString(PyExc_TypeError, "Type not defined by pyjournalctl");
+    return NULL;
+#endif
+}
+
+static int
+lock_init(journal_lock_t *lock)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    *lock = (PyMutex){0};
+#else
+    *lock = PyThread_allocate_lock();
+    if (*lock == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Unable to allocate lock");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void
+lock_acquire(journal_lock_t *lock)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    PyMutex_Lock(lock);
+#else
+    if (!PyThread_acquire_lock(*lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(*lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+#endif
+}
+
+static void
+lock_release(journal_lock_t *lock)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    PyMutex_Unlock(lock);
+#else
+    PyThread_release_lock(*lock);
+#endif
+}
+
+static void
+lock_free(journal_lock_t *lock)
+{
+#if PY_VERSION_HEX < 0x030D0000
+    if (*lock)
+        PyThread_free_lock(*lock);
+#endif
+}
+
+static int
+Journal___lock_init(Journal *self)
+{
+    return lock_init(&self->lock);
+}
+
+/* Locks `self`, raising RuntimeError if the calling thread holds the
+ * lock already, as when a converter uses the journal whose entry it
+ * converts */
+static int
+Journal___lock(Journal *self)
+{
+    unsigned long thread = PyThread_get_thread_ident();
+
+    if (atomic_load(&self->lock_owner) == thread) {
+        PyErr_SetString(PyExc_RuntimeError, "Journal is in use by this thread, such as by a converter");
+        return -1;
+    }
+    lock_acquire(&self->lock);
+    atomic_store(&self->lock_owner, thread);
+    return 0;
+}
+
+static void
+Journal___unlock(Journal *self)
+{
+    atomic_store(&self->lock_owner, 0);
+    lock_release(&self->lock);
+}
+
+/* Unpack METH_FASTCALL arguments into `out` (which must be NULL
+ * initialised) by position, or by keyword from `kwlist` */
+static int
+unpack_fastcall(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+                PyObject *kwnames, const char * const *kwlist,
+                Py_ssize_t required, PyObject **out)
+{
+    Py_ssize_t nkwlist, i, k;
+
+    for (nkwlist = 0; kwlist[nkwlist]; nkwlist++);
+    if (nargs > nkwlist) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)",
+                     fname, nkwlist, nargs);
+        return -1;
+    }
+    for (i = 0; i < nargs; i++)
+        out[i] = args[i];
+
+    for (i = 0; kwnames && i < PyTuple_GET_SIZE(kwnames); i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        for (k = 0; k < nkwlist; k++) {
+            if (PyUnicode_CompareWithASCIIString(name, kwlist[k]) == 0)
+                break;
+        }
+        if (k == nkwlist) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'",
+                         fname, name);
+            return -1;
+        }
+        if (out[k]) {
+            PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'",
+                         fname, kwlist[k]);
+            return -1;
+        }
+        out[k] = args[nargs + i];
+    }
+
+    for (i = 0; i < required; i++) {
+        if (out[i] == NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'",
+                         fname, kwlist[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+as_int64(PyObject *obj, int64_t *value)
+{
+    long long temp = PyLong_AsLongLong(obj);
+    if (temp == -1 && PyErr_Occurred())
+        return -1;
+    *value = temp;
+    return 0;
+}
+
+static const char *
+as_cstring(PyObject *obj)
+{
+    const char *str;
+    Py_ssize_t len;
+
+    if (!PyUnicode_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "expected str, got %.200s", Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+    str = PyUnicode_AsUTF8AndSize(obj, &len);
+    if (str && strlen(str) != (size_t) len) {
+        PyErr_SetString(PyExc_ValueError, "embedded null character");
+        return NULL;
+    }
+    return str;
+}
+
+static int
+Journal_traverse(Journal *self, visitproc visit, void *arg)
+{
+    size_t i;
+    for (i = 0; i < self->cache.values.size; i++) {
+        if (self->cache.values.entries[i].key)
+            Py_VISIT((PyObject *) self->cache.values.entries[i].data);
+    }
+    if (self->results) {
+        for (i = 0; i < self->results->n_entries; i++)
+            Py_VISIT(self->results->entries[i]->entries);
+        Py_VISIT(self->results->dropped);
+    }
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->default_call);
+    Py_VISIT(self->call_dict);
+    return 0;
+}
+
+static int
+Journal_clear(Journal *self)
+{
+    value_cache old;
+    Journal___cache_detach(self, &old);
+    value_cache_free(&old);
+    if (self->results) {
+        result_cache_clear(self->results);
+        Py_CLEAR(self->results->dropped);
+    }
+    Py_CLEAR(self->default_call);
+    Py_CLEAR(self->call_dict);
+    return 0;
+}
+
+static void
+Journal_dealloc(Journal* self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->j)
+        sd_journal_close(self->j);
+    Journal___filter_free(self->filter);
+    Journal___flush_recorded_matches(self);
+    PyMem_Free(self->path);
+    reader_close(self->reader);
+    bloom_index_free(self->bloom);
+    journal_index_free(self->index);
+    continuous_free(&self->continuous);
+    Journal_clear(self);
+    result_cache_free(self->results);
+    boot_index_free(self->boots);
+    lock_free(&self->lock);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Journal_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    pyjournalctl_state *state;
+    Journal *self;
+
+    state = get_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+
+    self = (Journal *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    if (Journal___lock_init(self) < 0 || lock_init(&self->continuous.lock) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    /* Defaults are built once per module; each instance gets its own
+     * copy of the call dictionary as it is mutable */
+    Py_INCREF(state->default_call);
+    self->default_call = state->default_call;
+    self->call_dict = PyDict_Copy(state->call_dict);
+    if (self->call_dict == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *) self;
+}
+
+PyDoc_STRVAR(Journal__doc__,
+"Journal([flags][, default_call][, call_dict][,path][, value_cache][, engine][, bloom]\n"
+"        [, result_cache][, result_cache_dir]) -> ...\n"
+"Journal instance\n\n"
+"Returns instance of Journal, which allows filtering and return\n"
+"of journal entries.\n"
+"Argument `flags` sets open flags of the journal, which can be one\n"
+"of, or ORed combination of constants: LOCAL_ONLY (default) opens\n"
+"journal on local machine only; RUNTIME_ONLY opens only\n"
+"volatile journal files; and SYSTEM_ONLY opens only\n"
+"journal files of system services and the kernel.\n"
+"Argument `default_call` must be a callable that accepts one\n"
+"argument which is string/bytes value of a field and returns\n"
+"python object.\n"
+"Argument `call_dict` is a dictionary where the key represents\n"
+"a field name, and value is a callable as per `default_call`.\n"
+"A set of sane defaults for `default_call` and `call_dict` are\n"
+"present.\n"
+"Argument `path` is the directory of journal files. Note that\n"
+"currently flags are ignored when `path` is present as they are\n"
+" not relevant.\n"
+"Argument `value_cache` enables reuse of converted values, holding up\n"
+"to `value_cache` distinct values per field. Repeated values of a field\n"
+"are then the same object, and converters are not called for them.\n"
+"The cache is emptied when `default_call` or `call_dict` is set, but\n"
+"not when `call_dict` is modified in place.\n"
+"Argument `engine` may be \"mmap\" with `path`, to read entries forward\n"
+"from the journal files directly while no matches are added, rather\n"
+"than through libsystemd, which is given the same files, so that files\n"
+"added to `path` later are not read. Fields compressed with zstd or\n"
+"lz4 are decompressed if libzstd or liblz4 can be loaded. Matches,\n"
+"seeking other than to the head, and entries with other compressed\n"
+"fields are handled by libsystemd, reading on from there until seeking\n"
+"to the head; if the files are not supported, libsystemd is used\n"
+"throughout.\n"
+"Argument `bloom` may be given with `path` to skip archived journal\n"
+"files which cannot have entries matching the added matches, using a\n"
+"bloom filter of the FIELD=value pairs of each file. Filters are built\n"
+"once per file and kept in sidecar files in $XDG_CACHE_HOME/pyjournalctl,\n"
+"or ~/.cache/pyjournalctl, if `bloom` is True, or in the directory\n"
+"`bloom`, which may be that of the journal files. Files are selected when\n"
+"seeking, or reading from the head, after matches change, and only when\n"
+"at least half of them are pruned; query_unique() then only covers the\n"
+"selected files. As every file is still opened, this pays off for\n"
+"matches found in few files of large archives, or archives not in the\n"
+"page cache; on small files which are cached it is slower.\n"
+"Argument `result_cache` enables caching of results of between(), up\n"
+"to `result_cache` bytes as measured unconverted; see between(). Those\n"
+"only covering archived files are also kept in `result_cache_dir` if\n"
+"given.\n"
+"A Journal instance may be shared between threads, but calls on it\n"
+"are serialised; use one instance per thread for parallel reading.\n"
+"Field callables must not call back into the same instance.");
+static int
+Journal_init(Journal *self, PyObject *args, PyObject *keywds)
+{
+    int flags=SD_JOURNAL_LOCAL_ONLY;
+    char *path=NULL;
+    PyObject *default_call=NULL, *call_dict=NULL;
+    Py_ssize_t max_values=0;
+    const char *engine=NULL;
+    PyObject *bloom_arg=NULL;
+    Py_ssize_t max_bytes=0;
+    const char *cache_dir=NULL;
+
+    static char *kwlist[] = {"flags", "default_call", "call_dict", "path", "value_cache", "engine", "bloom",
+                             "result_cache", "result_cache_dir", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, keywds, "|iOOsnsOnz", kwlist,
+                                      &flags, &default_call, &call_dict, &path, &max_values, &engine,
+                                      &bloom_arg, &max_bytes, &cache_dir))
+        return -1;
+
+    if (engine && strcmp(engine, "mmap") != 0 && strcmp(engine, "sd-journal") != 0) {
+        PyErr_SetString(PyExc_ValueError, "Engine must be \"mmap\" or \"sd-journal\"");
+        return -1;
+    }
+    if (engine && strcmp(engine, "mmap") == 0 && path == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Engine \"mmap\" requires path");
+        return -1;
+    }
+    int use_bloom = bloom_arg && bloom_arg != Py_None && bloom_arg != Py_False;
+    const char *sidecar_dir=NULL;
+    char *default_dir=NULL;
+    if (use_bloom && path == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Bloom filters require path");
+        return -1;
+    }
+    if (use_bloom && bloom_arg != Py_True && (sidecar_dir = as_cstring(bloom_arg)) == NULL)
+        return -1;
+    if (max_values < 0) {
+        PyErr_SetString(PyExc_ValueError, "Value cache size must be positive integer");
+        return -1;
+    }
+    if (max_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "Result cache size must be positive integer");
+        return -1;
+    }
+    if (cache_dir && max_bytes == 0) {
+        PyErr_SetString(PyExc_ValueError, "Result cache directory requires result_cache");
+        return -1;
+    }
+
+    if (default_call) {
+        if (PyCallable_Check(default_call) || default_call == Py_None) {
+            Py_INCREF(default_call);
+            Py_SETREF(self->default_call, default_call);
+        }else{
+            PyErr_SetString(PyExc_TypeError, "Default call not callable");
+            return -1;
+        }
+    }
+
+    if (call_dict) {
+        if (PyDict_Check(call_dict)) {
+            Py_INCREF(call_dict);
+            Py_SETREF(self->call_dict, call_dict);
+        }else if (call_dict == Py_None) {
+            PyObject *temp = PyDict_New();
+            if (temp == NULL)
+                return -1;
+            Py_SETREF(self->call_dict, temp);
+        }else{
+            PyErr_SetString(PyExc_TypeError, "Call dictionary must be dict type");
+            return -1;
+        }
+    }
+
+    int r;
+    sd_journal *j=NULL;
+    journal_reader *reader=NULL;
+    Py_BEGIN_ALLOW_THREADS
+    if (engine && strcmp(engine, "mmap") == 0) {
+        /* libsystemd given the files of the reader, or left to open the
+         * directory if the reader cannot */
+        r = reader_open(path, &reader);
+        if (r >= 0 && reader->n_files > 0)
+            r = reader_open_journal(reader, &j);
+        if (r < 0 || j == NULL) {
+            reader_close(reader);
+            reader = NULL;
+        }
+        if (r == -EPROTONOSUPPORT || r == -EBADMSG)
+            r = 0;
+    }else{
+        r = 0;
+    }
+    if (r >= 0 && j == NULL) {
+        if (path) {
+            r = sd_journal_open_directory(&j, path, 0);
+        }else{
+            r = sd_journal_open(&j, flags);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    if (r == -EINVAL) {
+        PyErr_SetString(PyExc_ValueError, "Invalid flags or path");
+        return -1;
+    }else if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        return -1;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening journal");
+        return -1;
+    }
+
+    char *path_copy=NULL;
+    bloom_index *bloom=NULL;
+    result_cache *results=NULL;
+    if (path)
+        path_copy = PyMem_Malloc(strlen(path) + 1);
+    /* Sidecars are only kept beside the journal files if asked for */
+    if (bloom_arg == Py_True)
+        sidecar_dir = default_dir = bloom_cache_dir();
+    if (use_bloom && (bloom = PyMem_RawCalloc(1, sizeof(bloom_index))) && sidecar_dir)
+        bloom->sidecar_dir = PyMem_RawMalloc(strlen(sidecar_dir) + 1);
+    if (max_bytes && (results = result_cache_new(max_bytes, cache_dir)) == NULL) {
+        sd_journal_close(j);
+        reader_close(reader);
+        PyMem_Free(path_copy);
+        bloom_index_free(bloom);
+        free(default_dir);
+        return -1;
+    }
+    if ((path && path_copy == NULL) || (use_bloom && bloom == NULL) ||
+        (sidecar_dir && bloom->sidecar_dir == NULL)) {
+        sd_journal_close(j);
+        reader_close(reader);
+        PyMem_Free(path_copy);
+        bloom_index_free(bloom);
+        result_cache_free(results);
+        free(default_dir);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (path)
+        strcpy(path_copy, path);
+    if (sidecar_dir)
+        strcpy(bloom->sidecar_dir, sidecar_dir);
+    free(default_dir);
+
+    if (Journal___lock(self) < 0) {
+        sd_journal_close(j);
+        reader_close(reader);
+        PyMem_Free(path_copy);
+        bloom_index_free(bloom);
+        result_cache_free(results);
+        return -1;
+    }
+    Journal___replace_handle(self, j);
+    self->flags = flags;
+    PyMem_Free(self->path);
+    self->path = path_copy;
+    Journal___flush_recorded_matches(self);
+    Journal___filter_free(self->filter);
+    self->filter = NULL;
+    reader_close(self->reader);
+    self->reader = reader;
+    self->reader_active = reader != NULL;
+    bloom_index_free(self->bloom);
+    self->bloom = bloom;
+    result_cache_free(self->results);
+    self->results = results;
+    self->at_head = 1;
+    self->positioned = 0;
+    value_cache old;
+    Journal___cache_detach(self, &old);
+    self->cache.max_values = max_values;
+    self->cache.hits = self->cache.misses = 0;
+    Journal___unlock(self);
+    value_cache_free(&old);
+
+    return 0;
+}
+
+static PyObject *
+Journal___get_callable(PyObject *call_dict, PyObject *key)
+{
+    PyObject *callable=NULL;
+#if PY_VERSION_HEX >= 0x030D0000
+    if (PyDict_GetItemRef(call_dict, key, &callable) < 0)
+        PyErr_Clear();
+#else
+    callable = PyDict_GetItemWithError(call_dict, key);
+    if (callable)
+        Py_INCREF(callable);
+    else
+        PyErr_Clear();
+#endif
+    return callable;
+}
+
+static PyObject *
+Journal___process_field(Journal *self, PyObject *key, const void *value, ssize_t value_len)
+{
+    PyObject *callable=NULL, *return_value=NULL;
+    const char *field=NULL;
+    int fallback=0;
+
+    if (PROBE_ENABLED(convert__start) || PROBE_ENABLED(convert__done) || PROBE_ENABLED(convert__fail)) {
+        field = PyUnicode_AsUTF8(key);
+        if (field == NULL)
+            PyErr_Clear();
+    }
+    PROBE2(convert__start, self, field);
+    if (PyDict_Check(self->call_dict))
+        callable = Journal___get_callable(self->call_dict, key);
+
+    if (callable && PyCallable_Check(callable)) {
+        return_value = PyObject_CallFunction(callable, "y#", value, (Py_ssize_t) value_len);
+        if (!return_value) {
+            PROBE3(convert__fail, self, field, 0);
+            PyErr_Clear();
+        }
+    }
+    Py_XDECREF(callable);
+    if (!return_value && PyCallable_Check(self->default_call)) {
+        return_value = PyObject_CallFunction(self->default_call, "y#", value, (Py_ssize_t) value_len);
+        if (!return_value)
+            PROBE3(convert__fail, self, field, 1);
+    }
+    if (!return_value) {
+        PyErr_Clear();
+        return_value = PyBytes_FromStringAndSize(value, value_len);
+        fallback = 1;
+    }
+    if (!return_value) {
+        PyErr_Clear();
+        Py_INCREF(Py_None);
+        return_value = Py_None;
+        fallback = 2;
+    }
+    PROBE3(convert__done, self, field, fallback);
+    return return_value;
+}
+
+/* Filter expressions are compiled into sd_journal matches as far as
+ * possible; the remainder is evaluated on the raw field data of each
+ * entry, before any python objects are created for it */
+enum {
+    FILTER_AND,
+    FILTER_OR,
+    FILTER_NOT,
+    FILTER_CMP,
+};
+
+enum {
+    FILTER_OP_EQ,
+    FILTER_OP_LT,
+    FILTER_OP_LE,
+    FILTER_OP_GT,
+    FILTER_OP_GE,
+    FILTER_OP_STARTSWITH,
+    FILTER_OP_ENDSWITH,
+    FILTER_OP_CONTAINS,
+};
+
+enum {
+    FILTER_FIELD_DATA,
+    FILTER_FIELD_REALTIME,
+    FILTER_FIELD_MONOTONIC,
+};
+
+typedef struct filter_node {
+    int type;
+    struct filter_node *left, *right;
+    int op;
+    int field_type;
+    char *field;
+    size_t field_len;
+    char *value;
+    size_t value_len;
+    int numeric;
+    long long number;
+    size_t leaf;
+} filter_node;
+
+struct journal_filter {
+    filter_node *root;
+    filter_node **leaves;
+    size_t n_leaves;
+    unsigned char *results;
+};
+
+/* Maximum number of OR'ed clauses a filter is expanded to as matches */
+#define FILTER_MAX_CLAUSES 64
+
+static void
+filter_node_free(filter_node *node)
+{
+    if (node == NULL)
+        return;
+    filter_node_free(node->left);
+    filter_node_free(node->right);
+    PyMem_Free(node->field);
+    PyMem_Free(node->value);
+    PyMem_Free(node);
+}
+
+static filter_node *
+filter_node_new(int type, filter_node *left, filter_node *right)
+{
+    filter_node *node = PyMem_Calloc(1, sizeof(filter_node));
+    if (node == NULL) {
+        filter_node_free(left);
+        filter_node_free(right);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+/* Deep copy of `node`, for filters used by other threads */
+static filter_node *
+filter_node_copy(const filter_node *node)
+{
+    filter_node *copy = PyMem_Malloc(sizeof(filter_node));
+    if (copy == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    *copy = *node;
+    copy->left = copy->right = NULL;
+    copy->field = copy->value = NULL;
+    if ((node->left && (copy->left = filter_node_copy(node->left)) == NULL) ||
+        (node->right && (copy->right = filter_node_copy(node->right)) == NULL)) {
+        filter_node_free(copy);
+        return NULL;
+    }
+    if ((node->field && (copy->field = PyMem_Malloc(node->field_len + 1)) == NULL) ||
+        (node->value && (copy->value = PyMem_Malloc(node->value_len + 1)) == NULL)) {
+        filter_node_free(copy);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (node->field)
+        memcpy(copy->field, node->field, node->field_len + 1);
+    if (node->value)
+        memcpy(copy->value, node->value, node->value_len + 1);
+    return copy;
+}
+
+static void
+Journal___filter_free(journal_filter *filter)
+{
+    if (filter == NULL)
+        return;
+    filter_node_free(filter->root);
+    PyMem_Free(filter->leaves);
+    PyMem_Free(filter->results);
+    PyMem_Free(filter);
+}
+
+enum {
+    FILTER_TOK_END,
+    FILTER_TOK_LPAREN,
+    FILTER_TOK_RPAREN,
+    FILTER_TOK_WORD,
+    FILTER_TOK_STRING,
+    FILTER_TOK_OP,
+    FILTER_TOK_NE,
+};
+
+typedef struct {
+    const char *s;
+    size_t len;
+    size_t pos;
+    size_t tok_pos;
+    int tok;
+    int op;
+    char *text;
+    size_t text_len;
+} filter_parser;
+
+static int
+filter_error(filter_parser *p, const char *msg)
+{
+    PyErr_Format(PyExc_ValueError, "Invalid filter expression at position %zu: %s",
+                 p->tok_pos, msg);
+    return -1;
+}
+
+static int
+filter_is_word_char(char c)
+{
+    return !(c == ' ' || c == '\t' || c == '\n' || c == '(' || c == ')' ||
+             c == '=' || c == '!' || c == '<' || c == '>' ||
+             c == '"' || c == '\'' || c == '\0');
+}
+
+static int
+filter_next_token(filter_parser *p)
+{
+    const char *s = p->s;
+
+    while (p->pos < p->len && (s[p->pos] == ' ' || s[p->pos] == '\t' || s[p->pos] == '\n'))
+        p->pos++;
+    p->tok_pos = p->pos;
+    PyMem_Free(p->text);
+    p->text = NULL;
+    p->text_len = 0;
+
+    if (p->pos >= p->len) {
+        p->tok = FILTER_TOK_END;
+        return 0;
+    }
+
+    char c = s[p->pos];
+    if (c == '(' || c == ')') {
+        p->tok = c == '(' ? FILTER_TOK_LPAREN : FILTER_TOK_RPAREN;
+        p->pos++;
+        return 0;
+    }
+    if (c == '=' || c == '!' || c == '<' || c == '>') {
+        int eq = p->pos + 1 < p->len && s[p->pos + 1] == '=';
+        p->tok = FILTER_TOK_OP;
+        if (c == '=') {
+            p->op = FILTER_OP_EQ;
+        }else if (c == '!') {
+            if (!eq)
+                return filter_error(p, "expected '!='");
+            p->tok = FILTER_TOK_NE;
+            p->op = FILTER_OP_EQ;
+        }else if (c == '<') {
+            p->op = eq ? FILTER_OP_LE : FILTER_OP_LT;
+        }else{
+            p->op = eq ? FILTER_OP_GE : FILTER_OP_GT;
+        }
+        p->pos += eq ? 2 : 1;
+        return 0;
+    }
+    if (c == '"' || c == '\'') {
+        size_t i;
+        p->text = PyMem_Malloc(p->len - p->pos + 1);
+        if (p->text == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = p->pos + 1; i < p->len && s[i] != c; i++) {
+            if (s[i] == '\\' && i + 1 < p->len)
+                i++;
+            p->text[p->text_len++] = s[i];
+        }
+        if (i >= p->len)
+            return filter_error(p, "unterminated string");
+        p->tok = FILTER_TOK_STRING;
+        p->pos = i + 1;
+        return 0;
+    }
+
+    size_t start = p->pos;
+    while (p->pos < p->len && filter_is_word_char(s[p->pos]))
+        p->pos++;
+    p->text_len = p->pos - start;
+    p->text = PyMem_Malloc(p->text_len + 1);
+    if (p->text == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(p->text, s + start, p->text_len);
+    p->tok = FILTER_TOK_WORD;
+    return 0;
+}
+
+static int
+filter_token_is(filter_parser *p, const char *keyword)
+{
+    return p->tok == FILTER_TOK_WORD && strlen(keyword) == p->text_len &&
+           strncasecmp(p->text, keyword, p->text_len) == 0;
+}
+
+static char *
+filter_take_text(filter_parser *p, size_t *len)
+{
+    char *text = p->text;
+    text[p->text_len] = '\0';
+    *len = p->text_len;
+    p->text = NULL;
+    p->text_len = 0;
+    return text;
+}
+
+static filter_node *filter_parse_or(filter_parser *p);
+
+static filter_node *
+filter_parse_comparison(filter_parser *p)
+{
+    filter_node *node;
+    int negate=0;
+    size_t i;
+
+    if (p->tok != FILTER_TOK_WORD) {
+        filter_error(p, "expected field name");
+        return NULL;
+    }
+    node = filter_node_new(FILTER_CMP, NULL, NULL);
+    if (node == NULL)
+        return NULL;
+    node->field = filter_take_text(p, &node->field_len);
+    for (i = 0; i < node->field_len; i++) {
+        char c = node->field[i];
+        if (!(c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))) {
+            filter_error(p, "invalid field name");
+            goto error;
+        }
+    }
+    if (strcmp(node->field, "__REALTIME_TIMESTAMP") == 0)
+        node->field_type = FILTER_FIELD_REALTIME;
+    else if (strcmp(node->field, "__MONOTONIC_TIMESTAMP") == 0)
+        node->field_type = FILTER_FIELD_MONOTONIC;
+
+    if (filter_next_token(p) < 0)
+        goto error;
+    if (p->tok == FILTER_TOK_OP || p->tok == FILTER_TOK_NE) {
+        node->op = p->op;
+        negate = p->tok == FILTER_TOK_NE;
+    }else if (filter_token_is(p, "startswith")) {
+        node->op = FILTER_OP_STARTSWITH;
+    }else if (filter_token_is(p, "endswith")) {
+        node->op = FILTER_OP_ENDSWITH;
+    }else if (filter_token_is(p, "contains")) {
+        node->op = FILTER_OP_CONTAINS;
+    }else{
+        filter_error(p, "expected comparison operator");
+        goto error;
+    }
+
+    if (filter_next_token(p) < 0)
+        goto error;
+    if (p->tok != FILTER_TOK_WORD && p->tok != FILTER_TOK_STRING) {
+        filter_error(p, "expected value");
+        goto error;
+    }
+    node->value = filter_take_text(p, &node->value_len);
+    if (node->value_len > 0) {
+        char *end;
+        errno = 0;
+        node->number = strtoll(node->value, &end, 10);
+        node->numeric = errno == 0 && *end == '\0';
+    }
+    if (node->field_type != FILTER_FIELD_DATA && !node->numeric) {
+        filter_error(p, "timestamps can only be compared to integers");
+        goto error;
+    }
+    if (filter_next_token(p) < 0)
+        goto error;
+
+    if (negate)
+        return filter_node_new(FILTER_NOT, node, NULL);
+    return node;
+
+error:
+    filter_node_free(node);
+    return NULL;
+}
+
+static filter_node *
+filter_parse_not(filter_parser *p)
+{
+    filter_node *node;
+
+    if (filter_token_is(p, "not")) {
+        if (filter_next_token(p) < 0)
+            return NULL;
+        node = filter_parse_not(p);
+        if (node == NULL)
+            return NULL;
+        return filter_node_new(FILTER_NOT, node, NULL);
+    }
+    if (p->tok == FILTER_TOK_LPAREN) {
+        if (filter_next_token(p) < 0)
+            return NULL;
+        node = filter_parse_or(p);
+        if (node == NULL)
+            return NULL;
+        if (p->tok != FILTER_TOK_RPAREN) {
+            filter_node_free(node);
+            filter_error(p, "expected ')'");
+            return NULL;
+        }
+        if (filter_next_token(p) < 0) {
+            filter_node_free(node);
+            return NULL;
+        }
+        return node;
+    }
+    return filter_parse_comparison(p);
+}
+
+static filter_node *
+filter_parse_and(filter_parser *p)
+{
+    filter_node *node, *right;
+
+    node = filter_parse_not(p);
+    while (node && filter_token_is(p, "and")) {
+        if (filter_next_token(p) < 0 || (right = filter_parse_not(p)) == NULL) {
+            filter_node_free(node);
+            return NULL;
+        }
+        node = filter_node_new(FILTER_AND, node, right);
+    }
+    return node;
+}
+
+static filter_node *
+filter_parse_or(filter_parser *p)
+{
+    filter_node *node, *right;
+
+    node = filter_parse_and(p);
+    while (node && filter_token_is(p, "or")) {
+        if (filter_next_token(p) < 0 || (right = filter_parse_and(p)) == NULL) {
+            filter_node_free(node);
+            return NULL;
+        }
+        node = filter_node_new(FILTER_OR, node, right);
+    }
+    return node;
+}
+
+static filter_node *
+filter_parse(const char *expression, size_t len)
+{
+    filter_parser p = {expression, len, 0, 0, FILTER_TOK_END, 0, NULL, 0};
+    filter_node *node=NULL;
+
+    if (filter_next_token(&p) == 0) {
+        node = filter_parse_or(&p);
+        if (node && p.tok != FILTER_TOK_END) {
+            filter_error(&p, "unexpected trailing input");
+            filter_node_free(node);
+            node = NULL;
+        }
+    }
+    PyMem_Free(p.text);
+    return node;
+}
+
+static int
+filter_compare_number(const filter_node *node, long long number)
+{
+    switch (node->op) {
+    case FILTER_OP_EQ: return number == node->number;
+    case FILTER_OP_LT: return number < node->number;
+    case FILTER_OP_LE: return number <= node->number;
+    case FILTER_OP_GT: return number > node->number;
+    case FILTER_OP_GE: return number >= node->number;
+    }
+    return 0;
+}
+
+static int
+filter_test_value(const filter_node *node, const char *value, size_t len)
+{
+    switch (node->op) {
+    case FILTER_OP_EQ:
+        return len == node->value_len && memcmp(value, node->value, len) == 0;
+    case FILTER_OP_STARTSWITH:
+        return len >= node->value_len && memcmp(value, node->value, node->value_len) == 0;
+    case FILTER_OP_ENDSWITH:
+        return len >= node->value_len &&
+               memcmp(value + len - node->value_len, node->value, node->value_len) == 0;
+    case FILTER_OP_CONTAINS:
+        return memmem(value, len, node->value, node->value_len) != NULL;
+    }
+
+    if (node->numeric) {
+        char buf[32], *end;
+        long long number;
+        if (len == 0 || len >= sizeof(buf))
+            return 0;
+        memcpy(buf, value, len);
+        buf[len] = '\0';
+        errno = 0;
+        number = strtoll(buf, &end, 10);
+        if (errno != 0 || *end != '\0')
+            return 0;
+        return filter_compare_number(node, number);
+    }else{
+        size_t n = len < node->value_len ? len : node->value_len;
+        int c = memcmp(value, node->value, n);
+        if (c == 0)
+            c = len < node->value_len ? -1 : len > node->value_len;
+        switch (node->op) {
+        case FILTER_OP_LT: return c < 0;
+        case FILTER_OP_LE: return c <= 0;
+        case FILTER_OP_GT: return c > 0;
+        case FILTER_OP_GE: return c >= 0;
+        }
+    }
+    return 0;
+}
+
+static int
+filter_eval(const filter_node *node, const unsigned char *results)
+{
+    switch (node->type) {
+    case FILTER_AND:
+        return filter_eval(node->left, results) && filter_eval(node->right, results);
+    case FILTER_OR:
+        return filter_eval(node->left, results) || filter_eval(node->right, results);
+    case FILTER_NOT:
+        return !filter_eval(node->left, results);
+    }
+    return results[node->leaf];
+}
+
+/* Evaluated without the GIL, with `results` of n_leaves bytes */
+static int
+Journal___filter_test(const journal_filter *filter, sd_journal *j, unsigned char *results)
+{
+    const void *data;
+    size_t data_len, i;
+    const char *delim_ptr;
+
+    memset(results, 0, filter->n_leaves);
+    for (i = 0; i < filter->n_leaves; i++) {
+        filter_node *leaf = filter->leaves[i];
+        uint64_t usec;
+        sd_id128_t boot_id;
+        if (leaf->field_type == FILTER_FIELD_REALTIME) {
+            if (sd_journal_get_realtime_usec(j, &usec) >= 0)
+                results[i] = filter_compare_number(leaf, (long long) usec);
+        }else if (leaf->field_type == FILTER_FIELD_MONOTONIC) {
+            if (sd_journal_get_monotonic_usec(j, &usec, &boot_id) >= 0)
+                results[i] = filter_compare_number(leaf, (long long) usec);
+        }
+    }
+
+    SD_JOURNAL_FOREACH_DATA(j, data, data_len) {
+        size_t field_len;
+        delim_ptr = memchr(data, '=', data_len);
+        if (delim_ptr == NULL)
+            continue;
+        field_len = delim_ptr - (const char *) data;
+        for (i = 0; i < filter->n_leaves; i++) {
+            filter_node *leaf = filter->leaves[i];
+            if (results[i] || leaf->field_type != FILTER_FIELD_DATA ||
+                leaf->field_len != field_len || memcmp(leaf->field, data, field_len) != 0)
+                continue;
+            results[i] = filter_test_value(leaf, delim_ptr + 1, data_len - field_len - 1);
+        }
+    }
+
+    return filter_eval(filter->root, results);
+}
+
+static int
+filter_collect_leaves(journal_filter *filter, filter_node *node)
+{
+    if (node->type != FILTER_CMP) {
+        if (filter_collect_leaves(filter, node->left) < 0)
+            return -1;
+        return node->right ? filter_collect_leaves(filter, node->right) : 0;
+    }
+    filter_node **leaves = PyMem_Realloc(filter->leaves, (filter->n_leaves + 1) * sizeof(filter_node *));
+    if (leaves == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    filter->leaves = leaves;
+    node->leaf = filter->n_leaves;
+    filter->leaves[filter->n_leaves++] = node;
+    return 0;
+}
+
+/* Takes ownership of `root`, combining it in AND with `filter` */
+static journal_filter *
+Journal___filter_add(journal_filter *filter, filter_node *root)
+{
+    if (filter == NULL) {
+        filter = PyMem_Calloc(1, sizeof(journal_filter));
+        if (filter == NULL) {
+            filter_node_free(root);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        filter->root = root;
+    }else{
+        filter->root = filter_node_new(FILTER_AND, filter->root, root);
+        if (filter->root == NULL)
+            goto error;
+    }
+
+    PyMem_Free(filter->leaves);
+    PyMem_Free(filter->results);
+    filter->leaves = NULL;
+    filter->results = NULL;
+    filter->n_leaves = 0;
+    if (filter_collect_leaves(filter, filter->root) < 0)
+        goto error;
+    filter->results = PyMem_Malloc(filter->n_leaves ? filter->n_leaves : 1);
+    if (filter->results == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    return filter;
+
+error:
+    Journal___filter_free(filter);
+    return NULL;
+}
+
+static PyObject *
+filter_match_bytes(const filter_node *node, const char *value, size_t value_len)
+{
+    PyObject *match = PyBytes_FromStringAndSize(NULL, node->field_len + 1 + value_len);
+    if (match == NULL)
+        return NULL;
+    char *buf = PyBytes_AS_STRING(match);
+    memcpy(buf, node->field, node->field_len);
+    buf[node->field_len] = '=';
+    memcpy(buf + node->field_len + 1, value, value_len);
+    return match;
+}
+
+/* Fields with a small, known set of values, which allows comparisons to
+ * be expanded into equality matches */
+static const struct {
+    const char *field;
+    long long min, max;
+} filter_enumerable[] = {
+    {"PRIORITY", 0, 7},
+    {NULL, 0, 0},
+};
+
+/* Returns list of OR'ed clauses, each a list of AND'ed "FIELD=value"
+ * matches, for a superset of the entries matched by `node`; or None if
+ * there is no such restriction. `exact` is set if no residual
+ * evaluation is required. */
+static PyObject *
+filter_prefilter(const filter_node *node, int *exact)
+{
+    PyObject *left, *right, *result=NULL;
+    int left_exact, right_exact;
+    Py_ssize_t i, k;
+
+    *exact = 0;
+    if (node->type == FILTER_CMP) {
+        if (node->field_type != FILTER_FIELD_DATA)
+            Py_RETURN_NONE;
+        if (node->op == FILTER_OP_EQ) {
+            PyObject *match = filter_match_bytes(node, node->value, node->value_len);
+            if (match == NULL)
+                return NULL;
+            result = Py_BuildValue("[[N]]", match);
+            *exact = result != NULL;
+            return result;
+        }
+        if (node->numeric && node->op != FILTER_OP_STARTSWITH &&
+            node->op != FILTER_OP_ENDSWITH && node->op != FILTER_OP_CONTAINS) {
+            for (i = 0; filter_enumerable[i].field; i++) {
+                if (strcmp(filter_enumerable[i].field, node->field) == 0)
+                    break;
+            }
+            if (filter_enumerable[i].field == NULL)
+                Py_RETURN_NONE;
+            long long v;
+            result = PyList_New(0);
+            for (v = filter_enumerable[i].min; result && v <= filter_enumerable[i].max; v++) {
+                char value[32];
+                if (!filter_compare_number(node, v))
+                    continue;
+                sprintf(value, "%lld", v);
+                PyObject *clause = Py_BuildValue("[N]", filter_match_bytes(node, value, strlen(value)));
+                if (clause == NULL || PyList_Append(result, clause) < 0)
+                    Py_CLEAR(result);
+                Py_XDECREF(clause);
+            }
+            /* No value in range: left to the residual, as no matches
+             * would restrict to nothing */
+            if (result && PyList_GET_SIZE(result) == 0) {
+                Py_DECREF(result);
+                Py_RETURN_NONE;
+            }
+            *exact = result != NULL;
+            return result;
+        }
+        Py_RETURN_NONE;
+    }
+    if (node->type == FILTER_NOT)
+        Py_RETURN_NONE;
+
+    left = filter_prefilter(node->left, &left_exact);
+    if (left == NULL)
+        return NULL;
+    right = filter_prefilter(node->right, &right_exact);
+    if (right == NULL) {
+        Py_DECREF(left);
+        return NULL;
+    }
+
+    if (node->type == FILTER_OR) {
+        if (left == Py_None || right == Py_None ||
+            PyList_GET_SIZE(left) + PyList_GET_SIZE(right) > FILTER_MAX_CLAUSES) {
+            Py_DECREF(left);
+            Py_DECREF(right);
+            Py_RETURN_NONE;
+        }
+        result = PySequence_Concat(left, right);
+        *exact = left_exact && right_exact;
+        goto finally;
+    }
+
+    /* FILTER_AND */
+    if (left == Py_None || right == Py_None) {
+        result = left == Py_None ? right : left;
+        Py_INCREF(result);
+        goto finally;
+    }
+    if (PyList_GET_SIZE(left) * PyList_GET_SIZE(right) > FILTER_MAX_CLAUSES) {
+        result = PyList_GET_SIZE(left) <= PyList_GET_SIZE(right) ? left : right;
+        Py_INCREF(result);
+        goto finally;
+    }
+    *exact = left_exact && right_exact;
+    result = PyList_New(0);
+    for (i = 0; result && i < PyList_GET_SIZE(left); i++) {
+        for (k = 0; result && k < PyList_GET_SIZE(right); k++) {
+            PyObject *clause = PySequence_List(PyList_GET_ITEM(left, i));
+            PyObject *other = PyList_GET_ITEM(right, k);
+            Py_ssize_t m, n;
+            if (clause == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+            /* Matches of the same field are OR'ed by sd_journal, so only
+             * one value per field can be kept within a clause */
+            for (m = 0; m < PyList_GET_SIZE(other); m++) {
+                PyObject *match = PyList_GET_ITEM(other, m);
+                const char *field = PyBytes_AS_STRING(match);
+                size_t field_len = strchr(field, '=') - field + 1;
+                int conflict=0;
+                for (n = 0; n < PyList_GET_SIZE(clause); n++) {
+                    if (strncmp(PyBytes_AS_STRING(PyList_GET_ITEM(clause, n)), field, field_len) == 0)
+                        conflict = 1;
+                }
+                if (conflict)
+                    *exact = 0;
+                else if (PyList_Append(clause, match) < 0)
+                    Py_CLEAR(result);
+            }
+            if (result && PyList_Append(result, clause) < 0)
+                Py_CLEAR(result);
+            Py_DECREF(clause);
+        }
+    }
+
+finally:
+    Py_DECREF(left);
+    Py_DECREF(right);
+    if (result && result != Py_None && PyList_GET_SIZE(result) == 0) {
+        Py_DECREF(result);
+        result = Py_None;
+        Py_INCREF(result);
+        *exact = 0;
+    }
+    if (result == NULL)
+        *exact = 0;
+    return result;
+}
+
+/* Moves `skip` entries passing the filter, returning the number moved as
+ * per sd_journal_next_skip */
+static int
+Journal___move_filtered(Journal *self, int64_t skip)
+{
+    int64_t step = skip > 0 ? 1LL : -1LL, n = skip > 0 ? skip : -skip, moved = 0;
+    int r;
+
+    while (moved < n) {
+        r = step > 0 ? sd_journal_next(self->j) : sd_journal_previous(self->j);
+        if (r < 0)
+            return r;
+        if (r == 0)
+            break;
+        if (Journal___filter_test(self->filter, self->j, self->filter->results))
+            moved++;
+    }
+    if (moved > 0 && moved < n) {
+        /* Return to the last entry passing the filter */
+        do {
+            r = step > 0 ? sd_journal_previous(self->j) : sd_journal_next(self->j);
+        } while (r > 0 && !Journal___filter_test(self->filter, self->j, self->filter->results));
+        if (r < 0)
+            return r;
+    }
+    return moved < INT_MAX ? (int) moved : INT_MAX;
+}
+
+/* Hands reading over from the mmap reader to libsystemd at the same entry,
+ * for anything the reader does not handle */
+static int
+Journal___release_reader(Journal *self)
+{
+    int r;
+    if (!self->reader_active)
+        return 0;
+    self->reader_active = 0;
+    Py_BEGIN_ALLOW_THREADS
+    r = reader_sync(self->reader, self->j);
+    Py_END_ALLOW_THREADS
+    if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking to current entry");
+        return -1;
+    }
+    return 0;
+}
+
+/* Before matches change, as libsystemd then keeps its position in a form
+ * lost on reopening the files, the cursor is kept for
+ * Journal___apply_bloom */
+static int
+Journal___matches_changing(Journal *self)
+{
+    bloom_index *bloom = self->bloom;
+    if (Journal___release_reader(self) < 0)
+        return -1;
+    if (bloom && bloom->paths && !self->at_head && bloom->cursor == NULL &&
+        sd_journal_get_cursor(self->j, &bloom->cursor) < 0)
+        bloom->cursor = NULL;
+    return 0;
+}
+
+/* Before seeking elsewhere than the head */
+static int
+Journal___seek_prepare(Journal *self)
+{
+    self->reader_active = 0;
+    self->at_head = 0;
+    self->positioned = 1;
+    return Journal___apply_bloom(self, 0);
+}
+
+static int
+Journal___seek_head(Journal *self)
+{
+    int r;
+    if (Journal___apply_bloom(self, 0) < 0)
+        return -1;
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_seek_head(self->j);
+    Py_END_ALLOW_THREADS
+    if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking to head");
+        return r;
+    }
+    if (self->reader && self->n_matches == 0) {
+        reader_seek_head(self->reader);
+        self->reader_active = 1;
+    }
+    self->at_head = 1;
+    self->positioned = 1;
+    return 0;
+}
+
+static int
+Journal___move(Journal *self, int64_t skip)
+{
+    int r=0;
+    if (skip == 0LL) {
+        PyErr_SetString(PyExc_ValueError, "Skip number must positive/negative integer");
+        return -EINVAL;
+    }else if (Journal___apply_bloom(self, 1) < 0) {
+        return -1;
+    }
+    if (skip < 0LL && self->at_head && self->positioned) {
+        /* Nothing is before the head, though libsystemd would return
+         * the first entry of each file */
+        return 0;
+    }else if (skip < 0LL && !self->positioned) {
+        /* Moving back from a journal not yet positioned starts at the
+         * tail, as libsystemd would otherwise start from the head of
+         * each file */
+        if (Journal___seek_prepare(self) < 0)
+            return -1;
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_seek_tail(self->j);
+        Py_END_ALLOW_THREADS
+        if (r < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Error seeking to tail");
+            return r;
+        }
+    }
+    self->at_head = 0;
+    self->positioned = 1;
+    if (self->reader_active && skip > 0LL && self->filter == NULL) {
+        int64_t moved = 0;
+        Py_BEGIN_ALLOW_THREADS
+        while (moved < skip && (r = reader_next(self->reader)) > 0)
+            moved++;
+        Py_END_ALLOW_THREADS
+        if (r >= 0)
+            r = moved < INT_MAX ? (int) moved : INT_MAX;
+    }else if (Journal___release_reader(self) < 0) {
+        return -1;
+    }else if (self->filter) {
+        Py_BEGIN_ALLOW_THREADS
+        r = Journal___move_filtered(self, skip);
+        Py_END_ALLOW_THREADS
+    }else if (skip == 1LL) {
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_next(self->j);
+        Py_END_ALLOW_THREADS
+    }else if (skip == -1LL) {
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_previous(self->j);
+        Py_END_ALLOW_THREADS
+    }else if (skip > 1LL) {
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_next_skip(self->j, skip);
+        Py_END_ALLOW_THREADS
+    }else if (skip < -1LL) {
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_previous_skip(self->j, -skip);
+        Py_END_ALLOW_THREADS
+    }else{
+        PyErr_SetString(PyExc_ValueError, "Skip number must positive/negative integer");
+        return -EINVAL;
+    }
+
+    if (r < 0)
+        PyErr_SetString(PyExc_RuntimeError, "Error getting next message");
+    return r;
+}
+
+/* Subset of fields to return for an entry */
+#define JOURNAL_FIELD_REALTIME  (1 << 0)
+#define JOURNAL_FIELD_MONOTONIC (1 << 1)
+#define JOURNAL_FIELD_CURSOR    (1 << 2)
+#define JOURNAL_FIELD_ALL (JOURNAL_FIELD_REALTIME | JOURNAL_FIELD_MONOTONIC | JOURNAL_FIELD_CURSOR)
+
+typedef struct {
+    Py_ssize_t n;
+    PyObject **keys;
+    const char **names;
+    Py_ssize_t *name_lens;
+    unsigned int special;
+} Journal_projection;
+
+static void
+Journal___projection_free(Journal_projection *proj)
+{
+    Py_ssize_t i;
+    if (proj == NULL)
+        return;
+    for (i = 0; i < proj->n; i++)
+        Py_DECREF(proj->keys[i]);
+    PyMem_Free(proj->keys);
+    PyMem_Free(proj->names);
+    PyMem_Free(proj->name_lens);
+    PyMem_Free(proj);
+}
+
+static Journal_projection *
+Journal___projection_new(PyObject *fields)
+{
+    Journal_projection *proj;
+    PyObject *seq;
+    Py_ssize_t i, n;
+
+    seq = PySequence_Fast(fields, "fields must be an iterable of strings");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+
+    proj = PyMem_Calloc(1, sizeof(Journal_projection));
+    if (proj == NULL)
+        goto nomem;
+    proj->keys = PyMem_Calloc(n ? n : 1, sizeof(PyObject *));
+    proj->names = PyMem_Calloc(n ? n : 1, sizeof(const char *));
+    proj->name_lens = PyMem_Calloc(n ? n : 1, sizeof(Py_ssize_t));
+    if (!proj->keys || !proj->names || !proj->name_lens)
+        goto nomem;
+
+    for (i = 0; i < n; i++) {
+        PyObject *key = PySequence_Fast_GET_ITEM(seq, i);
+        const char *name;
+        Py_ssize_t len;
+        if (!PyUnicode_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "fields must be an iterable of strings");
+            goto error;
+        }
+        name = PyUnicode_AsUTF8AndSize(key, &len);
+        if (name == NULL)
+            goto error;
+        if (strcmp(name, "__REALTIME_TIMESTAMP") == 0)
+            proj->special |= JOURNAL_FIELD_REALTIME;
+        else if (strcmp(name, "__MONOTONIC_TIMESTAMP") == 0)
+            proj->special |= JOURNAL_FIELD_MONOTONIC;
+        else if (strcmp(name, "__CURSOR") == 0)
+            proj->special |= JOURNAL_FIELD_CURSOR;
+        Py_INCREF(key);
+        proj->keys[proj->n] = key;
+        proj->names[proj->n] = name;
+        proj->name_lens[proj->n] = len;
+        proj->n++;
+    }
+    Py_DECREF(seq);
+    return proj;
+
+nomem:
+    PyErr_NoMemory();
+error:
+    Py_DECREF(seq);
+    Journal___projection_free(proj);
+    return NULL;
+}
+
+static PyObject *
+Journal___projection_key(const Journal_projection *proj, const char *name, size_t len)
+{
+    Py_ssize_t i;
+    for (i = 0; i < proj->n; i++) {
+        if ((size_t) proj->name_lens[i] == len && memcmp(proj->names[i], name, len) == 0)
+            return proj->keys[i];
+    }
+    return NULL;
+}
+
+/* Current entry of `j`, or of `reader` when not NULL */
+static int
+Journal___enumerate_data(journal_reader *reader, sd_journal *j, const void **data, size_t *len)
+{
+    return reader ? reader_enumerate_data(reader, data, len) : sd_journal_enumerate_data(j, data, len);
+}
+
+static void
+Journal___restart_data(journal_reader *reader, sd_journal *j)
+{
+    if (reader)
+        reader_restart_data(reader);
+    else
+        sd_journal_restart_data(j);
+}
+
+static int
+Journal___get_realtime(journal_reader *reader, sd_journal *j, uint64_t *ret)
+{
+    return reader ? reader_get_realtime_usec(reader, ret) : sd_journal_get_realtime_usec(j, ret);
+}
+
+static int
+Journal___get_monotonic(journal_reader *reader, sd_journal *j, uint64_t *ret, sd_id128_t *boot_id)
+{
+    return reader ? reader_get_monotonic_usec(reader, ret, boot_id) : sd_journal_get_monotonic_usec(j, ret, boot_id);
+}
+
+static int
+Journal___get_cursor(journal_reader *reader, sd_journal *j, char **ret)
+{
+    return reader ? reader_get_cursor(reader, ret) : sd_journal_get_cursor(j, ret);
+}
+
+/* Reader for the current entry of `j` if any; entries it cannot read
+ * are read by libsystemd instead */
+static journal_reader *
+Journal___entry_reader(Journal *self, sd_journal *j)
+{
+    return self->reader_active && j == self->j ? self->reader : NULL;
+}
+
+/* For an entry the reader cannot read, reading is handed over to
+ * libsystemd from that entry on, rather than for it alone, so that the
+ * cursor is sought once */
+static int
+Journal___entry_fallback(Journal *self, journal_reader **reader)
+{
+    *reader = NULL;
+    return Journal___release_reader(self);
+}
+
+/* As per Journal___process_field, but via the value cache. Only used for
+ * the instance's own handle, where `self` is locked */
+static PyObject *
+Journal___cached_field(Journal *self, PyObject *key, const void *msg, size_t msg_len, size_t field_len)
+{
+    value_cache *cache = &self->cache;
+    hashtable_entry *e, *field;
+    PyObject *value;
+    uint64_t hash;
+
+    hash = hash_bytes(msg, msg_len);
+    e = hashtable_find(&cache->values, msg, msg_len, hash);
+    if (e) {
+        cache->hits++;
+        value = e->data;
+        Py_INCREF(value);
+        return value;
+    }
+    cache->misses++;
+    value = Journal___process_field(self, key, (const char *) msg + field_len + 1, msg_len - field_len - 1);
+
+    /* Fields with more distinct values than the cap are not worth holding;
+     * failure to allocate only means the value is not cached */
+    field = hashtable_insert(&cache->fields, msg, field_len, hash_bytes(msg, field_len));
+    if (field && field->count < (uint64_t) cache->max_values) {
+        e = hashtable_insert(&cache->values, msg, msg_len, hash);
+        if (e) {
+            Py_INCREF(value);
+            e->data = value;
+            field->count++;
+        }
+    }
+    return value;
+}
+
+static int
+Journal___set_special_field(Journal *self, PyObject *dict, const char *name, const char *value)
+{
+    PyObject *key, *temp;
+    int r;
+
+    key = PyUnicode_FromString(name);
+    if (key == NULL)
+        return -1;
+    temp = Journal___process_field(self, key, value, strlen(value));
+    r = PyDict_SetItem(dict, key, temp);
+    Py_DECREF(key);
+    Py_DECREF(temp);
+    return r;
+}
+
+/* Sets field `key` of entry `dict`, or adds to a list of its values
+ * where the field is repeated */
+static int
+Journal___entry_add(PyObject *dict, PyObject *key, PyObject *value)
+{
+    PyObject *cur_value, *tmp_list;
+
+    cur_value = PyDict_GetItemWithError(dict, key);
+    if (cur_value) {
+        if (PyList_CheckExact(cur_value) && PyList_GET_SIZE(cur_value) > 1) {
+            PyList_Append(cur_value, value);
+        }else{
+            tmp_list = PyList_New(0);
+            PyList_Append(tmp_list, cur_value);
+            PyList_Append(tmp_list, value);
+            PyDict_SetItem(dict, key, tmp_list);
+            Py_DECREF(tmp_list);
+        }
+    }else{
+        PyDict_SetItem(dict, key, value);
+    }
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *
+Journal___get_entry(Journal *self, sd_journal *j, const Journal_projection *proj)
+{
+    PyObject *dict;
+    dict = PyDict_New();
+    if (dict == NULL)
+        return NULL;
+
+    const void *msg;
+    size_t msg_len;
+    const char *delim_ptr;
+    PyObject *key, *value;
+    journal_reader *reader = Journal___entry_reader(self, j);
+    int r;
+
+restart:
+    Journal___restart_data(reader, j);
+    while ((r = Journal___enumerate_data(reader, j, &msg, &msg_len)) > 0) {
+        delim_ptr = memchr(msg, '=', msg_len);
+        if (delim_ptr == NULL)
+            continue;
+        if (proj) {
+            key = Journal___projection_key(proj, msg, delim_ptr - (const char*) msg);
+            if (key == NULL)
+                continue;
+            Py_INCREF(key);
+        }else{
+            key = PyUnicode_FromStringAndSize(msg, delim_ptr - (const char*) msg);
+            if (key == NULL)
+                goto error;
+        }
+        if (self->cache.max_values > 0 && j == self->j)
+            value = Journal___cached_field(self, key, msg, msg_len, delim_ptr - (const char*) msg);
+        else
+            value = Journal___process_field(self, key, delim_ptr + 1, (const char*) msg + msg_len - (delim_ptr + 1) );
+        r = Journal___entry_add(dict, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (r < 0)
+            goto error;
+    }
+    if (r < 0 && reader) {
+        if (Journal___entry_fallback(self, &reader) < 0)
+            goto error;
+        PyDict_Clear(dict);
+        goto restart;
+    }
+
+    unsigned int special = proj ? proj->special : JOURNAL_FIELD_ALL;
+
+    uint64_t realtime;
+    if ((special & JOURNAL_FIELD_REALTIME) &&
+        Journal___get_realtime(reader, j, &realtime) == 0) {
+        char realtime_str[21];
+        sprintf(realtime_str, "%llu", (long long unsigned) realtime);
+        if (Journal___set_special_field(self, dict, "__REALTIME_TIMESTAMP", realtime_str) < 0)
+            goto error;
+    }
+
+    sd_id128_t sd_id;
+    uint64_t monotonic;
+    if ((special & JOURNAL_FIELD_MONOTONIC) &&
+        Journal___get_monotonic(reader, j, &monotonic, &sd_id) == 0) {
+        char monotonic_str[21];
+        sprintf(monotonic_str, "%llu", (long long unsigned) monotonic);
+        if (Journal___set_special_field(self, dict, "__MONOTONIC_TIMESTAMP", monotonic_str) < 0)
+            goto error;
+    }
+
+    char *cursor;
+    if ((special & JOURNAL_FIELD_CURSOR) &&
+        Journal___get_cursor(reader, j, &cursor) >= 0) {
+        r = Journal___set_special_field(self, dict, "__CURSOR", cursor);
+        free(cursor);
+        if (r < 0)
+            goto error;
+    }
+
+    return dict;
+
+error:
+    Py_DECREF(dict);
+    return NULL;
+}
+
+PyDoc_STRVAR(Journal_get_next__doc__,
+"get_next([skip]) -> dict\n\n"
+"Return dictionary of the next log entry. Optional skip value will\n"
+"return the `skip`th log entry.");
+static PyObject *
+Journal___get_next(Journal *self, int64_t skip)
+{
+    PyObject *dict;
+    int r;
+    PROBE2(entry__start, self, skip);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    r = Journal___move(self, skip);
+    if (r < 0) {
+        dict = NULL;
+    }else if ( r == 0) { //EOF
+        dict = PyDict_New();
+    }else{
+        dict = Journal___get_entry(self, self->j, NULL);
+    }
+    Journal___unlock(self);
+    PROBE2(entry__done, self, dict ? r : -1);
+    return dict;
+}
+
+static PyObject *
+Journal_get_next(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"skip", NULL};
+    PyObject *arg_skip=NULL;
+    int64_t skip=1LL;
+
+    if (unpack_fastcall("get_next", args, nargs, NULL, kwlist, 0, &arg_skip) < 0)
+        return NULL;
+    if (arg_skip && as_int64(arg_skip, &skip) < 0)
+        return NULL;
+
+    return Journal___get_next(self, skip);
+}
+
+/* Writes little endian length prefix for raw blobs */
+static char *
+raw_put_length(char *p, uint64_t len)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        *p++ = (char) (len >> (8 * i));
+    return p;
+}
+
+/* Copies "name=value" into bytes item `i` of tuple, or the blob at `p` */
+static int
+raw_put_field(PyObject *result, Py_ssize_t i, char **p, const char *name, size_t name_len,
+              const char *value, size_t value_len)
+{
+    char *dest;
+    if (*p) {
+        *p = raw_put_length(*p, name_len + value_len);
+        dest = *p;
+        *p += name_len + value_len;
+    }else{
+        PyObject *item = PyBytes_FromStringAndSize(NULL, name_len + value_len);
+        if (item == NULL)
+            return -1;
+        PyTuple_SET_ITEM(result, i, item);
+        dest = PyBytes_AS_STRING(item);
+    }
+    memcpy(dest, name, name_len);
+    memcpy(dest + name_len, value, value_len);
+    return 0;
+}
+
+/* Entry as unconverted "FIELD=value" items, in a tuple of bytes or a single
+ * bytes of items each preceded by its length as 64 bit little endian */
+static PyObject *
+Journal___get_entry_raw(Journal *self, int blob)
+{
+    static const char *special_names[] = {
+        "__REALTIME_TIMESTAMP=", "__MONOTONIC_TIMESTAMP=", "__CURSOR=",
+    };
+    const char *special_values[3] = {NULL, NULL, NULL};
+    char realtime_str[21], monotonic_str[21], *cursor=NULL, *p=NULL;
+    PyObject *result;
+    const void *msg;
+    size_t msg_len, total = 0;
+    Py_ssize_t n = 0, i = 0;
+    uint64_t realtime, monotonic;
+    sd_id128_t sd_id;
+    journal_reader *reader = Journal___entry_reader(self, self->j);
+    int k, r;
+
+    Journal___restart_data(reader, self->j);
+    while ((r = Journal___enumerate_data(reader, self->j, &msg, &msg_len)) > 0) {
+        total += msg_len;
+        n++;
+    }
+    if (r < 0 && reader) {
+        if (Journal___entry_fallback(self, &reader) < 0)
+            return NULL;
+        total = n = 0;
+        SD_JOURNAL_FOREACH_DATA(self->j, msg, msg_len) {
+            total += msg_len;
+            n++;
+        }
+    }
+
+    if (Journal___get_realtime(reader, self->j, &realtime) == 0) {
+        sprintf(realtime_str, "%llu", (long long unsigned) realtime);
+        special_values[0] = realtime_str;
+    }
+    if (Journal___get_monotonic(reader, self->j, &monotonic, &sd_id) == 0) {
+        sprintf(monotonic_str, "%llu", (long long unsigned) monotonic);
+        special_values[1] = monotonic_str;
+    }
+    if (Journal___get_cursor(reader, self->j, &cursor) >= 0)
+        special_values[2] = cursor;
+    for (k = 0; k < 3; k++) {
+        if (special_values[k]) {
+            total += strlen(special_names[k]) + strlen(special_values[k]);
+            n++;
+        }
+    }
+
+    if (blob) {
+        result = PyBytes_FromStringAndSize(NULL, total + 8 * n);
+        if (result)
+            p = PyBytes_AS_STRING(result);
+    }else{
+        result = PyTuple_New(n);
+    }
+    if (result == NULL)
+        goto finish;
+
+    Journal___restart_data(reader, self->j);
+    while (Journal___enumerate_data(reader, self->j, &msg, &msg_len) > 0) {
+        /* Entry data is not expected to change between passes */
+        if (i == n || (blob && p + 8 + msg_len > PyBytes_AS_STRING(result) + PyBytes_GET_SIZE(result)))
+            goto changed;
+        if (raw_put_field(result, i++, &p, msg, msg_len, NULL, 0) < 0)
+            goto error;
+    }
+    for (k = 0; k < 3; k++) {
+        if (special_values[k] == NULL)
+            continue;
+        if (i == n)
+            goto changed;
+        if (raw_put_field(result, i++, &p, special_names[k], strlen(special_names[k]),
+                          special_values[k], strlen(special_values[k])) < 0)
+            goto error;
+    }
+    if (i == n)
+        goto finish;
+
+changed:
+    PyErr_SetString(PyExc_RuntimeError, "Error reading entry data");
+error:
+    Py_CLEAR(result);
+finish:
+    free(cursor);
+    return result;
+}
+
+PyDoc_STRVAR(Journal_get_next_raw__doc__,
+"get_next_raw([skip][, blob]) -> tuple or bytes\n\n"
+"Return the next log entry as per get_next(), without any conversion.\n"
+"The entry is a tuple of bytes items in FIELD=value form, including\n"
+"__REALTIME_TIMESTAMP, __MONOTONIC_TIMESTAMP and __CURSOR; fields\n"
+"with several values are repeated. If `blob` is true, the entry is\n"
+"instead a single bytes object of the items, each preceded by its\n"
+"length as a 64 bit little endian integer. Returns an empty tuple or\n"
+"bytes at the end of the journal.");
+static PyObject *
+Journal_get_next_raw(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"skip", "blob", NULL};
+    PyObject *argv[2] = {NULL, NULL}, *result;
+    int64_t skip=1LL;
+    int blob=0, r;
+
+    if (unpack_fastcall("get_next_raw", args, nargs, kwnames, kwlist, 0, argv) < 0)
+        return NULL;
+    if (argv[0] && as_int64(argv[0], &skip) < 0)
+        return NULL;
+    if (argv[1] && (blob = PyObject_IsTrue(argv[1])) < 0)
+        return NULL;
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    r = Journal___move(self, skip);
+    if (r < 0)
+        result = NULL;
+    else if (r == 0) //EOF
+        result = blob ? PyBytes_FromStringAndSize(NULL, 0) : PyTuple_New(0);
+    else
+        result = Journal___get_entry_raw(self, blob);
+    Journal___unlock(self);
+    return result;
+}
+
+PyDoc_STRVAR(Journal_get_previous__doc__,
+"get_previous([skip]) -> dict\n\n"
+"Return dictionary of the previous log entry. Optional skip value\n"
+"will return the -`skip`th log entry. Equivalent to get_next(-skip).\n"
+"If the journal has not been positioned since it was opened, this\n"
+"returns the last log entry.");
+static PyObject *
+Journal_get_previous(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"skip", NULL};
+    PyObject *arg_skip=NULL;
+    int64_t skip=1LL;
+
+    if (unpack_fastcall("get_previous", args, nargs, NULL, kwlist, 0, &arg_skip) < 0)
+        return NULL;
+    if (arg_skip && as_int64(arg_skip, &skip) < 0)
+        return NULL;
+
+    return Journal___get_next(self, -skip);
+}
+
+static int
+Journal___as_match_string(PyObject *obj, const char **str, Py_ssize_t *len)
+{
+    if (PyUnicode_Check(obj)) {
+        *str = PyUnicode_AsUTF8AndSize(obj, len);
+        return *str ? 0 : -1;
+    }else if (PyBytes_Check(obj)) {
+        return PyBytes_AsStringAndSize(obj, (char **) str, len);
+    }
+    PyErr_SetString(PyExc_TypeError, "expected bytes or string");
+    return -1;
+}
+
+static int
+Journal___add_match(Journal *self, const void *match, size_t match_len)
+{
+    int r;
+    if (Journal___matches_changing(self) < 0)
+        return -1;
+    r = sd_journal_add_match(self->j, match, match_len);
+    if (r == -EINVAL) {
+        PyErr_SetString(PyExc_ValueError, "Invalid match");
+        return -1;
+    }else if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        return -1;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error adding match");
+        return -1;
+    }
+    return Journal___record_match(self, JOURNAL_MATCH, match, match_len);
+}
+
+static int
+Journal___add_junction(Journal *self, int kind)
+{
+    int r;
+    if (Journal___matches_changing(self) < 0)
+        return -1;
+    if (kind == JOURNAL_DISJUNCTION)
+        r = sd_journal_add_disjunction(self->j);
+    else
+        r = sd_journal_add_conjunction(self->j);
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        return -1;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error adding disjunction");
+        return -1;
+    }
+    return Journal___record_match(self, kind, NULL, 0);
+}
+
+/* Drops matches recorded after the first `n`, replaying those kept on
+ * the handle, as libsystemd cannot remove single matches */
+static void
+Journal___restore_matches(Journal *self, size_t n)
+{
+    size_t i;
+
+    for (i = n; i < self->n_matches; i++)
+        PyMem_Free(self->matches[i].data);
+    self->n_matches = n;
+    sd_journal_flush_matches(self->j);
+    for (i = 0; i < self->n_matches; i++) {
+        const journal_match *m = &self->matches[i];
+        if (m->kind == JOURNAL_MATCH)
+            sd_journal_add_match(self->j, m->data, m->len);
+        else if (m->kind == JOURNAL_DISJUNCTION)
+            sd_journal_add_disjunction(self->j);
+        else
+            sd_journal_add_conjunction(self->j);
+    }
+    if (self->bloom)
+        self->bloom->pending = 1;
+}
+
+static int
+Journal___add_match_keywds(Journal *self, PyObject *kwnames, PyObject *const *values)
+{
+    PyObject *key, *value;
+    Py_ssize_t i, match_key_len, match_value_len;
+    size_t match_len;
+    const char *match_key, *match_value;
+    char *match;
+    int r;
+    for (i = 0; i < PyTuple_GET_SIZE(kwnames); i++) {
+        key = PyTuple_GET_ITEM(kwnames, i);
+        value = values[i];
+        if (Journal___as_match_string(key, &match_key, &match_key_len) < 0 ||
+            Journal___as_match_string(value, &match_value, &match_value_len) < 0)
+            return -1;
+
+        match_len = match_key_len + 1 + match_value_len;
+        match = malloc(match_len);
+        if (match == NULL) {
+            PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+            return -1;
+        }
+        memcpy(match, match_key, match_key_len);
+        memcpy(match + match_key_len, "=", 1);
+        memcpy(match + match_key_len + 1, match_value, match_value_len);
+
+        r = Journal___add_match(self, match, match_len);
+        free(match);
+        if (r < 0)
+            return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(Journal_add_match__doc__,
+"add_match(match, ..., field=value, ...) -> None\n\n"
+"Add a match to filter journal log entries. All matches of different\n"
+"field are combined in logical AND, and matches of the same field\n"
+"are automatically combined in logical OR.\n"
+"Matches can be passed as strings \"field=value\", or keyword\n"
+"arguments field=\"value\".");
+static PyObject *
+Journal_add_match(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t arg_match_len;
+    const char *arg_match;
+    Py_ssize_t i;
+    int r=0;
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    for (i = 0; i < nargs; i++) {
+        if (Journal___as_match_string(args[i], &arg_match, &arg_match_len) < 0 ||
+            Journal___add_match(self, arg_match, arg_match_len) < 0) {
+            r = -1;
+            break;
+        }
+    }
+
+    if (r == 0 && kwnames)
+        r = Journal___add_match_keywds(self, kwnames, args + nargs);
+    Journal___unlock(self);
+
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Journal_add_disjunction__doc__,
+"add_disjunction() -> None\n\n"
+"Once called, all matches before and after are combined in logical\n"
+"OR.");
+static PyObject *
+Journal_add_disjunction(Journal *self, PyObject *args)
+{
+    int r;
+    if (Journal___lock(self) < 0)
+        return NULL;
+    r = Journal___add_junction(self, JOURNAL_DISJUNCTION);
+    Journal___unlock(self);
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Journal_flush_matches__doc__,
+"flush_matches() -> None\n\n"
+"Clears all current match filters.");
+static PyObject *
+Journal_flush_matches(Journal *self, PyObject *args)
+{
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (Journal___matches_changing(self) < 0) {
+        Journal___unlock(self);
+        return NULL;
+    }
+    sd_journal_flush_matches(self->j);
+    Journal___flush_recorded_matches(self);
+    Journal___filter_free(self->filter);
+    self->filter = NULL;
+    Journal___unlock(self);
+    PROBE4(match__change, self, PROBE_MATCH_FLUSH, NULL, 0);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Journal_filter__doc__,
+"filter(expression) -> None\n\n"
+"Add a filter expression, combined in logical AND with current\n"
+"matches and filters. Expressions combine comparisons with `and`,\n"
+"`or`, `not` and parentheses. Comparisons take the form FIELD op\n"
+"value, where op is one of =, !=, <, <=, >, >=, startswith,\n"
+"endswith or contains, and value is a word or quoted string, e.g.\n"
+"'PRIORITY<=3 and not _COMM=cron'. Ordering comparisons are numeric\n"
+"when value is an integer; __REALTIME_TIMESTAMP and\n"
+"__MONOTONIC_TIMESTAMP may also be compared. Comparisons are true\n"
+"if any value of the field matches, and false if it is absent.\n"
+"As much of the expression as possible is added as journal matches;\n"
+"the remainder is tested on raw field data, such that non-matching\n"
+"entries are never converted. Filters are cleared by flush_matches.\n"
+"Matches added afterwards are combined in logical AND.");
+static PyObject *
+Journal_filter(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"expression", NULL};
+    PyObject *arg=NULL, *prefilter;
+    const char *expression;
+    Py_ssize_t expression_len, i, k;
+    filter_node *root;
+    size_t n_matches;
+    int exact, r=0;
+
+    if (unpack_fastcall("filter", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if (!PyUnicode_Check(arg)) {
+        PyErr_SetString(PyExc_TypeError, "expression must be a string");
+        return NULL;
+    }
+    expression = PyUnicode_AsUTF8AndSize(arg, &expression_len);
+    if (expression == NULL)
+        return NULL;
+
+    root = filter_parse(expression, expression_len);
+    if (root == NULL)
+        return NULL;
+    prefilter = filter_prefilter(root, &exact);
+    if (prefilter == NULL) {
+        filter_node_free(root);
+        return NULL;
+    }
+
+    if (Journal___lock(self) < 0) {
+        filter_node_free(root);
+        Py_DECREF(prefilter);
+        return NULL;
+    }
+    n_matches = self->n_matches;
+    if (prefilter != Py_None) {
+        r = Journal___add_junction(self, JOURNAL_CONJUNCTION);
+        for (i = 0; r >= 0 && i < PyList_GET_SIZE(prefilter); i++) {
+            PyObject *clause = PyList_GET_ITEM(prefilter, i);
+            if (i > 0)
+                r = Journal___add_junction(self, JOURNAL_DISJUNCTION);
+            for (k = 0; r >= 0 && k < PyList_GET_SIZE(clause); k++) {
+                PyObject *match = PyList_GET_ITEM(clause, k);
+                r = Journal___add_match(self, PyBytes_AS_STRING(match), PyBytes_GET_SIZE(match));
+            }
+        }
+        if (r >= 0)
+            r = Journal___add_junction(self, JOURNAL_CONJUNCTION);
+    }
+    if (r >= 0 && !exact) {
+        self->filter = Journal___filter_add(self->filter, root);
+        root = NULL;
+        if (self->filter == NULL)
+            r = -1;
+    }
+    if (r < 0 && self->n_matches != n_matches)
+        Journal___restore_matches(self, n_matches);
+    Journal___unlock(self);
+    if (r >= 0)
+        PROBE4(match__change, self, PROBE_MATCH_FILTER, expression, (size_t) expression_len);
+
+    filter_node_free(root);
+    Py_DECREF(prefilter);
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Journal_seek__doc__,
+"seek(offset[, whence]) -> None\n\n"
+"Seek through journal by `offset` number of entries. Argument\n"
+"`whence` defines what the offset is relative to:\n"
+"os.SEEK_SET (default) from first match in journal;\n"
+"os.SEEK_CUR from current position in journal;\n"
+"and os.SEEK_END is from last match in journal.");
+static PyObject *
+Journal_seek(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"offset", "whence", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    int64_t offset, whence=SEEK_SET;
+
+    if (unpack_fastcall("seek", args, nargs, kwnames, kwlist, 1, argv) < 0)
+        return NULL;
+    if (as_int64(argv[0], &offset) < 0)
+        return NULL;
+    if (argv[1] && as_int64(argv[1], &whence) < 0)
+        return NULL;
+
+    int r=0;
+    PROBE2(seek__start, self, PROBE_SEEK_OFFSET);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (whence == SEEK_SET){
+        r = Journal___seek_head(self);
+        if (r >= 0 && offset > 0LL)
+            r = Journal___move(self, offset);
+    }else if (whence == SEEK_CUR){
+        if (offset != 0LL)
+            r = Journal___move(self, offset);
+    }else if (whence == SEEK_END){
+        r = Journal___seek_prepare(self);
+        if (r >= 0) {
+            Py_BEGIN_ALLOW_THREADS
+            r = sd_journal_seek_tail(self->j);
+            Py_END_ALLOW_THREADS
+            if (r < 0)
+                PyErr_SetString(PyExc_RuntimeError, "Error seeking to tail");
+        }
+        if (r >= 0) {
+            r = Journal___move(self, -1LL);
+            if (r >= 0 && offset < 0LL)
+                r = Journal___move(self, offset);
+        }
+    }else{
+        PyErr_SetString(PyExc_ValueError, "Invalid value for whence");
+        r = -EINVAL;
+    }
+    Journal___unlock(self);
+    PROBE3(seek__done, self, PROBE_SEEK_OFFSET, r);
+
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Journal_seek_realtime__doc__,
+"seek_realtime(realtime) -> None\n\n"
+"Seek to nearest matching journal entry to `realtime`. Argument\n"
+"`realtime` can be an integer unix timestamp in usecs or a "
+"datetime instance.");
+/* Converts an integer unix timestamp in usecs or datetime instance */
+static int
+Journal___as_realtime(Journal *self, PyObject *arg, uint64_t *ret)
+{
+    pyjournalctl_state *state = get_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return -1;
+
+    uint64_t timestamp=-1LL;
+    int is_datetime = PyObject_IsInstance(arg, state->datetime_type);
+    if (is_datetime < 0)
+        return -1;
+    if (is_datetime) {
+        PyObject *temp;
+        temp = PyObject_CallMethod(arg, "strftime", "s", "%s%f");
+        if (temp == NULL)
+            return -1;
+        const char *timestamp_str = PyUnicode_AsUTF8(temp);
+        if (timestamp_str == NULL) {
+            Py_DECREF(temp);
+            return -1;
+        }
+        timestamp = strtoull(timestamp_str, NULL, 10);
+        Py_DECREF(temp);
+    }else if (PyLong_Check(arg)) {
+        timestamp = PyLong_AsUnsignedLongLong(arg);
+        if (PyErr_Occurred())
+            PyErr_Clear();
+    }
+    if ((int64_t) timestamp < 0LL) {
+        PyErr_SetString(PyExc_ValueError, "Time must be positive integer or datetime instance");
+        return -1;
+    }
+    *ret = timestamp;
+    return 0;
+}
+
+static PyObject *
+Journal_seek_realtime(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"realtime", NULL};
+    PyObject *arg=NULL;
+    uint64_t timestamp;
+    if (unpack_fastcall("seek_realtime", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if (Journal___as_realtime(self, arg, &timestamp) < 0)
+        return NULL;
+
+    int r;
+    PROBE2(seek__start, self, PROBE_SEEK_REALTIME);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (Journal___seek_prepare(self) < 0) {
+        Journal___unlock(self);
+        PROBE3(seek__done, self, PROBE_SEEK_REALTIME, -1);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_seek_realtime_usec(self->j, timestamp);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+    PROBE3(seek__done, self, PROBE_SEEK_REALTIME, r);
+    if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seek to time");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* Converts a number of secs or timedelta instance to usecs */
+static int
+Journal___as_duration(Journal *self, PyObject *arg, uint64_t *ret)
+{
+    pyjournalctl_state *state = get_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return -1;
+
+    uint64_t usec=-1LL;
+    int is_timedelta = PyObject_IsInstance(arg, state->timedelta_type);
+    if (is_timedelta < 0)
+        return -1;
+    if (is_timedelta) {
+        PyObject *temp;
+        temp = PyObject_CallMethod(arg, "total_seconds", NULL);
+        if (temp == NULL)
+            return -1;
+        usec = (uint64_t) (PyFloat_AsDouble(temp) * 1E6);
+        Py_DECREF(temp);
+    }else if (PyFloat_Check(arg)) {
+        usec = (uint64_t) (PyFloat_AsDouble(arg) * 1E6);
+    }else if (PyLong_Check(arg)) {
+        usec = PyLong_AsUnsignedLongLong(arg) * (uint64_t) 1E6;
+        if (PyErr_Occurred())
+            PyErr_Clear();
+    }
+
+    if ((int64_t) usec < 0LL) {
+        PyErr_SetString(PyExc_ValueError, "Time must be positive number or timedelta instance");
+        return -1;
+    }
+    *ret = usec;
+    return 0;
+}
+
+PyDoc_STRVAR(Journal_seek_monotonic__doc__,
+"seek_monotonic(monotonic[, bootid]) -> None\n\n"
+"Seek to nearest matching journal entry to `monotonic`. Argument\n"
+"`monotonic` is an timestamp from boot in secs, or a\n"
+"timedelta instance.\n"
+"Argument `bootid` is a string representing which boot the\n"
+"monotonic time is reference to. Defaults to current bootid.");
+static PyObject *
+Journal_seek_monotonic(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"monotonic", "bootid", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    PyObject *arg;
+    const char *bootid=NULL;
+    if (unpack_fastcall("seek_monotonic", args, nargs, NULL, kwlist, 1, argv) < 0)
+        return NULL;
+    arg = argv[0];
+    if (argv[1] && (bootid = as_cstring(argv[1])) == NULL)
+        return NULL;
+
+    uint64_t timestamp;
+    if (Journal___as_duration(self, arg, &timestamp) < 0)
+        return NULL;
+
+    sd_id128_t sd_id;
+    int r;
+    if (bootid) {
+        r = sd_id128_from_string(bootid, &sd_id);
+        if (r == -EINVAL) {
+            PyErr_SetString(PyExc_ValueError, "Invalid bootid");
+            return NULL;
+        } else if (r < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Error processing bootid");
+            return NULL;
+        }
+    }else{
+        r = sd_id128_get_boot(&sd_id);
+        if (r == -EIO) {
+            PyErr_SetString(PyExc_IOError, "Error getting current boot ID");
+            return NULL;
+        } else if (r < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Error getting current boot ID");
+            return NULL;
+        }
+    }
+
+    PROBE2(seek__start, self, PROBE_SEEK_MONOTONIC);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (Journal___seek_prepare(self) < 0) {
+        Journal___unlock(self);
+        PROBE3(seek__done, self, PROBE_SEEK_MONOTONIC, -1);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_seek_monotonic_usec(self->j, sd_id, timestamp);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+    PROBE3(seek__done, self, PROBE_SEEK_MONOTONIC, r);
+    if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seek to time");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static uint64_t
+now_monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+/* As sd_journal_wait(), but polling with the lock of `self` released so
+ * that other threads may use the journal meanwhile. Called with the lock
+ * held, as it is again on return. */
+static int
+Journal___wait(Journal *self, uint64_t timeout_usec)
+{
+    journal_waiter waiter, **prev;
+    struct pollfd fds[2];
+    uint64_t deadline, now;
+    int fd, r;
+
+    /* The first wait on a handle starts watching the journal, and
+     * returns at once */
+    if (!self->watching) {
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_wait(self->j, 0);
+        Py_END_ALLOW_THREADS
+        if (r >= 0)
+            self->watching = 1;
+        return r;
+    }
+
+    fd = sd_journal_get_fd(self->j);
+    if (fd < 0)
+        return fd;
+    r = sd_journal_get_timeout(self->j, &deadline);
+    if (r < 0)
+        return r;
+    now = now_monotonic_usec();
+    if (timeout_usec != (uint64_t) -1 &&
+        (deadline == (uint64_t) -1 || now + timeout_usec < deadline))
+        deadline = now + timeout_usec;
+
+    fds[0].fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+    fds[0].events = sd_journal_get_events(self->j);
+    fds[1].fd = eventfd(0, EFD_CLOEXEC);
+    fds[1].events = POLLIN;
+    if (fds[0].fd < 0 || fds[1].fd < 0) {
+        r = -errno;
+        if (fds[0].fd >= 0)
+            close(fds[0].fd);
+        if (fds[1].fd >= 0)
+            close(fds[1].fd);
+        return r;
+    }
+    waiter.wake_fd = fds[1].fd;
+    waiter.replaced = 0;
+    waiter.next = self->waiters;
+    self->waiters = &waiter;
+    Journal___unlock(self);
+
+    Py_BEGIN_ALLOW_THREADS
+    do {
+        int timeout_ms = -1;
+        if (deadline != (uint64_t) -1) {
+            now = now_monotonic_usec();
+            timeout_ms = deadline > now ? (int) Py_MIN((deadline - now + 999) / 1000, (uint64_t) INT_MAX) : 0;
+        }
+        r = poll(fds, 2, timeout_ms);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        r = -errno;
+    close(fds[0].fd);
+    close(fds[1].fd);
+    Py_END_ALLOW_THREADS
+
+    Journal___lock(self);
+    if (waiter.replaced)
+        return SD_JOURNAL_INVALIDATE;
+    for (prev = &self->waiters; *prev != &waiter; prev = &(*prev)->next)
+        ;
+    *prev = waiter.next;
+    if (r < 0)
+        return r;
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_process(self->j);
+    Py_END_ALLOW_THREADS
+    return r;
+}
+
+PyDoc_STRVAR(Journal_wait__doc__,
+"wait([timeout]) -> Change state (integer)\n\n"
+"Waits until there is a change in the journal. Argument `timeout`\n"
+"is the maximum number of seconds to wait before returning\n"
+"regardless if journal has changed. If `timeout` is not given or is\n"
+"0, then it will block forever.\n"
+"Will return constants: NOP if no change; APPEND if new\n"
+"entries have been added to the end of the journal; and\n"
+"INVALIDATE if journal files have been added or removed.\n"
+"Continuous queries are then updated with any appended entries, as is\n"
+"the index of update_index() on APPEND or INVALIDATE.\n"
+"Other threads may use the journal while it waits; should they change\n"
+"the files it is opened on, as by adding matches with bloom filters in\n"
+"use, it returns INVALIDATE.");
+static PyObject *
+Journal_wait(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"timeout", NULL};
+    PyObject *arg_timeout=NULL, *dropped;
+    int64_t timeout=0LL;
+    if (unpack_fastcall("wait", args, nargs, NULL, kwlist, 0, &arg_timeout) < 0)
+        return NULL;
+    if (arg_timeout && as_int64(arg_timeout, &timeout) < 0)
+        return NULL;
+
+    int r;
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (Journal___release_reader(self) < 0) {
+        Journal___unlock(self);
+        return NULL;
+    }
+    PROBE2(wait__start, self, timeout == 0LL ? -1LL : (int64_t) (timeout * 1E6));
+    r = Journal___wait(self, timeout == 0LL ? (uint64_t) -1 : (uint64_t) (timeout * 1E6));
+    PROBE2(wait__done, self, r);
+    if ((r == SD_JOURNAL_APPEND || r == SD_JOURNAL_INVALIDATE) && self->results)
+        result_cache_invalidate(self->results);
+    if ((r == SD_JOURNAL_APPEND || r == SD_JOURNAL_INVALIDATE) && self->index) {
+        uint64_t added;
+        int u;
+        Py_BEGIN_ALLOW_THREADS
+        u = index_tail(self->index, &added);
+        Py_END_ALLOW_THREADS
+        if (added > 0)
+            self->index->unsaved = 1;
+        if (u < 0) {
+            Journal___unlock(self);
+            PyErr_SetString(PyExc_RuntimeError, "Error updating index");
+            return NULL;
+        }
+    }
+    dropped = result_cache_dropped(self->results);
+    if (r >= 0) {
+        int u;
+        lock_acquire(&self->continuous.lock);
+        Py_BEGIN_ALLOW_THREADS
+        u = Journal___continuous_update(&self->continuous);
+        Py_END_ALLOW_THREADS
+        lock_release(&self->continuous.lock);
+        if (u < 0) {
+            Journal___unlock(self);
+            Py_XDECREF(dropped);
+            PyErr_SetString(PyExc_RuntimeError, "Error updating continuous queries");
+            return NULL;
+        }
+    }
+    Journal___unlock(self);
+    Py_XDECREF(dropped);
+    return PyLong_FromLong(r);
+}
+
+PyDoc_STRVAR(Journal_seek_cursor__doc__,
+"seek_cursor(cursor) -> None\n\n"
+"Seeks to journal entry by given unique reference `cursor`.");
+static PyObject *
+Journal_seek_cursor(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"cursor", NULL};
+    PyObject *arg=NULL;
+    const char *cursor;
+    if (unpack_fastcall("seek_cursor", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if ((cursor = as_cstring(arg)) == NULL)
+        return NULL;
+
+    int r;
+    PROBE2(seek__start, self, PROBE_SEEK_CURSOR);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (Journal___seek_prepare(self) < 0) {
+        Journal___unlock(self);
+        PROBE3(seek__done, self, PROBE_SEEK_CURSOR, -1);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_seek_cursor(self->j, cursor);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+    PROBE3(seek__done, self, PROBE_SEEK_CURSOR, r);
+    if (r == -EINVAL) {
+        PyErr_SetString(PyExc_ValueError, "Invalid cursor");
+        return NULL;
+    }else if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        return NULL;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking to cursor");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* splitmix64, which is sufficient for sampling and cheap to seed */
+static uint64_t
+random_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in (0, 1] */
+static double
+random_double(uint64_t *state)
+{
+    return ((random_next(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static int
+random_seed(PyObject *seed, uint64_t *state)
+{
+    if (seed == NULL || seed == Py_None) {
+        if (getrandom(state, sizeof(*state), GRND_NONBLOCK) != sizeof(*state))
+            *state = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+        return 0;
+    }
+    *state = PyLong_AsUnsignedLongLongMask(seed);
+    if (*state == (uint64_t) -1 && PyErr_Occurred())
+        return -1;
+    return 0;
+}
+
+/* Entries to move to the next one kept, when each is kept with
+ * probability `rate`; i.e. geometrically distributed */
+static int64_t
+random_geometric_skip(uint64_t *state, double rate)
+{
+    double skip;
+    if (rate >= 1.0)
+        return 1;
+    skip = floor(log(random_double(state)) / log1p(-rate)) + 1;
+    return skip < INT_MAX ? (int64_t) skip : INT_MAX;
+}
+
+/* Cursors are compared as binary values, ordered as libsystemd orders
+ * entries of different files. They are parsed by hand, being read for
+ * every entry by some iterators, where sscanf() is the larger cost. */
+static int
+cursor_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Parses "<key>=<hex>" ended by ';' or the end of string, returning the
+ * position after it or NULL */
+static const char *
+cursor_parse_value(const char *p, char key, uint64_t *ret)
+{
+    uint64_t value = 0;
+    int n, d;
+
+    if (p == NULL || p[0] != key || p[1] != '=')
+        return NULL;
+    for (p += 2, n = 0; (d = cursor_hex_digit(*p)) >= 0; p++, n++) {
+        if (n == 16)
+            return NULL;
+        value = value << 4 | d;
+    }
+    if (n == 0 || (*p != ';' && *p != '\0'))
+        return NULL;
+    *ret = value;
+    return *p ? p + 1 : p;
+}
+
+/* As per cursor_parse_value, for 128 bit IDs of exactly 32 digits */
+static const char *
+cursor_parse_id(const char *p, char key, sd_id128_t *ret)
+{
+    int i, hi, lo;
+
+    if (p == NULL || p[0] != key || p[1] != '=')
+        return NULL;
+    for (p += 2, i = 0; i < 16; i++, p += 2) {
+        if ((hi = cursor_hex_digit(p[0])) < 0 || (lo = cursor_hex_digit(p[1])) < 0)
+            return NULL;
+        ret->bytes[i] = hi << 4 | lo;
+    }
+    if (*p != ';' && *p != '\0')
+        return NULL;
+    return *p ? p + 1 : p;
+}
+
+static int
+cursor_parse(const char *str, PyJournalctl_Cursor *cursor)
+{
+    const char *p;
+
+    p = cursor_parse_id(str, 's', &cursor->seqnum_id);
+    p = cursor_parse_value(p, 'i', &cursor->seqnum);
+    p = cursor_parse_id(p, 'b', &cursor->boot_id);
+    p = cursor_parse_value(p, 'm', &cursor->monotonic);
+    p = cursor_parse_value(p, 't', &cursor->realtime);
+    p = cursor_parse_value(p, 'x', &cursor->xor_hash);
+    return p ? 0 : -EBADMSG;
+}
+
+static int
+cursor_get(journal_reader *reader, sd_journal *j, PyJournalctl_Cursor *cursor)
+{
+    char *str;
+    int r;
+
+    if (reader)
+        return reader_get_cursor_values(reader, cursor);
+    r = Journal___get_cursor(reader, j, &str);
+    if (r < 0)
+        return r;
+    r = cursor_parse(str, cursor);
+    free(str);
+    return r;
+}
+
+static int
+cursor_compare(const PyJournalctl_Cursor *a, const PyJournalctl_Cursor *b)
+{
+    if (sd_id128_equal(a->seqnum_id, b->seqnum_id) && a->seqnum != b->seqnum)
+        return a->seqnum < b->seqnum ? -1 : 1;
+    if (sd_id128_equal(a->boot_id, b->boot_id) && a->monotonic != b->monotonic)
+        return a->monotonic < b->monotonic ? -1 : 1;
+    if (a->realtime != b->realtime)
+        return a->realtime < b->realtime ? -1 : 1;
+    return a->xor_hash < b->xor_hash ? -1 : a->xor_hash > b->xor_hash;
+}
+
+/* Formats `cursor` as per sd_journal_get_cursor() */
+static int
+cursor_format(const PyJournalctl_Cursor *cursor, char **ret)
+{
+    char seqnum_id[33], boot_id[33];
+
+    if (asprintf(ret, "s=%s;i=%" PRIx64 ";b=%s;m=%" PRIx64 ";t=%" PRIx64 ";x=%" PRIx64,
+                 sd_id128_to_string(cursor->seqnum_id, seqnum_id), cursor->seqnum,
+                 sd_id128_to_string(cursor->boot_id, boot_id), cursor->monotonic,
+                 cursor->realtime, cursor->xor_hash) < 0) {
+        *ret = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Entries returned by an iterator dropping duplicates, which are those
+ * with the boot ID, sequence number ID and sequence number, or the boot
+ * ID, realtime and hash of data of an entry returned before. Entries are
+ * iterated in time order, so only those within `window` microseconds of
+ * the latest need be kept: in a ring of at most DEDUP_MAX_ENTRIES, the
+ * oldest first. Each is found by either key via an open addressed table
+ * of its position in the ring plus one, at most half full. */
+#define DEDUP_DEFAULT_WINDOW 10000000LL
+#define DEDUP_MAX_ENTRIES    65536
+
+enum {
+    DEDUP_BY_SEQNUM,
+    DEDUP_BY_HASH,
+};
+
+typedef struct {
+    PyJournalctl_Cursor *ring;
+    uint32_t *tables[2];
+    size_t size;
+    size_t head;
+    size_t n;
+    int64_t window;
+    uint64_t dropped;
+} dedup_window;
+
+/* Boot ID is left to dedup_equal, being the same for most entries */
+static uint64_t
+dedup_hash(const PyJournalctl_Cursor *cursor, int by)
+{
+    uint64_t h;
+
+    if (by == DEDUP_BY_HASH)
+        h = cursor->xor_hash ^ cursor->realtime * 0x9E3779B97F4A7C15ULL;
+    else
+        h = (cursor->seqnum_id.qwords[0] ^ cursor->seqnum_id.qwords[1]) +
+            cursor->seqnum * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+static int
+dedup_equal(const PyJournalctl_Cursor *a, const PyJournalctl_Cursor *b, int by)
+{
+    if (!sd_id128_equal(a->boot_id, b->boot_id))
+        return 0;
+    if (by == DEDUP_BY_HASH)
+        return a->realtime == b->realtime && a->xor_hash == b->xor_hash;
+    return sd_id128_equal(a->seqnum_id, b->seqnum_id) && a->seqnum == b->seqnum;
+}
+
+static dedup_window *
+dedup_new(int64_t window)
+{
+    dedup_window *d = PyMem_RawCalloc(1, sizeof(dedup_window));
+    if (d)
+        d->window = window;
+    return d;
+}
+
+static void
+dedup_free(dedup_window *d)
+{
+    if (d == NULL)
+        return;
+    PyMem_RawFree(d->ring);
+    PyMem_RawFree(d->tables[0]);
+    PyMem_RawFree(d->tables[1]);
+    PyMem_RawFree(d);
+}
+
+/* Slot of table `by` holding `cursor`, or of ring position `pos` if
+ * given, otherwise the empty slot ending its probe sequence */
+static size_t
+dedup_find(const dedup_window *d, const PyJournalctl_Cursor *cursor, int by, size_t pos)
+{
+    size_t mask = 2 * d->size - 1, i;
+    const uint32_t *table = d->tables[by];
+
+    for (i = dedup_hash(cursor, by) & mask; table[i]; i = (i + 1) & mask) {
+        if (pos != (size_t) -1 ? table[i] == pos + 1
+                               : dedup_equal(&d->ring[table[i] - 1], cursor, by))
+            break;
+    }
+    return i;
+}
+
+/* Empties slot `i`, moving back later entries of its probe sequence */
+static void
+dedup_remove(dedup_window *d, int by, size_t i)
+{
+    size_t mask = 2 * d->size - 1, k, home;
+    uint32_t *table = d->tables[by];
+
+    for (k = (i + 1) & mask; table[k]; k = (k + 1) & mask) {
+        home = dedup_hash(&d->ring[table[k] - 1], by) & mask;
+        if (((k - home) & mask) >= ((k - i) & mask)) {
+            table[i] = table[k];
+            i = k;
+        }
+    }
+    table[i] = 0;
+}
+
+static void
+dedup_evict(dedup_window *d)
+{
+    int by;
+    for (by = DEDUP_BY_SEQNUM; by <= DEDUP_BY_HASH; by++)
+        dedup_remove(d, by, dedup_find(d, &d->ring[d->head], by, d->head));
+    d->head = (d->head + 1) & (d->size - 1);
+    d->n--;
+}
+
+/* Doubles the ring, which is then from position 0, and rebuilds tables */
+static int
+dedup_grow(dedup_window *d)
+{
+    size_t size = d->size ? d->size * 2 : 64, i;
+    PyJournalctl_Cursor *ring;
+    uint32_t *tables[2];
+    int by;
+
+    ring = PyMem_RawMalloc(size * sizeof(PyJournalctl_Cursor));
+    tables[0] = PyMem_RawCalloc(2 * size, sizeof(uint32_t));
+    tables[1] = PyMem_RawCalloc(2 * size, sizeof(uint32_t));
+    if (ring == NULL || tables[0] == NULL || tables[1] == NULL) {
+        PyMem_RawFree(ring);
+        PyMem_RawFree(tables[0]);
+        PyMem_RawFree(tables[1]);
+        return -ENOMEM;
+    }
+    for (i = 0; i < d->n; i++)
+        ring[i] = d->ring[(d->head + i) & (d->size - 1)];
+    PyMem_RawFree(d->ring);
+    PyMem_RawFree(d->tables[0]);
+    PyMem_RawFree(d->tables[1]);
+    d->ring = ring;
+    d->tables[0] = tables[0];
+    d->tables[1] = tables[1];
+    d->size = size;
+    d->head = 0;
+    for (i = 0; i < d->n; i++)
+        for (by = DEDUP_BY_SEQNUM; by <= DEDUP_BY_HASH; by++)
+            d->tables[by][dedup_find(d, &d->ring[i], by, i)] = i + 1;
+    return 0;
+}
+
+/* Returns 1 if entry of `cursor` is a duplicate, otherwise adds it and
+ * returns 0. Iteration towards the head is given by `reverse`. */
+static int
+dedup_check(dedup_window *d, const PyJournalctl_Cursor *cursor, int reverse)
+{
+    size_t pos;
+    int by;
+
+    for (by = DEDUP_BY_SEQNUM; d->n > 0 && by <= DEDUP_BY_HASH; by++) {
+        if (d->tables[by][dedup_find(d, cursor, by, (size_t) -1)]) {
+            d->dropped++;
+            return 1;
+        }
+    }
+
+    while (d->n > 0) {
+        const PyJournalctl_Cursor *oldest = &d->ring[d->head];
+        int64_t age = (int64_t) (reverse ? oldest->realtime - cursor->realtime
+                                         : cursor->realtime - oldest->realtime);
+        if (age <= d->window && d->n < DEDUP_MAX_ENTRIES)
+            break;
+        dedup_evict(d);
+    }
+    if (d->n == d->size && dedup_grow(d) < 0)
+        return -ENOMEM;
+
+    pos = (d->head + d->n) & (d->size - 1);
+    d->ring[pos] = *cursor;
+    d->n++;
+    for (by = DEDUP_BY_SEQNUM; by <= DEDUP_BY_HASH; by++)
+        d->tables[by][dedup_find(d, cursor, by, pos)] = pos + 1;
+    return 0;
+}
+
+typedef struct {
+    PyObject_HEAD
+    Journal *journal;
+    int64_t step;
+    int64_t remaining;
+    Journal_projection *projection;
+    double rate;
+    uint64_t random_state;
+    int has_stop;
+    PyJournalctl_Cursor stop;
+    dedup_window *dedup;
+} JournalIterator;
+
+PyDoc_STRVAR(JournalIterator__doc__,
+"Iterator over entries of a Journal, from its current position.\n\n"
+"Created by iter(journal), reversed(journal) or journal.entries().\n"
+"Moving the iterator moves the position of the underlying Journal.");
+
+static int
+JournalIterator_traverse(JournalIterator *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->journal);
+    return 0;
+}
+
+static int
+JournalIterator_clear(JournalIterator *self)
+{
+    Py_CLEAR(self->journal);
+    return 0;
+}
+
+static void
+JournalIterator_dealloc(JournalIterator *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    JournalIterator_clear(self);
+    Journal___projection_free(self->projection);
+    dedup_free(self->dedup);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+JournalIterator_iternext(JournalIterator *self)
+{
+    Journal *journal = self->journal;
+    PyObject *dict=NULL;
+    int r;
+
+    if (self->remaining == 0)
+        return NULL;
+
+    int64_t skip = self->step;
+    if (self->rate > 0.0)
+        skip *= random_geometric_skip(&self->random_state, self->rate);
+
+    if (Journal___lock(journal) < 0)
+        return NULL;
+    for (;;) {
+        r = Journal___move(journal, skip);
+        if (r <= 0 || (!self->has_stop && self->dedup == NULL))
+            break;
+        PyJournalctl_Cursor cursor;
+        int k = cursor_get(Journal___entry_reader(journal, journal->j), journal->j, &cursor);
+        if (k < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Error getting cursor");
+            r = -1;
+            break;
+        }
+        /* Stops at the first entry from the stop cursor */
+        if (self->has_stop && cursor_compare(&cursor, &self->stop) >= 0) {
+            r = self->remaining = 0;
+            break;
+        }
+        /* Duplicates are passed over, as entries not sampled are */
+        k = self->dedup ? dedup_check(self->dedup, &cursor, skip < 0) : 0;
+        if (k < 0) {
+            PyErr_NoMemory();
+            r = -1;
+            break;
+        }
+        if (k == 0)
+            break;
+    }
+    if (r > 0 && r >= (skip > 0 ? skip : -skip))
+        dict = Journal___get_entry(journal, journal->j, self->projection);
+    Journal___unlock(journal);
+
+    if (dict && self->remaining > 0)
+        self->remaining--;
+    return dict;
+}
+
+static PyObject *
+JournalIterator_get_duplicates(JournalIterator *self, void *closure)
+{
+    return PyLong_FromUnsignedLongLong(self->dedup ? self->dedup->dropped : 0);
+}
+
+static PyGetSetDef JournalIterator_getseters[] = {
+    {"duplicates", (getter)JournalIterator_get_duplicates, NULL,
+    "number of duplicate entries dropped", NULL},
+    {NULL}
+};
+
+static PyType_Slot JournalIterator_slots[] = {
+    {Py_tp_dealloc, JournalIterator_dealloc},
+    {Py_tp_traverse, JournalIterator_traverse},
+    {Py_tp_clear, JournalIterator_clear},
+    {Py_tp_doc, (void *)JournalIterator__doc__},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, JournalIterator_iternext},
+    {Py_tp_getset, JournalIterator_getseters},
+    {0, NULL}
+};
+
+static PyType_Spec JournalIterator_spec = {
+    "pyjournalctl.JournalIterator",
+    sizeof(JournalIterator),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    JournalIterator_slots,
+};
+
+static PyObject *
+Journal___new_iterator(Journal *self, int64_t step, int64_t limit, PyObject *fields)
+{
+    pyjournalctl_state *state;
+    JournalIterator *iter;
+
+    state = get_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return NULL;
+
+    iter = PyObject_GC_New(JournalIterator, state->JournalIteratorType);
+    if (iter == NULL)
+        return NULL;
+    Py_INCREF(self);
+    iter->journal = self;
+    iter->step = step;
+    iter->remaining = limit;
+    iter->projection = NULL;
+    iter->rate = 0.0;
+    iter->random_state = 0;
+    iter->has_stop = 0;
+    iter->dedup = NULL;
+    PyObject_GC_Track(iter);
+
+    if (fields && fields != Py_None) {
+        iter->projection = Journal___projection_new(fields);
+        if (iter->projection == NULL) {
+            Py_DECREF(iter);
+            return NULL;
+        }
+    }
+    return (PyObject *) iter;
+}
+
+static PyObject *
+Journal_iter(PyObject *self)
+{
+    return Journal___new_iterator((Journal *) self, 1LL, -1LL, NULL);
+}
+
+static PyObject *
+Journal_iternext(PyObject *self)
+{
+    Journal *iter = (Journal *)self;
+    PyObject *dict=NULL;
+    int r;
+
+    if (Journal___lock(iter) < 0)
+        return NULL;
+    r = Journal___move(iter, 1LL);
+    if (r > 0)
+        dict = Journal___get_entry(iter, iter->j, NULL);
+    Journal___unlock(iter);
+
+    return dict;
+}
+
+PyDoc_STRVAR(Journal_reversed__doc__,
+"__reversed__() -> iterator\n\n"
+"Return iterator of log entries in reverse order, from the current\n"
+"position towards the head of the journal, or from the tail if the\n"
+"journal has not been positioned since it was opened.");
+static PyObject *
+Journal_reversed(Journal *self, PyObject *args)
+{
+    return Journal___new_iterator(self, -1LL, -1LL, NULL);
+}
+
+PyDoc_STRVAR(Journal_entries__doc__,
+"entries([reverse][, limit][, fields][, dedup]) -> iterator\n\n"
+"Return iterator of log entries from the current position.\n"
+"Argument `reverse` iterates towards the head of the journal, from the\n"
+"tail if the journal has not been positioned since it was opened.\n"
+"Argument `limit` is the maximum number of entries returned.\n"
+"Argument `fields` is an iterable of field names; only these\n"
+"fields are converted and returned for each entry.\n"
+"Argument `dedup` drops entries which are copies of one returned\n"
+"before, as from overlapping journal directories, recognised by\n"
+"boot ID with sequence number ID and number, or with realtime and\n"
+"hash of data. It is True, or the window in microseconds within\n"
+"which copies are recognised, by default 10 seconds; at most 65536\n"
+"entries are kept. The iterator's `duplicates` attribute is the\n"
+"number dropped.");
+static PyObject *
+Journal_entries(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"reverse", "limit", "fields", "dedup", NULL};
+    PyObject *argv[4] = {NULL, NULL, NULL, NULL};
+    JournalIterator *iter;
+    int reverse=0;
+    int64_t limit=-1LL, window=-1LL;
+
+    if (unpack_fastcall("entries", args, nargs, kwnames, kwlist, 0, argv) < 0)
+        return NULL;
+    if (argv[0] && (reverse = PyObject_IsTrue(argv[0])) < 0)
+        return NULL;
+    if (argv[1] && argv[1] != Py_None) {
+        if (as_int64(argv[1], &limit) < 0)
+            return NULL;
+        if (limit < 0LL) {
+            PyErr_SetString(PyExc_ValueError, "Limit must be positive integer");
+            return NULL;
+        }
+    }
+    if (argv[3] && PyBool_Check(argv[3])) {
+        if (argv[3] == Py_True)
+            window = DEDUP_DEFAULT_WINDOW;
+    }else if (argv[3] && argv[3] != Py_None) {
+        if (as_int64(argv[3], &window) < 0)
+            return NULL;
+        if (window < 0LL) {
+            PyErr_SetString(PyExc_ValueError, "Dedup window must be positive integer");
+            return NULL;
+        }
+    }
+
+    iter = (JournalIterator *) Journal___new_iterator(self, reverse ? -1LL : 1LL, limit, argv[2]);
+    if (iter == NULL || window < 0LL)
+        return (PyObject *) iter;
+    iter->dedup = dedup_new(window);
+    if (iter->dedup == NULL) {
+        Py_DECREF(iter);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *) iter;
+}
+
+PyDoc_STRVAR(Journal_sample__doc__,
+"sample(rate=None, every=None[, seed][, fields]) -> iterator\n\n"
+"Return iterator of a sample of log entries from the current position.\n"
+"Argument `rate` keeps each entry with the given probability, or\n"
+"argument `every` keeps every `every`th entry. Entries not kept are\n"
+"skipped without being read. Argument `seed` is an integer making\n"
+"the sample reproducible. Argument `fields` is as per entries().");
+static PyObject *
+Journal_sample(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"rate", "every", "seed", "fields", NULL};
+    PyObject *argv[4] = {NULL, NULL, NULL, NULL};
+    JournalIterator *iter;
+    double rate=0.0;
+    int64_t every=1LL;
+
+    if (unpack_fastcall("sample", args, nargs, kwnames, kwlist, 0, argv) < 0)
+        return NULL;
+    if ((argv[0] == NULL || argv[0] == Py_None) == (argv[1] == NULL || argv[1] == Py_None)) {
+        PyErr_SetString(PyExc_TypeError, "sample() requires exactly one of rate or every");
+        return NULL;
+    }
+    if (argv[0] && argv[0] != Py_None) {
+        rate = PyFloat_AsDouble(argv[0]);
+        if (rate == -1.0 && PyErr_Occurred())
+            return NULL;
+        if (!(rate > 0.0 && rate <= 1.0)) {
+            PyErr_SetString(PyExc_ValueError, "Rate must be 0 < rate <= 1");
+            return NULL;
+        }
+    }else{
+        if (as_int64(argv[1], &every) < 0)
+            return NULL;
+        if (every < 1LL || every > INT_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Every must be positive integer");
+            return NULL;
+        }
+    }
+
+    iter = (JournalIterator *) Journal___new_iterator(self, every, -1LL, argv[3]);
+    if (iter == NULL)
+        return NULL;
+    iter->rate = rate;
+    if (random_seed(argv[2], &iter->random_state) < 0) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    return (PyObject *) iter;
+}
+
+PyDoc_STRVAR(Journal_reservoir__doc__,
+"reservoir(k[, seed][, fields]) -> list\n\n"
+"Return a uniform random sample of `k` log entries, from the current\n"
+"position to the end of the journal. Entries are only read when they\n"
+"enter the sample, so cost grows with k * log(n / k) rather than the\n"
+"n entries passed. Arguments `seed` and `fields` are as per sample().");
+static PyObject *
+Journal_reservoir(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"k", "seed", "fields", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    PyObject *result, *entry;
+    Journal_projection *proj=NULL;
+    uint64_t random_state;
+    int64_t k, skip;
+    double w;
+    int r=0;
+
+    if (unpack_fastcall("reservoir", args, nargs, kwnames, kwlist, 1, argv) < 0)
+        return NULL;
+    if (as_int64(argv[0], &k) < 0)
+        return NULL;
+    if (k < 0LL) {
+        PyErr_SetString(PyExc_ValueError, "k must be positive integer");
+        return NULL;
+    }
+    if (random_seed(argv[1], &random_state) < 0)
+        return NULL;
+    if (argv[2] && argv[2] != Py_None && (proj = Journal___projection_new(argv[2])) == NULL)
+        return NULL;
+    result = PyList_New(0);
+    if (result == NULL) {
+        Journal___projection_free(proj);
+        return NULL;
+    }
+
+    if (Journal___lock(self) < 0) {
+        Py_DECREF(result);
+        Journal___projection_free(proj);
+        return NULL;
+    }
+    while (PyList_GET_SIZE(result) < k) {
+        r = Journal___move(self, 1LL);
+        if (r <= 0)
+            break;
+        entry = Journal___get_entry(self, self->j, proj);
+        if (entry == NULL || PyList_Append(result, entry) < 0) {
+            Py_XDECREF(entry);
+            r = -1;
+            break;
+        }
+        Py_DECREF(entry);
+    }
+
+    /* Algorithm L: skips between replacements are drawn directly */
+    w = k > 0 ? exp(log(random_double(&random_state)) / k) : 1.0;
+    while (r > 0 && w < 1.0) {
+        double temp = floor(log(random_double(&random_state)) / log1p(-w)) + 1;
+        skip = temp < INT_MAX ? (int64_t) temp : INT_MAX;
+        r = Journal___move(self, skip);
+        if (r < skip)
+            break;
+        entry = Journal___get_entry(self, self->j, proj);
+        if (entry == NULL) {
+            r = -1;
+            break;
+        }
+        PyList_SetItem(result, random_next(&random_state) % k, entry);
+        w *= exp(log(random_double(&random_state)) / k);
+    }
+    Journal___unlock(self);
+
+    Journal___projection_free(proj);
+    if (r < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+/* Sketches summarise values of a field in memory fixed by their size,
+ * however many distinct values there are:
+ *   distinct   HyperLogLog of 2^precision one byte registers
+ *   frequency  Count-Min of depth rows of width counters
+ *   top_k      Space-Saving of k counters, each with its value, kept in
+ *              a min-heap by count and found by an open addressed table
+ * Sketches of the same kind, field and size may be merged. They do not
+ * require the GIL, other than when converted to python objects. */
+enum {
+    SKETCH_DISTINCT,
+    SKETCH_FREQUENCY,
+    SKETCH_TOP_K,
+};
+
+#define SKETCH_DEFAULT_PRECISION 14
+#define SKETCH_DEFAULT_WIDTH     2048
+#define SKETCH_DEFAULT_DEPTH     5
+#define SKETCH_DEFAULT_K         100
+
+typedef struct {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    uint64_t count;
+    uint64_t error;
+    size_t heap_pos;
+} sketch_counter;
+
+typedef struct {
+    int kind;
+    unsigned int precision;
+    size_t width, depth, k;
+    uint64_t total;
+    uint8_t *registers;
+    uint64_t *counts;
+    sketch_counter *counters;
+    size_t n_counters;
+    size_t *heap;
+    ssize_t *table;
+    size_t table_size;
+} sketch;
+
+/* Allocates `s` with the kind and size already set */
+static int
+sketch_init(sketch *s)
+{
+    size_t i;
+
+    s->total = 0;
+    s->n_counters = 0;
+    switch (s->kind) {
+    case SKETCH_DISTINCT:
+        s->registers = PyMem_RawCalloc((size_t) 1 << s->precision, 1);
+        return s->registers ? 0 : -ENOMEM;
+    case SKETCH_FREQUENCY:
+        s->counts = PyMem_RawCalloc(s->width * s->depth, sizeof(uint64_t));
+        return s->counts ? 0 : -ENOMEM;
+    default:
+        for (s->table_size = 16; s->table_size < 2 * s->k; s->table_size <<= 1);
+        s->counters = PyMem_RawCalloc(s->k, sizeof(sketch_counter));
+        s->heap = PyMem_RawMalloc(s->k * sizeof(size_t));
+        s->table = PyMem_RawMalloc(s->table_size * sizeof(ssize_t));
+        if (s->counters == NULL || s->heap == NULL || s->table == NULL)
+            return -ENOMEM;
+        for (i = 0; i < s->table_size; i++)
+            s->table[i] = -1;
+        return 0;
+    }
+}
+
+static void
+sketch_free(sketch *s)
+{
+    size_t i;
+    for (i = 0; s->counters && i < s->n_counters; i++)
+        PyMem_RawFree(s->counters[i].key);
+    PyMem_RawFree(s->registers);
+    PyMem_RawFree(s->counts);
+    PyMem_RawFree(s->counters);
+    PyMem_RawFree(s->heap);
+    PyMem_RawFree(s->table);
+    s->registers = NULL;
+    s->counts = NULL;
+    s->counters = NULL;
+    s->heap = NULL;
+    s->table = NULL;
+    s->n_counters = 0;
+}
+
+/* Returns slot of table holding counter of `key`, or the empty slot
+ * where it would be inserted */
+static size_t
+sketch_table_slot(const sketch *s, const char *key, size_t key_len, uint64_t hash)
+{
+    size_t mask = s->table_size - 1, i = hash & mask;
+    const sketch_counter *c;
+
+    while (s->table[i] >= 0) {
+        c = &s->counters[s->table[i]];
+        if (c->hash == hash && c->key_len == key_len && memcmp(c->key, key, key_len) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Removes counter from the table, shifting back those after it so that
+ * linear probing needs no tombstones */
+static void
+sketch_table_remove(sketch *s, const sketch_counter *c)
+{
+    size_t mask = s->table_size - 1, i, j, home;
+
+    i = sketch_table_slot(s, c->key, c->key_len, c->hash);
+    j = i;
+    for (;;) {
+        s->table[i] = -1;
+        do {
+            j = (j + 1) & mask;
+            if (s->table[j] < 0)
+                return;
+            home = s->counters[s->table[j]].hash & mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        s->table[i] = s->table[j];
+        i = j;
+    }
+}
+
+static void
+sketch_heap_swap(sketch *s, size_t a, size_t b)
+{
+    size_t t = s->heap[a];
+    s->heap[a] = s->heap[b];
+    s->heap[b] = t;
+    s->counters[s->heap[a]].heap_pos = a;
+    s->counters[s->heap[b]].heap_pos = b;
+}
+
+/* Restores the heap after the count at `pos` increased */
+static void
+sketch_heap_down(sketch *s, size_t pos)
+{
+    size_t child;
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= s->n_counters)
+            return;
+        if (child + 1 < s->n_counters &&
+            s->counters[s->heap[child + 1]].count < s->counters[s->heap[child]].count)
+            child++;
+        if (s->counters[s->heap[pos]].count <= s->counters[s->heap[child]].count)
+            return;
+        sketch_heap_swap(s, pos, child);
+        pos = child;
+    }
+}
+
+/* Smallest count of a full top_k sketch, being the most any value not
+ * counted may have occurred, or 0 */
+static uint64_t
+sketch_min_count(const sketch *s)
+{
+    return s->n_counters == s->k ? s->counters[s->heap[0]].count : 0;
+}
+
+/* Restores the heap after a counter was added at `pos` */
+static void
+sketch_heap_up(sketch *s, size_t pos)
+{
+    while (pos > 0 && s->counters[s->heap[(pos - 1) / 2]].count > s->counters[s->heap[pos]].count) {
+        sketch_heap_swap(s, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+/* Counts `key`, replacing the least counted value if not counted and
+ * the sketch is full */
+static int
+sketch_count(sketch *s, const char *key, size_t key_len, uint64_t hash, uint64_t count, uint64_t error)
+{
+    sketch_counter *c;
+    size_t slot, pos;
+    char *copy;
+
+    slot = sketch_table_slot(s, key, key_len, hash);
+    if (s->table[slot] >= 0) {
+        c = &s->counters[s->table[slot]];
+        c->count += count;
+        c->error += error;
+        sketch_heap_down(s, c->heap_pos);
+        return 0;
+    }
+    copy = PyMem_RawMalloc(key_len ? key_len : 1);
+    if (copy == NULL)
+        return -ENOMEM;
+    memcpy(copy, key, key_len);
+    if (s->n_counters < s->k) {
+        pos = s->n_counters++;
+        c = &s->counters[pos];
+        s->heap[pos] = pos;
+        c->heap_pos = pos;
+        c->count = count;
+        c->error = error;
+    }else{
+        c = &s->counters[s->heap[0]];
+        sketch_table_remove(s, c);
+        slot = sketch_table_slot(s, key, key_len, hash);
+        PyMem_RawFree(c->key);
+        c->error = c->count + error;
+        c->count += count;
+    }
+    c->key = copy;
+    c->key_len = key_len;
+    c->hash = hash;
+    s->table[slot] = c - s->counters;
+    sketch_heap_up(s, c->heap_pos);
+    sketch_heap_down(s, c->heap_pos);
+    return 0;
+}
+
+static int
+sketch_add(sketch *s, const char *value, size_t len)
+{
+    uint64_t h1, h2, rank;
+    size_t i, col;
+
+    bloom_hashes(value, len, &h1, &h2);
+    s->total++;
+    switch (s->kind) {
+    case SKETCH_DISTINCT:
+        /* Register from the top bits, rank from the position of the
+         * first set bit of the rest, if any */
+        i = h2 >> (64 - s->precision);
+        rank = h2 << s->precision;
+        rank = rank ? (uint64_t) __builtin_clzll(rank) + 1 : 64 - s->precision + 1;
+        if (rank > 64 - s->precision)
+            rank = 64 - s->precision + 1;
+        if (s->registers[i] < rank)
+            s->registers[i] = rank;
+        return 0;
+    case SKETCH_FREQUENCY:
+        for (i = 0; i < s->depth; i++) {
+            col = (h1 + i * h2) % s->width;
+            s->counts[i * s->width + col]++;
+        }
+        return 0;
+    default:
+        return sketch_count(s, value, len, h1, 1, 0);
+    }
+}
+
+static double
+sketch_distinct(const sketch *s)
+{
+    size_t m = (size_t) 1 << s->precision, i, zeros = 0;
+    double sum = 0.0, alpha, estimate;
+
+    for (i = 0; i < m; i++) {
+        sum += ldexp(1.0, -s->registers[i]);
+        zeros += s->registers[i] == 0;
+    }
+    alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1.0 + 1.079 / m);
+    estimate = alpha * m * m / sum;
+    /* Linear counting is more accurate for small cardinalities; 64 bit
+     * hashes need no correction for large ones */
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log((double) m / zeros);
+    return estimate;
+}
+
+static uint64_t
+sketch_frequency(const sketch *s, const char *value, size_t len)
+{
+    uint64_t h1, h2, count, min = UINT64_MAX;
+    size_t i;
+
+    bloom_hashes(value, len, &h1, &h2);
+    for (i = 0; i < s->depth; i++) {
+        count = s->counts[i * s->width + (h1 + i * h2) % s->width];
+        if (count < min)
+            min = count;
+    }
+    return min;
+}
+
+static int
+sketch_counter_compare(const void *a, const void *b)
+{
+    const sketch_counter *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->error < y->error ? -1 : x->error > y->error;
+}
+
+/* Merges `src` into `dst`, which may be the same sketch. Counters of
+ * top_k sketches are combined, each value missing from a full sketch
+ * taking its smallest count as both count and error, and the k largest
+ * kept, as per mergeable summaries of Agarwal et al. */
+static int
+sketch_merge(sketch *dst, const sketch *src)
+{
+    sketch_counter *merged, *c;
+    uint64_t dst_min, src_min;
+    size_t i, n = 0, slot;
+
+    dst->total += src->total;
+    switch (dst->kind) {
+    case SKETCH_DISTINCT:
+        for (i = 0; i < ((size_t) 1 << dst->precision); i++) {
+            if (src->registers[i] > dst->registers[i])
+                dst->registers[i] = src->registers[i];
+        }
+        return 0;
+    case SKETCH_FREQUENCY:
+        if (dst == src) {
+            for (i = 0; i < dst->width * dst->depth; i++)
+                dst->counts[i] *= 2;
+        }else{
+            for (i = 0; i < dst->width * dst->depth; i++)
+                dst->counts[i] += src->counts[i];
+        }
+        return 0;
+    }
+
+    merged = PyMem_RawMalloc((dst->n_counters + src->n_counters) * sizeof(sketch_counter) + 1);
+    if (merged == NULL)
+        return -ENOMEM;
+    dst_min = sketch_min_count(dst);
+    src_min = sketch_min_count(src);
+    for (i = 0; i < dst->n_counters; i++) {
+        merged[n] = dst->counters[i];
+        slot = sketch_table_slot(src, merged[n].key, merged[n].key_len, merged[n].hash);
+        if (src->table[slot] >= 0) {
+            merged[n].count += src->counters[src->table[slot]].count;
+            merged[n].error += src->counters[src->table[slot]].error;
+        }else{
+            merged[n].count += src_min;
+            merged[n].error += src_min;
+        }
+        n++;
+    }
+    for (i = 0; dst != src && i < src->n_counters; i++) {
+        c = &src->counters[i];
+        if (dst->table[sketch_table_slot(dst, c->key, c->key_len, c->hash)] >= 0)
+            continue;
+        merged[n] = *c;
+        merged[n].key = PyMem_RawMalloc(c->key_len ? c->key_len : 1);
+        if (merged[n].key == NULL) {
+            while (n-- > dst->n_counters)
+                PyMem_RawFree(merged[n].key);
+            PyMem_RawFree(merged);
+            return -ENOMEM;
+        }
+        memcpy(merged[n].key, c->key, c->key_len);
+        merged[n].count += dst_min;
+        merged[n].error += dst_min;
+        n++;
+    }
+    qsort(merged, n, sizeof(sketch_counter), sketch_counter_compare);
+
+    /* Sorted by descending count, the kept counters are a valid heap in
+     * reverse order */
+    for (i = 0; i < dst->table_size; i++)
+        dst->table[i] = -1;
+    dst->n_counters = n < dst->k ? n : dst->k;
+    for (i = 0; i < dst->n_counters; i++) {
+        dst->counters[i] = merged[i];
+        dst->counters[i].heap_pos = dst->n_counters - 1 - i;
+        dst->heap[dst->n_counters - 1 - i] = i;
+        slot = sketch_table_slot(dst, merged[i].key, merged[i].key_len, merged[i].hash);
+        dst->table[slot] = i;
+    }
+    for (; i < n; i++)
+        PyMem_RawFree(merged[i].key);
+    PyMem_RawFree(merged);
+    return 0;
+}
+
+typedef struct {
+    PyObject_HEAD
+    journal_lock_t lock;
+    Journal *journal;
+    PyObject *field;
+    sketch sketch;
+} JournalSketch;
+
+PyDoc_STRVAR(JournalSketch__doc__,
+"Sketch of values of a field, returned by Journal.parallel_scan() with\n"
+"a \"distinct\", \"frequency\" or \"top_k\" aggregate. Memory used is fixed\n"
+"by its size. Attribute `total` is the number of values counted, and\n"
+"`error` the bound on error of its estimates:\n"
+"  distinct   standard error of estimate() relative to the true number,\n"
+"             1.04 / sqrt(2 ** precision)\n"
+"  frequency  most count() overestimates by, e * total / width, with\n"
+"             probability 1 - exp(-depth); it never underestimates\n"
+"  top_k      most any count of top() or count() overestimates by,\n"
+"             total / k; each value occurring more than that is in top()\n"
+"Values are converted as per call_dict of the Journal scanned.");
+
+static int
+JournalSketch_traverse(JournalSketch *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->journal);
+    Py_VISIT(self->field);
+    return 0;
+}
+
+static int
+JournalSketch_clear(JournalSketch *self)
+{
+    Py_CLEAR(self->journal);
+    Py_CLEAR(self->field);
+    return 0;
+}
+
+static void
+JournalSketch_dealloc(JournalSketch *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    JournalSketch_clear(self);
+    sketch_free(&self->sketch);
+    lock_free(&self->lock);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+/* Takes ownership of the allocations of `s` */
+static PyObject *
+JournalSketch___new(Journal *journal, PyObject *field, sketch *s)
+{
+    pyjournalctl_state *state;
+    JournalSketch *self;
+
+    state = get_state_by_type(Py_TYPE(journal));
+    if (state == NULL)
+        return NULL;
+    self = PyObject_GC_New(JournalSketch, state->JournalSketchType);
+    if (self == NULL)
+        return NULL;
+    if (lock_init(&self->lock) < 0) {
+        self->journal = NULL;
+        self->field = NULL;
+        memset(&self->sketch, 0, sizeof(sketch));
+        Py_DECREF(self);
+        return NULL;
+    }
+    Py_INCREF(journal);
+    Py_INCREF(field);
+    self->journal = journal;
+    self->field = field;
+    self->sketch = *s;
+    memset(s, 0, sizeof(sketch));
+    PyObject_GC_Track(self);
+    return (PyObject *) self;
+}
+
+PyDoc_STRVAR(JournalSketch_estimate__doc__,
+"estimate() -> int\n\n"
+"Return estimated number of distinct values of a \"distinct\" sketch.");
+static PyObject *
+JournalSketch_estimate(JournalSketch *self, PyObject *args)
+{
+    double estimate;
+
+    if (self->sketch.kind != SKETCH_DISTINCT) {
+        PyErr_SetString(PyExc_ValueError, "Only distinct sketches have an estimate");
+        return NULL;
+    }
+    lock_acquire(&self->lock);
+    estimate = sketch_distinct(&self->sketch);
+    lock_release(&self->lock);
+    return PyLong_FromUnsignedLongLong((unsigned long long) llround(estimate));
+}
+
+PyDoc_STRVAR(JournalSketch_count__doc__,
+"count(value) -> int\n\n"
+"Return estimated number of times `value`, as bytes or string, occurred\n"
+"in a \"frequency\" or \"top_k\" sketch. For values not in top() of a\n"
+"\"top_k\" sketch, this is the most the value may have occurred.");
+static PyObject *
+JournalSketch_count(JournalSketch *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"value", NULL};
+    PyObject *arg;
+    const char *value;
+    Py_ssize_t len;
+    uint64_t count, h1, h2;
+    size_t slot;
+
+    if (unpack_fastcall("count", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if (self->sketch.kind == SKETCH_DISTINCT) {
+        PyErr_SetString(PyExc_ValueError, "Distinct sketches do not count values");
+        return NULL;
+    }
+    if (Journal___as_match_string(arg, &value, &len) < 0)
+        return NULL;
+
+    lock_acquire(&self->lock);
+    if (self->sketch.kind == SKETCH_FREQUENCY) {
+        count = sketch_frequency(&self->sketch, value, len);
+    }else{
+        bloom_hashes(value, len, &h1, &h2);
+        slot = sketch_table_slot(&self->sketch, value, len, h1);
+        if (self->sketch.table[slot] >= 0)
+            count = self->sketch.counters[self->sketch.table[slot]].count;
+        else
+            count = sketch_min_count(&self->sketch);
+    }
+    lock_release(&self->lock);
+    return PyLong_FromUnsignedLongLong(count);
+}
+
+PyDoc_STRVAR(JournalSketch_top__doc__,
+"top([n]) -> list\n\n"
+"Return list of up to `n`, default all, (value, count, error) tuples of\n"
+"a \"top_k\" sketch by descending count, where the true number of times\n"
+"value occurred is between count - error and count.");
+static PyObject *
+JournalSketch_top(JournalSketch *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"n", NULL};
+    PyObject *arg=NULL, *result=NULL, *item, *value;
+    sketch_counter *counters;
+    int64_t n = -1;
+    size_t i, count, copied = 0;
+
+    if (unpack_fastcall("top", args, nargs, NULL, kwlist, 0, &arg) < 0)
+        return NULL;
+    if (arg && arg != Py_None && as_int64(arg, &n) < 0)
+        return NULL;
+    if (self->sketch.kind != SKETCH_TOP_K) {
+        PyErr_SetString(PyExc_ValueError, "Only top_k sketches have top values");
+        return NULL;
+    }
+
+    /* Copied, as converting values may run arbitrary code */
+    lock_acquire(&self->lock);
+    count = self->sketch.n_counters;
+    counters = PyMem_Malloc(count * sizeof(sketch_counter) + 1);
+    for (; counters && copied < count; copied++) {
+        counters[copied] = self->sketch.counters[copied];
+        counters[copied].key = PyMem_Malloc(counters[copied].key_len + 1);
+        if (counters[copied].key == NULL)
+            break;
+        memcpy(counters[copied].key, self->sketch.counters[copied].key, counters[copied].key_len);
+    }
+    lock_release(&self->lock);
+    if (counters == NULL || copied < count) {
+        PyErr_NoMemory();
+        goto finish;
+    }
+
+    qsort(counters, count, sizeof(sketch_counter), sketch_counter_compare);
+    if (n >= 0 && (size_t) n < count)
+        count = n;
+    result = PyList_New(count);
+    for (i = 0; result && i < count; i++) {
+        value = Journal___process_field(self->journal, self->field, counters[i].key, counters[i].key_len);
+        item = value ? Py_BuildValue("(NKK)", value, (unsigned long long) counters[i].count,
+                                     (unsigned long long) counters[i].error) : NULL;
+        if (item == NULL)
+            Py_CLEAR(result);
+        else
+            PyList_SET_ITEM(result, i, item);
+    }
+
+finish:
+    for (i = 0; i < copied; i++)
+        PyMem_Free(counters[i].key);
+    PyMem_Free(counters);
+    return result;
+}
+
+PyDoc_STRVAR(JournalSketch_merge__doc__,
+"merge(other) -> None\n\n"
+"Merge sketch `other`, of the same kind, field and size, into this one,\n"
+"such as from a scan of another Journal or time range. Estimates are\n"
+"then of values counted by either, with error bounds as per their\n"
+"combined total.");
+static PyObject *
+JournalSketch_merge(JournalSketch *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"other", NULL};
+    JournalSketch *other, *first, *second;
+    PyObject *arg;
+    int r;
+
+    if (unpack_fastcall("merge", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if (!PyObject_TypeCheck(arg, Py_TYPE(self))) {
+        PyErr_SetString(PyExc_TypeError, "other must be a JournalSketch");
+        return NULL;
+    }
+    other = (JournalSketch *) arg;
+    r = PyObject_RichCompareBool(self->field, other->field, Py_EQ);
+    if (r < 0)
+        return NULL;
+    if (!r || self->sketch.kind != other->sketch.kind ||
+        self->sketch.precision != other->sketch.precision || self->sketch.width != other->sketch.width ||
+        self->sketch.depth != other->sketch.depth || self->sketch.k != other->sketch.k) {
+        PyErr_SetString(PyExc_ValueError, "Sketches must be of the same kind, field and size");
+        return NULL;
+    }
+
+    /* Locked in address order, so merges either way cannot deadlock */
+    first = self < other ? self : other;
+    second = self < other ? other : self;
+    lock_acquire(&first->lock);
+    if (second != first)
+        lock_acquire(&second->lock);
+    r = sketch_merge(&self->sketch, &other->sketch);
+    if (second != first)
+        lock_release(&second->lock);
+    lock_release(&first->lock);
+    if (r < 0)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+JournalSketch_get_kind(JournalSketch *self, void *closure)
+{
+    switch (self->sketch.kind) {
+    case SKETCH_DISTINCT:
+        return PyUnicode_FromString("distinct");
+    case SKETCH_FREQUENCY:
+        return PyUnicode_FromString("frequency");
+    default:
+        return PyUnicode_FromString("top_k");
+    }
+}
+
+static PyObject *
+JournalSketch_get_field(JournalSketch *self, void *closure)
+{
+    Py_INCREF(self->field);
+    return self->field;
+}
+
+static PyObject *
+JournalSketch_get_total(JournalSketch *self, void *closure)
+{
+    uint64_t total;
+    lock_acquire(&self->lock);
+    total = self->sketch.total;
+    lock_release(&self->lock);
+    return PyLong_FromUnsignedLongLong(total);
+}
+
+static PyObject *
+JournalSketch_get_error(JournalSketch *self, void *closure)
+{
+    double error;
+
+    lock_acquire(&self->lock);
+    switch (self->sketch.kind) {
+    case SKETCH_DISTINCT:
+        error = 1.04 / sqrt((double) ((size_t) 1 << self->sketch.precision));
+        break;
+    case SKETCH_FREQUENCY:
+        error = M_E * self->sketch.total / self->sketch.width;
+        break;
+    default:
+        error = (double) self->sketch.total / self->sketch.k;
+        break;
+    }
+    lock_release(&self->lock);
+    return PyFloat_FromDouble(error);
+}
+
+static PyMethodDef JournalSketch_methods[] = {
+    {"estimate", (PyCFunction)JournalSketch_estimate, METH_NOARGS,
+    JournalSketch_estimate__doc__},
+    {"count", (PyCFunction)(void(*)(void))JournalSketch_count, METH_FASTCALL,
+    JournalSketch_count__doc__},
+    {"top", (PyCFunction)(void(*)(void))JournalSketch_top, METH_FASTCALL,
+    JournalSketch_top__doc__},
+    {"merge", (PyCFunction)(void(*)(void))JournalSketch_merge, METH_FASTCALL,
+    JournalSketch_merge__doc__},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef JournalSketch_getseters[] = {
+    {"kind", (getter)JournalSketch_get_kind, NULL,
+    "\"distinct\", \"frequency\" or \"top_k\"", NULL},
+    {"field", (getter)JournalSketch_get_field, NULL,
+    "name of field sketched", NULL},
+    {"total", (getter)JournalSketch_get_total, NULL,
+    "number of values counted", NULL},
+    {"error", (getter)JournalSketch_get_error, NULL,
+    "bound on error of estimates", NULL},
+    {NULL}
+};
+
+static PyType_Slot JournalSketch_slots[] = {
+    {Py_tp_dealloc, JournalSketch_dealloc},
+    {Py_tp_traverse, JournalSketch_traverse},
+    {Py_tp_clear, JournalSketch_clear},
+    {Py_tp_doc, (void *)JournalSketch__doc__},
+    {Py_tp_methods, JournalSketch_methods},
+    {Py_tp_getset, JournalSketch_getseters},
+    {0, NULL}
+};
+
+static PyType_Spec JournalSketch_spec = {
+    "pyjournalctl.JournalSketch",
+    sizeof(JournalSketch),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    JournalSketch_slots,
+};
+
+/* Shards are planned from entries sampled at evenly spaced positions,
+ * with up to SHARD_WALK entries read from each to estimate its bucket.
+ * Positions are sequence numbers where the journal is of one sequence,
+ * so that buckets are of equal numbers of entries before matches, or
+ * otherwise realtime. */
+#define SHARD_BUCKETS_PER_SHARD 32
+#define SHARD_MAX_BUCKETS       65536
+#define SHARD_WALK              16
+
+typedef struct {
+    int by_seqnum;
+    sd_id128_t seqnum_id;
+} shard_space;
+
+typedef struct {
+    int valid;
+    PyJournalctl_Cursor cursor;
+} shard_sample;
+
+/* Position of an entry; those of another sequence are taken to be at
+ * `prev`, the position of the entry before */
+static uint64_t
+shard_position(const shard_space *space, const PyJournalctl_Cursor *cursor, uint64_t prev)
+{
+    if (!space->by_seqnum)
+        return cursor->realtime;
+    return sd_id128_equal(cursor->seqnum_id, space->seqnum_id) ? cursor->seqnum : prev;
+}
+
+/* Moves to the next entry passing the filter, unless reaching position
+ * `end` first, returning its position in `pos` */
+static int
+Journal___shard_next(Journal *self, sd_journal *j, const shard_space *space, uint64_t end,
+                     PyJournalctl_Cursor *cursor, uint64_t *pos)
+{
+    int r;
+    while ((r = sd_journal_next(j)) > 0) {
+        if ((r = cursor_get(NULL, j, cursor)) < 0)
+            return r;
+        if ((*pos = shard_position(space, cursor, *pos)) >= end)
+            return 0;
+        if (!self->filter || Journal___filter_test(self->filter, j, self->filter->results))
+            return 1;
+    }
+    return r;
+}
+
+/* Samples the first entry from position `x`, before `end` */
+static int
+Journal___shard_sample(Journal *self, sd_journal *j, const shard_space *space, uint64_t x,
+                       uint64_t end, shard_sample *sample)
+{
+    uint64_t pos = x;
+    char id[33], cursor[64];
+    int r;
+
+    sample->valid = 0;
+    if (space->by_seqnum) {
+        snprintf(cursor, sizeof(cursor), "s=%s;i=%" PRIx64,
+                 sd_id128_to_string(space->seqnum_id, id), x);
+        r = sd_journal_seek_cursor(j, cursor);
+    }else{
+        r = sd_journal_seek_realtime_usec(j, x);
+    }
+    if (r >= 0)
+        r = Journal___shard_next(self, j, space, end, &sample->cursor, &pos);
+    if (r > 0)
+        sample->valid = 1;
+    return r;
+}
+
+/* Estimates entries of the bucket from position `x` to `end`, counted up
+ * to SHARD_WALK and extrapolated beyond */
+static int
+Journal___shard_estimate(Journal *self, sd_journal *j, const shard_space *space, uint64_t x,
+                         uint64_t end, shard_sample *first, double *estimate)
+{
+    PyJournalctl_Cursor cursor;
+    uint64_t start, pos;
+    int count, r;
+
+    *estimate = 0.0;
+    r = Journal___shard_sample(self, j, space, x, end, first);
+    if (r <= 0)
+        return r;
+    start = pos = shard_position(space, &first->cursor, x);
+    for (count = 1; count <= SHARD_WALK; count++) {
+        r = Journal___shard_next(self, j, space, end, &cursor, &pos);
+        if (r <= 0)
+            break;
+    }
+    if (r < 0)
+        return r;
+    if (count <= SHARD_WALK)
+        *estimate = count;
+    else
+        *estimate = (double) SHARD_WALK * (end - start) / (pos > start ? pos - start : 1);
+    if (*estimate < count)
+        *estimate = count;
+    return 0;
+}
+
+static int Journal___walk_files(Journal *self, journal_file_func func, void *arg);
+
+/* Sequence of journal files, `several` if of more than one or a header
+ * cannot be read */
+typedef struct {
+    int n_files;
+    int several;
+    sd_id128_t seqnum_id;
+} shard_sequence;
+
+static void
+shard_sequence_file(const char *dir, int dir_fd, const char *name, void *arg)
+{
+    uint8_t header[JOURNAL_HEADER_MIN_SIZE];
+    shard_sequence *seq = arg;
+    sd_id128_t id;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header, "LPKSHHRH", 8) == 0) {
+        memcpy(id.bytes, header + 72, sizeof(id.bytes));
+        if (seq->n_files++ == 0)
+            seq->seqnum_id = id;
+        else if (!sd_id128_equal(id, seq->seqnum_id))
+            seq->several = 1;
+    }else{
+        seq->several = 1;
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Sets the positions from `since` to `until`, by sequence number if all
+ * journal files are of one sequence, as seeking by sequence number does
+ * not place files of others */
+static int
+Journal___shard_space(Journal *self, uint64_t since, uint64_t until, shard_space *space,
+                      uint64_t *lo, uint64_t *hi)
+{
+    shard_sample a={0}, b={0};
+    shard_sequence seq={0};
+    sd_journal *j=NULL;
+    int r;
+
+    space->by_seqnum = 0;
+    *lo = since;
+    *hi = until;
+    r = Journal___open_unfiltered(self, NULL, &j);
+    if (r < 0)
+        return r;
+    /* Samples are taken without matches or filter */
+    r = sd_journal_seek_realtime_usec(j, since);
+    if (r >= 0 && (r = sd_journal_next(j)) > 0 && (r = cursor_get(NULL, j, &a.cursor)) >= 0)
+        a.valid = 1;
+    if (r >= 0)
+        r = sd_journal_seek_realtime_usec(j, until);
+    if (r >= 0 && (r = sd_journal_next(j)) > 0 && (r = cursor_get(NULL, j, &b.cursor)) >= 0) {
+        b.valid = 1;
+    }else if (r == 0) {
+        /* Up to the end of the journal, just after the last entry */
+        r = sd_journal_seek_tail(j);
+        if (r >= 0 && (r = sd_journal_previous(j)) > 0 && (r = cursor_get(NULL, j, &b.cursor)) >= 0) {
+            b.cursor.seqnum++;
+            b.valid = 1;
+        }
+    }
+    sd_journal_close(j);
+    if (r >= 0 && a.valid && b.valid && sd_id128_equal(a.cursor.seqnum_id, b.cursor.seqnum_id) &&
+        a.cursor.seqnum < b.cursor.seqnum && a.cursor.realtime < until &&
+        Journal___walk_files(self, shard_sequence_file, &seq) == 0 && !seq.several &&
+        sd_id128_equal(seq.seqnum_id, a.cursor.seqnum_id)) {
+        space->by_seqnum = 1;
+        space->seqnum_id = a.cursor.seqnum_id;
+        *lo = a.cursor.seqnum;
+        *hi = b.cursor.seqnum;
+    }
+    return r < 0 ? r : 0;
+}
+
+/* Sets the start of each of `n` shards of entries from realtime `since`
+ * to `until` in `bounds`, and the end of the last in bounds[n], not valid
+ * where there are no entries from there, with the estimated number of
+ * entries in `total`. Does not require the GIL, but `self` must be
+ * locked. */
+static int
+Journal___shard_bounds(Journal *self, sd_journal *j, int64_t n, uint64_t since, uint64_t until,
+                       shard_sample *bounds, double *total)
+{
+    shard_sample *samples=NULL;
+    shard_space space={0}, time_space={0};
+    double *estimates=NULL, done=0.0;
+    uint64_t lo=0, hi=0, n_buckets=0, b;
+    int64_t k;
+    int r = 0;
+
+    *total = 0.0;
+    if (until > since)
+        r = Journal___shard_space(self, since, until, &space, &lo, &hi);
+    if (r >= 0 && hi > lo) {
+        n_buckets = n * SHARD_BUCKETS_PER_SHARD;
+        if (n_buckets > hi - lo)
+            n_buckets = hi - lo;
+        samples = PyMem_RawCalloc(n_buckets, sizeof(shard_sample));
+        estimates = PyMem_RawCalloc(n_buckets, sizeof(double));
+        if (samples == NULL || estimates == NULL)
+            r = -ENOMEM;
+    }
+#define SHARD_POSITION(b) (lo + (uint64_t) ((double) (hi - lo) * (b) / n_buckets))
+    for (b = 0; r >= 0 && b < n_buckets; b++) {
+        r = Journal___shard_estimate(self, j, &space, SHARD_POSITION(b), SHARD_POSITION(b + 1),
+                                     &samples[b], &estimates[b]);
+        *total += estimates[b];
+    }
+
+    /* Start of each shard, at the entry reaching its share of the total */
+    for (b = 0, k = 0; r >= 0 && b < n_buckets && k < n; b++) {
+        uint64_t start, end = SHARD_POSITION(b + 1);
+        if (estimates[b] <= 0.0)
+            continue;
+        if (k == 0)
+            bounds[k++] = samples[b];
+        start = shard_position(&space, &samples[b].cursor, SHARD_POSITION(b));
+        while (r >= 0 && k < n && done + estimates[b] > *total * k / n) {
+            double offset = (*total * k / n - done) / estimates[b];
+            r = Journal___shard_sample(self, j, &space, start + (uint64_t) ((end - start) * offset),
+                                       UINT64_MAX, &bounds[k]);
+            k++;
+        }
+        done += estimates[b];
+    }
+#undef SHARD_POSITION
+    if (r >= 0)
+        r = Journal___shard_sample(self, j, &time_space, until > since ? until : since,
+                                   UINT64_MAX, &bounds[n]);
+    PyMem_RawFree(samples);
+    PyMem_RawFree(estimates);
+    return r;
+}
+
+/* Makes shards not started empty, and none start out of order */
+static void
+shard_order(shard_sample *bounds, int64_t n)
+{
+    int64_t k;
+
+    for (k = 0; k < n; k++) {
+        if (!bounds[k].valid)
+            bounds[k] = k > 0 ? bounds[k - 1] : bounds[n];
+        else if (k > 0 && cursor_compare(&bounds[k].cursor, &bounds[k - 1].cursor) < 0)
+            bounds[k] = bounds[k - 1];
+        if (bounds[n].valid && cursor_compare(&bounds[k].cursor, &bounds[n].cursor) > 0)
+            bounds[k] = bounds[n];
+    }
+}
+
+/* Parallel scans split the entries into slices between cursors planned
+ * as per plan_shards(), which worker threads take in turn, each with its
+ * own sd_journal handle. Slices are of positions, so entries of the time
+ * range are all found however their realtime is ordered. */
+enum {
+    SCAN_COUNT,
+    SCAN_COUNT_BY,
+    SCAN_MIN_TIMESTAMP,
+    SCAN_MAX_TIMESTAMP,
+    SCAN_SKETCH,
+    SCAN_CALL,
+};
+
+#define SCAN_SLICES_PER_WORKER 4
+
+typedef struct {
+    Journal *journal;
+    journal_filter *filter;
+    int aggregate;
+    const char *field;
+    size_t field_len;
+    PyObject *field_obj;
+    sketch sketch;
+    PyObject *func;
+    PyInterpreterState *interp;
+    uint64_t since, until, n_slices;
+    int from_head;
+    shard_sample *bounds;
+    char **cursors;
+    atomic_uint_fast64_t next_slice;
+    atomic_int failed;
+    PyObject **slice_results;
+} parallel_scan;
+
+typedef struct {
+    parallel_scan *scan;
+    sd_journal *j;
+    pthread_t thread;
+    int started;
+    int r;
+    uint64_t count, min, max;
+    hashtable counts;
+    sketch sketch;
+    PyObject *error;
+} parallel_worker;
+
+/* Calls scan function on the current entry. Called with GIL */
+static int
+Journal___scan_call(parallel_worker *worker, sd_journal *j, uint64_t slice)
+{
+    parallel_scan *scan = worker->scan;
+    PyObject *entry, *value, **results = &scan->slice_results[slice];
+    int r = 0;
+
+    entry = Journal___get_entry(scan->journal, j, NULL);
+    if (entry == NULL)
+        return -1;
+    value = PyObject_CallOneArg(scan->func, entry);
+    Py_DECREF(entry);
+    if (value == NULL)
+        return -1;
+    if (value != Py_None) {
+        if (*results == NULL && (*results = PyList_New(0)) == NULL)
+            r = -1;
+        else
+            r = PyList_Append(*results, value);
+    }
+    Py_DECREF(value);
+    return r;
+}
+
+static void *
+Journal___scan_worker(void *arg)
+{
+    parallel_worker *worker = arg;
+    parallel_scan *scan = worker->scan;
+    journal_filter *filter = scan->filter;
+    unsigned char *results=NULL;
+    PyThreadState *tstate=NULL;
+    sd_journal *j = worker->j;
+    PyJournalctl_Cursor cursor;
+    uint64_t slice, t;
+    const void *data;
+    size_t len;
+    int r = 0;
+
+    if (filter && (results = PyMem_RawMalloc(filter->n_leaves ? filter->n_leaves : 1)) == NULL)
+        r = -ENOMEM;
+    if (r >= 0 && scan->aggregate == SCAN_COUNT_BY)
+        r = hashtable_init(&worker->counts, 0);
+    if (r >= 0 && scan->aggregate == SCAN_SKETCH) {
+        worker->sketch = scan->sketch;
+        r = sketch_init(&worker->sketch);
+    }
+    if (r >= 0 && scan->aggregate == SCAN_CALL && (tstate = PyThreadState_New(scan->interp)) == NULL)
+        r = -ENOMEM;
+
+    while (r >= 0 && !atomic_load(&scan->failed)) {
+        slice = atomic_fetch_add(&scan->next_slice, 1);
+        if (slice >= scan->n_slices)
+            break;
+        const shard_sample *start = &scan->bounds[slice], *end = &scan->bounds[slice + 1];
+
+        /* Slices not started are empty, but for the first from the head */
+        if (start->valid ? end->valid && cursor_compare(&start->cursor, &end->cursor) >= 0
+                         : slice > 0 || !scan->from_head)
+            continue;
+        r = start->valid ? sd_journal_seek_cursor(j, scan->cursors[slice]) : sd_journal_seek_head(j);
+        while (r >= 0 && !atomic_load(&scan->failed)) {
+            r = sd_journal_next(j);
+            if (r <= 0)
+                break;
+            r = sd_journal_get_realtime_usec(j, &t);
+            if (r < 0)
+                break;
+            /* Handles were all opened before planning, so the slice ends
+             * at the entry starting the next, which is only looked for
+             * among those of its time */
+            if (end->valid && t == end->cursor.realtime) {
+                r = cursor_get(NULL, j, &cursor);
+                if (r < 0 || cursor_compare(&cursor, &end->cursor) >= 0)
+                    break;
+            }
+            if (t < scan->since || t >= scan->until || (filter && !Journal___filter_test(filter, j, results)))
+                continue;
+
+            switch (scan->aggregate) {
+            case SCAN_COUNT:
+                worker->count++;
+                break;
+            case SCAN_COUNT_BY:
+                if (sd_journal_get_data(j, scan->field, &data, &len) < 0)
+                    break;
+                if (len > scan->field_len) {
+                    const char *value = (const char *) data + scan->field_len + 1;
+                    size_t value_len = len - scan->field_len - 1;
+                    hashtable_entry *e = hashtable_insert(&worker->counts, value, value_len,
+                                                          hash_bytes(value, value_len));
+                    if (e == NULL)
+                        r = -ENOMEM;
+                    else
+                        e->count++;
+                }
+                break;
+            case SCAN_SKETCH:
+                if (sd_journal_get_data(j, scan->field, &data, &len) < 0)
+                    break;
+                if (len > scan->field_len)
+                    r = sketch_add(&worker->sketch, (const char *) data + scan->field_len + 1,
+                                   len - scan->field_len - 1);
+                break;
+            case SCAN_MIN_TIMESTAMP:
+            case SCAN_MAX_TIMESTAMP:
+                if (worker->count == 0 || t < worker->min)
+                    worker->min = t;
+                if (worker->count == 0 || t > worker->max)
+                    worker->max = t;
+                worker->count++;
+                break;
+            case SCAN_CALL:
+                PyEval_AcquireThread(tstate);
+                if (Journal___scan_call(worker, j, slice) < 0) {
+#if PY_VERSION_HEX >= 0x030C0000
+                    worker->error = PyErr_GetRaisedException();
+#else
+                    PyObject *type, *traceback;
+                    PyErr_Fetch(&type, &worker->error, &traceback);
+                    PyErr_NormalizeException(&type, &worker->error, &traceback);
+                    if (worker->error && traceback)
+                        PyException_SetTraceback(worker->error, traceback);
+                    Py_XDECREF(type);
+                    Py_XDECREF(traceback);
+#endif
+                    r = -ECANCELED;
+                }
+                PyEval_ReleaseThread(tstate);
+                break;
+            }
+        }
+        if (r > 0)
+            r = 0;
+    }
+
+    if (r < 0)
+        atomic_store(&scan->failed, 1);
+    worker->r = r;
+    if (tstate) {
+        PyEval_AcquireThread(tstate);
+        PyThreadState_Clear(tstate);
+        PyThreadState_DeleteCurrent();
+    }
+    PyMem_RawFree(results);
+    return NULL;
+}
+
+/* Reduces worker results into a python object */
+static PyObject *
+Journal___scan_reduce(parallel_scan *scan, parallel_worker *workers, int n_workers)
+{
+    Journal *self = scan->journal;
+    PyObject *result=NULL, *key=NULL, *value, *count;
+    uint64_t total = 0, min = 0, max = 0, i;
+    int k, found = 0;
+    char str[21];
+
+    switch (scan->aggregate) {
+    case SCAN_COUNT:
+        for (k = 0; k < n_workers; k++)
+            total += workers[k].count;
+        return PyLong_FromUnsignedLongLong(total);
+    case SCAN_MIN_TIMESTAMP:
+    case SCAN_MAX_TIMESTAMP:
+        for (k = 0; k < n_workers; k++) {
+            if (workers[k].count == 0)
+                continue;
+            if (!found || workers[k].min < min)
+                min = workers[k].min;
+            if (!found || workers[k].max > max)
+                max = workers[k].max;
+            found = 1;
+        }
+        if (!found)
+            Py_RETURN_NONE;
+        key = PyUnicode_FromString("__REALTIME_TIMESTAMP");
+        if (key == NULL)
+            return NULL;
+        sprintf(str, "%llu", (long long unsigned) (scan->aggregate == SCAN_MIN_TIMESTAMP ? min : max));
+        result = Journal___process_field(self, key, str, strlen(str));
+        Py_DECREF(key);
+        return result;
+    case SCAN_COUNT_BY:
+        /* Merge into the first worker's table */
+        for (k = 1; k < n_workers; k++) {
+            for (i = 0; i < workers[k].counts.size; i++) {
+                hashtable_entry *e = &workers[k].counts.entries[i], *m;
+                if (e->key == NULL)
+                    continue;
+                m = hashtable_insert(&workers[0].counts, e->key, e->key_len, e->hash);
+                if (m == NULL)
+                    return PyErr_NoMemory();
+                m->count += e->count;
+            }
+        }
+        result = PyDict_New();
+        key = PyUnicode_FromStringAndSize(scan->field, scan->field_len);
+        if (result == NULL || key == NULL)
+            goto error;
+        for (i = 0; i < workers[0].counts.size; i++) {
+            hashtable_entry *e = &workers[0].counts.entries[i];
+            if (e->key == NULL)
+                continue;
+            value = Journal___process_field(self, key, e->key, e->key_len);
+            count = PyLong_FromUnsignedLongLong(e->count);
+            if (count == NULL || PyDict_SetItem(result, value, count) < 0) {
+                Py_DECREF(value);
+                Py_XDECREF(count);
+                goto error;
+            }
+            Py_DECREF(value);
+            Py_DECREF(count);
+        }
+        Py_DECREF(key);
+        return result;
+    case SCAN_SKETCH:
+        if (n_workers == 0) {
+            sketch empty = scan->sketch;
+            if (sketch_init(&empty) < 0) {
+                sketch_free(&empty);
+                return PyErr_NoMemory();
+            }
+            result = JournalSketch___new(self, scan->field_obj, &empty);
+            sketch_free(&empty);
+            return result;
+        }
+        for (k = 1; k < n_workers; k++) {
+            if (sketch_merge(&workers[0].sketch, &workers[k].sketch) < 0)
+                return PyErr_NoMemory();
+        }
+        return JournalSketch___new(self, scan->field_obj, &workers[0].sketch);
+    default:
+        result = PyList_New(0);
+        if (result == NULL)
+            return NULL;
+        for (i = 0; i < scan->n_slices; i++) {
+            PyObject *slice = scan->slice_results[i];
+            if (slice && PyList_SetSlice(result, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX, slice) < 0)
+                goto error;
+        }
+        return result;
+    }
+
+error:
+    Py_XDECREF(result);
+    Py_XDECREF(key);
+    return NULL;
+}
+
+/* Parses ("distinct", FIELD[, precision]), ("frequency", FIELD[, width
+ * [, depth]]) or ("top_k", FIELD[, k]) aggregate */
+static int
+Journal___scan_sketch(parallel_scan *scan, PyObject *aggregate)
+{
+    static const char * const names[] = {"distinct", "frequency", "top_k"};
+    static const Py_ssize_t max_sizes[] = {3, 4, 3};
+    PyObject *name = PyTuple_GET_ITEM(aggregate, 0);
+    Py_ssize_t n = PyTuple_GET_SIZE(aggregate), field_len;
+    int64_t sizes[2] = {0, 0};
+    int kind, i;
+
+    for (kind = 0; kind < 3 && PyUnicode_CompareWithASCIIString(name, names[kind]) != 0; kind++);
+    if (kind == 3 || n > max_sizes[kind]) {
+        PyErr_SetString(PyExc_ValueError, "Unknown aggregate");
+        return -1;
+    }
+    scan->field_obj = PyTuple_GET_ITEM(aggregate, 1);
+    if (!PyUnicode_Check(scan->field_obj) ||
+        (scan->field = PyUnicode_AsUTF8AndSize(scan->field_obj, &field_len)) == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_Format(PyExc_TypeError, "%s field must be a string", names[kind]);
+        return -1;
+    }
+    scan->field_len = field_len;
+    for (i = 2; i < n; i++) {
+        if (as_int64(PyTuple_GET_ITEM(aggregate, i), &sizes[i - 2]) < 0)
+            return -1;
+    }
+
+    scan->aggregate = SCAN_SKETCH;
+    scan->sketch.kind = kind;
+    switch (kind) {
+    case SKETCH_DISTINCT:
+        scan->sketch.precision = n > 2 ? sizes[0] : SKETCH_DEFAULT_PRECISION;
+        if (n > 2 && (sizes[0] < 4 || sizes[0] > 18)) {
+            PyErr_SetString(PyExc_ValueError, "Precision must be between 4 and 18");
+            return -1;
+        }
+        break;
+    case SKETCH_FREQUENCY:
+        scan->sketch.width = n > 2 ? sizes[0] : SKETCH_DEFAULT_WIDTH;
+        scan->sketch.depth = n > 3 ? sizes[1] : SKETCH_DEFAULT_DEPTH;
+        if ((n > 2 && (sizes[0] < 1 || sizes[0] > (1 << 24))) || (n > 3 && (sizes[1] < 1 || sizes[1] > 32))) {
+            PyErr_SetString(PyExc_ValueError, "Width must be between 1 and 2**24, and depth between 1 and 32");
+            return -1;
+        }
+        break;
+    case SKETCH_TOP_K:
+        scan->sketch.k = n > 2 ? sizes[0] : SKETCH_DEFAULT_K;
+        if (n > 2 && (sizes[0] < 1 || sizes[0] > (1 << 20))) {
+            PyErr_SetString(PyExc_ValueError, "K must be between 1 and 2**20");
+            return -1;
+        }
+        break;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(Journal_parallel_scan__doc__,
+"parallel_scan(aggregate[, since][, until][, workers]) -> object\n\n"
+"Scan log entries between realtime `since` and `until` across worker\n"
+"threads, each with its own journal handle opened with the same flags,\n"
+"path, matches and filter as this one. Entries from the position of\n"
+"`since` up to that of `until` are split into slices as per\n"
+"plan_shards(), taken in turn by the workers, and those with realtime\n"
+"in range are scanned. Arguments `since` and `until` are as per\n"
+"seek_realtime(), defaulting to the full journal whatever the order of\n"
+"times, and `until` is exclusive. Argument `workers` defaults to the\n"
+"number of CPUs. The journal is not locked while workers run.\n"
+"Argument `aggregate` is one of:\n"
+"  \"count\"             number of entries\n"
+"  (\"count_by\", FIELD) dictionary of counts by value of FIELD\n"
+"  \"min_timestamp\"     earliest __REALTIME_TIMESTAMP\n"
+"  \"max_timestamp\"     latest __REALTIME_TIMESTAMP\n"
+"  (\"distinct\", FIELD[, PRECISION])\n"
+"                      JournalSketch estimating number of distinct values\n"
+"                      of FIELD, in 2 ** PRECISION bytes, default 14\n"
+"  (\"frequency\", FIELD[, WIDTH[, DEPTH]])\n"
+"                      JournalSketch estimating counts by value of FIELD,\n"
+"                      in WIDTH * DEPTH counters, default 2048 * 5\n"
+"  (\"top_k\", FIELD[, K]) JournalSketch of most frequent values of FIELD,\n"
+"                      in K counters, default 100\n"
+"which are computed without the GIL, or a callable called with each\n"
+"entry, returning a list of the results other than None in time order.\n"
+"The current position of the journal is not changed.");
+static PyObject *
+Journal_parallel_scan(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"aggregate", "since", "until", "workers", NULL};
+    PyObject *argv[4] = {NULL, NULL, NULL, NULL};
+    PyObject *result=NULL, *field_obj=NULL;
+    parallel_scan scan;
+    parallel_worker *workers=NULL;
+    int64_t n_workers;
+    uint64_t since = 0, until = 0, from, to, i;
+    double total;
+    Py_ssize_t field_len;
+    int since_given, until_given, k, r = 0;
+
+    if (unpack_fastcall("parallel_scan", args, nargs, kwnames, kwlist, 1, argv) < 0)
+        return NULL;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.journal = self;
+    if (PyCallable_Check(argv[0])) {
+        scan.aggregate = SCAN_CALL;
+        scan.func = argv[0];
+        scan.interp = PyInterpreterState_Get();
+    }else if (PyUnicode_Check(argv[0]) && PyUnicode_CompareWithASCIIString(argv[0], "count") == 0) {
+        scan.aggregate = SCAN_COUNT;
+    }else if (PyUnicode_Check(argv[0]) && PyUnicode_CompareWithASCIIString(argv[0], "min_timestamp") == 0) {
+        scan.aggregate = SCAN_MIN_TIMESTAMP;
+    }else if (PyUnicode_Check(argv[0]) && PyUnicode_CompareWithASCIIString(argv[0], "max_timestamp") == 0) {
+        scan.aggregate = SCAN_MAX_TIMESTAMP;
+    }else if (PyTuple_Check(argv[0]) && PyTuple_GET_SIZE(argv[0]) == 2 &&
+              PyUnicode_Check(PyTuple_GET_ITEM(argv[0], 0)) &&
+              PyUnicode_CompareWithASCIIString(PyTuple_GET_ITEM(argv[0], 0), "count_by") == 0) {
+        scan.aggregate = SCAN_COUNT_BY;
+        field_obj = PyTuple_GET_ITEM(argv[0], 1);
+        if (!PyUnicode_Check(field_obj) ||
+            (scan.field = PyUnicode_AsUTF8AndSize(field_obj, &field_len)) == NULL) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "count_by field must be a string");
+            return NULL;
+        }
+        scan.field_len = field_len;
+    }else if (PyTuple_Check(argv[0]) && PyTuple_GET_SIZE(argv[0]) >= 2 &&
+              PyUnicode_Check(PyTuple_GET_ITEM(argv[0], 0))) {
+        if (Journal___scan_sketch(&scan, argv[0]) < 0)
+            return NULL;
+    }else{
+        PyErr_SetString(PyExc_ValueError, "Unknown aggregate");
+        return NULL;
+    }
+    if (argv[1] && argv[1] != Py_None && Journal___as_realtime(self, argv[1], &since) < 0)
+        return NULL;
+    if (argv[2] && argv[2] != Py_None && Journal___as_realtime(self, argv[2], &until) < 0)
+        return NULL;
+    if (argv[3] && argv[3] != Py_None) {
+        if (as_int64(argv[3], &n_workers) < 0)
+            return NULL;
+        if (n_workers < 1LL || n_workers > 1024LL) {
+            PyErr_SetString(PyExc_ValueError, "Workers must be between 1 and 1024");
+            return NULL;
+        }
+    }else{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = n > 0 ? n : 1;
+    }
+
+    since_given = argv[1] != NULL && argv[1] != Py_None;
+    until_given = argv[2] != NULL && argv[2] != Py_None;
+    scan.n_slices = n_workers * SCAN_SLICES_PER_WORKER;
+    if (scan.n_slices > SHARD_MAX_BUCKETS / SHARD_BUCKETS_PER_SHARD)
+        scan.n_slices = SHARD_MAX_BUCKETS / SHARD_BUCKETS_PER_SHARD;
+    if (n_workers > (int64_t) scan.n_slices)
+        n_workers = scan.n_slices;
+    workers = PyMem_Calloc(n_workers, sizeof(parallel_worker));
+    scan.bounds = PyMem_Calloc(scan.n_slices + 1, sizeof(shard_sample));
+    scan.cursors = PyMem_Calloc(scan.n_slices + 1, sizeof(char *));
+    if (scan.aggregate == SCAN_CALL)
+        scan.slice_results = PyMem_Calloc(scan.n_slices, sizeof(PyObject *));
+    if (workers == NULL || scan.bounds == NULL || scan.cursors == NULL ||
+        (scan.aggregate == SCAN_CALL && scan.slice_results == NULL)) {
+        PyErr_NoMemory();
+        goto finish;
+    }
+
+    /* Workers are given their handles, filter and slices up front, so that
+     * the journal is not locked while they run, and may be used by `func` */
+    if (Journal___lock(self) < 0)
+        goto finish;
+    if (self->filter) {
+        filter_node *root = filter_node_copy(self->filter->root);
+        if (root == NULL || (scan.filter = Journal___filter_add(NULL, root)) == NULL) {
+            Journal___unlock(self);
+            goto finish;
+        }
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (k = 0; r >= 0 && k < n_workers; k++)
+        r = Journal___open_copy(self, &workers[k].j);
+    if (r >= 0 && (!since_given || !until_given)) {
+        r = sd_journal_get_cutoff_realtime_usec(workers[0].j, &from, &to);
+        if (r > 0) {
+            if (!since_given)
+                since = from;
+            if (!until_given)
+                until = to + 1;
+        }else if (r == 0) {
+            until = since;
+        }
+    }
+    if (r >= 0 && until > since) {
+        r = Journal___shard_bounds(self, workers[0].j, scan.n_slices, since, until, scan.bounds, &total);
+        /* Without bounds, from the head or to the end */
+        if (!until_given)
+            scan.bounds[scan.n_slices].valid = 0;
+        shard_order(scan.bounds, scan.n_slices);
+        if (!since_given)
+            scan.bounds[0].valid = 0;
+        scan.from_head = !since_given;
+    }
+    for (i = 0; r >= 0 && i <= scan.n_slices; i++) {
+        if (scan.bounds[i].valid)
+            r = cursor_format(&scan.bounds[i].cursor, &scan.cursors[i]);
+    }
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        goto finish;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening journal");
+        goto finish;
+    }
+    if (until <= since) {
+        result = Journal___scan_reduce(&scan, NULL, 0);
+        goto finish;
+    }
+
+    /* Without bounds, whatever the times of entries */
+    scan.since = since_given ? since : 0;
+    scan.until = until_given ? until : UINT64_MAX;
+    r = 0;
+    Py_BEGIN_ALLOW_THREADS
+    for (k = 0; k < n_workers; k++) {
+        workers[k].scan = &scan;
+        if (pthread_create(&workers[k].thread, NULL, Journal___scan_worker, &workers[k]) != 0) {
+            atomic_store(&scan.failed, 1);
+            r = -EAGAIN;
+            break;
+        }
+        workers[k].started = 1;
+    }
+    for (k = 0; k < n_workers; k++) {
+        if (workers[k].started)
+            pthread_join(workers[k].thread, NULL);
+    }
+    Py_END_ALLOW_THREADS
+
+    PyObject *error=NULL;
+    for (k = 0; k < n_workers; k++) {
+        if (workers[k].error && error == NULL)
+            error = workers[k].error;
+        else
+            Py_XDECREF(workers[k].error);
+        if (workers[k].started && workers[k].r < 0 && (r >= 0 || r == -ECANCELED))
+            r = workers[k].r;
+    }
+    if (error) {
+#if PY_VERSION_HEX >= 0x030C0000
+        PyErr_SetRaisedException(error);
+#else
+        PyErr_SetObject((PyObject *) Py_TYPE(error), error);
+        Py_DECREF(error);
+#endif
+    }else if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error scanning journal");
+    }else{
+        result = Journal___scan_reduce(&scan, workers, n_workers);
+    }
+
+finish:
+    for (k = 0; workers && k < n_workers; k++) {
+        if (workers[k].j)
+            sd_journal_close(workers[k].j);
+        hashtable_free(&workers[k].counts);
+        sketch_free(&workers[k].sketch);
+    }
+    PyMem_Free(workers);
+    for (i = 0; scan.cursors && i <= scan.n_slices; i++)
+        free(scan.cursors[i]);
+    PyMem_Free(scan.cursors);
+    PyMem_Free(scan.bounds);
+    Journal___filter_free(scan.filter);
+    if (scan.slice_results) {
+        for (i = 0; i < scan.n_slices; i++)
+            Py_XDECREF(scan.slice_results[i]);
+        PyMem_Free(scan.slice_results);
+    }
+    return result;
+}
+
+PyDoc_STRVAR(Journal_plan_shards__doc__,
+"plan_shards(n[, since][, until]) -> list\n\n"
+"Split log entries between realtime `since` and `until` into `n`\n"
+"contiguous shards of roughly equal numbers of entries under the\n"
+"current matches and filter, for reading with range(). Returns a list\n"
+"of `n` (start_cursor, end_cursor, approx_count) tuples, where each\n"
+"end_cursor is the start_cursor of the next shard. The first\n"
+"start_cursor is None if `since` is not given, and the last end_cursor\n"
+"is None if `until` is not given or there are no entries from it, so\n"
+"that shards cover the journal from the head or to the end whatever the\n"
+"order of times. Shards may be empty, with equal start_cursor and\n"
+"end_cursor. Counts are estimated from entries sampled at evenly\n"
+"spaced sequence numbers, or times where the range spans several\n"
+"sequences, rather than read in full.\n"
+"Arguments `since` and `until` are as per parallel_scan(). The current\n"
+"position of the journal is not changed.");
+static PyObject *
+Journal_plan_shards(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"n", "since", "until", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    PyObject *result=NULL;
+    shard_sample *bounds=NULL;
+    double total=0.0;
+    char **cursors=NULL;
+    sd_journal *j=NULL;
+    uint64_t since=0, until=0, from, to;
+    int64_t n, k;
+    int r;
+
+    if (unpack_fastcall("plan_shards", args, nargs, kwnames, kwlist, 1, argv) < 0)
+        return NULL;
+    if (as_int64(argv[0], &n) < 0)
+        return NULL;
+    if (n < 1LL || n > SHARD_MAX_BUCKETS / SHARD_BUCKETS_PER_SHARD) {
+        PyErr_Format(PyExc_ValueError, "n must be between 1 and %d",
+                     SHARD_MAX_BUCKETS / SHARD_BUCKETS_PER_SHARD);
+        return NULL;
+    }
+    if (argv[1] && argv[1] != Py_None && Journal___as_realtime(self, argv[1], &since) < 0)
+        return NULL;
+    if (argv[2] && argv[2] != Py_None && Journal___as_realtime(self, argv[2], &until) < 0)
+        return NULL;
+
+    bounds = PyMem_Calloc(n + 1, sizeof(shard_sample));
+    cursors = PyMem_Calloc(n + 1, sizeof(char *));
+    if (bounds == NULL || cursors == NULL) {
+        PyErr_NoMemory();
+        goto finish;
+    }
+
+    if (Journal___lock(self) < 0)
+        goto finish;
+    Py_BEGIN_ALLOW_THREADS
+    r = Journal___open_copy(self, &j);
+    if (r >= 0)
+        r = sd_journal_get_cutoff_realtime_usec(j, &from, &to);
+    if (r > 0) {
+        if (argv[1] == NULL || argv[1] == Py_None)
+            since = from;
+        if (argv[2] == NULL || argv[2] == Py_None)
+            until = to + 1;
+    }else if (r == 0) {
+        until = since;
+    }
+    if (r >= 0)
+        r = Journal___shard_bounds(self, j, n, since, until, bounds, &total);
+    if (r >= 0 && !bounds[0].valid && !bounds[n].valid) {
+        /* No entries in range or after, so all shards are empty at the last */
+        r = sd_journal_seek_tail(j);
+        do {
+            r = r < 0 ? r : sd_journal_previous(j);
+        } while (r > 0 && self->filter && !Journal___filter_test(self->filter, j, self->filter->results));
+        if (r > 0 && (r = cursor_get(NULL, j, &bounds[n].cursor)) >= 0)
+            bounds[n].valid = 1;
+    }
+    if (r >= 0) {
+        /* Without bounds, from the head or to the end, as seeking across
+         * sequences by cursor may pass entries out of order */
+        if (argv[2] == NULL || argv[2] == Py_None)
+            bounds[n].valid = 0;
+        shard_order(bounds, n);
+        if (argv[1] == NULL || argv[1] == Py_None)
+            bounds[0].valid = 0;
+    }
+    for (k = 0; r >= 0 && k <= n; k++) {
+        if (bounds[k].valid)
+            r = cursor_format(&bounds[k].cursor, &cursors[k]);
+    }
+    if (j)
+        sd_journal_close(j);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        goto finish;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error sampling journal");
+        goto finish;
+    }
+    result = PyList_New(n);
+    for (k = 0; result && k < n; k++) {
+        uint64_t count = (uint64_t) llround(total * (k + 1) / n) - (uint64_t) llround(total * k / n);
+        PyObject *item = Py_BuildValue("(zzK)", cursors[k], cursors[k + 1], (unsigned long long) count);
+        if (item == NULL)
+            Py_CLEAR(result);
+        else
+            PyList_SET_ITEM(result, k, item);
+    }
+
+finish:
+    for (k = 0; cursors && k <= n; k++)
+        free(cursors[k]);
+    PyMem_Free(cursors);
+    PyMem_Free(bounds);
+    return result;
+}
+
+PyDoc_STRVAR(Journal_range__doc__,
+"range(start_cursor, end_cursor[, fields]) -> iterator\n\n"
+"Return iterator of log entries from the entry at `start_cursor`, or\n"
+"the head of the journal if None, up to but excluding entries from\n"
+"`end_cursor`, or to the end of the journal if None. Entries are those\n"
+"under the current matches and filter, such that the shards returned\n"
+"by plan_shards() are each read exactly once. Argument `fields` is as\n"
+"per entries(). Moving the iterator moves the position of the journal.");
+static PyObject *
+Journal_range(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"start_cursor", "end_cursor", "fields", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    JournalIterator *iter;
+    const char *start=NULL, *end=NULL;
+    PyJournalctl_Cursor stop;
+    int r;
+
+    if (unpack_fastcall("range", args, nargs, kwnames, kwlist, 2, argv) < 0)
+        return NULL;
+    if (argv[0] != Py_None && (start = as_cstring(argv[0])) == NULL)
+        return NULL;
+    if (argv[1] != Py_None && (end = as_cstring(argv[1])) == NULL)
+        return NULL;
+    if (end && cursor_parse(end, &stop) < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid end cursor");
+        return NULL;
+    }
+
+    iter = (JournalIterator *) Journal___new_iterator(self, 1LL, -1LL, argv[2]);
+    if (iter == NULL)
+        return NULL;
+    iter->has_stop = end != NULL;
+    if (end)
+        iter->stop = stop;
+
+    if (Journal___lock(self) < 0) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    if (Journal___seek_prepare(self) < 0) {
+        Journal___unlock(self);
+        Py_DECREF(iter);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = start ? sd_journal_seek_cursor(self->j, start) : sd_journal_seek_head(self->j);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+    if (r < 0) {
+        Py_DECREF(iter);
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking to start cursor");
+        return NULL;
+    }
+    return (PyObject *) iter;
+}
+
+PyDoc_STRVAR(Journal_update_index__doc__,
+"update_index(path) -> int\n\n"
+"Load the word index of MESSAGE stored at `path`, creating it if need\n"
+"be, and add the log entries since it was last updated, ignoring any\n"
+"matches and filter, then save it. The index is then used by search(),\n"
+"and entries appended later are added to it by wait(), to be saved by\n"
+"the next update_index(). Returns the number of entries added. The\n"
+"current position of the journal is not changed.");
+static PyObject *
+Journal_update_index(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"path", NULL};
+    PyObject *arg_path=NULL;
+    journal_index *index, *old=NULL;
+    sd_journal *j=NULL;
+    const char *path;
+    uint64_t added=0;
+    int r;
+
+    if (unpack_fastcall("update_index", args, nargs, NULL, kwlist, 1, &arg_path) < 0)
+        return NULL;
+    if ((path = as_cstring(arg_path)) == NULL)
+        return NULL;
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    index = self->index;
+    Py_BEGIN_ALLOW_THREADS
+    if (index == NULL || strcmp(index->path, path) != 0) {
+        index = PyMem_RawCalloc(1, sizeof(journal_index));
+        if (index == NULL || (index->path = PyMem_RawMalloc(strlen(path) + 1)) == NULL) {
+            r = -ENOMEM;
+        }else{
+            strcpy(index->path, path);
+            r = index_load(index, path);
+            if (r >= 0 && index->tokens.entries == NULL)
+                r = hashtable_init(&index->tokens, 0);
+        }
+    }else{
+        r = 0;
+    }
+    if (r >= 0 && index->j == NULL) {
+        r = Journal___open_unfiltered(self, NULL, &j);
+        if (r >= 0) {
+            sd_journal_get_fd(j);
+            index->j = j;
+        }
+    }else if (r >= 0) {
+        /* Picks up files added since */
+        r = sd_journal_process(index->j);
+    }
+    if (r >= 0)
+        r = index_update(index, index->j, &added);
+    if (r >= 0 && (added > 0 || index != self->index || index->unsaved))
+        r = index_save(index, path);
+    if (r >= 0)
+        index->unsaved = 0;
+    Py_END_ALLOW_THREADS
+
+    if (r >= 0 && index != self->index) {
+        old = self->index;
+        self->index = index;
+    }else if (r < 0 && index != self->index) {
+        old = index;
+    }
+    Journal___unlock(self);
+    journal_index_free(old);
+
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        return NULL;
+    }else if (r == -EBADMSG) {
+        PyErr_SetString(PyExc_ValueError, "Invalid index file");
+        return NULL;
+    }else if (r < 0) {
+        errno = -r;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(added);
+}
+
+PyDoc_STRVAR(Journal_search__doc__,
+"search(text[, limit][, fields]) -> list\n\n"
+"Return log entries whose MESSAGE contains `text`, ignoring ASCII case,\n"
+"where `text` starts and ends on word boundaries. Candidate entries\n"
+"are found from the words of `text` in the index loaded by\n"
+"update_index(), so entries appended since are only found once wait()\n"
+"has returned APPEND or INVALIDATE for them. Only entries\n"
+"passing the current matches and filter are returned, in journal\n"
+"order, up to `limit` if given. Argument `fields` is as per sample().\n"
+"The journal is left positioned on the last entry returned.");
+static PyObject *
+Journal_search(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"text", "limit", "fields", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    PyObject *result=NULL, *entry;
+    Journal_projection *proj=NULL;
+    journal_index *index;
+    index_query query;
+    const char *text;
+    Py_ssize_t text_len;
+    int64_t limit=-1LL;
+    uint32_t i;
+    size_t k;
+    int r=0;
+
+    if (unpack_fastcall("search", args, nargs, kwnames, kwlist, 1, argv) < 0)
+        return NULL;
+    if ((text = as_cstring(argv[0])) == NULL)
+        return NULL;
+    text_len = strlen(text);
+    if (argv[1] && argv[1] != Py_None) {
+        if (as_int64(argv[1], &limit) < 0)
+            return NULL;
+        if (limit < 0LL) {
+            PyErr_SetString(PyExc_ValueError, "Limit must be positive integer");
+            return NULL;
+        }
+    }
+    if (argv[2] && argv[2] != Py_None && (proj = Journal___projection_new(argv[2])) == NULL)
+        return NULL;
+
+    /* At most one word per two bytes of text */
+    query.postings = PyMem_Malloc((text_len / 2 + 1) * sizeof(index_postings *));
+    result = PyList_New(0);
+    if (query.postings == NULL || result == NULL) {
+        PyMem_Free(query.postings);
+        Py_XDECREF(result);
+        Journal___projection_free(proj);
+        return PyErr_NoMemory();
+    }
+    query.n = 0;
+
+    if (Journal___lock(self) < 0) {
+        PyMem_Free(query.postings);
+        Py_DECREF(result);
+        Journal___projection_free(proj);
+        return NULL;
+    }
+    index = self->index;
+    if (index == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "No index loaded, see update_index()");
+        r = -1;
+        goto finish;
+    }
+    query.index = index;
+    index_tokenize(text, text_len, index_query_token, &query);
+    if (query.n == 0) {
+        PyErr_SetString(PyExc_ValueError, "Text must contain a word");
+        r = -1;
+        goto finish;
+    }
+    /* Smallest postings first, so the others are only probed */
+    qsort(query.postings, query.n, sizeof(index_postings *), index_postings_compare);
+    if (query.postings[0] == NULL)
+        goto finish;
+
+    for (i = 0; i < query.postings[0]->n && (limit < 0 || PyList_GET_SIZE(result) < limit); i++) {
+        uint32_t n = query.postings[0]->items[i];
+        const index_entry *e = &index->entries[n];
+        char cursor[64], id[33];
+        const void *data;
+        size_t len;
+
+        for (k = 1; k < query.n && index_postings_contains(query.postings[k], n); k++);
+        if (k < query.n)
+            continue;
+
+        sd_id128_to_string(index->ids[e->id], id);
+        snprintf(cursor, sizeof(cursor), "s=%s;i=%" PRIx64, id, e->seqnum);
+        if (Journal___seek_prepare(self) < 0) {
+            r = -1;
+            break;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_seek_cursor(self->j, cursor);
+        if (r >= 0 && (r = sd_journal_next(self->j)) > 0)
+            r = sd_journal_test_cursor(self->j, cursor);
+        if (r > 0 && self->filter && !Journal___filter_test(self->filter, self->j, self->filter->results))
+            r = 0;
+        if (r > 0) {
+            r = sd_journal_get_data(self->j, "MESSAGE", &data, &len);
+            if (r == -ENOENT)
+                r = 0;
+            else if (r >= 0)
+                r = index_match_text((const char *) data + 8, len - 8, text, text_len);
+        }
+        Py_END_ALLOW_THREADS
+        if (r < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Error seeking to indexed entry");
+            break;
+        }
+        if (r == 0)
+            continue;
+        entry = Journal___get_entry(self, self->j, proj);
+        if (entry == NULL || PyList_Append(result, entry) < 0) {
+            Py_XDECREF(entry);
+            r = -1;
+            break;
+        }
+        Py_DECREF(entry);
+    }
+
+finish:
+    Journal___unlock(self);
+    PyMem_Free(query.postings);
+    Journal___projection_free(proj);
+    if (r < 0)
+        Py_CLEAR(result);
+    return result;
+}
+
+/* Continuous queries keep an aggregate of matching entries over a time
+ * window, in a ring of buckets each `step` usecs of realtime wide. The
+ * totals of the window are kept alongside, with buckets subtracted as
+ * they expire, so that values are read without a scan. Entries are
+ * taken from the tail handle as wait() returns. */
+#define CQ_DEFAULT_BUCKETS 60
+#define CQ_MAX_BUCKETS     65536
+
+enum {
+    CQ_COUNT,
+    CQ_COUNT_BY,
+    CQ_SUM,
+};
+
+typedef struct {
+    uint64_t index;
+    uint64_t count;
+    int64_t sum;
+    hashtable counts;
+} cq_bucket;
+
+struct continuous_query {
+    char *name;
+    int aggregate;
+    char *field;
+    size_t field_len;
+    journal_filter *filter;
+    uint64_t step;
+    uint64_t n_buckets;
+    cq_bucket *buckets;
+    uint64_t head;
+    uint64_t count;
+    int64_t sum;
+    hashtable counts;
+};
+
+static void
+continuous_query_free(continuous_query *q)
+{
+    uint64_t i;
+    if (q == NULL)
+        return;
+    for (i = 0; q->buckets && i < q->n_buckets; i++)
+        hashtable_free(&q->buckets[i].counts);
+    hashtable_free(&q->counts);
+    Journal___filter_free(q->filter);
+    PyMem_Free(q->buckets);
+    PyMem_Free(q->field);
+    PyMem_Free(q->name);
+    PyMem_Free(q);
+}
+
+static void
+continuous_free(journal_continuous *cq)
+{
+    size_t i;
+    for (i = 0; i < cq->n_queries; i++)
+        continuous_query_free(cq->queries[i]);
+    PyMem_Free(cq->queries);
+    if (cq->j)
+        sd_journal_close(cq->j);
+    lock_free(&cq->lock);
+}
+
+static continuous_query *
+continuous_find(journal_continuous *cq, const char *name, size_t *pos)
+{
+    size_t i;
+    for (i = 0; i < cq->n_queries; i++) {
+        if (strcmp(cq->queries[i]->name, name) == 0) {
+            if (pos)
+                *pos = i;
+            return cq->queries[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+cq_evict(continuous_query *q, cq_bucket *b)
+{
+    size_t k;
+
+    q->count -= b->count;
+    q->sum -= b->sum;
+    for (k = 0; k < b->counts.size; k++) {
+        const hashtable_entry *e = &b->counts.entries[k];
+        hashtable_entry *t;
+        if (e->key == NULL)
+            continue;
+        t = hashtable_find(&q->counts, e->key, e->key_len, e->hash);
+        if (t && (t->count -= e->count) == 0)
+            hashtable_remove(&q->counts, t);
+    }
+    hashtable_free(&b->counts);
+    b->count = 0;
+    b->sum = 0;
+}
+
+/* Moves the newest bucket of the window up to `index`, expiring those
+ * which fall out of it */
+static void
+cq_advance(continuous_query *q, uint64_t index)
+{
+    uint64_t i;
+
+    if (index <= q->head)
+        return;
+    i = index - q->head >= q->n_buckets ? index - q->n_buckets + 1 : q->head + 1;
+    for (; i <= index; i++) {
+        cq_bucket *b = &q->buckets[i % q->n_buckets];
+        cq_evict(q, b);
+        b->index = i;
+    }
+    q->head = index;
+}
+
+/* Adds the current entry of `j` if it matches. Does not require the GIL,
+ * but the continuous queries must be locked. */
+static int
+cq_add(continuous_query *q, sd_journal *j, uint64_t realtime)
+{
+    uint64_t index = realtime / q->step;
+    const void *data=NULL;
+    size_t len=0;
+    cq_bucket *b;
+    int r;
+
+    if (index + q->n_buckets <= q->head)
+        return 0;
+    if (q->filter && !Journal___filter_test(q->filter, j, q->filter->results))
+        return 0;
+    if (q->field) {
+        r = sd_journal_get_data(j, q->field, &data, &len);
+        if (r == -ENOENT)
+            return 0;
+        if (r < 0)
+            return r;
+        data = (const char *) data + q->field_len + 1;
+        len -= q->field_len + 1;
+    }
+
+    cq_advance(q, index);
+    b = &q->buckets[index % q->n_buckets];
+    if (q->aggregate == CQ_COUNT_BY) {
+        uint64_t hash = hash_bytes(data, len);
+        hashtable_entry *e, *t;
+        e = hashtable_insert(&b->counts, data, len, hash);
+        if (e == NULL)
+            return -ENOMEM;
+        t = hashtable_insert(&q->counts, data, len, hash);
+        if (t == NULL)
+            return -ENOMEM;
+        e->count++;
+        t->count++;
+    }else if (q->aggregate == CQ_SUM) {
+        char number[24], *end;
+        long long n;
+        if (len == 0 || len >= sizeof(number))
+            return 0;
+        memcpy(number, data, len);
+        number[len] = '\0';
+        errno = 0;
+        n = strtoll(number, &end, 10);
+        if (*end != '\0' || errno)
+            return 0;
+        b->sum += n;
+        q->sum += n;
+    }
+    b->count++;
+    q->count++;
+    return 0;
+}
+
+/* Adds entries appended since last called to all queries. Does not
+ * require the GIL, but the continuous queries must be locked. */
+static int
+Journal___continuous_update(journal_continuous *cq)
+{
+    uint64_t realtime;
+    size_t i;
+    int r;
+
+    if (cq->j == NULL)
+        return 0;
+    r = sd_journal_process(cq->j);
+    if (r < 0)
+        return r;
+    while ((r = sd_journal_next(cq->j)) > 0) {
+        r = sd_journal_get_realtime_usec(cq->j, &realtime);
+        for (i = 0; r >= 0 && i < cq->n_queries; i++)
+            r = cq_add(cq->queries[i], cq->j, realtime);
+        if (r < 0)
+            return r;
+    }
+    return r;
+}
+
+/* Adds entries already in the window of `q` to it, up to the current
+ * position of the tail handle. Does not require the GIL, but `self` and
+ * the continuous queries must be locked. */
+static int
+Journal___continuous_backfill(Journal *self, continuous_query *q)
+{
+    struct timespec now;
+    sd_journal *j=NULL;
+    char *cursor=NULL;
+    uint64_t realtime, since;
+    int r;
+
+    if (sd_journal_get_cursor(self->continuous.j, &cursor) < 0)
+        return 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    since = (uint64_t) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    since = (since / q->step + 1 - q->n_buckets) * q->step;
+
+    r = Journal___open_unfiltered(self, NULL, &j);
+    if (r >= 0)
+        r = sd_journal_seek_realtime_usec(j, since);
+    while (r >= 0 && (r = sd_journal_next(j)) > 0) {
+        r = sd_journal_get_realtime_usec(j, &realtime);
+        if (r >= 0)
+            r = cq_add(q, j, realtime);
+        if (r >= 0 && sd_journal_test_cursor(j, cursor) > 0)
+            break;
+    }
+    if (j)
+        sd_journal_close(j);
+    free(cursor);
+    return r < 0 ? r : 0;
+}
+
+/* Reads values of `q` as of now, with the continuous queries locked.
+ * For CQ_COUNT_BY, a list of (raw value, count) is returned. */
+static PyObject *
+cq_value(continuous_query *q)
+{
+    struct timespec now;
+    PyObject *result, *item;
+    size_t k;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    cq_advance(q, ((uint64_t) now.tv_sec * 1000000ULL + now.tv_nsec / 1000) / q->step);
+    if (q->aggregate == CQ_COUNT)
+        return PyLong_FromUnsignedLongLong(q->count);
+    if (q->aggregate == CQ_SUM)
+        return PyLong_FromLongLong(q->sum);
+
+    result = PyList_New(0);
+    for (k = 0; result && k < q->counts.size; k++) {
+        const hashtable_entry *e = &q->counts.entries[k];
+        if (e->key == NULL)
+            continue;
+        item = Py_BuildValue("(y#K)", e->key, (Py_ssize_t) e->key_len,
+                             (unsigned long long) e->count);
+        if (item == NULL || PyList_Append(result, item) < 0)
+            Py_CLEAR(result);
+        Py_XDECREF(item);
+    }
+    return result;
+}
+
+PyDoc_STRVAR(Journal_add_continuous_query__doc__,
+"add_continuous_query(name, aggregate, window[, expression][, step][, tumbling]) -> None\n\n"
+"Register a continuous query `name`, keeping `aggregate` of entries\n"
+"matching filter `expression`, as per filter(), over a time `window` in\n"
+"secs or timedelta instance. Argument `aggregate` is one of:\n"
+"  \"count\"             number of entries\n"
+"  (\"count_by\", FIELD) dictionary of counts by value of FIELD\n"
+"  (\"sum\", FIELD)      sum of integer values of FIELD\n"
+"The window is sliding, to within `step` which defaults to 1/60th of\n"
+"the window, or if `tumbling` is True, is the current multiple of\n"
+"`window` since the epoch. Entries already in the window are added\n"
+"at once, and then those appended to the journal each time wait()\n"
+"returns, regardless of the matches of this journal. Values are read\n"
+"by continuous_query().");
+static PyObject *
+Journal_add_continuous_query(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"name", "aggregate", "window", "expression", "step", "tumbling", NULL};
+    PyObject *argv[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+    journal_continuous *cq = &self->continuous;
+    continuous_query *q, **queries;
+    const char *name, *field=NULL, *expression;
+    Py_ssize_t field_len=0, expression_len;
+    uint64_t window, step;
+    filter_node *root;
+    int tumbling=0, r=0;
+
+    if (unpack_fastcall("add_continuous_query", args, nargs, kwnames, kwlist, 3, argv) < 0)
+        return NULL;
+    if ((name = as_cstring(argv[0])) == NULL)
+        return NULL;
+    if (argv[5] && (tumbling = PyObject_IsTrue(argv[5])) < 0)
+        return NULL;
+    if (Journal___as_duration(self, argv[2], &window) < 0)
+        return NULL;
+    if (argv[4] && argv[4] != Py_None) {
+        if (tumbling) {
+            PyErr_SetString(PyExc_ValueError, "Step is not used for tumbling windows");
+            return NULL;
+        }
+        if (Journal___as_duration(self, argv[4], &step) < 0)
+            return NULL;
+    }else{
+        step = tumbling ? window : window / CQ_DEFAULT_BUCKETS;
+    }
+    if (window == 0 || step == 0 || step > window || (window + step - 1) / step > CQ_MAX_BUCKETS) {
+        PyErr_SetString(PyExc_ValueError, "Window must be positive, of at most 65536 steps");
+        return NULL;
+    }
+
+    q = PyMem_Calloc(1, sizeof(continuous_query));
+    if (q == NULL)
+        return PyErr_NoMemory();
+    q->step = step;
+    q->n_buckets = (window + step - 1) / step;
+    if (PyUnicode_Check(argv[1]) && PyUnicode_CompareWithASCIIString(argv[1], "count") == 0) {
+        q->aggregate = CQ_COUNT;
+    }else if (PyTuple_Check(argv[1]) && PyTuple_GET_SIZE(argv[1]) == 2 &&
+              PyUnicode_Check(PyTuple_GET_ITEM(argv[1], 0)) &&
+              (PyUnicode_CompareWithASCIIString(PyTuple_GET_ITEM(argv[1], 0), "count_by") == 0 ||
+               PyUnicode_CompareWithASCIIString(PyTuple_GET_ITEM(argv[1], 0), "sum") == 0)) {
+        q->aggregate = PyUnicode_CompareWithASCIIString(PyTuple_GET_ITEM(argv[1], 0), "sum") == 0 ? CQ_SUM : CQ_COUNT_BY;
+        if (!PyUnicode_Check(PyTuple_GET_ITEM(argv[1], 1)) ||
+            (field = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(argv[1], 1), &field_len)) == NULL) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "Aggregate field must be a string");
+            goto error;
+        }
+    }else{
+        PyErr_SetString(PyExc_ValueError, "Unknown aggregate");
+        goto error;
+    }
+    q->name = PyMem_Malloc(strlen(name) + 1);
+    q->buckets = PyMem_Calloc(q->n_buckets, sizeof(cq_bucket));
+    if (field)
+        q->field = PyMem_Malloc(field_len + 1);
+    if (q->name == NULL || q->buckets == NULL || (field && q->field == NULL)) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    strcpy(q->name, name);
+    if (field) {
+        memcpy(q->field, field, field_len + 1);
+        q->field_len = field_len;
+    }
+    if (argv[3] && argv[3] != Py_None) {
+        if ((expression = as_cstring(argv[3])) == NULL)
+            goto error;
+        expression_len = strlen(expression);
+        if ((root = filter_parse(expression, expression_len)) == NULL)
+            goto error;
+        if ((q->filter = Journal___filter_add(NULL, root)) == NULL)
+            goto error;
+    }
+
+    if (Journal___lock(self) < 0)
+        goto error;
+    lock_acquire(&cq->lock);
+    if (continuous_find(cq, name, NULL)) {
+        PyErr_SetString(PyExc_ValueError, "Continuous query already exists");
+        r = -1;
+        goto finish;
+    }
+    queries = PyMem_Realloc(cq->queries, (cq->n_queries + 1) * sizeof(continuous_query *));
+    if (queries == NULL) {
+        PyErr_NoMemory();
+        r = -1;
+        goto finish;
+    }
+    cq->queries = queries;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (cq->j == NULL) {
+        r = Journal___open_unfiltered(self, NULL, &cq->j);
+        if (r >= 0) {
+            sd_journal_get_fd(cq->j);
+            r = sd_journal_seek_tail(cq->j);
+        }
+        if (r >= 0)
+            r = sd_journal_previous(cq->j);
+        if (r < 0 && cq->j) {
+            sd_journal_close(cq->j);
+            cq->j = NULL;
+        }
+    }else{
+        r = Journal___continuous_update(cq);
+    }
+    if (r >= 0)
+        r = Journal___continuous_backfill(self, q);
+    Py_END_ALLOW_THREADS
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error reading journal for continuous query");
+    }else{
+        cq->queries[cq->n_queries++] = q;
+        q = NULL;
+    }
+
+finish:
+    lock_release(&cq->lock);
+    Journal___unlock(self);
+    continuous_query_free(q);
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+
+error:
+    continuous_query_free(q);
+    return NULL;
+}
+
+PyDoc_STRVAR(Journal_continuous_query__doc__,
+"continuous_query(name) -> object\n\n"
+"Returns current value of continuous query `name`, as of the entries\n"
+"added by the last wait(). This does not wait for the journal, so may\n"
+"be called while another thread waits.");
+static PyObject *
+Journal_continuous_query(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"name", NULL};
+    PyObject *arg=NULL, *value, *result, *key;
+    continuous_query *q;
+    const char *name;
+    Py_ssize_t i;
+    int aggregate;
+
+    if (unpack_fastcall("continuous_query", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if ((name = as_cstring(arg)) == NULL)
+        return NULL;
+
+    lock_acquire(&self->continuous.lock);
+    q = continuous_find(&self->continuous, name, NULL);
+    if (q == NULL) {
+        lock_release(&self->continuous.lock);
+        PyErr_SetString(PyExc_ValueError, "Unknown continuous query");
+        return NULL;
+    }
+    aggregate = q->aggregate;
+    key = aggregate == CQ_COUNT_BY ? PyUnicode_FromStringAndSize(q->field, q->field_len) : NULL;
+    value = cq_value(q);
+    lock_release(&self->continuous.lock);
+    if (aggregate != CQ_COUNT_BY || value == NULL || key == NULL) {
+        if (aggregate == CQ_COUNT_BY && key == NULL)
+            Py_CLEAR(value);
+        Py_XDECREF(key);
+        return value;
+    }
+
+    /* Values are converted once unlocked, as calls may run arbitrary code */
+    result = PyDict_New();
+    for (i = 0; result && i < PyList_GET_SIZE(value); i++) {
+        PyObject *item = PyList_GET_ITEM(value, i), *converted;
+        converted = Journal___process_field(self, key, PyBytes_AS_STRING(PyTuple_GET_ITEM(item, 0)),
+                                            PyBytes_GET_SIZE(PyTuple_GET_ITEM(item, 0)));
+        if (converted == NULL || PyDict_SetItem(result, converted, PyTuple_GET_ITEM(item, 1)) < 0)
+            Py_CLEAR(result);
+        Py_XDECREF(converted);
+    }
+    Py_DECREF(key);
+    Py_DECREF(value);
+    return result;
+}
+
+PyDoc_STRVAR(Journal_remove_continuous_query__doc__,
+"remove_continuous_query(name) -> None\n\n"
+"Remove continuous query `name`.");
+static PyObject *
+Journal_remove_continuous_query(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"name", NULL};
+    journal_continuous *cq = &self->continuous;
+    PyObject *arg=NULL;
+    continuous_query *q;
+    const char *name;
+    size_t pos;
+
+    if (unpack_fastcall("remove_continuous_query", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if ((name = as_cstring(arg)) == NULL)
+        return NULL;
+
+    lock_acquire(&cq->lock);
+    q = continuous_find(cq, name, &pos);
+    if (q) {
+        memmove(&cq->queries[pos], &cq->queries[pos + 1], (cq->n_queries - pos - 1) * sizeof(continuous_query *));
+        cq->n_queries--;
+    }
+    lock_release(&cq->lock);
+    if (q == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Unknown continuous query");
+        return NULL;
+    }
+    continuous_query_free(q);
+    Py_RETURN_NONE;
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} result_buffer;
+
+/* Appends `len` bytes, preceded by their length if `prefixed`. Uses raw
+ * allocators, so does not require the GIL. */
+static int
+result_buffer_put(result_buffer *b, const void *data, size_t len, int prefixed)
+{
+    size_t need = b->len + len + (prefixed ? 8 : 0);
+    uint64_t v;
+
+    if (need > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        char *temp;
+        while (size < need)
+            size *= 2;
+        temp = PyMem_RawRealloc(b->data, size);
+        if (temp == NULL)
+            return -ENOMEM;
+        b->data = temp;
+        b->size = size;
+    }
+    if (prefixed) {
+        v = htole64(len);
+        memcpy(b->data + b->len, &v, 8);
+        b->len += 8;
+    }
+    if (len)
+        memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int
+result_match_compare(const void *a, const void *b)
+{
+    const journal_match *x = *(const journal_match * const *) a, *y = *(const journal_match * const *) b;
+    int r = memcmp(x->data, y->data, x->len < y->len ? x->len : y->len);
+    return r ? r : (x->len > y->len) - (x->len < y->len);
+}
+
+static int
+result_name_compare(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+static int
+result_key_filter(result_buffer *key, const filter_node *node)
+{
+    char head[48];
+    int r;
+
+    if (node == NULL)
+        return result_buffer_put(key, "-", 1, 1);
+    snprintf(head, sizeof(head), "%d,%d,%d", node->type, node->op, node->field_type);
+    r = result_buffer_put(key, head, strlen(head), 1);
+    if (r == 0)
+        r = result_buffer_put(key, node->field, node->field ? node->field_len : 0, 1);
+    if (r == 0)
+        r = result_buffer_put(key, node->value, node->value ? node->value_len : 0, 1);
+    if (r == 0 && node->type != FILTER_CMP)
+        r = result_key_filter(key, node->left);
+    if (r == 0 && node->type != FILTER_CMP)
+        r = result_key_filter(key, node->right);
+    return r;
+}
+
+/* Key of between() results: the journal opened, its matches with those
+ * of each term sorted, filter, time range and sorted projection */
+static int
+Journal___result_key(Journal *self, uint64_t since, uint64_t until, const Journal_projection *proj,
+                     result_buffer *key)
+{
+    const journal_match **term=NULL;
+    const char **names=NULL;
+    char head[64];
+    size_t i, k, n = 0;
+    uint64_t range[2];
+    int r;
+
+    snprintf(head, sizeof(head), "%d:%d", RESULT_CACHE_VERSION, self->path ? -1 : self->flags);
+    r = result_buffer_put(key, head, strlen(head), 1);
+    if (r == 0)
+        r = result_buffer_put(key, self->path, self->path ? strlen(self->path) : 0, 1);
+
+    term = PyMem_Malloc((self->n_matches ? self->n_matches : 1) * sizeof(journal_match *));
+    if (term == NULL)
+        r = -ENOMEM;
+    for (i = 0; r == 0 && i <= self->n_matches; i++) {
+        if (i < self->n_matches && self->matches[i].kind == JOURNAL_MATCH) {
+            term[n++] = &self->matches[i];
+            continue;
+        }
+        qsort(term, n, sizeof(journal_match *), result_match_compare);
+        for (k = 0; r == 0 && k < n; k++) {
+            if (k == 0 || result_match_compare(&term[k - 1], &term[k]) != 0)
+                r = result_buffer_put(key, term[k]->data, term[k]->len, 1);
+        }
+        n = 0;
+        if (r == 0 && i < self->n_matches)
+            r = result_buffer_put(key, self->matches[i].kind == JOURNAL_DISJUNCTION ? "|" : "&", 1, 1);
+    }
+    PyMem_Free(term);
+    if (r == 0)
+        r = result_key_filter(key, self->filter ? self->filter->root : NULL);
+
+    range[0] = htole64(since);
+    range[1] = htole64(until);
+    if (r == 0)
+        r = result_buffer_put(key, range, sizeof(range), 1);
+    if (r == 0 && proj == NULL)
+        r = result_buffer_put(key, "*", 1, 1);
+    if (r == 0 && proj) {
+        names = PyMem_Malloc((proj->n ? proj->n : 1) * sizeof(const char *));
+        if (names == NULL)
+            r = -ENOMEM;
+        for (i = 0; r == 0 && i < (size_t) proj->n; i++)
+            names[i] = proj->names[i];
+        if (r == 0)
+            qsort(names, proj->n, sizeof(const char *), result_name_compare);
+        for (i = 0; r == 0 && i < (size_t) proj->n; i++)
+            r = result_buffer_put(key, names[i], strlen(names[i]), 1);
+        PyMem_Free(names);
+    }
+    return r;
+}
+
+/* Journal files found for Journal___walk_files, and their disk usage */
+typedef struct {
+    int flags;
+    const char *root;
+    const char *machine;
+    char **dirs;
+    char **names;
+    size_t n;
+    uint64_t blocks;
+    int err;
+} journal_file_set;
+
+/* As per file_has_type_prefix of libsystemd */
+static int
+journal_file_has_type(const char *name, const char *type)
+{
+    size_t len = strlen(type);
+    if (strncmp(name, type, len) != 0)
+        return 0;
+    name += len;
+    return strcmp(name, ".journal") == 0 || strcmp(name, ".journal~") == 0 || name[0] == '@';
+}
+
+static void
+journal_file_set_add(const char *dir, int dir_fd, const char *name, void *arg)
+{
+    journal_file_set *set = arg;
+    const char *base = strrchr(dir, '/');
+    char user[32];
+    struct stat st;
+    char **dirs, **names;
+
+    if (set->err < 0)
+        return;
+    /* Types and machines as opened by sd_journal_open with the flags */
+    if (set->flags & (SD_JOURNAL_SYSTEM_ONLY | SD_JOURNAL_CURRENT_USER)) {
+        snprintf(user, sizeof(user), "user-%u", (unsigned) getuid());
+        if (!((set->flags & SD_JOURNAL_SYSTEM_ONLY) && journal_file_has_type(name, "system")) &&
+            !((set->flags & SD_JOURNAL_CURRENT_USER) && journal_file_has_type(name, user)))
+            return;
+    }
+    if (set->machine && strcmp(dir, set->root) != 0 && (base == NULL || strcmp(base + 1, set->machine) != 0))
+        return;
+
+    if (fstatat(dir_fd, name, &st, 0) < 0) {
+        set->err = -errno;
+        return;
+    }
+    dirs = PyMem_RawRealloc(set->dirs, (set->n + 1) * sizeof(char *));
+    if (dirs)
+        set->dirs = dirs;
+    names = dirs ? PyMem_RawRealloc(set->names, (set->n + 1) * sizeof(char *)) : NULL;
+    if (names)
+        set->names = names;
+    if (names == NULL || (set->dirs[set->n] = strdup(dir)) == NULL) {
+        set->err = -ENOMEM;
+        return;
+    }
+    if ((set->names[set->n] = strdup(name)) == NULL) {
+        free(set->dirs[set->n]);
+        set->err = -ENOMEM;
+        return;
+    }
+    set->n++;
+    set->blocks += st.st_blocks;
+}
+
+/* Adds file at `path` to `set` */
+static void
+journal_file_set_add_path(journal_file_set *set, const char *path)
+{
+    const char *name = strrchr(path, '/');
+    char *dir;
+    int dir_fd;
+
+    if (name == NULL || (dir = strndup(path, name - path)) == NULL) {
+        set->err = name ? -ENOMEM : -EINVAL;
+        return;
+    }
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        set->err = -errno;
+    }else{
+        journal_file_set_add(dir, dir_fd, name + 1, set);
+        close(dir_fd);
+    }
+    free(dir);
+}
+
+/* Calls `func` with each journal file of `self`, as opened by
+ * sd_journal_open or sd_journal_open_directory, or selected by bloom
+ * filters. Returns -1, without calling `func`, if they cannot be found
+ * exactly: for flags opening other files, or if their disk usage is not
+ * that of the files libsystemd has open. Does not require the GIL, but
+ * `self` must be locked. */
+static int
+Journal___walk_files(Journal *self, journal_file_func func, void *arg)
+{
+    static const char * const roots[] = {"/run/log/journal", "/var/log/journal"};
+    journal_file_set set;
+    sd_id128_t machine;
+    char machine_str[33];
+    uint64_t usage;
+    size_t i;
+    int dir_fd = -1;
+
+    memset(&set, 0, sizeof(set));
+    if (self->bloom && self->bloom->paths) {
+        for (i = 0; self->bloom->paths[i] && set.err >= 0; i++)
+            journal_file_set_add_path(&set, self->bloom->paths[i]);
+    }else if (self->path) {
+        set.root = self->path;
+        journal_dir_walk(self->path, 1, journal_file_set_add, &set);
+    }else if (self->flags & ~(SD_JOURNAL_LOCAL_ONLY | SD_JOURNAL_RUNTIME_ONLY |
+                              SD_JOURNAL_SYSTEM_ONLY | SD_JOURNAL_CURRENT_USER)) {
+        set.err = -EOPNOTSUPP;
+    }else{
+        set.flags = self->flags;
+        if (self->flags & SD_JOURNAL_LOCAL_ONLY) {
+            if (sd_id128_get_machine(&machine) < 0)
+                set.err = -ENOENT;
+            else
+                set.machine = sd_id128_to_string(machine, machine_str);
+        }
+        for (i = 0; i < 2 && set.err >= 0; i++) {
+            if (i == 1 && (self->flags & SD_JOURNAL_RUNTIME_ONLY))
+                break;
+            set.root = roots[i];
+            journal_dir_walk(roots[i], 1, journal_file_set_add, &set);
+        }
+    }
+    if (set.err >= 0 && (sd_journal_get_usage(self->j, &usage) < 0 || usage != set.blocks * 512))
+        set.err = -ESTALE;
+
+    for (i = 0; set.err >= 0 && i < set.n; i++) {
+        if (i == 0 || strcmp(set.dirs[i], set.dirs[i - 1]) != 0) {
+            if (dir_fd >= 0)
+                close(dir_fd);
+            dir_fd = open(set.dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (dir_fd >= 0)
+            func(set.dirs[i], dir_fd, set.names[i], arg);
+    }
+    if (dir_fd >= 0)
+        close(dir_fd);
+    for (i = 0; i < set.n; i++) {
+        free(set.dirs[i]);
+        free(set.names[i]);
+    }
+    PyMem_RawFree(set.dirs);
+    PyMem_RawFree(set.names);
+    return set.err < 0 ? -1 : 0;
+}
+
+/* Lowers `since` to the first realtime of a journal file still being
+ * appended to, which are those not named as archived, or files whose
+ * header cannot be read */
+static void
+result_live_since_file(const char *dir, int dir_fd, const char *name, void *arg)
+{
+    uint8_t header[JOURNAL_HEADER_MIN_SIZE];
+    uint64_t *since = arg;
+    int fd;
+
+    if (strchr(name, '@') || name[strlen(name) - 1] == '~')
+        return;
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header, "LPKSHHRH", 8) == 0) {
+        if (read_le64(header + 152) > 0 && read_le64(header + 184) < *since)
+            *since = read_le64(header + 184);
+    }else{
+        *since = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+/* First realtime of entries in active journal files, or UINT64_MAX if
+ * there are none. Does not require the GIL. */
+static uint64_t
+Journal___live_since(Journal *self)
+{
+    uint64_t since = UINT64_MAX;
+
+    if (Journal___walk_files(self, result_live_since_file, &since) < 0)
+        since = 0;
+    return since;
+}
+
+/* Appends the current entry unconverted, as held by the result cache.
+ * Does not require the GIL. */
+static int
+result_put_entry(result_buffer *b, sd_journal *j, const Journal_projection *proj, uint64_t realtime)
+{
+    unsigned int special = proj ? proj->special : JOURNAL_FIELD_ALL;
+    const void *msg;
+    const char *delim_ptr;
+    size_t msg_len, start;
+    char item[256], *cursor;
+    uint64_t monotonic, v;
+    sd_id128_t boot_id;
+    Py_ssize_t i;
+    int r;
+
+    start = b->len;
+    r = result_buffer_put(b, NULL, 0, 1);
+    sd_journal_restart_data(j);
+    while (r == 0 && (r = sd_journal_enumerate_data(j, &msg, &msg_len)) > 0) {
+        r = 0;
+        delim_ptr = memchr(msg, '=', msg_len);
+        if (delim_ptr == NULL)
+            continue;
+        for (i = 0; proj && i < proj->n; i++) {
+            if ((size_t) proj->name_lens[i] == (size_t) (delim_ptr - (const char *) msg) &&
+                memcmp(proj->names[i], msg, proj->name_lens[i]) == 0)
+                break;
+        }
+        if (proj && i == proj->n)
+            continue;
+        r = result_buffer_put(b, msg, msg_len, 1);
+    }
+    if (r == 0 && (special & JOURNAL_FIELD_REALTIME)) {
+        snprintf(item, sizeof(item), "__REALTIME_TIMESTAMP=%llu", (unsigned long long) realtime);
+        r = result_buffer_put(b, item, strlen(item), 1);
+    }
+    if (r == 0 && (special & JOURNAL_FIELD_MONOTONIC) &&
+        sd_journal_get_monotonic_usec(j, &monotonic, &boot_id) >= 0) {
+        snprintf(item, sizeof(item), "__MONOTONIC_TIMESTAMP=%llu", (unsigned long long) monotonic);
+        r = result_buffer_put(b, item, strlen(item), 1);
+    }
+    if (r == 0 && (special & JOURNAL_FIELD_CURSOR) && sd_journal_get_cursor(j, &cursor) >= 0) {
+        if ((size_t) snprintf(item, sizeof(item), "__CURSOR=%s", cursor) < sizeof(item))
+            r = result_buffer_put(b, item, strlen(item), 1);
+        free(cursor);
+    }
+    if (r < 0)
+        return r;
+    v = htole64(b->len - start - 8);
+    memcpy(b->data + start, &v, 8);
+    return 0;
+}
+
+/* Converts entries held by the result cache, with `self` locked */
+static PyObject *
+Journal___result_entries(Journal *self, const char *data, size_t size, const Journal_projection *proj)
+{
+    const uint8_t *p = (const uint8_t *) data, *end = p + size, *entry_end;
+    PyObject *result, *dict=NULL, *key, *value;
+    const char *msg, *delim_ptr;
+    size_t msg_len, field_len;
+    int r = 0;
+
+    result = PyList_New(0);
+    if (result == NULL)
+        return NULL;
+    while (r == 0 && end - p >= 8) {
+        entry_end = p + 8 + read_le64(p);
+        p += 8;
+        dict = PyDict_New();
+        if (dict == NULL)
+            goto error;
+        while (r == 0 && entry_end - p >= 8) {
+            msg_len = read_le64(p);
+            msg = (const char *) p + 8;
+            p += 8 + msg_len;
+            delim_ptr = memchr(msg, '=', msg_len);
+            if (delim_ptr == NULL)
+                continue;
+            field_len = delim_ptr - msg;
+            if (proj) {
+                key = Journal___projection_key(proj, msg, field_len);
+                if (key == NULL)
+                    continue;
+                Py_INCREF(key);
+            }else{
+                key = PyUnicode_FromStringAndSize(msg, field_len);
+                if (key == NULL)
+                    goto error;
+            }
+            /* Timestamps and cursors are distinct per entry, so are not
+             * worth holding in the value cache */
+            if (self->cache.max_values > 0 && !(field_len > 2 && msg[0] == '_' && msg[1] == '_'))
+                value = Journal___cached_field(self, key, msg, msg_len, field_len);
+            else
+                value = Journal___process_field(self, key, delim_ptr + 1, msg_len - field_len - 1);
+            r = Journal___entry_add(dict, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+        if (r < 0 || PyList_Append(result, dict) < 0)
+            goto error;
+        Py_CLEAR(dict);
+    }
+    return result;
+
+error:
+    Py_XDECREF(dict);
+    Py_DECREF(result);
+    return NULL;
+}
+
+/* Copies results held by the result cache, so they are not changed by
+ * the caller. Values of repeated fields are copied too; others are
+ * shared. */
+static PyObject *
+result_copy(PyObject *entries)
+{
+    Py_ssize_t i, n = PyList_GET_SIZE(entries), pos;
+    PyObject *result, *dict, *key, *value, *copy;
+
+    result = PyList_New(n);
+    if (result == NULL)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        dict = PyDict_Copy(PyList_GET_ITEM(entries, i));
+        if (dict == NULL)
+            goto error;
+        PyList_SET_ITEM(result, i, dict);
+        pos = 0;
+        while (PyDict_Next(dict, &pos, &key, &value)) {
+            if (!PyList_CheckExact(value))
+                continue;
+            copy = PyList_GetSlice(value, 0, PyList_GET_SIZE(value));
+            if (copy == NULL || PyDict_SetItem(dict, key, copy) < 0) {
+                Py_XDECREF(copy);
+                goto error;
+            }
+            Py_DECREF(copy);
+        }
+    }
+    return result;
+
+error:
+    Py_DECREF(result);
+    return NULL;
+}
+
+/* Reads entries between `since` and `until` into `b`. Does not require
+ * the GIL, but `self` must be locked and prepared for seeking. */
+static int
+Journal___result_scan(Journal *self, uint64_t since, uint64_t until, const Journal_projection *proj,
+                      result_buffer *b)
+{
+    uint64_t realtime;
+    int r;
+
+    r = sd_journal_seek_realtime_usec(self->j, since);
+    while (r >= 0) {
+        r = self->filter ? Journal___move_filtered(self, 1) : sd_journal_next(self->j);
+        if (r <= 0)
+            break;
+        r = sd_journal_get_realtime_usec(self->j, &realtime);
+        if (r < 0 || realtime >= until)
+            break;
+        if (realtime >= since)
+            r = result_put_entry(b, self->j, proj, realtime);
+    }
+    return r < 0 ? r : 0;
+}
+
+PyDoc_STRVAR(Journal_between__doc__,
+"between(since, until[, fields]) -> list\n\n"
+"Return list of log entries from realtime `since` up to but excluding\n"
+"`until`, under the current matches and filter. Arguments `since` and\n"
+"`until` are as per seek_realtime(), and `fields` as per entries().\n"
+"With the `result_cache` argument of Journal, results are cached by\n"
+"matches, filter, time range and fields. Results ending before the\n"
+"first entry of every journal file still being written are kept until\n"
+"evicted, as archived files do not change; others until wait() returns\n"
+"APPEND or INVALIDATE. All are dropped from memory when `call_dict` or\n"
+"`default_call` is changed. The position of the journal is moved, other\n"
+"than by results from the cache.");
+static PyObject *
+Journal_between(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"since", "until", "fields", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL}, *result=NULL, *entries=NULL, *dropped;
+    Journal_projection *proj=NULL;
+    result_buffer key = {NULL, 0, 0}, data = {NULL, 0, 0};
+    result_cache_entry *e=NULL;
+    result_cache *cache;
+    uint64_t since, until, hash = 0;
+    int live = 1, found = 0, r = 0;
+
+    if (unpack_fastcall("between", args, nargs, kwnames, kwlist, 2, argv) < 0)
+        return NULL;
+    if (Journal___as_realtime(self, argv[0], &since) < 0 ||
+        Journal___as_realtime(self, argv[1], &until) < 0)
+        return NULL;
+    if (argv[2] && argv[2] != Py_None && (proj = Journal___projection_new(argv[2])) == NULL)
+        return NULL;
+
+    if (Journal___lock(self) < 0) {
+        Journal___projection_free(proj);
+        return NULL;
+    }
+    cache = self->results;
+    if (cache) {
+        if ((r = Journal___result_key(self, since, until, proj, &key)) < 0)
+            goto finish;
+        hash = hash_bytes(key.data, key.len);
+        e = result_cache_find(cache, key.data, key.len, hash);
+        if (e) {
+            cache->hits++;
+            result = result_copy(e->entries);
+            goto finish;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        live = until > Journal___live_since(self);
+        if (!live && cache->dir)
+            found = r = result_cache_load(cache, key.data, key.len, hash, &data.data, &data.len);
+        Py_END_ALLOW_THREADS
+        if (r < 0)
+            goto finish;
+        if (found)
+            cache->disk_hits++;
+        else
+            cache->misses++;
+    }
+    if (!found) {
+        if (Journal___seek_prepare(self) < 0) {
+            r = -1;
+            goto finish;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        r = Journal___result_scan(self, since, until, proj, &data);
+        Py_END_ALLOW_THREADS
+        if (r < 0)
+            goto finish;
+    }
+    entries = Journal___result_entries(self, data.data, data.len, proj);
+    if (entries == NULL || cache == NULL) {
+        result = entries;
+        entries = NULL;
+        goto finish;
+    }
+    if ((result = result_copy(entries)) == NULL)
+        goto finish;
+    if (!live && !found && cache->dir) {
+        Py_BEGIN_ALLOW_THREADS
+        result_cache_save(cache, key.data, key.len, hash, data.data, data.len);
+        Py_END_ALLOW_THREADS
+    }
+
+    e = PyMem_Calloc(1, sizeof(result_cache_entry));
+    if (e == NULL) {
+        r = -ENOMEM;
+        goto finish;
+    }
+    e->key = key.data;
+    e->key_len = key.len;
+    e->hash = hash;
+    e->entries = entries;
+    e->size = data.len;
+    e->live = live;
+    key.data = NULL;
+    entries = NULL;
+    if (result_cache_insert(cache, e) < 0)
+        Py_CLEAR(result);
+
+finish:
+    dropped = result_cache_dropped(cache);
+    Journal___unlock(self);
+    Py_XDECREF(dropped);
+    Py_XDECREF(entries);
+    PyMem_RawFree(key.data);
+    PyMem_RawFree(data.data);
+    Journal___projection_free(proj);
+    if (r == -ENOMEM) {
+        Py_CLEAR(result);
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+    }else if (r < 0 && !PyErr_Occurred()) {
+        PyErr_SetString(PyExc_RuntimeError, "Error reading journal");
+    }
+    return result;
+}
+
+PyDoc_STRVAR(Journal_result_cache_info__doc__,
+"result_cache_info() -> dict\n\n"
+"Return dictionary of result cache statistics: `hits` from memory and\n"
+"`disk_hits`, `misses`, `evictions` of least recently used results,\n"
+"`invalidations` by changes to the journal, and `size` and `bytes` of\n"
+"results held, up to `max_bytes`. Returns None if the result cache is\n"
+"not in use.");
+static PyObject *
+Journal_result_cache_info(Journal *self, PyObject *args)
+{
+    unsigned long long hits, disk_hits, misses, evictions, invalidations, size, bytes, max_bytes;
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (self->results == NULL) {
+        Journal___unlock(self);
         Py_RETURN_NONE;
+    }
+    hits = self->results->hits;
+    disk_hits = self->results->disk_hits;
+    misses = self->results->misses;
+    evictions = self->results->evictions;
+    invalidations = self->results->invalidations;
+    size = self->results->n_entries;
+    bytes = self->results->bytes;
+    max_bytes = self->results->max_bytes;
+    Journal___unlock(self);
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}", "hits", hits, "disk_hits", disk_hits,
+                         "misses", misses, "evictions", evictions, "invalidations", invalidations,
+                         "size", size, "bytes", bytes, "max_bytes", max_bytes);
+}
+
+/* Cursors of get_by_cursors(), fetched in order of sequence number
+ * within each sequence, from a handle on just the journal file whose
+ * header covers them where found, so that each is sought in one file
+ * read front to back. Entries up to CURSOR_WALK ahead of the last found
+ * are stepped to rather than sought. */
+#define CURSOR_WALK 8
+
+typedef struct {
+    const char *str;
+    PyJournalctl_Cursor cursor;
+    Py_ssize_t index;
+    Py_ssize_t entry;
+} cursor_lookup;
+
+typedef struct {
+    char *path;
+    sd_id128_t seqnum_id;
+    uint64_t head_seqnum;
+    uint64_t tail_seqnum;
+} cursor_file;
+
+typedef struct {
+    cursor_file *files;
+    size_t n_files;
+} cursor_files;
+
+static void
+cursor_files_add(const char *dir, int dir_fd, const char *name, void *arg)
+{
+    uint8_t header[JOURNAL_HEADER_MIN_SIZE];
+    cursor_files *files = arg;
+    cursor_file *f;
+    int fd, ok;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    ok = pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+         memcmp(header, "LPKSHHRH", 8) == 0 && read_le64(header + 152) > 0;
+    close(fd);
+    if (!ok)
+        return;
+    f = PyMem_RawRealloc(files->files, (files->n_files + 1) * sizeof(cursor_file));
+    if (f == NULL)
+        return;
+    files->files = f;
+    f = &files->files[files->n_files];
+    if (asprintf(&f->path, "%s/%s", dir, name) < 0)
+        return;
+    memcpy(f->seqnum_id.bytes, header + 72, 16);
+    f->tail_seqnum = read_le64(header + 160);
+    f->head_seqnum = read_le64(header + 168);
+    files->n_files++;
+}
+
+static void
+cursor_files_free(cursor_files *files)
+{
+    size_t i;
+    for (i = 0; i < files->n_files; i++)
+        free(files->files[i].path);
+    PyMem_RawFree(files->files);
+}
+
+static const cursor_file *
+cursor_files_find(const cursor_files *files, const PyJournalctl_Cursor *cursor)
+{
+    size_t i;
+    for (i = 0; i < files->n_files; i++) {
+        const cursor_file *f = &files->files[i];
+        if (sd_id128_equal(f->seqnum_id, cursor->seqnum_id) &&
+            f->head_seqnum <= cursor->seqnum && cursor->seqnum <= f->tail_seqnum)
+            return f;
+    }
+    return NULL;
+}
+
+static int
+cursor_lookup_compare(const void *a, const void *b)
+{
+    const cursor_lookup *x = a, *y = b;
+    int r = memcmp(&x->cursor.seqnum_id, &y->cursor.seqnum_id, sizeof(sd_id128_t));
+    if (r != 0)
+        return r;
+    if (x->cursor.seqnum != y->cursor.seqnum)
+        return x->cursor.seqnum < y->cursor.seqnum ? -1 : 1;
+    if (x->cursor.realtime != y->cursor.realtime)
+        return x->cursor.realtime < y->cursor.realtime ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Moves `j` to the entry at `l`, stepping from `last` if near enough,
+ * returning 1 if found under the matches and filter of `self` */
+static int
+Journal___cursor_find(Journal *self, sd_journal *j, const cursor_lookup *last, const cursor_lookup *l)
+{
+    uint64_t step;
+    int r = 0;
+
+    if (last && sd_id128_equal(last->cursor.seqnum_id, l->cursor.seqnum_id) &&
+        l->cursor.seqnum - last->cursor.seqnum <= CURSOR_WALK) {
+        for (step = 0, r = 1; r > 0 && step < l->cursor.seqnum - last->cursor.seqnum; step++)
+            r = sd_journal_next(j);
+        r = r > 0 ? sd_journal_test_cursor(j, l->str) : r;
+    }
+    if (r <= 0) {
+        r = sd_journal_seek_cursor(j, l->str);
+        if (r >= 0)
+            r = sd_journal_next(j);
+        if (r > 0)
+            r = sd_journal_test_cursor(j, l->str);
+    }
+    if (r > 0 && self->filter && !Journal___filter_test(self->filter, j, self->filter->results))
+        r = 0;
+    return r;
+}
+
+/* Reads entries of `lookups`, sorted, into `b`, setting the number of
+ * each found. Does not require the GIL, but `self` must be locked and
+ * prepared for seeking. */
+static int
+Journal___cursor_scan(Journal *self, cursor_lookup *lookups, Py_ssize_t n, const Journal_projection *proj,
+                      result_buffer *b)
+{
+    cursor_files files = {NULL, 0};
+    const cursor_file *file = NULL, *f;
+    const cursor_lookup *last = NULL;
+    sd_journal *fj = NULL, *j;
+    uint64_t realtime;
+    Py_ssize_t i, found = 0;
+    int r = 0;
+
+    Journal___walk_files(self, cursor_files_add, &files);
+    for (i = 0; i < n; i++) {
+        cursor_lookup *l = &lookups[i];
+        if (last && l->cursor.seqnum == last->cursor.seqnum && strcmp(l->str, last->str) == 0) {
+            l->entry = last->entry;
+            continue;
+        }
+        f = cursor_files_find(&files, &l->cursor);
+        if (f && f != file) {
+            char *paths[2] = {f->path, NULL};
+            if (fj)
+                sd_journal_close(fj);
+            fj = NULL;
+            if (Journal___open_handle(self, paths, &fj) < 0)
+                fj = NULL;
+            file = f;
+            last = NULL;
+        }
+        j = f && fj ? fj : self->j;
+        r = Journal___cursor_find(self, j, last, l);
+        if (r == 0 && j != self->j)
+            r = Journal___cursor_find(self, j = self->j, NULL, l);
+        if (r < 0)
+            break;
+        last = NULL;
+        if (r == 0)
+            continue;
+        r = sd_journal_get_realtime_usec(j, &realtime);
+        if (r >= 0)
+            r = result_put_entry(b, j, proj, realtime);
+        if (r < 0)
+            break;
+        l->entry = found++;
+        if (j == fj)
+            last = l;
+    }
+    if (fj)
+        sd_journal_close(fj);
+    cursor_files_free(&files);
+    return r < 0 ? r : 0;
+}
+
+PyDoc_STRVAR(Journal_get_by_cursors__doc__,
+"get_by_cursors(cursors[, fields]) -> list\n\n"
+"Return list of log entries at each of `cursors`, in the same order.\n"
+"Cursors not found, such as of entries since removed, or not under the\n"
+"current matches, or invalid, give None rather than an error. Entries\n"
+"are read in order of position in the journal files rather than as\n"
+"given. Argument `fields` is as per entries(). The position of the\n"
+"journal is moved.");
+static PyObject *
+Journal_get_by_cursors(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"cursors", "fields", NULL};
+    PyObject *argv[2] = {NULL, NULL}, *cursors, *entries=NULL, *result=NULL, *entry;
+    Journal_projection *proj=NULL;
+    result_buffer data = {NULL, 0, 0};
+    cursor_lookup *lookups;
+    Py_ssize_t n, n_valid = 0, i;
+    int r;
+
+    if (unpack_fastcall("get_by_cursors", args, nargs, kwnames, kwlist, 1, argv) < 0)
+        return NULL;
+    /* Copied so that the strings are kept while the GIL is released */
+    cursors = PySequence_Tuple(argv[0]);
+    if (cursors == NULL)
+        return NULL;
+    n = PyTuple_GET_SIZE(cursors);
+    lookups = PyMem_Calloc(n ? n : 1, sizeof(cursor_lookup));
+    if (lookups == NULL) {
+        Py_DECREF(cursors);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        cursor_lookup *l = &lookups[n_valid];
+        if ((l->str = as_cstring(PyTuple_GET_ITEM(cursors, i))) == NULL)
+            goto finish;
+        if (cursor_parse(l->str, &l->cursor) < 0)
+            continue;
+        l->index = i;
+        l->entry = -1;
+        n_valid++;
+    }
+    if (argv[1] && argv[1] != Py_None && (proj = Journal___projection_new(argv[1])) == NULL)
+        goto finish;
+    qsort(lookups, n_valid, sizeof(cursor_lookup), cursor_lookup_compare);
+
+    if (Journal___lock(self) < 0)
+        goto finish;
+    if (Journal___seek_prepare(self) < 0) {
+        Journal___unlock(self);
+        goto finish;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = Journal___cursor_scan(self, lookups, n_valid, proj, &data);
+    Py_END_ALLOW_THREADS
+    if (r >= 0)
+        entries = Journal___result_entries(self, data.data, data.len, proj);
+    Journal___unlock(self);
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        goto finish;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking to cursor");
+        goto finish;
+    }
+    if (entries == NULL)
+        goto finish;
+
+    result = PyList_New(n);
+    if (result == NULL)
+        goto finish;
+    for (i = 0; i < n; i++) {
+        Py_INCREF(Py_None);
+        PyList_SET_ITEM(result, i, Py_None);
+    }
+    for (i = 0; i < n_valid; i++) {
+        if (lookups[i].entry < 0)
+            continue;
+        /* Repeated cursors, being adjacent once sorted, each have their
+         * own copy of the entry */
+        entry = PyList_GET_ITEM(entries, lookups[i].entry);
+        if (i > 0 && lookups[i - 1].entry == lookups[i].entry) {
+            entry = PyDict_Copy(entry);
+        }else{
+            Py_INCREF(entry);
+        }
+        if (entry == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SetItem(result, lookups[i].index, entry);
+    }
+
+finish:
+    Py_XDECREF(entries);
+    Py_DECREF(cursors);
+    PyMem_Free(lookups);
+    PyMem_RawFree(data.data);
+    Journal___projection_free(proj);
+    return result;
+}
+
+/* Sessions are entries sharing the value of a field, ended by a gap of
+ * more than `gap` microseconds after the last of them. Open sessions are
+ * found by value in `open`, and listed by last entry, the least recent
+ * first, such that those whose gap has passed are at the head. At most
+ * max_sessions are open, the least recent being ended early beyond
+ * that, and at most max_entries entries of each are held, later ones
+ * only counted. Ended sessions are queued in `done` until returned.
+ * These do not require the GIL. */
+typedef struct session {
+    char *value;
+    size_t value_len;
+    uint64_t start;
+    uint64_t end;
+    uint64_t count;
+    size_t n_entries;
+    result_buffer entries;
+    struct session *prev;
+    struct session *next;
+} session;
+
+typedef struct {
+    hashtable open;
+    session *oldest;
+    session *newest;
+    session *done;
+    session *done_tail;
+    int64_t gap;
+    size_t max_sessions;
+    size_t max_entries;
+    uint64_t evicted;
+} session_table;
+
+static void
+session_free(session *s)
+{
+    if (s == NULL)
+        return;
+    PyMem_RawFree(s->value);
+    PyMem_RawFree(s->entries.data);
+    PyMem_RawFree(s);
+}
+
+static void
+session_table_free(session_table *t)
+{
+    session *s, *next;
+
+    for (s = t->oldest; s; s = next) {
+        next = s->next;
+        session_free(s);
+    }
+    for (s = t->done; s; s = next) {
+        next = s->next;
+        session_free(s);
+    }
+    t->oldest = t->newest = t->done = t->done_tail = NULL;
+    hashtable_free(&t->open);
+}
+
+static void
+session_unlink(session_table *t, session *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        t->oldest = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    else
+        t->newest = s->prev;
+    s->prev = s->next = NULL;
+}
+
+static void
+session_append(session_table *t, session *s)
+{
+    s->prev = t->newest;
+    s->next = NULL;
+    if (t->newest)
+        t->newest->next = s;
+    else
+        t->oldest = s;
+    t->newest = s;
+}
+
+/* Moves open session `s` to the queue of those ended */
+static void
+session_end(session_table *t, session *s)
+{
+    hashtable_entry *e;
+
+    e = hashtable_find(&t->open, s->value, s->value_len, hash_bytes(s->value, s->value_len));
+    if (e)
+        hashtable_remove(&t->open, e);
+    session_unlink(t, s);
+    if (t->done_tail)
+        t->done_tail->next = s;
+    else
+        t->done = s;
+    t->done_tail = s;
+}
+
+static void
+session_expire(session_table *t, uint64_t now)
+{
+    while (t->oldest && (int64_t) (now - t->oldest->end) > t->gap)
+        session_end(t, t->oldest);
+}
+
+/* Adds the current entry of `j` to the session of its value of `field` */
+static int
+session_add(session_table *t, sd_journal *j, const char *field, const Journal_projection *proj)
+{
+    hashtable_entry *e;
+    session *s;
+    const void *data;
+    const char *value;
+    size_t len, value_len, field_len = strlen(field);
+    uint64_t realtime, hash;
+    int r;
+
+    r = sd_journal_get_realtime_usec(j, &realtime);
+    if (r < 0)
+        return r;
+    session_expire(t, realtime);
+
+    r = sd_journal_get_data(j, field, &data, &len);
+    if (r == -ENOENT)
+        return 0;
+    if (r < 0)
+        return r;
+    value = (const char *) data + field_len + 1;
+    value_len = len - field_len - 1;
+    hash = hash_bytes(value, value_len);
+
+    e = hashtable_find(&t->open, value, value_len, hash);
+    s = e ? e->data : NULL;
+    if (s && (int64_t) (realtime - s->end) > t->gap) {
+        /* Entries out of time order may pass a gap not yet expired */
+        session_end(t, s);
+        s = NULL;
+    }
+    if (s == NULL) {
+        if (t->open.n >= t->max_sessions) {
+            session_end(t, t->oldest);
+            t->evicted++;
+        }
+        s = PyMem_RawCalloc(1, sizeof(session));
+        if (s == NULL)
+            return -ENOMEM;
+        s->value = PyMem_RawMalloc(value_len ? value_len : 1);
+        e = s->value ? hashtable_insert(&t->open, value, value_len, hash) : NULL;
+        if (e == NULL) {
+            session_free(s);
+            return -ENOMEM;
+        }
+        memcpy(s->value, value, value_len);
+        s->value_len = value_len;
+        s->start = s->end = realtime;
+        e->data = s;
+    }else{
+        session_unlink(t, s);
+        if (realtime > s->end)
+            s->end = realtime;
+    }
+    session_append(t, s);
+
+    s->count++;
+    if (s->n_entries < t->max_entries) {
+        r = result_put_entry(&s->entries, j, proj, realtime);
+        if (r < 0)
+            return r;
+        s->n_entries++;
+    }
+    return 0;
+}
+
+/* Reads entries until a session ends or the end of the journal, where
+ * sessions whose gap has passed by the clock end. Does not require the
+ * GIL, but `self` must be locked. */
+static int
+Journal___session_scan(Journal *self, session_table *t, const char *field, const Journal_projection *proj)
+{
+    struct timespec now;
+    int r;
+
+    while (t->done == NULL) {
+        r = self->filter ? Journal___move_filtered(self, 1) : sd_journal_next(self->j);
+        if (r < 0)
+            return r;
+        if (r == 0) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            session_expire(t, (uint64_t) now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+            break;
+        }
+        r = session_add(t, self->j, field, proj);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+typedef struct {
+    PyObject_HEAD
+    Journal *journal;
+    PyObject *field;
+    Journal_projection *projection;
+    session_table sessions;
+} JournalSessions;
+
+PyDoc_STRVAR(JournalSessions__doc__,
+"Iterator over sessions of entries of a Journal, created by\n"
+"journal.sessions(). Each is a tuple of (value, start, end, count,\n"
+"entries) as sessions end. Iteration stops at the end of the journal,\n"
+"other than for sessions whose gap has passed by the clock, and may be\n"
+"resumed after wait() for sessions of entries added since. Attribute\n"
+"`open` is the number of sessions not yet ended, and `evicted` the\n"
+"number ended early as there were max_sessions open.");
+
+static int
+JournalSessions_traverse(JournalSessions *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->journal);
+    Py_VISIT(self->field);
+    return 0;
+}
+
+static int
+JournalSessions_clear(JournalSessions *self)
+{
+    Py_CLEAR(self->journal);
+    Py_CLEAR(self->field);
+    return 0;
+}
+
+static void
+JournalSessions_dealloc(JournalSessions *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    JournalSessions_clear(self);
+    Journal___projection_free(self->projection);
+    session_table_free(&self->sessions);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+/* Converts and frees the first ended session, with the journal locked */
+static PyObject *
+JournalSessions___pop(JournalSessions *self)
+{
+    session_table *t = &self->sessions;
+    session *s = t->done;
+    PyObject *key_realtime, *value, *start=NULL, *end=NULL, *entries=NULL;
+    unsigned long long count = s->count;
+    char str[21];
+
+    t->done = s->next;
+    if (t->done == NULL)
+        t->done_tail = NULL;
+
+    value = Journal___process_field(self->journal, self->field, s->value, s->value_len);
+    key_realtime = PyUnicode_FromString("__REALTIME_TIMESTAMP");
+    if (value && key_realtime) {
+        sprintf(str, "%llu", (unsigned long long) s->start);
+        start = Journal___process_field(self->journal, key_realtime, str, strlen(str));
+        sprintf(str, "%llu", (unsigned long long) s->end);
+        end = Journal___process_field(self->journal, key_realtime, str, strlen(str));
+        entries = Journal___result_entries(self->journal, s->entries.data, s->entries.len,
+                                           self->projection);
+    }
+    Py_XDECREF(key_realtime);
+    session_free(s);
+    if (value && start && end && entries)
+        return Py_BuildValue("(NNNKN)", value, start, end, count, entries);
+    Py_XDECREF(value);
+    Py_XDECREF(start);
+    Py_XDECREF(end);
+    Py_XDECREF(entries);
+    return NULL;
+}
+
+static PyObject *
+JournalSessions_iternext(JournalSessions *self)
+{
+    Journal *journal = self->journal;
+    const char *field = PyUnicode_AsUTF8(self->field);
+    PyObject *result = NULL;
+    int r = 0;
+
+    if (field == NULL)
+        return NULL;
+    if (Journal___lock(journal) < 0)
+        return NULL;
+    if (self->sessions.done == NULL) {
+        if (Journal___apply_bloom(journal, 1) < 0) {
+            Journal___unlock(journal);
+            return NULL;
+        }
+        journal->at_head = 0;
+        journal->positioned = 1;
+        if (Journal___release_reader(journal) < 0) {
+            Journal___unlock(journal);
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        r = Journal___session_scan(journal, &self->sessions, field, self->projection);
+        Py_END_ALLOW_THREADS
+    }
+    if (r == -ENOMEM)
+        PyErr_NoMemory();
+    else if (r < 0)
+        PyErr_SetString(PyExc_RuntimeError, "Error reading sessions");
+    else if (self->sessions.done)
+        result = JournalSessions___pop(self);
+    Journal___unlock(journal);
+    return result;
+}
+
+PyDoc_STRVAR(JournalSessions_flush__doc__,
+"flush() -> list\n\n"
+"End all open sessions, returning them and any others ended but not\n"
+"yet returned, as per iteration.");
+static PyObject *
+JournalSessions_flush(JournalSessions *self, PyObject *args)
+{
+    PyObject *result, *item;
+
+    result = PyList_New(0);
+    if (result == NULL)
+        return NULL;
+    if (Journal___lock(self->journal) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    while (self->sessions.oldest)
+        session_end(&self->sessions, self->sessions.oldest);
+    while (self->sessions.done) {
+        item = JournalSessions___pop(self);
+        if (item == NULL || PyList_Append(result, item) < 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(result);
+            break;
+        }
+        Py_DECREF(item);
+    }
+    Journal___unlock(self->journal);
+    return result;
+}
+
+static PyObject *
+JournalSessions_get_open(JournalSessions *self, void *closure)
+{
+    size_t n;
+
+    if (Journal___lock(self->journal) < 0)
+        return NULL;
+    n = self->sessions.open.n;
+    Journal___unlock(self->journal);
+    return PyLong_FromSize_t(n);
+}
+
+static PyObject *
+JournalSessions_get_evicted(JournalSessions *self, void *closure)
+{
+    uint64_t n;
+
+    if (Journal___lock(self->journal) < 0)
+        return NULL;
+    n = self->sessions.evicted;
+    Journal___unlock(self->journal);
+    return PyLong_FromUnsignedLongLong(n);
+}
+
+static PyMethodDef JournalSessions_methods[] = {
+    {"flush", (PyCFunction)JournalSessions_flush, METH_NOARGS,
+    JournalSessions_flush__doc__},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef JournalSessions_getseters[] = {
+    {"open", (getter)JournalSessions_get_open, NULL,
+    "number of sessions not yet ended", NULL},
+    {"evicted", (getter)JournalSessions_get_evicted, NULL,
+    "number of sessions ended early, as max_sessions were open", NULL},
+    {NULL}
+};
+
+static PyType_Slot JournalSessions_slots[] = {
+    {Py_tp_dealloc, JournalSessions_dealloc},
+    {Py_tp_traverse, JournalSessions_traverse},
+    {Py_tp_clear, JournalSessions_clear},
+    {Py_tp_doc, (void *)JournalSessions__doc__},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, JournalSessions_iternext},
+    {Py_tp_methods, JournalSessions_methods},
+    {Py_tp_getset, JournalSessions_getseters},
+    {0, NULL}
+};
+
+static PyType_Spec JournalSessions_spec = {
+    "pyjournalctl.JournalSessions",
+    sizeof(JournalSessions),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    JournalSessions_slots,
+};
+
+#define SESSIONS_DEFAULT_MAX_SESSIONS 1024
+#define SESSIONS_DEFAULT_MAX_ENTRIES  100
+
+PyDoc_STRVAR(Journal_sessions__doc__,
+"sessions(key_field, gap_usec[, fields][, max_sessions][, max_entries])\n"
+"    -> iterator\n\n"
+"Return iterator of sessions of log entries from the current position:\n"
+"entries with the same value of field `key_field`, ended by more than\n"
+"`gap_usec` microseconds without another. Each is a tuple of (value,\n"
+"start, end, count, entries), returned as soon as it ends, with the\n"
+"realtimes of its first and last entries, its number of entries, and\n"
+"a list of its entries with `fields` as per entries(). Entries without\n"
+"the field are passed over. At most `max_sessions`, by default 1024,\n"
+"are open at once, the least recently active ending early beyond that.\n"
+"At most `max_entries`, by default 100, entries are listed per session;\n"
+"later ones are only counted. See JournalSessions for follow mode.\n"
+"Moving the iterator moves the position of the journal.");
+static PyObject *
+Journal_sessions(Journal *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"key_field", "gap_usec", "fields", "max_sessions",
+                                          "max_entries", NULL};
+    PyObject *argv[5] = {NULL, NULL, NULL, NULL, NULL};
+    pyjournalctl_state *state;
+    JournalSessions *iter;
+    int64_t gap, max_sessions=SESSIONS_DEFAULT_MAX_SESSIONS, max_entries=SESSIONS_DEFAULT_MAX_ENTRIES;
+
+    if (unpack_fastcall("sessions", args, nargs, kwnames, kwlist, 2, argv) < 0)
+        return NULL;
+    if (as_cstring(argv[0]) == NULL)
+        return NULL;
+    if (as_int64(argv[1], &gap) < 0)
+        return NULL;
+    if (gap < 0LL) {
+        PyErr_SetString(PyExc_ValueError, "Gap must be positive integer");
+        return NULL;
+    }
+    if (argv[3] && argv[3] != Py_None) {
+        if (as_int64(argv[3], &max_sessions) < 0)
+            return NULL;
+        if (max_sessions < 1LL) {
+            PyErr_SetString(PyExc_ValueError, "Max sessions must be positive integer");
+            return NULL;
+        }
+    }
+    if (argv[4] && argv[4] != Py_None) {
+        if (as_int64(argv[4], &max_entries) < 0)
+            return NULL;
+        if (max_entries < 0LL) {
+            PyErr_SetString(PyExc_ValueError, "Max entries must be positive integer");
+            return NULL;
+        }
+    }
+
+    state = get_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return NULL;
+    iter = PyObject_GC_New(JournalSessions, state->JournalSessionsType);
+    if (iter == NULL)
+        return NULL;
+    Py_INCREF(self);
+    Py_INCREF(argv[0]);
+    iter->journal = self;
+    iter->field = argv[0];
+    iter->projection = NULL;
+    memset(&iter->sessions, 0, sizeof(session_table));
+    iter->sessions.gap = gap;
+    iter->sessions.max_sessions = (size_t) max_sessions;
+    iter->sessions.max_entries = (size_t) max_entries;
+    PyObject_GC_Track(iter);
+
+    if (argv[2] && argv[2] != Py_None) {
+        iter->projection = Journal___projection_new(argv[2]);
+        if (iter->projection == NULL) {
+            Py_DECREF(iter);
+            return NULL;
+        }
+        /* Entries with no fields are not worth holding */
+        if (iter->projection->n == 0)
+            iter->sessions.max_entries = 0;
+    }
+    if (hashtable_init(&iter->sessions.open, 0) < 0) {
+        Py_DECREF(iter);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *) iter;
+}
+
+PyDoc_STRVAR(Journal_seek_head__doc__,
+"seek_head() -> None\n\n"
+"Seek to before the first entry of the journal, such that the next\n"
+"entry returned is the first.");
+static PyObject *
+Journal_seek_head(Journal *self, PyObject *args)
+{
+    int r;
+    PROBE2(seek__start, self, PROBE_SEEK_HEAD);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    r = Journal___seek_head(self);
+    Journal___unlock(self);
+    PROBE3(seek__done, self, PROBE_SEEK_HEAD, r);
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Journal_seek_tail__doc__,
+"seek_tail() -> None\n\n"
+"Seek to after the last entry of the journal, such that the previous\n"
+"entry returned is the last.");
+static PyObject *
+Journal_seek_tail(Journal *self, PyObject *args)
+{
+    int r;
+    PROBE2(seek__start, self, PROBE_SEEK_TAIL);
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (Journal___seek_prepare(self) < 0) {
+        Journal___unlock(self);
+        PROBE3(seek__done, self, PROBE_SEEK_TAIL, -1);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_seek_tail(self->j);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+    PROBE3(seek__done, self, PROBE_SEEK_TAIL, r);
+    if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking to tail");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+#ifdef SD_JOURNAL_FOREACH_UNIQUE
+PyDoc_STRVAR(Journal_query_unique__doc__,
+"query_unique(field) -> a set of values\n\n"
+"Returns a set of unique values in journal for given `field`.\n"
+"Note this does not respect any journal matches.");
+static PyObject *
+Journal_query_unique(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"field", NULL};
+    PyObject *arg=NULL;
+    const char *query;
+    if (unpack_fastcall("query_unique", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if ((query = as_cstring(arg)) == NULL)
+        return NULL;
+
+    PyObject *value_set, *key, *value;
+    value_set = PySet_New(0);
+    if (value_set == NULL)
+        return NULL;
+    key = PyUnicode_FromString(query);
+    if (key == NULL) {
+        Py_DECREF(value_set);
+        return NULL;
+    }
+
+    int r;
+    if (Journal___lock(self) < 0) {
+        Py_DECREF(key);
+        Py_DECREF(value_set);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = sd_journal_query_unique(self->j, query);
+    Py_END_ALLOW_THREADS
+    if (r == -EINVAL) {
+        PyErr_SetString(PyExc_ValueError, "Invalid field name");
+    } else if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+    } else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error querying journal");
+    } else {
+        const void *uniq;
+        size_t uniq_len;
+        const char *delim_ptr;
+
+        SD_JOURNAL_FOREACH_UNIQUE(self->j, uniq, uniq_len) {
+            delim_ptr = memchr(uniq, '=', uniq_len);
+            if (delim_ptr == NULL)
+                continue;
+            value = Journal___process_field(self, key, delim_ptr + 1, (const char*) uniq + uniq_len - (delim_ptr + 1));
+            PySet_Add(value_set, value);
+            Py_DECREF(value);
+        }
+    }
+    Journal___unlock(self);
+    Py_DECREF(key);
+
+    if (r < 0) {
+        Py_DECREF(value_set);
+        return NULL;
+    }
+    return value_set;
+}
+#endif //def SD_JOURNAL_FOREACH_UNIQUE
+
+PyDoc_STRVAR(Journal_log_level__doc__,
+"log_level(level) -> None\n\n"
+"Sets maximum log level by setting matches for PRIORITY.");
+static PyObject *
+Journal_log_level(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"level", NULL};
+    PyObject *arg=NULL;
+    int64_t level;
+    if (unpack_fastcall("log_level", args, nargs, NULL, kwlist, 1, &arg) < 0)
+        return NULL;
+    if (as_int64(arg, &level) < 0)
+        return NULL;
+
+    if (level < 0 || level > 7) {
+        PyErr_SetString(PyExc_ValueError, "Log level should be 0 <= level <= 7");
+        return NULL;
+    }
+    int i, r=0;
+    char level_str[32];
+    if (Journal___lock(self) < 0)
+        return NULL;
+    for(i = 0; i <= level && r == 0; i++) {
+        sprintf(level_str, "PRIORITY=%i", i);
+        r = Journal___add_match(self, level_str, strlen(level_str));
+    }
+    Journal___unlock(self);
+    if (r < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Journal___add_id128_match(Journal *self, const char *field, sd_id128_t sd_id)
+{
+    char match[64];
+    int r;
+
+    strcpy(match, field);
+    strcat(match, "=");
+    sd_id128_to_string(sd_id, match + strlen(match));
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    r = Journal___add_match(self, match, strlen(match));
+    Journal___unlock(self);
+    if (r < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+/* Boots of list_boots(), found per journal file by matched seeks to the
+ * head and tail of each _BOOT_ID in it, then merged across files. Those
+ * of archived files are kept, as the files do not change, keyed on path
+ * and file ID. */
+typedef struct {
+    sd_id128_t boot_id;
+    uint64_t first;
+    uint64_t last;
+    char *cursor;
+} boot_info;
+
+typedef struct {
+    char *path;
+    uint8_t file_id[16];
+    int archived;
+    int seen;
+    boot_info *boots;
+    size_t n_boots;
+} boot_file;
+
+struct boot_index {
+    boot_file *files;
+    size_t n_files;
+};
+
+static void
+boot_file_clear(boot_file *f)
+{
+    size_t i;
+    for (i = 0; i < f->n_boots; i++)
+        free(f->boots[i].cursor);
+    PyMem_RawFree(f->boots);
+    free(f->path);
+}
+
+static void
+boot_index_free(boot_index *index)
+{
+    size_t i;
+    if (index == NULL)
+        return;
+    for (i = 0; i < index->n_files; i++)
+        boot_file_clear(&index->files[i]);
+    PyMem_RawFree(index->files);
+    PyMem_RawFree(index);
+}
+
+static int
+boot_info_compare(const void *a, const void *b)
+{
+    const boot_info *x = a, *y = b;
+    if (x->first != y->first)
+        return x->first < y->first ? -1 : 1;
+    return memcmp(&x->boot_id, &y->boot_id, sizeof(sd_id128_t));
+}
+
+/* Adds journal file to `list`, being a boot_index of files found */
+static void
+boot_files_add(const char *dir, int dir_fd, const char *name, void *arg)
+{
+    uint8_t header[JOURNAL_HEADER_MIN_SIZE];
+    boot_index *list = arg;
+    boot_file *f;
+    int fd, ok;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    ok = pread(fd, header, sizeof(header), 0) == sizeof(header) && memcmp(header, "LPKSHHRH", 8) == 0;
+    close(fd);
+    if (!ok)
+        return;
+    f = PyMem_RawRealloc(list->files, (list->n_files + 1) * sizeof(boot_file));
+    if (f == NULL)
+        return;
+    list->files = f;
+    f = &list->files[list->n_files];
+    memset(f, 0, sizeof(boot_file));
+    if (asprintf(&f->path, "%s/%s", dir, name) < 0)
+        return;
+    memcpy(f->file_id, header + 24, 16);
+    f->archived = strchr(name, '@') != NULL || header[16] == JOURNAL_STATE_ARCHIVED;
+    list->n_files++;
+}
+
+#ifdef SD_JOURNAL_FOREACH_UNIQUE
+/* Finds the boots of journal file `f` on a handle of its own */
+static int
+boot_file_scan(Journal *self, boot_file *f)
+{
+    char *paths[2] = {f->path, NULL}, match[64];
+    sd_journal *j=NULL;
+    boot_info *boots;
+    const void *uniq;
+    size_t uniq_len, i;
+    int r;
+
+    r = Journal___open_unfiltered(self, f->path ? paths : NULL, &j);
+    if (r >= 0)
+        r = sd_journal_query_unique(j, "_BOOT_ID");
+    if (r < 0)
+        goto finish;
+    SD_JOURNAL_FOREACH_UNIQUE(j, uniq, uniq_len) {
+        if (uniq_len != 9 + 32)
+            continue;
+        memcpy(match, (const char *) uniq + 9, 32);
+        match[32] = '\0';
+        boots = PyMem_RawRealloc(f->boots, (f->n_boots + 1) * sizeof(boot_info));
+        if (boots == NULL) {
+            r = -ENOMEM;
+            goto finish;
+        }
+        f->boots = boots;
+        memset(&boots[f->n_boots], 0, sizeof(boot_info));
+        if (sd_id128_from_string(match, &boots[f->n_boots].boot_id) >= 0)
+            f->n_boots++;
+    }
+    for (i = 0; r >= 0 && i < f->n_boots; i++) {
+        boot_info *b = &f->boots[i];
+        strcpy(match, "_BOOT_ID=");
+        sd_id128_to_string(b->boot_id, match + 9);
+        sd_journal_flush_matches(j);
+        r = sd_journal_add_match(j, match, 0);
+        if (r >= 0)
+            r = sd_journal_seek_head(j);
+        if (r >= 0 && (r = sd_journal_next(j)) > 0 &&
+            (r = sd_journal_get_realtime_usec(j, &b->first)) >= 0)
+            r = sd_journal_get_cursor(j, &b->cursor);
+        if (r >= 0)
+            r = sd_journal_seek_tail(j);
+        if (r >= 0 && (r = sd_journal_previous(j)) > 0)
+            r = sd_journal_get_realtime_usec(j, &b->last);
+    }
+
+finish:
+    if (j)
+        sd_journal_close(j);
+    if (r < 0) {
+        for (i = 0; i < f->n_boots; i++)
+            free(f->boots[i].cursor);
+        f->n_boots = 0;
+        return r;
+    }
+    return 0;
+}
+
+/* Updates the boots kept of `self`, then returns them merged across its
+ * journal files, sorted by first entry. Does not require the GIL, but
+ * `self` must be locked. */
+static int
+Journal___list_boots(Journal *self, boot_info **ret, size_t *n_ret)
+{
+    boot_index found = {NULL, 0}, *index = self->boots;
+    boot_info *boots = NULL, *b;
+    size_t i, k, m, n = 0, size = 0;
+    boot_file *f;
+    int r = 0;
+
+    if (index == NULL) {
+        index = self->boots = PyMem_RawCalloc(1, sizeof(boot_index));
+        if (index == NULL)
+            return -ENOMEM;
+    }
+    for (i = 0; i < index->n_files; i++)
+        index->files[i].seen = 0;
+    if (Journal___walk_files(self, boot_files_add, &found) < 0) {
+        /* Files not known exactly, so the journal is scanned as a whole,
+         * not kept */
+        found.files = PyMem_RawCalloc(1, sizeof(boot_file));
+        if (found.files == NULL)
+            return -ENOMEM;
+        found.n_files = 1;
+    }
+
+    for (k = 0; r >= 0 && k < found.n_files; k++) {
+        f = &found.files[k];
+        for (i = 0; f->path && i < index->n_files; i++) {
+            if (strcmp(index->files[i].path, f->path) == 0 &&
+                memcmp(index->files[i].file_id, f->file_id, 16) == 0)
+                break;
+        }
+        if (i < index->n_files) {
+            index->files[i].seen = 1;
+            f = &index->files[i];
+        }else{
+            /* Files which cannot be read are left out, and not kept */
+            r = boot_file_scan(self, f);
+            if (r == -ENOMEM)
+                break;
+            if (f->archived && r >= 0) {
+                boot_file *files = PyMem_RawRealloc(index->files, (index->n_files + 1) * sizeof(boot_file));
+                if (files == NULL) {
+                    r = -ENOMEM;
+                    break;
+                }
+                index->files = files;
+                files[index->n_files] = *f;
+                files[index->n_files].seen = 1;
+                memset(f, 0, sizeof(boot_file));
+                f = &files[index->n_files++];
+            }
+            r = 0;
+        }
+        for (m = 0; m < f->n_boots; m++) {
+            if (f->boots[m].cursor == NULL)
+                continue;
+            for (i = 0; i < n && !sd_id128_equal(boots[i].boot_id, f->boots[m].boot_id); i++);
+            if (i == n) {
+                if (n == size) {
+                    size = size ? size * 2 : 16;
+                    b = PyMem_RawRealloc(boots, size * sizeof(boot_info));
+                    if (b == NULL) {
+                        r = -ENOMEM;
+                        break;
+                    }
+                    boots = b;
+                }
+                boots[n++] = f->boots[m];
+            }else{
+                if (f->boots[m].first < boots[i].first) {
+                    boots[i].first = f->boots[m].first;
+                    boots[i].cursor = f->boots[m].cursor;
+                }
+                if (f->boots[m].last > boots[i].last)
+                    boots[i].last = f->boots[m].last;
+            }
+        }
+    }
+
+    /* Cursors of the merged boots are copied, as those of files which
+     * are not kept are freed with them */
+    for (i = 0; r >= 0 && i < n; i++) {
+        if ((boots[i].cursor = strdup(boots[i].cursor)) == NULL)
+            r = -ENOMEM;
+    }
+    if (r < 0) {
+        while (i-- > 0)
+            free(boots[i].cursor);
+        PyMem_RawFree(boots);
+        boots = NULL;
+        n = 0;
+    }else if (n > 0) {
+        qsort(boots, n, sizeof(boot_info), boot_info_compare);
+    }
+
+    /* Drops files since rotated away or removed */
+    for (i = 0, k = 0; i < index->n_files; i++) {
+        if (index->files[i].seen)
+            index->files[k++] = index->files[i];
+        else
+            boot_file_clear(&index->files[i]);
+    }
+    index->n_files = k;
+    for (k = 0; k < found.n_files; k++)
+        boot_file_clear(&found.files[k]);
+    PyMem_RawFree(found.files);
 
-    PyObject *key, *value;
-    Py_ssize_t pos=0, match_key_len, match_value_len;
-    int match_len;
-    char *match_key, *match_value;
-    void *match;
-    while (PyDict_Next(keywds, &pos, &key, &value)) {
-#if PY_MAJOR_VERSION >=3
-        if (PyUnicode_Check(key)) {
-#if PY_MINOR_VERSION >=3
-            match_key = PyUnicode_AsUTF8AndSize(key, &match_key_len);
-#else
-            PyObject *temp2;
-            temp2 = PyUnicode_AsUTF8String(key);
-            PyBytes_AsStringAndSize(temp2, &match_key, &match_key_len);
-            Py_DECREF(temp2);
-#endif
-        }else if (PyBytes_Check(key)) {
-            PyBytes_AsStringAndSize(key, &match_key, &match_key_len);
-        }else{
-            PyErr_SetString(PyExc_TypeError, "expected bytes or string");
+    *ret = boots;
+    *n_ret = n;
+    return r;
+}
+
+static void
+boot_infos_free(boot_info *boots, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        free(boots[i].cursor);
+    PyMem_RawFree(boots);
+}
+
+static int
+Journal___boots(Journal *self, boot_info **boots, size_t *n)
+{
+    int r;
+
+    if (Journal___lock(self) < 0)
+        return -1;
+    Py_BEGIN_ALLOW_THREADS
+    r = Journal___list_boots(self, boots, n);
+    Py_END_ALLOW_THREADS
+    Journal___unlock(self);
+    if (r == -ENOMEM) {
+        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
+        return -1;
+    }else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error listing boots");
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(Journal_list_boots__doc__,
+"list_boots() -> list\n\n"
+"Return list of (boot ID, first realtime, last realtime, first cursor)\n"
+"tuples of each boot in the journal, earliest first. They are found by\n"
+"seeking to the head and tail of each boot in each journal file, rather\n"
+"than by reading entries, and are kept for archived files where the\n"
+"files of the journal are known exactly from its flags. Values are\n"
+"converted as per _BOOT_ID and __REALTIME_TIMESTAMP. This does not\n"
+"respect any journal matches.");
+static PyObject *
+Journal_list_boots(Journal *self, PyObject *args)
+{
+    PyObject *result, *key_id=NULL, *key_realtime=NULL, *item;
+    char str[33];
+    boot_info *boots = NULL;
+    size_t n = 0, i;
+
+    if (Journal___boots(self, &boots, &n) < 0)
+        return NULL;
+
+    result = PyList_New(n);
+    key_id = PyUnicode_FromString("_BOOT_ID");
+    key_realtime = PyUnicode_FromString("__REALTIME_TIMESTAMP");
+    if (result == NULL || key_id == NULL || key_realtime == NULL) {
+        Py_CLEAR(result);
+        goto finish;
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *boot_id, *first, *last;
+        sd_id128_to_string(boots[i].boot_id, str);
+        boot_id = Journal___process_field(self, key_id, str, 32);
+        sprintf(str, "%llu", (unsigned long long) boots[i].first);
+        first = Journal___process_field(self, key_realtime, str, strlen(str));
+        sprintf(str, "%llu", (unsigned long long) boots[i].last);
+        last = Journal___process_field(self, key_realtime, str, strlen(str));
+        item = boot_id && first && last ? Py_BuildValue("(NNNs)", boot_id, first, last, boots[i].cursor) : NULL;
+        if (item == NULL) {
+            if (!(boot_id && first && last)) {
+                Py_XDECREF(boot_id);
+                Py_XDECREF(first);
+                Py_XDECREF(last);
+            }
+            Py_CLEAR(result);
+            goto finish;
         }
-        if (PyUnicode_Check(value)) {
-#if PY_MINOR_VERSION >=3
-            match_value = PyUnicode_AsUTF8AndSize(value, &match_value_len);
-#else
-            PyObject *temp3;
-            temp3 = PyUnicode_AsUTF8String(value);
-            PyBytes_AsStringAndSize(temp3, &match_value, &match_value_len);
-            Py_DECREF(temp3);
+        PyList_SET_ITEM(result, i, item);
+    }
+
+finish:
+    Py_XDECREF(key_id);
+    Py_XDECREF(key_realtime);
+    boot_infos_free(boots, n);
+    return result;
+}
+
+PyDoc_STRVAR(Journal_boot__doc__,
+"boot([offset]) -> None\n\n"
+"Sets match filter for the _BOOT_ID of boot `offset`, as per\n"
+"journalctl --boot: 0, the default, is the last boot and negative\n"
+"offsets earlier boots, while positive offsets count from the first\n"
+"boot as 1. Boots are as per list_boots(). Without a `path`, boot 0 is\n"
+"the current boot, as per this_boot().");
+static PyObject *
+Journal_boot(Journal *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    static const char * const kwlist[] = {"offset", NULL};
+    PyObject *arg=NULL;
+    boot_info *boots = NULL;
+    sd_id128_t boot_id;
+    int64_t offset = 0;
+    size_t n = 0;
+
+    if (unpack_fastcall("boot", args, nargs, NULL, kwlist, 0, &arg) < 0)
+        return NULL;
+    if (arg && as_int64(arg, &offset) < 0)
+        return NULL;
+    if (offset == 0 && self->path == NULL && sd_id128_get_boot(&boot_id) >= 0)
+        return Journal___add_id128_match(self, "_BOOT_ID", boot_id);
+
+    if (Journal___boots(self, &boots, &n) < 0)
+        return NULL;
+    if (offset > 0 ? (uint64_t) offset > n : (uint64_t) -offset >= n) {
+        boot_infos_free(boots, n);
+        PyErr_SetString(PyExc_ValueError, "No boot at offset");
+        return NULL;
+    }
+    boot_id = boots[offset > 0 ? offset - 1 : (int64_t) n - 1 + offset].boot_id;
+    boot_infos_free(boots, n);
+    return Journal___add_id128_match(self, "_BOOT_ID", boot_id);
+}
+#endif //def SD_JOURNAL_FOREACH_UNIQUE
+
+PyDoc_STRVAR(Journal_this_boot__doc__,
+"this_boot() -> None\n\n"
+"Sets match filter for the current _BOOT_ID.");
+static PyObject *
+Journal_this_boot(Journal *self, PyObject *args)
+{
+    sd_id128_t sd_id;
+    int r;
+    r = sd_id128_get_boot(&sd_id);
+    if (r == -EIO) {
+        PyErr_SetString(PyExc_IOError, "Error getting current boot ID");
+        return NULL;
+    } else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error getting current boot ID");
+        return NULL;
+    }
+
+    return Journal___add_id128_match(self, "_BOOT_ID", sd_id);
+}
+
+PyDoc_STRVAR(Journal_this_machine__doc__,
+"this_machine() -> None\n\n"
+"Sets match filter for the current _MACHINE_ID.");
+static PyObject *
+Journal_this_machine(Journal *self, PyObject *args)
+{
+    sd_id128_t sd_id;
+    int r;
+    r = sd_id128_get_machine(&sd_id);
+    if (r == -EIO) {
+        PyErr_SetString(PyExc_IOError, "Error getting current boot ID");
+        return NULL;
+    } else if (r < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Error getting current boot ID");
+        return NULL;
+    }
+
+    return Journal___add_id128_match(self, "_MACHINE_ID", sd_id);
+}
+
+PyDoc_STRVAR(Journal_value_cache_info__doc__,
+"value_cache_info() -> dict\n\n"
+"Return dictionary of value cache statistics: `hits` and `misses` of\n"
+"lookups, `size` of values held, `fields` seen and `max_values` per\n"
+"field as set by the `value_cache` argument.");
+static PyObject *
+Journal_value_cache_info(Journal *self, PyObject *args)
+{
+    unsigned long long hits, misses, size, fields;
+    Py_ssize_t max_values;
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    hits = self->cache.hits;
+    misses = self->cache.misses;
+    size = self->cache.values.n;
+    fields = self->cache.fields.n;
+    max_values = self->cache.max_values;
+    Journal___unlock(self);
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:n}", "hits", hits, "misses", misses,
+                         "size", size, "fields", fields, "max_values", max_values);
+}
+
+static PyObject *
+Journal_get_default_call(Journal *self, void *closure)
+{
+    PyObject *value;
+    if (Journal___lock(self) < 0)
+        return NULL;
+    value = self->default_call;
+    Py_INCREF(value);
+    Journal___unlock(self);
+    return value;
+}
+
+static int
+Journal_set_default_call(Journal *self, PyObject *value, void *closure)
+{
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete default_call");
+        return -1;
+    }
+    if (! PyCallable_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "default_call must be callable");
+        return -1;
+    }
+    PyObject *old, *dropped;
+    value_cache old_cache;
+    if (Journal___lock(self) < 0)
+        return -1;
+    Py_INCREF(value);
+    old = self->default_call;
+    self->default_call = value;
+    Journal___cache_detach(self, &old_cache);
+    if (self->results)
+        result_cache_clear(self->results);
+    dropped = result_cache_dropped(self->results);
+    Journal___unlock(self);
+    Py_DECREF(old);
+    Py_XDECREF(dropped);
+    value_cache_free(&old_cache);
+
+    return 0;
+}
+
+PyDoc_STRVAR(Journal_bloom_info__doc__,
+"bloom_info() -> dict\n\n"
+"Return dictionary of bloom filter statistics: number of journal\n"
+"`files`, those `indexed` by a filter, filters `built` rather than\n"
+"loaded from sidecar files, and files `pruned` for the current matches,\n"
+"which is 0 unless at least half of the files could be.\n"
+"Returns None if bloom filters are not in use.");
+static PyObject *
+Journal_bloom_info(Journal *self, PyObject *args)
+{
+    unsigned long long files = 0, indexed = 0, built = 0, pruned = 0;
+    size_t i;
+
+    if (Journal___lock(self) < 0)
+        return NULL;
+    if (self->bloom == NULL) {
+        Journal___unlock(self);
+        Py_RETURN_NONE;
+    }
+    files = self->bloom->n_files;
+    for (i = 0; i < self->bloom->n_files; i++)
+        indexed += self->bloom->files[i].bits != NULL;
+    built = self->bloom->built;
+    pruned = self->bloom->pruned;
+    Journal___unlock(self);
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K}", "files", files, "indexed", indexed,
+                         "built", built, "pruned", pruned);
+}
+
+static PyObject *
+Journal_get_engine(Journal *self, void *closure)
+{
+    return PyUnicode_FromString(self->reader ? "mmap" : "sd-journal");
+}
+
+static PyObject *
+Journal_get_call_dict(Journal *self, void *closure)
+{
+    PyObject *value;
+    if (Journal___lock(self) < 0)
+        return NULL;
+    value = self->call_dict;
+    Py_INCREF(value);
+    Journal___unlock(self);
+    return value;
+}
+
+static int
+Journal_set_call_dict(Journal *self, PyObject *value, void *closure)
+{
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete call_dict");
+        return -1;
+    }
+    if (! PyDict_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "call_dict must be dict type");
+        return -1;
+    }
+    PyObject *old, *dropped;
+    value_cache old_cache;
+    if (Journal___lock(self) < 0)
+        return -1;
+    Py_INCREF(value);
+    old = self->call_dict;
+    self->call_dict = value;
+    Journal___cache_detach(self, &old_cache);
+    if (self->results)
+        result_cache_clear(self->results);
+    dropped = result_cache_dropped(self->results);
+    Journal___unlock(self);
+    Py_DECREF(old);
+    Py_XDECREF(dropped);
+    value_cache_free(&old_cache);
+
+    return 0;
+}
+
+/*static PyObject *
+Journal_get_data_threshold(Journal *self, void *closure)
+{
+    size_t cvalue;
+    PyObject *value;
+    int r;
+
+    r = sd_journal_get_data_threshold(self->j, &cvalue);
+    if (r < 0){
+        PyErr_SetString(PyExc_RuntimeError, "Error getting data threshold");
+        return NULL;
+    }
+
+    value = PyLong_FromSize_t(cvalue);
+    return value;
+}
+
+static int
+Journal_set_data_threshold(Journal *self, PyObject *value, void *closure)
+{
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete data threshold");
+        return -1;
+    }
+    if (! PyLong_Check(value)){
+        PyErr_SetString(PyExc_TypeError, "Data threshold must be int");
+        return -1;
+    }
+    int r;
+    r = sd_journal_set_data_threshold(self->j, (size_t) PyLong_AsLong(value));
+    if (r < 0){
+        PyErr_SetString(PyExc_RuntimeError, "Error setting data threshold");
+        return -1;
+    }
+    return 0;
+} */
+
+static PyGetSetDef Journal_getseters[] = {
+/*    {"data_threshold",
+    (getter)Journal_get_data_threshold,
+    (setter)Journal_set_data_threshold,
+    "data threshold",
+    NULL},*/
+    {"call_dict",
+    (getter)Journal_get_call_dict,
+    (setter)Journal_set_call_dict,
+    "dictionary of calls for each field",
+    NULL},
+    {"default_call",
+    (getter)Journal_get_default_call,
+    (setter)Journal_set_default_call,
+    "default call for values for fields",
+    NULL},
+    {"engine",
+    (getter)Journal_get_engine,
+    NULL,
+    "engine reading the journal, \"mmap\" or \"sd-journal\"",
+    NULL},
+    {NULL}
+};
+
+static PyMethodDef Journal_methods[] = {
+    {"get_next", (PyCFunction)(void(*)(void))Journal_get_next, METH_FASTCALL,
+    Journal_get_next__doc__},
+    {"get_previous", (PyCFunction)(void(*)(void))Journal_get_previous, METH_FASTCALL,
+    Journal_get_previous__doc__},
+    {"get_next_raw", (PyCFunction)(void(*)(void))Journal_get_next_raw, METH_FASTCALL | METH_KEYWORDS,
+    Journal_get_next_raw__doc__},
+    {"add_match", (PyCFunction)(void(*)(void))Journal_add_match, METH_FASTCALL | METH_KEYWORDS,
+    Journal_add_match__doc__},
+    {"add_disjunction", (PyCFunction)Journal_add_disjunction, METH_NOARGS,
+    Journal_add_disjunction__doc__},
+    {"flush_matches", (PyCFunction)Journal_flush_matches, METH_NOARGS,
+    Journal_flush_matches__doc__},
+    {"filter", (PyCFunction)(void(*)(void))Journal_filter, METH_FASTCALL,
+    Journal_filter__doc__},
+    {"seek", (PyCFunction)(void(*)(void))Journal_seek, METH_FASTCALL | METH_KEYWORDS,
+    Journal_seek__doc__},
+    {"seek_head", (PyCFunction)Journal_seek_head, METH_NOARGS,
+    Journal_seek_head__doc__},
+    {"seek_tail", (PyCFunction)Journal_seek_tail, METH_NOARGS,
+    Journal_seek_tail__doc__},
+    {"parallel_scan", (PyCFunction)(void(*)(void))Journal_parallel_scan, METH_FASTCALL | METH_KEYWORDS,
+    Journal_parallel_scan__doc__},
+    {"plan_shards", (PyCFunction)(void(*)(void))Journal_plan_shards, METH_FASTCALL | METH_KEYWORDS,
+    Journal_plan_shards__doc__},
+    {"range", (PyCFunction)(void(*)(void))Journal_range, METH_FASTCALL | METH_KEYWORDS,
+    Journal_range__doc__},
+    {"update_index", (PyCFunction)(void(*)(void))Journal_update_index, METH_FASTCALL,
+    Journal_update_index__doc__},
+    {"search", (PyCFunction)(void(*)(void))Journal_search, METH_FASTCALL | METH_KEYWORDS,
+    Journal_search__doc__},
+    {"add_continuous_query", (PyCFunction)(void(*)(void))Journal_add_continuous_query, METH_FASTCALL | METH_KEYWORDS,
+    Journal_add_continuous_query__doc__},
+    {"continuous_query", (PyCFunction)(void(*)(void))Journal_continuous_query, METH_FASTCALL,
+    Journal_continuous_query__doc__},
+    {"remove_continuous_query", (PyCFunction)(void(*)(void))Journal_remove_continuous_query, METH_FASTCALL,
+    Journal_remove_continuous_query__doc__},
+    {"between", (PyCFunction)(void(*)(void))Journal_between, METH_FASTCALL | METH_KEYWORDS,
+    Journal_between__doc__},
+    {"seek_realtime", (PyCFunction)(void(*)(void))Journal_seek_realtime, METH_FASTCALL,
+    Journal_seek_realtime__doc__},
+    {"seek_monotonic", (PyCFunction)(void(*)(void))Journal_seek_monotonic, METH_FASTCALL,
+    Journal_seek_monotonic__doc__},
+    {"wait", (PyCFunction)(void(*)(void))Journal_wait, METH_FASTCALL,
+    Journal_wait__doc__},
+    {"seek_cursor", (PyCFunction)(void(*)(void))Journal_seek_cursor, METH_FASTCALL,
+    Journal_seek_cursor__doc__},
+    {"entries", (PyCFunction)(void(*)(void))Journal_entries, METH_FASTCALL | METH_KEYWORDS,
+    Journal_entries__doc__},
+    {"__reversed__", (PyCFunction)Journal_reversed, METH_NOARGS,
+    Journal_reversed__doc__},
+    {"sample", (PyCFunction)(void(*)(void))Journal_sample, METH_FASTCALL | METH_KEYWORDS,
+    Journal_sample__doc__},
+    {"reservoir", (PyCFunction)(void(*)(void))Journal_reservoir, METH_FASTCALL | METH_KEYWORDS,
+    Journal_reservoir__doc__},
+#ifdef SD_JOURNAL_FOREACH_UNIQUE
+    {"query_unique", (PyCFunction)(void(*)(void))Journal_query_unique, METH_FASTCALL,
+    Journal_query_unique__doc__},
 #endif
-        }else if (PyBytes_Check(value)) {
-            PyBytes_AsStringAndSize(value, &match_value, &match_value_len);
-        }else{
-            PyErr_SetString(PyExc_TypeError, "expected bytes or string");
-        }
-#else
-        PyString_AsStringAndSize(key, &match_key, &match_key_len);
-        PyString_AsStringAndSize(value, &match_value, &match_value_len);
+    {"log_level", (PyCFunction)(void(*)(void))Journal_log_level, METH_FASTCALL,
+    Journal_log_level__doc__},
+#ifdef SD_JOURNAL_FOREACH_UNIQUE
+    {"list_boots", (PyCFunction)Journal_list_boots, METH_NOARGS,
+    Journal_list_boots__doc__},
+    {"boot", (PyCFunction)(void(*)(void))Journal_boot, METH_FASTCALL,
+    Journal_boot__doc__},
 #endif
-        if (PyErr_Occurred())
-            return NULL;
+    {"this_boot", (PyCFunction)Journal_this_boot, METH_NOARGS,
+    Journal_this_boot__doc__},
+    {"this_machine", (PyCFunction)Journal_this_machine, METH_NOARGS,
+    Journal_this_machine__doc__},
+    {"value_cache_info", (PyCFunction)Journal_value_cache_info, METH_NOARGS,
+    Journal_value_cache_info__doc__},
+    {"get_by_cursors", (PyCFunction)(void(*)(void))Journal_get_by_cursors, METH_FASTCALL | METH_KEYWORDS,
+    Journal_get_by_cursors__doc__},
+    {"sessions", (PyCFunction)(void(*)(void))Journal_sessions, METH_FASTCALL | METH_KEYWORDS,
+    Journal_sessions__doc__},
+    {"result_cache_info", (PyCFunction)Journal_result_cache_info, METH_NOARGS,
+    Journal_result_cache_info__doc__},
+    {"bloom_info", (PyCFunction)Journal_bloom_info, METH_NOARGS,
+    Journal_bloom_info__doc__},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Journal_slots[] = {
+    {Py_tp_dealloc, Journal_dealloc},
+    {Py_tp_traverse, Journal_traverse},
+    {Py_tp_clear, Journal_clear},
+    {Py_tp_doc, (void *)Journal__doc__},
+    {Py_tp_iter, Journal_iter},
+    {Py_tp_iternext, Journal_iternext},
+    {Py_tp_methods, Journal_methods},
+    {Py_tp_getset, Journal_getseters},
+    {Py_tp_init, Journal_init},
+    {Py_tp_new, Journal_new},
+    {0, NULL}
+};
+
+static PyType_Spec Journal_spec = {
+    "pyjournalctl.Journal",
+    sizeof(Journal),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    Journal_slots,
+};
+
+/* Writer of entries to journald by its native protocol, one datagram per
+ * entry, sent in batches by sendmmsg. Entries too large for a datagram
+ * are passed as a sealed memfd, as per sd_journal_sendv(). */
+#define WRITER_DEFAULT_PATH  "/run/systemd/journal/socket"
+#define WRITER_DEFAULT_BATCH 64
+#define WRITER_MMSG_MAX      64
+#define WRITER_SNDBUF        (8 * 1024 * 1024)
+
+typedef struct {
+    PyObject_HEAD
+    journal_lock_t lock;
+    int fd;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    Py_ssize_t batch_size;
+    char *buf;
+    size_t buf_len;
+    size_t buf_size;
+    size_t *ends;
+    Py_ssize_t n_pending;
+    Py_ssize_t ends_size;
+} JournalWriter;
 
-        match_len = match_key_len + 1 + match_value_len;
-        match = malloc(match_len);
-        memcpy(match, match_key, match_key_len);
-        memcpy(match + match_key_len, "=", 1);
-        memcpy(match + match_key_len + 1, match_value, match_value_len);
+static int
+writer_reserve(JournalWriter *self, size_t len)
+{
+    char *buf;
+    size_t size = self->buf_size ? self->buf_size : 4096;
 
-        r = sd_journal_add_match(self->j, match, match_len);
-        free(match);
-        if (r == -EINVAL) {
-            PyErr_SetString(PyExc_ValueError, "Invalid match");
-            return NULL;
-        }else if (r == -ENOMEM) {
-            PyErr_SetString(PyExc_MemoryError, "Not enough memory");
-            return NULL;
-        }else if (r < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Error adding match");
-            return NULL;
-        }
+    if (self->buf_len + len <= self->buf_size)
+        return 0;
+    while (size < self->buf_len + len)
+        size *= 2;
+    buf = PyMem_Realloc(self->buf, size);
+    if (buf == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
-
-    Py_RETURN_NONE;
+    self->buf = buf;
+    self->buf_size = size;
+    return 0;
 }
 
-PyDoc_STRVAR(Journal_add_disjunction__doc__,
-"add_disjunction() -> None\n\n"
-"Once called, all matches before and after are combined in logical\n"
-"OR.");
-static PyObject *
-Journal_add_disjunction(Journal *self, PyObject *args)
+/* Field names as accepted by journald from clients */
+static int
+writer_valid_field(const char *name, size_t len)
 {
-    int r;
-    r = sd_journal_add_disjunction(self->j);
-    if (r == -ENOMEM) {
-        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
-        return NULL;
-    }else if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error adding disjunction");
-        return NULL;
+    size_t i;
+    if (len == 0 || len > 64 || name[0] == '_' || (name[0] >= '0' && name[0] <= '9'))
+        return 0;
+    for (i = 0; i < len; i++) {
+        if (!((name[i] >= 'A' && name[i] <= 'Z') || (name[i] >= '0' && name[i] <= '9') || name[i] == '_'))
+            return 0;
     }
-    Py_RETURN_NONE;
+    return 1;
 }
 
-PyDoc_STRVAR(Journal_flush_matches__doc__,
-"flush_matches() -> None\n\n"
-"Clears all current match filters.");
-static PyObject *
-Journal_flush_matches(Journal *self, PyObject *args)
+/* Appends "NAME=value\n", or binary safe "NAME\n<le64 length>value\n"
+ * where value contains a newline */
+static int
+JournalWriter___add_data(JournalWriter *self, const char *name, size_t name_len,
+                         const char *value, size_t value_len)
 {
-    sd_journal_flush_matches(self->j);
-    Py_RETURN_NONE;
+    char *p;
+    int binary = memchr(value, '\n', value_len) != NULL;
+
+    if (writer_reserve(self, name_len + value_len + (binary ? 10 : 2)) < 0)
+        return -1;
+    p = self->buf + self->buf_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    if (binary) {
+        uint64_t le = htole64(value_len);
+        *p++ = '\n';
+        memcpy(p, &le, 8);
+        p += 8;
+    }else{
+        *p++ = '=';
+    }
+    memcpy(p, value, value_len);
+    p += value_len;
+    *p++ = '\n';
+    self->buf_len = p - self->buf;
+    return 0;
 }
 
-PyDoc_STRVAR(Journal_seek__doc__,
-"seek(offset[, whence]) -> None\n\n"
-"Seek through journal by `offset` number of entries. Argument\n"
-"`whence` defines what the offset is relative to:\n"
-"os.SEEK_SET (default) from first match in journal;\n"
-"os.SEEK_CUR from current position in journal;\n"
-"and os.SEEK_END is from last match in journal.");
-static PyObject *
-Journal_seek(Journal *self, PyObject *args, PyObject *keywds)
+/* Appends field name `key` and value to list `fields`, as bytes, str or
+ * int, or str() of others, so that no python code is run once the writer
+ * is locked. Sequences give a value each. */
+static int
+JournalWriter___convert_field(PyObject *fields, PyObject *key, PyObject *value, int nested)
 {
-    int64_t offset;
-    int whence=SEEK_SET;
-    static char *kwlist[] = {"offset", "whence", NULL};
+    const char *name;
+    Py_ssize_t name_len, i;
+    PyObject *temp;
+    int r;
 
-    if (! PyArg_ParseTupleAndKeywords(args, keywds, "L|i", kwlist,
-                                      &offset, &whence))
-        return NULL;
+    name = PyUnicode_Check(key) ? PyUnicode_AsUTF8AndSize(key, &name_len) : NULL;
+    if (name == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "Field names must be strings");
+        return -1;
+    }
+    if (!writer_valid_field(name, name_len)) {
+        PyErr_Format(PyExc_ValueError, "Invalid field name: %R", key);
+        return -1;
+    }
 
-    PyObject *arg;
-    if (whence == SEEK_SET){
-        int r;
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_seek_head(self->j);
-        Py_END_ALLOW_THREADS
-        if (r < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Error seeking to head");
-            return NULL;
-        }
-        if (offset > 0LL) {
-            arg = Py_BuildValue("(L)", offset);
-            Py_DECREF(Journal_get_next(self, arg));
-            Py_DECREF(arg);
-        }
-    }else if (whence == SEEK_CUR){
-        arg = Py_BuildValue("(L)", offset);
-        Py_DECREF(Journal_get_next(self, arg));
-        Py_DECREF(arg);
-    }else if (whence == SEEK_END){
-        int r;
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_seek_tail(self->j);
-        Py_END_ALLOW_THREADS
-        if (r < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Error seeking to tail");
-            return NULL;
+    if (!nested && (PyList_Check(value) || PyTuple_Check(value))) {
+        for (i = 0; i < PySequence_Fast_GET_SIZE(value); i++) {
+            PyObject *item = PySequence_Fast_GET_ITEM(value, i);
+            Py_INCREF(item);
+            r = JournalWriter___convert_field(fields, key, item, 1);
+            Py_DECREF(item);
+            if (r < 0)
+                return -1;
         }
-        arg = Py_BuildValue("(L)", -1LL);
-        Py_DECREF(Journal_get_next(self, arg));
-        Py_DECREF(arg);
-        if (offset < 0LL) {
-            arg = Py_BuildValue("(L)", offset);
-            Py_DECREF(Journal_get_next(self, arg));
-            Py_DECREF(arg);
+        return 0;
+    }
+    if (PyBytes_Check(value) || PyUnicode_Check(value)) {
+        Py_INCREF(value);
+        temp = value;
+    }else if (PyLong_Check(value) && !PyBool_Check(value)) {
+        int overflow;
+        long long n = PyLong_AsLongLongAndOverflow(value, &overflow);
+        if (n == -1 && PyErr_Occurred())
+            return -1;
+        if (overflow) {
+            temp = PyObject_Str(value);
+        }else{
+            Py_INCREF(value);
+            temp = value;
         }
     }else{
-        PyErr_SetString(PyExc_ValueError, "Invalid value for whence");
-        return NULL;
+        temp = PyObject_Str(value);
     }
-    Py_RETURN_NONE;
+    if (temp == NULL)
+        return -1;
+    r = PyList_Append(fields, key) < 0 || PyList_Append(fields, temp) < 0 ? -1 : 0;
+    Py_DECREF(temp);
+    return r;
 }
 
-PyDoc_STRVAR(Journal_seek_realtime__doc__,
-"seek_realtime(realtime) -> None\n\n"
-"Seek to nearest matching journal entry to `realtime`. Argument\n"
-"`realtime` can be an integer unix timestamp in usecs or a "
-"datetime instance.");
-static PyObject *
-Journal_seek_realtime(Journal *self, PyObject *args)
+/* Appends field from a value converted by JournalWriter___convert_field,
+ * without building strings for them */
+static int
+JournalWriter___add_field(JournalWriter *self, PyObject *key, PyObject *value)
 {
-    PyObject *arg;
-    if (! PyArg_ParseTuple(args, "O", &arg))
-        return NULL;
+    const char *name, *data;
+    Py_ssize_t name_len, data_len;
+    char number[24];
 
-    uint64_t timestamp=-1LL;
-    if (PyDateTime_Check(arg)) {
-        PyObject *temp;
-        char *timestamp_str;
-        temp = PyObject_CallMethod(arg, "strftime", "s", "%s%f");
-#if PY_MAJOR_VERSION >=3
-        PyObject *temp2;
-        temp2 = PyUnicode_AsUTF8String(temp);
-        timestamp_str = PyBytes_AsString(temp2);
-        Py_DECREF(temp2);
-#else
-        timestamp_str = PyString_AsString(temp);
-#endif
-        Py_DECREF(temp);
-        timestamp = strtoull(timestamp_str, NULL, 10);
-    }else if (PyLong_Check(arg)) {
-        timestamp = PyLong_AsUnsignedLongLong(arg);
-#if PY_MAJOR_VERSION <3
-    }else if (PyInt_Check(arg)) {
-        timestamp = PyInt_AsUnsignedLongLongMask(arg);
-#endif
+    if ((name = PyUnicode_AsUTF8AndSize(key, &name_len)) == NULL)
+        return -1;
+    if (PyBytes_Check(value)) {
+        data = PyBytes_AS_STRING(value);
+        data_len = PyBytes_GET_SIZE(value);
+    }else if (PyUnicode_Check(value)) {
+        if ((data = PyUnicode_AsUTF8AndSize(value, &data_len)) == NULL)
+            return -1;
+    }else{
+        data_len = snprintf(number, sizeof(number), "%lld", PyLong_AsLongLong(value));
+        data = number;
     }
-    if ((int64_t) timestamp < 0LL) {
-        PyErr_SetString(PyExc_ValueError, "Time must be positive integer or datetime instance");
-        return NULL;
+    return JournalWriter___add_data(self, name, name_len, data, data_len);
+}
+
+static int
+writer_send_memfd(JournalWriter *self, const char *data, size_t len)
+{
+    union {
+        struct cmsghdr cmsghdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    size_t done = 0;
+    int memfd, r = 0;
+
+    memfd = memfd_create("journal-data", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+    if (memfd < 0)
+        return -errno;
+    while (done < len) {
+        ssize_t n = write(memfd, data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            r = -errno;
+            break;
+        }
+        done += n;
+    }
+    if (r == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+        r = -errno;
+    if (r == 0) {
+        memset(&control, 0, sizeof(control));
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_name = &self->addr;
+        mh.msg_namelen = self->addr_len;
+        mh.msg_control = &control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+        while ((r = sendmsg(self->fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+        r = r < 0 ? -errno : 0;
+    }
+    close(memfd);
+    return r;
+}
+
+/* Sends pending entries, keeping any not sent. Does not require the GIL,
+ * but `self` must be locked. */
+static int
+JournalWriter___send(JournalWriter *self, Py_ssize_t *sent)
+{
+    struct mmsghdr msgs[WRITER_MMSG_MAX];
+    struct iovec iov[WRITER_MMSG_MAX];
+    Py_ssize_t i = 0, k, n;
+    size_t start;
+    int r = 0;
+
+    while (i < self->n_pending && r >= 0) {
+        n = self->n_pending - i < WRITER_MMSG_MAX ? self->n_pending - i : WRITER_MMSG_MAX;
+        memset(msgs, 0, n * sizeof(struct mmsghdr));
+        for (k = 0; k < n; k++) {
+            start = i + k > 0 ? self->ends[i + k - 1] : 0;
+            iov[k].iov_base = self->buf + start;
+            iov[k].iov_len = self->ends[i + k] - start;
+            msgs[k].msg_hdr.msg_name = &self->addr;
+            msgs[k].msg_hdr.msg_namelen = self->addr_len;
+            msgs[k].msg_hdr.msg_iov = &iov[k];
+            msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+        r = sendmmsg(self->fd, msgs, n, MSG_NOSIGNAL);
+        if (r > 0) {
+            i += r;
+            r = 0;
+        }else if (r < 0 && errno == EINTR) {
+            r = 0;
+        }else if (r < 0 && (errno == EMSGSIZE || errno == ENOBUFS)) {
+            r = writer_send_memfd(self, iov[0].iov_base, iov[0].iov_len);
+            if (r == 0)
+                i++;
+        }else if (r < 0) {
+            r = -errno;
+        }
     }
 
+    if (i > 0) {
+        start = self->ends[i - 1];
+        memmove(self->buf, self->buf + start, self->buf_len - start);
+        self->buf_len -= start;
+        for (k = i; k < self->n_pending; k++)
+            self->ends[k - i] = self->ends[k] - start;
+        self->n_pending -= i;
+    }
+    *sent = i;
+    return r;
+}
+
+static int
+JournalWriter___flush(JournalWriter *self, Py_ssize_t *sent)
+{
     int r;
     Py_BEGIN_ALLOW_THREADS
-    r = sd_journal_seek_realtime_usec(self->j, timestamp);
+    r = JournalWriter___send(self, sent);
     Py_END_ALLOW_THREADS
     if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error seek to time");
-        return NULL;
+        errno = -r;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, self->addr.sun_path);
+        return -1;
     }
-    Py_RETURN_NONE;
+    return 0;
 }
 
-PyDoc_STRVAR(Journal_seek_monotonic__doc__,
-"seek_monotonic(monotonic[, bootid]) -> None\n\n"
-"Seek to nearest matching journal entry to `monotonic`. Argument\n"
-"`monotonic` is an timestamp from boot in secs, or a\n"
-"timedelta instance.\n"
-"Argument `bootid` is a string representing which boot the\n"
-"monotonic time is reference to. Defaults to current bootid.");
+PyDoc_STRVAR(JournalWriter__doc__,
+"JournalWriter([path][, batch_size]) -> JournalWriter instance\n\n"
+"Writer of log entries to journald, by its native protocol on the\n"
+"socket at `path`, which defaults to journald's. Entries are sent\n"
+"`batch_size` at a time, defaulting to 64, or when flushed or closed;\n"
+"a batch_size of 1 sends each entry immediately. Entries too large for\n"
+"a datagram are passed to journald as a file descriptor.");
 static PyObject *
-Journal_seek_monotonic(Journal *self, PyObject *args)
+JournalWriter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    PyObject *arg;
-    char *bootid=NULL;
-    if (! PyArg_ParseTuple(args, "O|s", &arg, &bootid))
+    JournalWriter *self;
+
+    self = (JournalWriter *)type->tp_alloc(type, 0);
+    if (self == NULL)
         return NULL;
+    self->fd = -1;
+    if (lock_init(&self->lock) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *) self;
+}
 
-    uint64_t timestamp=-1LL;
-    if PyDelta_Check(arg) {
-        PyObject *temp;
-        temp = PyObject_CallMethod(arg, "total_seconds", NULL);
-        timestamp = (uint64_t) (PyFloat_AsDouble(temp) * 1E6);
-        Py_DECREF(temp);
-    }else if (PyFloat_Check(arg)) {
-        timestamp = (uint64_t) (PyFloat_AsDouble(arg) * 1E6);
-    }else if (PyLong_Check(arg)) {
-        timestamp = PyLong_AsUnsignedLongLong(arg) * (uint64_t) 1E6;
-#if PY_MAJOR_VERSION <3
-    }else if (PyInt_Check(arg)) {
-        timestamp = PyInt_AsUnsignedLongLongMask(arg) * (uint64_t) 1E6;
-#endif
+static int
+JournalWriter_init(JournalWriter *self, PyObject *args, PyObject *keywds)
+{
+    static char *kwlist[] = {"path", "batch_size", NULL};
+    const char *path = WRITER_DEFAULT_PATH;
+    Py_ssize_t batch_size = WRITER_DEFAULT_BATCH;
+    int fd, sndbuf = WRITER_SNDBUF;
 
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "|sn", kwlist, &path, &batch_size))
+        return -1;
+    if (batch_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "Batch size must be positive integer");
+        return -1;
+    }
+    if (strlen(path) >= sizeof(self->addr.sun_path)) {
+        PyErr_SetString(PyExc_ValueError, "Socket path too long");
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
     }
+    /* Best effort, for fewer entries passed by file descriptor */
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
 
-    if ((int64_t) timestamp < 0LL) {
-        PyErr_SetString(PyExc_ValueError, "Time must be positive number or timedelta instance");
-        return NULL;
+    lock_acquire(&self->lock);
+    if (self->fd >= 0)
+        close(self->fd);
+    self->fd = fd;
+    memset(&self->addr, 0, sizeof(self->addr));
+    self->addr.sun_family = AF_UNIX;
+    strcpy(self->addr.sun_path, path);
+    self->addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    self->batch_size = batch_size;
+    self->buf_len = 0;
+    self->n_pending = 0;
+    lock_release(&self->lock);
+    return 0;
+}
+
+static void
+JournalWriter_dealloc(JournalWriter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+    Py_ssize_t sent;
+
+    if (self->fd >= 0) {
+        JournalWriter___send(self, &sent);
+        close(self->fd);
     }
+    PyMem_Free(self->buf);
+    PyMem_Free(self->ends);
+    lock_free(&self->lock);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
 
-    sd_id128_t sd_id;
-    int r;
-    if (bootid) {
-        r = sd_id128_from_string(bootid, &sd_id);
-        if (r == -EINVAL) {
-            PyErr_SetString(PyExc_ValueError, "Invalid bootid");
-            return NULL;
-        } else if (r < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Error processing bootid");
-            return NULL;
-        }
-    }else{
-        r = sd_id128_get_boot(&sd_id);
-        if (r == -EIO) {
-            PyErr_SetString(PyExc_IOError, "Error getting current boot ID");
-            return NULL;
-        } else if (r < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Error getting current boot ID");
-            return NULL;
+PyDoc_STRVAR(JournalWriter_send__doc__,
+"send([fields], **kwargs) -> None\n\n"
+"Queue a log entry with fields from mapping `fields` and keyword\n"
+"arguments, e.g. send(MESSAGE=\"Hello\", PRIORITY=6). Values are\n"
+"bytes, str, int, others as str(), or a list or tuple of these for\n"
+"repeated fields. Field names are upper case letters, digits and\n"
+"underscores, not starting with an underscore. The batch is sent once\n"
+"full.");
+static PyObject *
+JournalWriter_send(JournalWriter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *items=NULL, *fields;
+    Py_ssize_t i, n_kw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0, sent;
+    size_t start, *ends;
+    int r = 0;
+
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError, "send() takes at most 1 positional argument (%zd given)", nargs);
+        return NULL;
+    }
+    if (nargs == 1 && (items = PyMapping_Items(args[0])) == NULL)
+        return NULL;
+    if ((fields = PyList_New(0)) == NULL) {
+        Py_XDECREF(items);
+        return NULL;
+    }
+    for (i = 0; r == 0 && items && i < PyList_GET_SIZE(items); i++) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError, "fields must be a mapping");
+            r = -1;
+        }else{
+            r = JournalWriter___convert_field(fields, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1), 0);
         }
     }
-
-    Py_BEGIN_ALLOW_THREADS
-    r = sd_journal_seek_monotonic_usec(self->j, sd_id, timestamp);
-    Py_END_ALLOW_THREADS
+    for (i = 0; r == 0 && i < n_kw; i++)
+        r = JournalWriter___convert_field(fields, PyTuple_GET_ITEM(kwnames, i), args[nargs + i], 0);
+    Py_XDECREF(items);
+    if (r == 0 && PyList_GET_SIZE(fields) == 0) {
+        PyErr_SetString(PyExc_ValueError, "Entry has no fields");
+        r = -1;
+    }
     if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error seek to time");
+        Py_DECREF(fields);
         return NULL;
     }
+
+    lock_acquire(&self->lock);
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed writer");
+        r = -1;
+        goto finish;
+    }
+    if (self->n_pending == self->ends_size) {
+        Py_ssize_t size = self->ends_size ? self->ends_size * 2 : WRITER_MMSG_MAX;
+        ends = PyMem_Realloc(self->ends, size * sizeof(size_t));
+        if (ends == NULL) {
+            PyErr_NoMemory();
+            r = -1;
+            goto finish;
+        }
+        self->ends = ends;
+        self->ends_size = size;
+    }
+    start = self->buf_len;
+    for (i = 0; r == 0 && i < PyList_GET_SIZE(fields); i += 2)
+        r = JournalWriter___add_field(self, PyList_GET_ITEM(fields, i), PyList_GET_ITEM(fields, i + 1));
+    if (r < 0) {
+        self->buf_len = start;
+        goto finish;
+    }
+    self->ends[self->n_pending++] = self->buf_len;
+    if (self->n_pending >= self->batch_size)
+        r = JournalWriter___flush(self, &sent);
+
+finish:
+    lock_release(&self->lock);
+    Py_DECREF(fields);
+    if (r < 0)
+        return NULL;
     Py_RETURN_NONE;
 }
- 
-PyDoc_STRVAR(Journal_wait__doc__,
-"wait([timeout]) -> Change state (integer)\n\n"
-"Waits until there is a change in the journal. Argument `timeout`\n"
-"is the maximum number of seconds to wait before returning\n"
-"regardless if journal has changed. If `timeout` is not given or is\n"
-"0, then it will block forever.\n"
-"Will return constants: NOP if no change; APPEND if new\n"
-"entries have been added to the end of the journal; and\n"
-"INVALIDATE if journal files have been added or removed.");
+
+PyDoc_STRVAR(JournalWriter_flush__doc__,
+"flush() -> int\n\n"
+"Send queued log entries, returning the number sent. Entries not sent\n"
+"on error remain queued.");
 static PyObject *
-Journal_wait(Journal *self, PyObject *args, PyObject *keywds)
+JournalWriter_flush(JournalWriter *self, PyObject *args)
 {
-    int64_t timeout=0LL;
-    if (! PyArg_ParseTuple(args, "|L", &timeout))
-        return NULL;
+    Py_ssize_t sent = 0;
+    int r = 0;
 
-    int r;
-    if ( timeout == 0LL) {
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_wait(self->j, (uint64_t) -1);
-        Py_END_ALLOW_THREADS
-    }else{
-        Py_BEGIN_ALLOW_THREADS
-        r = sd_journal_wait(self->j, timeout * 1E6);
-        Py_END_ALLOW_THREADS
-    }
-#if PY_MAJOR_VERSION >=3
-    return PyLong_FromLong(r);
-#else
-    return PyInt_FromLong(r);
-#endif
+    lock_acquire(&self->lock);
+    if (self->fd >= 0)
+        r = JournalWriter___flush(self, &sent);
+    lock_release(&self->lock);
+    if (r < 0)
+        return NULL;
+    return PyLong_FromSsize_t(sent);
 }
 
-PyDoc_STRVAR(Journal_seek_cursor__doc__,
-"seek_cursor(cursor) -> None\n\n"
-"Seeks to journal entry by given unique reference `cursor`.");
+PyDoc_STRVAR(JournalWriter_close__doc__,
+"close() -> None\n\n"
+"Send queued log entries and close the socket. Entries not sent on\n"
+"error are discarded.");
 static PyObject *
-Journal_seek_cursor(Journal *self, PyObject *args)
+JournalWriter_close(JournalWriter *self, PyObject *args)
 {
-    const char *cursor;
-    if (! PyArg_ParseTuple(args, "s", &cursor))
-        return NULL;
-
-    int r;
-    Py_BEGIN_ALLOW_THREADS
-    r = sd_journal_seek_cursor(self->j, cursor);
-    Py_END_ALLOW_THREADS
-    if (r == -EINVAL) {
-        PyErr_SetString(PyExc_ValueError, "Invalid cursor");
-        return NULL;
-    }else if (r == -ENOMEM) {
-        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
-        return NULL;
-    }else if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error seeking to cursor");
-        return NULL;
+    Py_ssize_t sent;
+    int r = 0;
+
+    lock_acquire(&self->lock);
+    if (self->fd >= 0) {
+        r = JournalWriter___flush(self, &sent);
+        close(self->fd);
+        self->fd = -1;
+        self->buf_len = 0;
+        self->n_pending = 0;
     }
+    lock_release(&self->lock);
+    if (r < 0)
+        return NULL;
     Py_RETURN_NONE;
 }
 
 static PyObject *
-Journal_iter(PyObject *self)
+JournalWriter_enter(JournalWriter *self, PyObject *args)
 {
     Py_INCREF(self);
-    return self;
+    return (PyObject *) self;
 }
 
 static PyObject *
-Journal_iternext(PyObject *self)
+JournalWriter_exit(JournalWriter *self, PyObject *args)
 {
-    Journal *iter = (Journal *)self;
-    PyObject *dict, *arg;
-    Py_ssize_t dict_size;
-
-    arg =  Py_BuildValue("()");
-    dict = Journal_get_next(iter, arg);
-    Py_DECREF(arg);
-    dict_size = PyDict_Size(dict);
-    if ((int64_t) dict_size > 0LL) {
-        return dict;
-    }else{
-        Py_DECREF(dict);
-        PyErr_SetNone(PyExc_StopIteration);
+    PyObject *result = JournalWriter_close(self, NULL);
+    if (result == NULL)
         return NULL;
-    }
+    Py_DECREF(result);
+    Py_RETURN_FALSE;
 }
 
-#ifdef SD_JOURNAL_FOREACH_UNIQUE
-PyDoc_STRVAR(Journal_query_unique__doc__,
-"query_unique(field) -> a set of values\n\n"
-"Returns a set of unique values in journal for given `field`.\n"
-"Note this does not respect any journal matches.");
 static PyObject *
-Journal_query_unique(Journal *self, PyObject *args)
+JournalWriter_get_pending(JournalWriter *self, void *closure)
 {
-    char *query;
-    if (! PyArg_ParseTuple(args, "s", &query))
-        return NULL;
+    Py_ssize_t n;
+    lock_acquire(&self->lock);
+    n = self->n_pending;
+    lock_release(&self->lock);
+    return PyLong_FromSsize_t(n);
+}
 
-    int r;
-    Py_BEGIN_ALLOW_THREADS
-    r = sd_journal_query_unique(self->j, query);
-    Py_END_ALLOW_THREADS
-    if (r == -EINVAL) {
-        PyErr_SetString(PyExc_ValueError, "Invalid field name");
-        return NULL;
-    } else if (r == -ENOMEM) {
-        PyErr_SetString(PyExc_MemoryError, "Not enough memory");
-        return NULL;
-    } else if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error querying journal");
-        return NULL;
-    }
+static PyGetSetDef JournalWriter_getseters[] = {
+    {"pending",
+    (getter)JournalWriter_get_pending,
+    NULL,
+    "number of entries queued and not yet sent",
+    NULL},
+    {NULL}
+};
 
-    const void *uniq;
-    size_t uniq_len;
-    const char *delim_ptr;
-    PyObject *value_set, *key, *value;
-    value_set = PySet_New(0);
+static PyMethodDef JournalWriter_methods[] = {
+    {"send", (PyCFunction)(void(*)(void))JournalWriter_send, METH_FASTCALL | METH_KEYWORDS,
+    JournalWriter_send__doc__},
+    {"flush", (PyCFunction)JournalWriter_flush, METH_NOARGS,
+    JournalWriter_flush__doc__},
+    {"close", (PyCFunction)JournalWriter_close, METH_NOARGS,
+    JournalWriter_close__doc__},
+    {"__enter__", (PyCFunction)JournalWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)JournalWriter_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
 
-#if PY_MAJOR_VERSION >=3
-    key = PyUnicode_FromString(query);
-#else
-    key = PyString_FromString(query);
-#endif
+static PyType_Slot JournalWriter_slots[] = {
+    {Py_tp_dealloc, JournalWriter_dealloc},
+    {Py_tp_doc, (void *)JournalWriter__doc__},
+    {Py_tp_methods, JournalWriter_methods},
+    {Py_tp_getset, JournalWriter_getseters},
+    {Py_tp_init, JournalWriter_init},
+    {Py_tp_new, JournalWriter_new},
+    {0, NULL}
+};
 
-    SD_JOURNAL_FOREACH_UNIQUE(self->j, uniq, uniq_len) {
-        delim_ptr = memchr(uniq, '=', uniq_len);
-        value = Journal___process_field(self, key, delim_ptr + 1, (const char*) uniq + uniq_len - (delim_ptr + 1));
-        PySet_Add(value_set, value);
-        Py_DECREF(value);
-    }
-    Py_DECREF(key);
-    return value_set;
-}
-#endif //def SD_JOURNAL_FOREACH_UNIQUE
+static PyType_Spec JournalWriter_spec = {
+    "pyjournalctl.JournalWriter",
+    sizeof(JournalWriter),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    JournalWriter_slots,
+};
 
-PyDoc_STRVAR(Journal_log_level__doc__,
-"log_level(level) -> None\n\n"
-"Sets maximum log level by setting matches for PRIORITY.");
-static PyObject *
-Journal_log_level(Journal *self, PyObject *args)
+/* C API exported by capsule, see pyjournalctl.h */
+static sd_journal *
+capi_acquire(PyObject *obj)
 {
-    int level;
-    if (! PyArg_ParseTuple(args, "i", &level))
-        return NULL;
+    pyjournalctl_state *state = get_state_by_type(Py_TYPE(obj));
+    Journal *self = (Journal *) obj;
 
-    if (level < 0 || level > 7) {
-        PyErr_SetString(PyExc_ValueError, "Log level should be 0 <= level <= 7");
+    if (state == NULL || !PyObject_TypeCheck(obj, state->JournalType)) {
+        PyErr_Clear();
+        PyErr_Format(PyExc_TypeError, "expected pyjournalctl.Journal, got %.200s",
+                     Py_TYPE(obj)->tp_name);
         return NULL;
     }
-    int i;
-    char level_str[2];
-    PyObject *arg, *keywds;
-    for(i = 0; i <= level; i++) {
-        sprintf(level_str, "%i", i);
-        arg = PyTuple_New(0);
-        keywds = Py_BuildValue("{s:s}", "PRIORITY", level_str);
-        Journal_add_match(self, arg, keywds);
-        Py_DECREF(arg);
-        Py_DECREF(keywds);
-        if (PyErr_Occurred())
-            return NULL;
-    }
-    Py_RETURN_NONE;
-}
-
-PyDoc_STRVAR(Journal_this_boot__doc__,
-"this_boot() -> None\n\n"
-"Sets match filter for the current _BOOT_ID.");
-static PyObject *
-Journal_this_boot(Journal *self, PyObject *args)
-{
-    sd_id128_t sd_id;
-    int r;
-    r = sd_id128_get_boot(&sd_id);
-    if (r == -EIO) {
-        PyErr_SetString(PyExc_IOError, "Error getting current boot ID");
+    if (Journal___lock(self) < 0)
         return NULL;
-    } else if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error getting current boot ID");
+    if (Journal___apply_bloom(self, 1) < 0 || Journal___release_reader(self) < 0) {
+        Journal___unlock(self);
         return NULL;
     }
+    self->at_head = 0;
+    return self->j;
+}
 
-    char bootid[33];
-    sd_id128_to_string(sd_id, bootid);
-
-    PyObject *arg, *keywds;
-    arg = PyTuple_New(0);
-    keywds = Py_BuildValue("{s:s}", "_BOOT_ID", bootid);
-    Journal_add_match(self, arg, keywds);
-    Py_DECREF(arg);
-    Py_DECREF(keywds);
-    if (PyErr_Occurred())
-        return NULL;
-
-    Py_RETURN_NONE;
+static void
+capi_release(PyObject *obj)
+{
+    Journal___unlock((Journal *) obj);
 }
 
-PyDoc_STRVAR(Journal_this_machine__doc__,
-"this_machine() -> None\n\n"
-"Sets match filter for the current _MACHINE_ID.");
-static PyObject *
-Journal_this_machine(Journal *self, PyObject *args)
+static int
+capi_next(PyObject *obj, int64_t skip)
 {
-    sd_id128_t sd_id;
+    Journal *self = (Journal *) obj;
     int r;
-    r = sd_id128_get_machine(&sd_id);
-    if (r == -EIO) {
-        PyErr_SetString(PyExc_IOError, "Error getting current boot ID");
-        return NULL;
-    } else if (r < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error getting current boot ID");
-        return NULL;
+    if (skip < 0LL && !self->positioned) {
+        /* As per Journal___move */
+        r = sd_journal_seek_tail(self->j);
+        if (r < 0)
+            return r;
     }
+    self->positioned = 1;
+    if (self->filter && skip != 0LL)
+        return Journal___move_filtered(self, skip);
+    else if (skip > 0LL)
+        return sd_journal_next_skip(self->j, skip);
+    else if (skip < 0LL)
+        return sd_journal_previous_skip(self->j, -skip);
+    return -EINVAL;
+}
 
-    char machineid[33];
-    sd_id128_to_string(sd_id, machineid);
-
-    PyObject *arg, *keywds;
-    arg = PyTuple_New(0);
-    keywds = Py_BuildValue("{s:s}", "_MACHINE_ID", machineid);
-    Journal_add_match(self, arg, keywds);
-    Py_DECREF(arg);
-    Py_DECREF(keywds);
-    if (PyErr_Occurred())
-        return NULL;
+static int
+capi_enumerate_data(PyObject *obj, PyJournalctl_DataFunc func, void *arg)
+{
+    sd_journal *j = ((Journal *) obj)->j;
+    const void *data;
+    size_t len;
+    int r;
 
-    Py_RETURN_NONE;
+    sd_journal_restart_data(j);
+    while ((r = sd_journal_enumerate_data(j, &data, &len)) > 0) {
+        if ((r = func(arg, data, len)) != 0)
+            return r;
+    }
+    return r;
 }
 
-static PyObject *
-Journal_get_default_call(Journal *self, void *closure)
+static int
+capi_get_realtime(PyObject *obj, uint64_t *usec)
 {
-    Py_INCREF(self->default_call);
-    return self->default_call;
+    return sd_journal_get_realtime_usec(((Journal *) obj)->j, usec);
 }
 
 static int
-Journal_set_default_call(Journal *self, PyObject *value, void *closure)
+capi_get_monotonic(PyObject *obj, uint64_t *usec, sd_id128_t *boot_id)
 {
-    if (value == NULL) {
-        PyErr_SetString(PyExc_TypeError, "Cannot delete default_call");
-        return -1;
-    }
-    if (! PyCallable_Check(value)) {
-        PyErr_SetString(PyExc_TypeError, "default_call must be callable");
-        return -1;
-    }
-    Py_DECREF(self->default_call);
-    Py_INCREF(value);
-    self->default_call = value;
+    return sd_journal_get_monotonic_usec(((Journal *) obj)->j, usec, boot_id);
+}
 
-    return 0;
+static int
+capi_get_cursor(PyObject *obj, PyJournalctl_Cursor *cursor)
+{
+    return cursor_get(NULL, ((Journal *) obj)->j, cursor);
 }
 
-static PyObject *
-Journal_get_call_dict(Journal *self, void *closure)
+static int
+capi_seek_cursor(PyObject *obj, const PyJournalctl_Cursor *cursor)
 {
-    Py_INCREF(self->call_dict);
-    return self->call_dict;
+    char str[160], seqnum_id[33], boot_id[33];
+
+    snprintf(str, sizeof(str), "s=%s;i=%" PRIx64 ";b=%s;m=%" PRIx64 ";t=%" PRIx64 ";x=%" PRIx64,
+             sd_id128_to_string(cursor->seqnum_id, seqnum_id), cursor->seqnum,
+             sd_id128_to_string(cursor->boot_id, boot_id), cursor->monotonic,
+             cursor->realtime, cursor->xor_hash);
+    ((Journal *) obj)->positioned = 1;
+    return sd_journal_seek_cursor(((Journal *) obj)->j, str);
 }
 
+static const PyJournalctl_CAPI pyjournalctl_capi = {
+    PYJOURNALCTL_CAPI_VERSION,
+    sizeof(PyJournalctl_CAPI),
+    capi_acquire,
+    capi_release,
+    capi_next,
+    capi_enumerate_data,
+    capi_get_realtime,
+    capi_get_monotonic,
+    capi_get_cursor,
+    capi_seek_cursor,
+};
+
+/* Default field conversions, evaluated once per module */
+static const char default_call_str[] =
+    "functools.partial(str, encoding='utf-8')";
+static const char call_dict_str[] = "{"
+    "'PRIORITY': int,"
+    "'LEADER': int,"
+    "'SESSION_ID': int,"
+    "'USERSPACE_USEC': int,"
+    "'INITRD_USEC': int,"
+    "'KERNEL_USEC': int,"
+    "'_UID': int,"
+    "'_GID': int,"
+    "'_PID': int,"
+    "'SYSLOG_FACILITY': int,"
+    "'SYSLOG_PID': int,"
+    "'_AUDIT_SESSION': int,"
+    "'_AUDIT_LOGINUID': int,"
+    "'_SYSTEMD_SESSION': int,"
+    "'_SYSTEMD_OWNER_UID': int,"
+    "'CODE_LINE': int,"
+    "'ERRNO': int,"
+    "'EXIT_STATUS': int,"
+    "'_SOURCE_REALTIME_TIMESTAMP': lambda x: datetime.datetime.fromtimestamp(float(x)/1E6),"
+    "'__REALTIME_TIMESTAMP': lambda x: datetime.datetime.fromtimestamp(float(x)/1E6),"
+    "'_SOURCE_MONOTONIC_TIMESTAMP': lambda x: datetime.timedelta(microseconds=float(x)),"
+    "'__MONOTONIC_TIMESTAMP': lambda x: datetime.timedelta(microseconds=float(x)),"
+    "'COREDUMP': bytes,"
+    "'COREDUMP_PID': int,"
+    "'COREDUMP_UID': int,"
+    "'COREDUMP_GID': int,"
+    "'COREDUMP_SESSION': int,"
+    "'COREDUMP_SIGNAL': int,"
+    "'COREDUMP_TIMESTAMP': lambda x: datetime.datetime.fromtimestamp(float(x)/1E6),"
+    "}";
+
 static int
-Journal_set_call_dict(Journal *self, PyObject *value, void *closure)
+pyjournalctl_exec(PyObject *m)
 {
-    if (value == NULL) {
-        PyErr_SetString(PyExc_TypeError, "Cannot delete call_dict");
+    pyjournalctl_state *state = (pyjournalctl_state *) PyModule_GetState(m);
+    PyObject *globals=NULL, *temp;
+    int r=-1;
+
+    state->JournalType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &Journal_spec, NULL);
+    if (state->JournalType == NULL)
         return -1;
-    }
-    if (! PyDict_Check(value)) {
-        PyErr_SetString(PyExc_TypeError, "call_dict must be dict type");
+    if (PyModule_AddType(m, state->JournalType) < 0)
+        return -1;
+    state->JournalIteratorType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &JournalIterator_spec, NULL);
+    if (state->JournalIteratorType == NULL)
+        return -1;
+    if (PyModule_AddType(m, state->JournalIteratorType) < 0)
+        return -1;
+    state->JournalWriterType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &JournalWriter_spec, NULL);
+    if (state->JournalWriterType == NULL)
+        return -1;
+    if (PyModule_AddType(m, state->JournalWriterType) < 0)
+        return -1;
+    state->JournalSketchType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &JournalSketch_spec, NULL);
+    if (state->JournalSketchType == NULL)
+        return -1;
+    if (PyModule_AddType(m, state->JournalSketchType) < 0)
+        return -1;
+    state->JournalSessionsType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &JournalSessions_spec, NULL);
+    if (state->JournalSessionsType == NULL)
+        return -1;
+    if (PyModule_AddType(m, state->JournalSessionsType) < 0)
         return -1;
-    }
-    Py_DECREF(self->call_dict);
-    Py_INCREF(value);
-    self->call_dict = value;
 
-    return 0;
-}
+    /* Private globals for the default calls, rather than builtins */
+    globals = PyDict_New();
+    if (globals == NULL)
+        return -1;
+    if (PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins()) < 0)
+        goto finally;
+    temp = PyImport_ImportModule("functools");
+    if (temp == NULL || PyDict_SetItemString(globals, "functools", temp) < 0) {
+        Py_XDECREF(temp);
+        goto finally;
+    }
+    Py_DECREF(temp);
+    temp = PyImport_ImportModule("datetime");
+    if (temp == NULL || PyDict_SetItemString(globals, "datetime", temp) < 0) {
+        Py_XDECREF(temp);
+        goto finally;
+    }
+    state->datetime_type = PyObject_GetAttrString(temp, "datetime");
+    state->timedelta_type = PyObject_GetAttrString(temp, "timedelta");
+    Py_DECREF(temp);
+    if (state->datetime_type == NULL || state->timedelta_type == NULL)
+        goto finally;
 
-/*static PyObject *
-Journal_get_data_threshold(Journal *self, void *closure)
-{
-    size_t cvalue;
-    PyObject *value;
-    int r;
+    state->default_call = PyRun_String(default_call_str, Py_eval_input, globals, NULL);
+    if (state->default_call == NULL)
+        goto finally;
+    state->call_dict = PyRun_String(call_dict_str, Py_eval_input, globals, NULL);
+    if (state->call_dict == NULL)
+        goto finally;
 
-    r = sd_journal_get_data_threshold(self->j, &cvalue);
-    if (r < 0){
-        PyErr_SetString(PyExc_RuntimeError, "Error getting data threshold");
-        return NULL;
+    if (PyModule_AddStringConstant(m, "__version__", "0.7.0") < 0 ||
+        PyModule_AddIntConstant(m, "NOP", SD_JOURNAL_NOP) < 0 ||
+        PyModule_AddIntConstant(m, "APPEND", SD_JOURNAL_APPEND) < 0 ||
+        PyModule_AddIntConstant(m, "INVALIDATE", SD_JOURNAL_INVALIDATE) < 0 ||
+        PyModule_AddIntConstant(m, "LOCAL_ONLY", SD_JOURNAL_LOCAL_ONLY) < 0 ||
+        PyModule_AddIntConstant(m, "RUNTIME_ONLY", SD_JOURNAL_RUNTIME_ONLY) < 0 ||
+        PyModule_AddIntConstant(m, "SYSTEM_ONLY", SD_JOURNAL_SYSTEM_ONLY) < 0)
+        goto finally;
+    temp = PyCapsule_New((void *) &pyjournalctl_capi, PYJOURNALCTL_CAPSULE_NAME, NULL);
+    if (temp == NULL || PyModule_AddObject(m, "_C_API", temp) < 0) {
+        Py_XDECREF(temp);
+        goto finally;
     }
 
-#if PY_MAJOR_VERSION >=3
-    value = PyLong_FromSize_t(cvalue);
-#else
-    value = PyInt_FromSize_t(cvalue);
-#endif
-    return value;
+    r = 0;
+finally:
+    Py_DECREF(globals);
+    return r;
 }
 
 static int
-Journal_set_data_threshold(Journal *self, PyObject *value, void *closure)
+pyjournalctl_traverse(PyObject *m, visitproc visit, void *arg)
 {
-    if (value == NULL) {
-        PyErr_SetString(PyExc_TypeError, "Cannot delete data threshold");
-        return -1;
-    }
-#if PY_MAJOR_VERSION >=3
-    if (! PyLong_Check(value)){
-#else
-    if (! PyInt_Check(value)){
-#endif
-        PyErr_SetString(PyExc_TypeError, "Data threshold must be int");
-        return -1;
-    }
-    int r;
-#if PY_MAJOR_VERSION >=3
-    r = sd_journal_set_data_threshold(self->j, (size_t) PyLong_AsLong(value));
-#else
-    r = sd_journal_set_data_threshold(self->j, (size_t) PyInt_AsLong(value));
-#endif
-    if (r < 0){
-        PyErr_SetString(PyExc_RuntimeError, "Error setting data threshold");
-        return -1;
-    }
+    pyjournalctl_state *state = (pyjournalctl_state *) PyModule_GetState(m);
+    Py_VISIT(state->JournalType);
+    Py_VISIT(state->JournalIteratorType);
+    Py_VISIT(state->JournalWriterType);
+    Py_VISIT(state->JournalSketchType);
+    Py_VISIT(state->JournalSessionsType);
+    Py_VISIT(state->datetime_type);
+    Py_VISIT(state->timedelta_type);
+    Py_VISIT(state->default_call);
+    Py_VISIT(state->call_dict);
     return 0;
-} */
+}
 
-static PyGetSetDef Journal_getseters[] = {
-/*    {"data_threshold",
-    (getter)Journal_get_data_threshold,
-    (setter)Journal_set_data_threshold,
-    "data threshold",
-    NULL},*/
-    {"call_dict",
-    (getter)Journal_get_call_dict,
-    (setter)Journal_set_call_dict,
-    "dictionary of calls for each field",
-    NULL},
-    {"default_call",
-    (getter)Journal_get_default_call,
-    (setter)Journal_set_default_call,
-    "default call for values for fields",
-    NULL},
-    {NULL}
-};
+static int
+pyjournalctl_clear(PyObject *m)
+{
+    pyjournalctl_state *state = (pyjournalctl_state *) PyModule_GetState(m);
+    Py_CLEAR(state->JournalType);
+    Py_CLEAR(state->JournalIteratorType);
+    Py_CLEAR(state->JournalWriterType);
+    Py_CLEAR(state->JournalSketchType);
+    Py_CLEAR(state->JournalSessionsType);
+    Py_CLEAR(state->datetime_type);
+    Py_CLEAR(state->timedelta_type);
+    Py_CLEAR(state->default_call);
+    Py_CLEAR(state->call_dict);
+    return 0;
+}
 
-static PyMethodDef Journal_methods[] = {
-    {"get_next", (PyCFunction)Journal_get_next, METH_VARARGS,
-    Journal_get_next__doc__},
-    {"get_previous", (PyCFunction)Journal_get_previous, METH_VARARGS,
-    Journal_get_previous__doc__},
-    {"add_match", (PyCFunction)Journal_add_match, METH_VARARGS|METH_KEYWORDS,
-    Journal_add_match__doc__},
-    {"add_disjunction", (PyCFunction)Journal_add_disjunction, METH_NOARGS,
-    Journal_add_disjunction__doc__},
-    {"flush_matches", (PyCFunction)Journal_flush_matches, METH_NOARGS,
-    Journal_flush_matches__doc__},
-    {"seek", (PyCFunction)Journal_seek, METH_VARARGS | METH_KEYWORDS,
-    Journal_seek__doc__},
-    {"seek_realtime", (PyCFunction)Journal_seek_realtime, METH_VARARGS,
-    Journal_seek_realtime__doc__},
-    {"seek_monotonic", (PyCFunction)Journal_seek_monotonic, METH_VARARGS,
-    Journal_seek_monotonic__doc__},
-    {"wait", (PyCFunction)Journal_wait, METH_VARARGS,
-    Journal_wait__doc__},
-    {"seek_cursor", (PyCFunction)Journal_seek_cursor, METH_VARARGS,
-    Journal_seek_cursor__doc__},
-#ifdef SD_JOURNAL_FOREACH_UNIQUE
-    {"query_unique", (PyCFunction)Journal_query_unique, METH_VARARGS,
-    Journal_query_unique__doc__},
-#endif
-    {"log_level", (PyCFunction)Journal_log_level, METH_VARARGS,
-    Journal_log_level__doc__},
-    {"this_boot", (PyCFunction)Journal_this_boot, METH_NOARGS,
-    Journal_this_boot__doc__},
-    {"this_machine", (PyCFunction)Journal_this_machine, METH_NOARGS,
-    Journal_this_machine__doc__},
-    {NULL}  /* Sentinel */
-};
+static void
+pyjournalctl_free(void *m)
+{
+    pyjournalctl_clear((PyObject *) m);
+}
 
-static PyTypeObject JournalType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "pyjournalctl.Journal",           /*tp_name*/
-    sizeof(Journal),                  /*tp_basicsize*/
-    0,                                /*tp_itemsize*/
-    (destructor)Journal_dealloc,      /*tp_dealloc*/
-    0,                                /*tp_print*/
-    0,                                /*tp_getattr*/
-    0,                                /*tp_setattr*/
-    0,                                /*tp_compare*/
-    0,                                /*tp_repr*/
-    0,                                /*tp_as_number*/
-    0,                                /*tp_as_sequence*/
-    0,                                /*tp_as_mapping*/
-    0,                                /*tp_hash */
-    0,                                /*tp_call*/
-    0,                                /*tp_str*/
-    0,                                /*tp_getattro*/
-    0,                                /*tp_setattro*/
-    0,                                /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/*tp_flags*/
-    Journal__doc__,                   /* tp_doc */
-    0,                                /* tp_traverse */
-    0,                                /* tp_clear */
-    0,                                /* tp_richcompare */
-    0,                                /* tp_weaklistoffset */
-    Journal_iter,                     /* tp_iter */
-    Journal_iternext,                 /* tp_iternext */
-    Journal_methods,                  /* tp_methods */
-    0,                                /* tp_members */
-    Journal_getseters,                /* tp_getset */
-    0,                                /* tp_base */
-    0,                                /* tp_dict */
-    0,                                /* tp_descr_get */
-    0,                                /* tp_descr_set */
-    0,                                /* tp_dictoffset */
-    (initproc)Journal_init,           /* tp_init */
-    0,                                /* tp_alloc */
-    Journal_new,                      /* tp_new */
+static PyModuleDef_Slot pyjournalctl_slots[] = {
+    {Py_mod_exec, pyjournalctl_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
 };
 
-#if PY_MAJOR_VERSION >= 3
-static PyModuleDef pyjournalctl_module = {
+static struct PyModuleDef pyjournalctl_module = {
     PyModuleDef_HEAD_INIT,
     "pyjournalctl",
     "Module that reads systemd journal similar to journalctl.",
-    -1,
-    NULL, NULL, NULL, NULL, NULL
+    sizeof(pyjournalctl_state),
+    NULL,
+    pyjournalctl_slots,
+    pyjournalctl_traverse,
+    pyjournalctl_clear,
+    pyjournalctl_free,
 };
-#endif
 
 PyMODINIT_FUNC
-#if PY_MAJOR_VERSION >= 3
 PyInit_pyjournalctl(void)
-#else
-initpyjournalctl(void) 
-#endif
 {
-    PyObject* m;
-
-    PyDateTime_IMPORT;
-
-    if (PyType_Ready(&JournalType) < 0)
-#if PY_MAJOR_VERSION >= 3
-        return NULL;
-#else
-        return;
-#endif
-
-#if PY_MAJOR_VERSION >= 3
-    m = PyModule_Create(&pyjournalctl_module);
-    if (m == NULL)
-        return NULL;
-#else
-    m = Py_InitModule3("pyjournalctl", NULL,
-                   "Module that reads systemd journal similar to journalctl.");
-    if (m == NULL)
-        return;
-#endif
-
-    Py_INCREF(&JournalType);
-    PyModule_AddObject(m, "Journal", (PyObject *)&JournalType);
-    PyModule_AddStringConstant(m, "__version__", "0.7.0");
-    PyModule_AddIntConstant(m, "NOP", SD_JOURNAL_NOP);
-    PyModule_AddIntConstant(m, "APPEND", SD_JOURNAL_APPEND);
-    PyModule_AddIntConstant(m, "INVALIDATE", SD_JOURNAL_INVALIDATE);
-    PyModule_AddIntConstant(m, "LOCAL_ONLY", SD_JOURNAL_LOCAL_ONLY);
-    PyModule_AddIntConstant(m, "RUNTIME_ONLY", SD_JOURNAL_RUNTIME_ONLY);
-    PyModule_AddIntConstant(m, "SYSTEM_ONLY", SD_JOURNAL_SYSTEM_ONLY);
-
-#if PY_MAJOR_VERSION >= 3
-    return m;
-#endif
+    return PyModuleDef_Init(&pyjournalctl_module);
 }
@@ -0,0 +1,101 @@
+/*
+pyjournalctl - Python module that reads systemd journal similar to journalctl
+Copyright (C) 2012  Steven Hiscocks
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* C API of pyjournalctl, for other extension modules to read entries of
+ * a Journal set up from Python without creating Python objects:
+ *
+ *     if (PyJournalctl_ImportAPI() < 0)
+ *         return NULL;
+ *     if (PyJournalctl_API->acquire(journal) == NULL)
+ *         return NULL;
+ *     Py_BEGIN_ALLOW_THREADS
+ *     while ((r = PyJournalctl_API->next(journal, 1)) > 0 &&
+ *            (r = PyJournalctl_API->enumerate_data(journal, send_field, conn)) == 0);
+ *     Py_END_ALLOW_THREADS
+ *     PyJournalctl_API->release(journal);
+ *
+ * Functions taking a journal, other than acquire(), may only be called
+ * between acquire() and release() of that journal, and do not require
+ * the GIL. They return negative errno values on error. The caller must
+ * hold a reference to the journal throughout, and must not call its
+ * Python methods while it is acquired. */
+
+#ifndef PYJOURNALCTL_H
+#define PYJOURNALCTL_H
+
+#include <Python.h>
+#include <stdint.h>
+#include <systemd/sd-journal.h>
+
+#define PYJOURNALCTL_CAPSULE_NAME "pyjournalctl._C_API"
+/* Incremented as functions are added to the end of PyJournalctl_CAPI */
+#define PYJOURNALCTL_CAPI_VERSION 1
+
+/* Cursor of an entry as binary values, as per sd_journal_get_cursor() */
+typedef struct {
+    sd_id128_t seqnum_id;
+    uint64_t seqnum;
+    sd_id128_t boot_id;
+    uint64_t monotonic;
+    uint64_t realtime;
+    uint64_t xor_hash;
+} PyJournalctl_Cursor;
+
+/* Called with each "FIELD=value" of an entry; non-zero return stops
+ * enumeration, which then returns that value */
+typedef int (*PyJournalctl_DataFunc)(void *arg, const void *data, size_t len);
+
+typedef struct {
+    unsigned int version;
+    size_t size;
+    /* Locks `journal` and returns its handle, positioned as per its
+     * Python methods. Requires the GIL; on error returns NULL with an
+     * exception set. The handle may be used directly until release(),
+     * without the filter of the Journal. */
+    sd_journal *(*acquire)(PyObject *journal);
+    void (*release)(PyObject *journal);
+    /* Moves by `skip` entries honouring the filter, as per get_next()
+     * and get_previous(), returning the number moved */
+    int (*next)(PyObject *journal, int64_t skip);
+    int (*enumerate_data)(PyObject *journal, PyJournalctl_DataFunc func, void *arg);
+    int (*get_realtime)(PyObject *journal, uint64_t *usec);
+    int (*get_monotonic)(PyObject *journal, uint64_t *usec, sd_id128_t *boot_id);
+    int (*get_cursor)(PyObject *journal, PyJournalctl_Cursor *cursor);
+    int (*seek_cursor)(PyObject *journal, const PyJournalctl_Cursor *cursor);
+} PyJournalctl_CAPI;
+
+#ifndef PYJOURNALCTL_MODULE
+static const PyJournalctl_CAPI *PyJournalctl_API;
+
+static int
+PyJournalctl_ImportAPI(void)
+{
+    PyJournalctl_API = (const PyJournalctl_CAPI *) PyCapsule_Import(PYJOURNALCTL_CAPSULE_NAME, 0);
+    if (PyJournalctl_API == NULL)
+        return -1;
+    if (PyJournalctl_API->version < PYJOURNALCTL_CAPI_VERSION) {
+        PyJournalctl_API = NULL;
+        PyErr_SetString(PyExc_ImportError, "pyjournalctl C API version too old");
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+#endif /* PYJOURNALCTL_H */
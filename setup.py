@@ -1,14 +1,22 @@
-from distutils.core import setup, Extension
+import os
+from setuptools import setup, Extension
+
+# USDT probes, see examples/bpftrace; requires systemtap's sys/sdt.h
+define_macros = [("WITH_USDT", "1")] if os.environ.get("PYJOURNALCTL_USDT") else []
 
 setup(name="pyjournalctl",
       description="A module that reads systemd journal similar to journalctl",
       long_description=open("README.rst").read(),
       version="0.7.0",
       ext_modules=[Extension("pyjournalctl", ["pyjournalctl.c"],
+                   depends=["pyjournalctl.h"],
+                   define_macros=define_macros,
                    libraries=["systemd-journal", "systemd-id128"])],
+      headers=["pyjournalctl.h"],
       author="Steven Hiscocks",
       author_email="steven@hiscocks.me.uk",
       url="https://github.com/kwirk/pyjournalctl",
+      python_requires=">=3.9",
       license="GNU Lesser General Public License (LGPL), Version 2",
       keywords="systemd journald journal sd-journal systemd-journal",
       classifiers=[
@@ -18,8 +26,8 @@ setup(name="pyjournalctl",
           "License :: OSI Approved :: GNU Lesser General Public License v2 or later (LGPLv2+)",
           "Operating System :: POSIX :: Linux",
           "Programming Language :: C",
-          "Programming Language :: Python :: 2.7",
           "Programming Language :: Python :: 3",
+          "Programming Language :: Python :: Free Threading",
           "Programming Language :: Python :: Implementation :: CPython",
           "Topic :: Software Development :: Libraries :: Python Modules",
           "Topic :: System :: Logging",
@@ -0,0 +1,233 @@
+/* Extension using the C API of pyjournalctl, built by test_capi.py */
+
+#define PY_SSIZE_T_CLEAN
+#include "pyjournalctl.h"
+
+typedef struct {
+    PyObject *fields;
+    Py_ssize_t stop_after;
+} collect_arg;
+
+static int
+collect_field(void *arg, const void *data, size_t len)
+{
+    collect_arg *c = arg;
+    PyObject *field;
+
+    field = PyBytes_FromStringAndSize(data, len);
+    if (field == NULL || PyList_Append(c->fields, field) < 0) {
+        Py_XDECREF(field);
+        return -ENOMEM;
+    }
+    Py_DECREF(field);
+    if (c->stop_after > 0 && PyList_GET_SIZE(c->fields) >= c->stop_after)
+        return 1;
+    return 0;
+}
+
+/* As sd_id128_to_string(), so as not to link with libsystemd */
+static char *
+id_to_string(sd_id128_t id, char s[33])
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < 16; i++) {
+        s[i * 2] = hex[id.bytes[i] >> 4];
+        s[i * 2 + 1] = hex[id.bytes[i] & 15];
+    }
+    s[32] = '\0';
+    return s;
+}
+
+static PyObject *
+error(int r)
+{
+    if (!PyErr_Occurred()) {
+        errno = -r;
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return NULL;
+}
+
+/* read(journal, skip) -> list of (realtime, monotonic, boot_id, fields),
+ * moving by skip until no more entries */
+static PyObject *
+consumer_read(PyObject *module, PyObject *args)
+{
+    PyObject *journal, *entries, *entry;
+    long long skip;
+    collect_arg c;
+    uint64_t realtime, monotonic;
+    sd_id128_t boot_id;
+    char boot_id_str[33];
+    int r;
+
+    if (!PyArg_ParseTuple(args, "OL", &journal, &skip))
+        return NULL;
+    entries = PyList_New(0);
+    if (entries == NULL)
+        return NULL;
+    if (PyJournalctl_API->acquire(journal) == NULL) {
+        Py_DECREF(entries);
+        return NULL;
+    }
+    c.stop_after = 0;
+    while ((r = PyJournalctl_API->next(journal, skip)) > 0) {
+        c.fields = PyList_New(0);
+        if (c.fields == NULL) {
+            r = -ENOMEM;
+            break;
+        }
+        if ((r = PyJournalctl_API->enumerate_data(journal, collect_field, &c)) < 0 ||
+            (r = PyJournalctl_API->get_realtime(journal, &realtime)) < 0 ||
+            (r = PyJournalctl_API->get_monotonic(journal, &monotonic, &boot_id)) < 0) {
+            Py_DECREF(c.fields);
+            break;
+        }
+        entry = Py_BuildValue("(KKsN)", (unsigned long long) realtime,
+                              (unsigned long long) monotonic,
+                              id_to_string(boot_id, boot_id_str), c.fields);
+        if (entry == NULL || PyList_Append(entries, entry) < 0) {
+            Py_XDECREF(entry);
+            r = -ENOMEM;
+            break;
+        }
+        Py_DECREF(entry);
+    }
+    PyJournalctl_API->release(journal);
+    if (r < 0) {
+        Py_DECREF(entries);
+        return error(r);
+    }
+    return entries;
+}
+
+/* first_fields(journal, n) -> (result, fields) of the next entry, with
+ * enumeration stopped after n fields */
+static PyObject *
+consumer_first_fields(PyObject *module, PyObject *args)
+{
+    PyObject *journal;
+    collect_arg c;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "On", &journal, &c.stop_after))
+        return NULL;
+    c.fields = PyList_New(0);
+    if (c.fields == NULL)
+        return NULL;
+    if (PyJournalctl_API->acquire(journal) == NULL) {
+        Py_DECREF(c.fields);
+        return NULL;
+    }
+    r = PyJournalctl_API->next(journal, 1);
+    if (r > 0)
+        r = PyJournalctl_API->enumerate_data(journal, collect_field, &c);
+    PyJournalctl_API->release(journal);
+    if (r < 0) {
+        Py_DECREF(c.fields);
+        return error(r);
+    }
+    return Py_BuildValue("(iN)", r, c.fields);
+}
+
+static PyObject *
+cursor_tuple(const PyJournalctl_Cursor *cursor)
+{
+    char seqnum_id[33], boot_id[33];
+
+    return Py_BuildValue("(sKsKKK)", id_to_string(cursor->seqnum_id, seqnum_id),
+                         (unsigned long long) cursor->seqnum,
+                         id_to_string(cursor->boot_id, boot_id),
+                         (unsigned long long) cursor->monotonic,
+                         (unsigned long long) cursor->realtime,
+                         (unsigned long long) cursor->xor_hash);
+}
+
+/* cursor_round_trip(journal, skip) -> (cursor, cursor after seeking back)
+ * of the entry `skip` on, read again after moving past it */
+static PyObject *
+consumer_cursor_round_trip(PyObject *module, PyObject *args)
+{
+    PyObject *journal;
+    long long skip;
+    PyJournalctl_Cursor cursor, again;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "OL", &journal, &skip))
+        return NULL;
+    if (PyJournalctl_API->acquire(journal) == NULL)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    r = PyJournalctl_API->next(journal, skip);
+    if (r == 0)
+        r = -ENOENT;
+    if (r > 0)
+        r = PyJournalctl_API->get_cursor(journal, &cursor);
+    if (r >= 0)
+        r = PyJournalctl_API->next(journal, 1);
+    if (r >= 0)
+        r = PyJournalctl_API->seek_cursor(journal, &cursor);
+    if (r >= 0)
+        r = PyJournalctl_API->next(journal, 1);
+    if (r >= 0)
+        r = PyJournalctl_API->get_cursor(journal, &again);
+    Py_END_ALLOW_THREADS
+    PyJournalctl_API->release(journal);
+    if (r < 0)
+        return error(r);
+    return Py_BuildValue("(NN)", cursor_tuple(&cursor), cursor_tuple(&again));
+}
+
+static PyObject *
+consumer_import_api(PyObject *module, PyObject *args)
+{
+    if (PyJournalctl_ImportAPI() < 0)
+        return NULL;
+    return PyLong_FromUnsignedLong(PyJournalctl_API->version);
+}
+
+/* The API as first imported, as PyJournalctl_API is unset when an
+ * import fails */
+static const PyJournalctl_CAPI *real_api;
+static PyJournalctl_CAPI fake_api;
+
+/* capsule(version) -> capsule of the API claiming another version */
+static PyObject *
+consumer_capsule(PyObject *module, PyObject *args)
+{
+    unsigned int version;
+
+    if (!PyArg_ParseTuple(args, "I", &version))
+        return NULL;
+    fake_api = *real_api;
+    fake_api.version = version;
+    return PyCapsule_New(&fake_api, PYJOURNALCTL_CAPSULE_NAME, NULL);
+}
+
+static PyMethodDef consumer_methods[] = {
+    {"read", consumer_read, METH_VARARGS, NULL},
+    {"first_fields", consumer_first_fields, METH_VARARGS, NULL},
+    {"cursor_round_trip", consumer_cursor_round_trip, METH_VARARGS, NULL},
+    {"import_api", consumer_import_api, METH_NOARGS, NULL},
+    {"capsule", consumer_capsule, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef consumer_module = {
+    PyModuleDef_HEAD_INIT,
+    "capi_consumer",
+    NULL,
+    -1,
+    consumer_methods,
+};
+
+PyMODINIT_FUNC
+PyInit_capi_consumer(void)
+{
+    if (PyJournalctl_ImportAPI() < 0)
+        return NULL;
+    real_api = PyJournalctl_API;
+    return PyModule_Create(&consumer_module);
+}
@@ -0,0 +1,339 @@
+"""Write small journal files for the tests.
+
+The files follow the journal file format documented by systemd
+(https://systemd.io/JOURNAL_FILE_FORMAT/): non-compact, with Jenkins
+hashes, so that sd-journal and the mmap engine both read them, and
+uncompressed unless asked otherwise.
+Entries are written in the order given, which lets the tests build
+journals with several boots, clock jumps and duplicate entries.
+"""
+
+import ctypes
+import ctypes.util
+import lzma
+import os
+import struct
+import uuid
+
+HEADER_SIZE = 272
+OBJECT_DATA = 1
+OBJECT_FIELD = 2
+OBJECT_ENTRY = 3
+OBJECT_DATA_HASH_TABLE = 4
+OBJECT_FIELD_HASH_TABLE = 5
+OBJECT_ENTRY_ARRAY = 6
+STATE_OFFLINE = 0
+STATE_ARCHIVED = 2
+DATA_HASH_BUCKETS = 2047
+FIELD_HASH_BUCKETS = 333
+# Object flags and incompatible header flags of each compression
+COMPRESSION = {"xz": (1, 1), "lz4": (2, 2), "zstd": (4, 8)}
+
+
+def _rot(x, k):
+    return ((x << k) | (x >> (32 - k))) & 0xffffffff
+
+
+def _mix(a, b, c):
+    m = 0xffffffff
+    a = (a - c) & m; a ^= _rot(c, 4); c = (c + b) & m
+    b = (b - a) & m; b ^= _rot(a, 6); a = (a + c) & m
+    c = (c - b) & m; c ^= _rot(b, 8); b = (b + a) & m
+    a = (a - c) & m; a ^= _rot(c, 16); c = (c + b) & m
+    b = (b - a) & m; b ^= _rot(a, 19); a = (a + c) & m
+    c = (c - b) & m; c ^= _rot(b, 4); b = (b + a) & m
+    return a, b, c
+
+
+def _final(a, b, c):
+    m = 0xffffffff
+    c ^= b; c = (c - _rot(b, 14)) & m
+    a ^= c; a = (a - _rot(c, 11)) & m
+    b ^= a; b = (b - _rot(a, 25)) & m
+    c ^= b; c = (c - _rot(b, 16)) & m
+    a ^= c; a = (a - _rot(c, 4)) & m
+    b ^= a; b = (b - _rot(a, 14)) & m
+    c ^= b; c = (c - _rot(b, 24)) & m
+    return a, b, c
+
+
+def jenkins_hash64(data):
+    """Bob Jenkins' lookup3 hashlittle2, as used for unkeyed journal files"""
+    length = len(data)
+    a = b = c = (0xdeadbeef + length) & 0xffffffff
+    pos = 0
+    while length - pos > 12:
+        x, y, z = struct.unpack_from("<III", data, pos)
+        a, b, c = _mix((a + x) & 0xffffffff, (b + y) & 0xffffffff,
+                       (c + z) & 0xffffffff)
+        pos += 12
+    if length - pos > 0:
+        x, y, z = struct.unpack("<III", data[pos:].ljust(12, b"\0"))
+        a, b, c = _final((a + x) & 0xffffffff, (b + y) & 0xffffffff,
+                         (c + z) & 0xffffffff)
+    return c << 32 | b
+
+
+def _align(n):
+    return (n + 7) & ~7
+
+
+def _library(name):
+    path = ctypes.util.find_library(name)
+    try:
+        return ctypes.CDLL(path or "lib%s.so.1" % name)
+    except OSError:
+        return None
+
+
+def compressor(name):
+    """Function compressing a data payload as journald does with `name`,
+    or None if its library is not found"""
+    if name == "xz":
+        return lambda data: lzma.compress(data, check=lzma.CHECK_NONE)
+    lib = _library(name)
+    if lib is None:
+        return None
+    if name == "zstd":
+        def compress(data):
+            out = ctypes.create_string_buffer(lib.ZSTD_compressBound(
+                ctypes.c_size_t(len(data))))
+            n = lib.ZSTD_compress(out, ctypes.c_size_t(len(out)), data,
+                                  ctypes.c_size_t(len(data)), 1)
+            return out.raw[:n]
+    else:
+        def compress(data):
+            out = ctypes.create_string_buffer(lib.LZ4_compressBound(len(data)))
+            n = lib.LZ4_compress_default(data, out, len(data), len(out))
+            return struct.pack("<Q", len(data)) + out.raw[:n]
+    return compress
+
+
+class JournalFile:
+    """Builds one journal file in memory, object by object, as journald does
+
+    Each entry is a mapping or a sequence of (field, value) pairs; values
+    are bytes or str.  Unless given, seqnums count up from `seqnum`, and
+    the boot ID is the one passed to the constructor.  Monotonic
+    timestamps start at 1 for each boot and follow realtime, but still
+    increase where the realtime clock goes back.
+
+    Objects are only ever added at the end, and entry arrays are chained
+    with room to spare, so writing the file again after more entries were
+    appended only fills in unused space, updates counters and adds to the
+    end: readers with the file open see entries appended to it.
+
+    With `compress`, "xz", "lz4" or "zstd", data payloads of at least
+    `compress_threshold` bytes are compressed, as by journald.
+    """
+
+    def __init__(self, seqnum_id=None, machine_id=None, boot_id=None,
+                 seqnum=1, compress=None, compress_threshold=512):
+        self.seqnum_id = seqnum_id or uuid.uuid4()
+        self.machine_id = machine_id or uuid.uuid4()
+        self.boot_id = boot_id or uuid.uuid4()
+        self.seqnum = seqnum
+        self.entries = []
+        # Latest realtime and last monotonic timestamp of each boot
+        self.boots = {}
+        self.file_id = uuid.uuid4()
+        self.compress = compress
+        self.compressor = compressor(compress) if compress else None
+        if compress and self.compressor is None:
+            raise ValueError("No library for %s compression" % compress)
+        self.compress_threshold = compress_threshold
+        self.out = bytearray(HEADER_SIZE)
+        self.n_objects = 0
+        self.n_entry_arrays = 0
+        self.depth = {"data": 0, "field": 0}
+        self.fields = {}
+        self.datas = {}
+        # Entry array chains: [first array, tail array, used in tail, total]
+        self.entry_array = [0, 0, 0, 0]
+        self.data_arrays = {}
+        self.data_table = self._add_object(OBJECT_DATA_HASH_TABLE,
+                                           bytes(16 * DATA_HASH_BUCKETS))
+        self.field_table = self._add_object(OBJECT_FIELD_HASH_TABLE,
+                                            bytes(16 * FIELD_HASH_BUCKETS))
+
+    def _add_object(self, type_, body, flags=0):
+        offset = len(self.out)
+        self.out.extend(struct.pack("<BB6xQ", type_, flags, 16 + len(body)))
+        self.out.extend(body)
+        self.out.extend(b"\0" * (_align(len(self.out)) - len(self.out)))
+        self.n_objects += 1
+        self.tail_object_offset = offset
+        return offset
+
+    def _put(self, offset, fmt, *values):
+        struct.pack_into(fmt, self.out, offset, *values)
+
+    def _get(self, offset):
+        return struct.unpack_from("<Q", self.out, offset)[0]
+
+    def _link_hash(self, table, buckets, kind, offset, hash_):
+        item = table + 16 + 16 * (hash_ % buckets)
+        head, tail = struct.unpack_from("<QQ", self.out, item)
+        if tail:
+            self._put(tail + 24, "<Q", offset)
+            chain, o = 1, head
+            while o != offset:
+                o = self._get(o + 24)
+                chain += 1
+            self.depth[kind] = max(self.depth[kind], chain)
+            self._put(item + 8, "<Q", offset)
+        else:
+            self._put(item, "<QQ", offset, offset)
+
+    def _link_array(self, chain, entry):
+        first, tail, used, total = chain
+        if not tail or used == (self._get(tail + 8) - 24) // 8:
+            array = self._add_object(
+                OBJECT_ENTRY_ARRAY, bytes(8 + 8 * max(4, 2 * total)))
+            self.n_entry_arrays += 1
+            if tail:
+                self._put(tail + 16, "<Q", array)
+            else:
+                chain[0] = array
+            chain[1], chain[2] = array, 0
+        self._put(chain[1] + 24 + 8 * chain[2], "<Q", entry)
+        chain[2] += 1
+        chain[3] += 1
+
+    def _data(self, payload):
+        if payload in self.datas:
+            return self.datas[payload]
+        name = payload.split(b"=", 1)[0]
+        if name not in self.fields:
+            hash_ = jenkins_hash64(name)
+            self.fields[name] = self._add_object(
+                OBJECT_FIELD, struct.pack("<QQQ", hash_, 0, 0) + name)
+            self._link_hash(self.field_table, FIELD_HASH_BUCKETS, "field",
+                            self.fields[name], hash_)
+        field = self.fields[name]
+        hash_ = jenkins_hash64(payload)
+        flags, stored = 0, payload
+        if self.compressor and len(payload) >= self.compress_threshold:
+            flags, stored = (COMPRESSION[self.compress][0],
+                             self.compressor(payload))
+        offset = self._add_object(
+            OBJECT_DATA,
+            struct.pack("<QQQQQQ", hash_, 0, self._get(field + 32), 0, 0, 0)
+            + stored, flags)
+        self._put(field + 32, "<Q", offset)
+        self._link_hash(self.data_table, DATA_HASH_BUCKETS, "data", offset,
+                        hash_)
+        self.datas[payload] = (offset, hash_)
+        return self.datas[payload]
+
+    def append(self, fields, realtime, monotonic=None, boot_id=None,
+               seqnum=None):
+        boot_id = boot_id or self.boot_id
+        if seqnum is None:
+            seqnum = self.entries[-1][0] + 1 if self.entries else self.seqnum
+        last = self.boots.get(boot_id, (realtime, 0))
+        if monotonic is None:
+            monotonic = last[1] + max(realtime - last[0], 1)
+        self.boots[boot_id] = (max(realtime, last[0]), monotonic)
+        if hasattr(fields, "items"):
+            fields = fields.items()
+        items = []
+        for name, value in fields:
+            if isinstance(value, str):
+                value = value.encode()
+            items.append(name.encode() + b"=" + value)
+        items.append(b"_BOOT_ID=" + boot_id.hex.encode())
+        items.append(b"_MACHINE_ID=" + self.machine_id.hex.encode())
+        self.entries.append((seqnum, realtime, monotonic, boot_id))
+
+        refs = dict(self._data(payload) for payload in items)
+        xor_hash = 0
+        body = bytearray()
+        for offset in sorted(refs):
+            xor_hash ^= refs[offset]
+            body.extend(struct.pack("<QQ", offset, refs[offset]))
+        entry = self._add_object(
+            OBJECT_ENTRY,
+            struct.pack("<QQQ16sQ", seqnum, realtime, monotonic,
+                        boot_id.bytes, xor_hash) + bytes(body))
+        self._link_array(self.entry_array, entry)
+        for offset in sorted(refs):
+            n_entries = self._get(offset + 56)
+            if n_entries == 0:
+                self._put(offset + 40, "<Q", entry)
+            else:
+                chain = self.data_arrays.setdefault(offset, [0, 0, 0, 0])
+                self._link_array(chain, entry)
+                self._put(offset + 48, "<Q", chain[0])
+            self._put(offset + 56, "<Q", n_entries + 1)
+        self.tail_entry_offset = entry
+
+    def default_name(self, prefix="system", archived=True):
+        if not archived:
+            return prefix + ".journal"
+        seqnum, realtime = (self.entries[0][:2] if self.entries
+                            else (self.seqnum, 0))
+        return "%s@%s-%016x-%016x.journal" % (
+            prefix, self.seqnum_id.hex, seqnum, realtime)
+
+    def write(self, path, archived=True):
+        """Write the file, or update it in place if it exists"""
+        first = self.entries[0] if self.entries else (0, 0, 0, None)
+        last = self.entries[-1] if self.entries else (0, 0, 0, None)
+        header = struct.pack(
+            "<8sIIB7x16s16s16s16sQQQQQQQQQQQQQQQQQQQQQIIQ",
+            b"LPKSHHRH", 0,
+            COMPRESSION[self.compress][1] if self.compress else 0,
+            STATE_ARCHIVED if archived else STATE_OFFLINE,
+            self.file_id.bytes, self.machine_id.bytes,
+            last[3].bytes if last[3] else bytes(16), self.seqnum_id.bytes,
+            HEADER_SIZE, len(self.out) - HEADER_SIZE,
+            self.data_table + 16, 16 * DATA_HASH_BUCKETS,
+            self.field_table + 16, 16 * FIELD_HASH_BUCKETS,
+            self.tail_object_offset, self.n_objects,
+            len(self.entries), last[0], first[0], self.entry_array[0],
+            first[1], last[1], last[2],
+            len(self.datas), len(self.fields), 0, self.n_entry_arrays,
+            self.depth["data"], self.depth["field"],
+            self.entry_array[1], self.entry_array[2],
+            self.tail_entry_offset if self.entries else 0)
+        # Objects first and the header last, never truncating, so that a
+        # reader only finds complete entries
+        with open(path, "r+b" if os.path.exists(path) else "wb") as f:
+            f.seek(HEADER_SIZE)
+            f.write(self.out[HEADER_SIZE:])
+            f.flush()
+            f.seek(0)
+            f.write(header)
+        return path
+
+
+def write_journal(directory, entries, files=1, archived=True, **kwargs):
+    """Write entries to `files` journal files in directory, return paths
+
+    Entries are (fields, realtime) or (fields, realtime, boot_id) tuples,
+    split in turn between files as if the journal had been rotated.  The
+    last file is left active unless `archived`.  Further keyword arguments
+    go to JournalFile.
+    """
+    entries = list(entries)
+    kwargs.setdefault("seqnum_id", uuid.uuid4())
+    kwargs.setdefault("machine_id", uuid.uuid4())
+    kwargs.setdefault("boot_id", uuid.uuid4())
+    os.makedirs(directory, exist_ok=True)
+    paths = []
+    boots = {}
+    seqnum = kwargs.pop("seqnum", 1)
+    for i in range(files):
+        journal = JournalFile(seqnum=seqnum, **kwargs)
+        journal.boots = boots
+        for entry in entries[len(entries) * i // files:
+                             len(entries) * (i + 1) // files]:
+            journal.append(*entry[:2], boot_id=entry[2] if len(entry) > 2
+                           else None)
+        seqnum += len(journal.entries)
+        last = archived or i < files - 1
+        paths.append(journal.write(
+            os.path.join(directory, journal.default_name(archived=last)),
+            archived=last))
+    return paths
@@ -0,0 +1,172 @@
+import os
+import shutil
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+N_FILES = 9
+PER_FILE = 40
+# Units found in a single file each; rare3 in the active file
+RARE = {50: "rare1", 130: "rare2", 340: "rare3"}
+
+
+def make_entries(rare=RARE):
+    entries = []
+    for n in range(N_FILES * PER_FILE):
+        fields = {"MESSAGE": "m%d" % n, "UNIT": rare.get(n, "u%d" % (n % 3))}
+        if PER_FILE <= n < 2 * PER_FILE:
+            fields["TAG"] = "t"
+        if n < 5 * PER_FILE:
+            fields["HALF"] = "1"
+        entries.append((fields, BASE + n * 1000))
+    return entries
+
+
+class BloomTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.tmpdir.name, "journal")
+        self.sidecars = os.path.join(self.tmpdir.name, "sidecars")
+        os.mkdir(self.sidecars)
+        self.files = write_journal(self.path, make_entries(), files=N_FILES,
+                                   archived=False)
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def messages(self, journal):
+        return [entry["MESSAGE"] for entry in journal]
+
+    def compare(self, setup):
+        """Messages read with bloom filters, checked against those read
+        without, and bloom_info()"""
+        plain = pyjournalctl.Journal(path=self.path)
+        setup(plain)
+        journal = pyjournalctl.Journal(path=self.path, bloom=self.sidecars)
+        setup(journal)
+        messages = self.messages(journal)
+        self.assertEqual(messages, self.messages(plain))
+        return messages, journal.bloom_info()
+
+    def test_match(self):
+        messages, info = self.compare(
+            lambda journal: journal.add_match(UNIT="rare1"))
+        self.assertEqual(messages, ["m50"])
+        self.assertEqual(info, {"files": N_FILES, "indexed": N_FILES - 1,
+                                "built": N_FILES - 1, "pruned": N_FILES - 2})
+
+    def test_common_match(self):
+        messages, info = self.compare(
+            lambda journal: journal.add_match(UNIT="u0"))
+        self.assertEqual(len(messages), N_FILES * PER_FILE // 3)
+        self.assertEqual(info["pruned"], 0)
+
+    def test_few_pruned(self):
+        # Four of the nine files could be pruned, too few to reopen
+        messages, info = self.compare(
+            lambda journal: journal.add_match(HALF="1"))
+        self.assertEqual(len(messages), 5 * PER_FILE)
+        self.assertEqual(info["pruned"], 0)
+
+    def test_disjunction(self):
+        def setup(journal):
+            journal.add_match(UNIT="rare1")
+            journal.add_disjunction()
+            journal.add_match(UNIT="rare2")
+        messages, info = self.compare(setup)
+        self.assertEqual(messages, ["m50", "m130"])
+        self.assertEqual(info["pruned"], N_FILES - 3)
+
+    def test_conjunction(self):
+        messages, info = self.compare(lambda journal: journal.filter(
+            "(UNIT=rare1 or UNIT=rare2) and (TAG=t or MESSAGE=m0)"))
+        self.assertEqual(messages, ["m50"])
+        self.assertEqual(info["pruned"], N_FILES - 2)
+        messages, info = self.compare(
+            lambda journal: journal.filter("UNIT=rare2 and TAG=t"))
+        self.assertEqual(messages, [])
+        self.assertEqual(info["pruned"], N_FILES - 1)
+
+    def test_filter(self):
+        messages, info = self.compare(
+            lambda journal: journal.filter("UNIT=rare1 or UNIT=rare3"))
+        self.assertEqual(messages, ["m50", "m340"])
+        self.assertEqual(info["pruned"], N_FILES - 2)
+        messages, info = self.compare(
+            lambda journal: journal.filter("UNIT=rare2 and MESSAGE contains 3"))
+        self.assertEqual(messages, ["m130"])
+        self.assertEqual(info["pruned"], N_FILES - 2)
+
+    def test_match_while_reading(self):
+        def setup(journal):
+            self.assertEqual([journal.get_next()["MESSAGE"]
+                              for _ in range(3)], ["m0", "m1", "m2"])
+            journal.add_match(UNIT="rare2")
+        messages, info = self.compare(setup)
+        self.assertEqual(messages, ["m130"])
+        self.assertEqual(info["pruned"], 0)
+
+        journal = pyjournalctl.Journal(path=self.path, bloom=self.sidecars)
+        setup(journal)
+        self.assertEqual(journal.get_next()["MESSAGE"], "m130")
+        journal.flush_matches()
+        journal.add_match(UNIT="rare1")
+        journal.seek_head()
+        self.assertEqual(self.messages(journal), ["m50"])
+        self.assertEqual(journal.bloom_info()["pruned"], N_FILES - 2)
+
+    def test_active_file(self):
+        messages, info = self.compare(
+            lambda journal: journal.add_match(UNIT="rare3"))
+        self.assertEqual(messages, ["m340"])
+        self.assertEqual(info["pruned"], N_FILES - 1)
+
+    def test_sidecar_reuse(self):
+        for built in (N_FILES - 1, 0):
+            messages, info = self.compare(
+                lambda journal: journal.add_match(UNIT="rare2"))
+            self.assertEqual(messages, ["m130"])
+            self.assertEqual(info["built"], built)
+        self.assertEqual(len(os.listdir(self.sidecars)), N_FILES - 1)
+
+    def test_stale_sidecar(self):
+        self.compare(lambda journal: journal.add_match(UNIT="rare1"))
+        # The file of rare1 replaced by one of the same name without it
+        other = os.path.join(self.tmpdir.name, "other")
+        entries = make_entries({50: "rare4"})[PER_FILE:2 * PER_FILE]
+        replaced, = write_journal(other, entries)
+        shutil.move(replaced, self.files[1])
+
+        messages, info = self.compare(
+            lambda journal: journal.add_match(UNIT="rare4"))
+        self.assertEqual(messages, ["m50"])
+        self.assertEqual(info["built"], 1)
+        messages, info = self.compare(
+            lambda journal: journal.add_match(UNIT="rare1"))
+        self.assertEqual(messages, [])
+        self.assertEqual(info["built"], 0)
+
+    def test_corrupt_sidecar(self):
+        self.compare(lambda journal: journal.add_match(UNIT="rare1"))
+        sidecar = os.path.join(self.sidecars,
+                               os.path.basename(self.files[1]) + ".bloom")
+        with open(sidecar, "r+b") as f:
+            f.truncate(64)
+        messages, info = self.compare(
+            lambda journal: journal.add_match(UNIT="rare1"))
+        self.assertEqual(messages, ["m50"])
+        self.assertEqual(info["built"], 1)
+
+    def test_no_bloom(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        self.assertIsNone(journal.bloom_info())
+        self.assertRaises(ValueError, pyjournalctl.Journal, bloom=True)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,144 @@
+import os
+import tempfile
+import time
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import JournalFile, write_journal
+
+BASE = 1700000000000000
+BOOTS = [uuid.uuid4() for _ in range(4)]
+BOOT_IDS = [boot.hex for boot in BOOTS]
+
+
+def make_entries(start, end, boot):
+    return [({"MESSAGE": "%d" % n, "UNIT": "u%d" % (n % 2)},
+             BASE + n * 1000, BOOTS[boot]) for n in range(start, end)]
+
+
+class BootTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = self.tmpdir.name
+        self.ids = {"seqnum_id": uuid.uuid4(), "machine_id": uuid.uuid4()}
+        # Boot 0 over two files, boot 1 sharing the second with it, and
+        # boot 2 in the file still being written
+        write_journal(self.path, make_entries(0, 300, 0) +
+                      make_entries(300, 400, 1), files=2, **self.ids)
+        self.active = JournalFile(seqnum=401, **self.ids)
+        self.append(make_entries(400, 500, 2))
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def append(self, entries):
+        for fields, realtime, boot_id in entries:
+            self.active.append(fields, realtime, boot_id=boot_id)
+        self.active.write(os.path.join(self.path, "system.journal"),
+                          archived=False)
+
+    def open(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        # The first wait() reports INVALIDATE, as changes were not watched
+        journal.wait(0)
+        return journal
+
+    def expected(self, journal):
+        """Boots as found by reading every entry"""
+        journal.flush_matches()
+        journal.seek_head()
+        boots = {}
+        for e in journal:
+            boot = boots.setdefault(e["_BOOT_ID"], [e["__REALTIME_TIMESTAMP"],
+                                                    None, e["__CURSOR"]])
+            boot[1] = e["__REALTIME_TIMESTAMP"]
+        journal.seek_head()
+        return sorted(((boot_id, first, last, cursor)
+                       for boot_id, (first, last, cursor) in boots.items()),
+                      key=lambda boot: (boot[1], boot[0]))
+
+    def wait_for_change(self, journal):
+        deadline = time.monotonic() + 10
+        while journal.wait(1) == pyjournalctl.NOP:
+            self.assertLess(time.monotonic(), deadline)
+
+    def messages(self, journal):
+        journal.seek_head()
+        return [int(e["MESSAGE"]) for e in journal]
+
+    def test_list_boots(self):
+        journal = self.open()
+        boots = journal.list_boots()
+        self.assertEqual(boots, self.expected(journal))
+        self.assertEqual([b[0] for b in boots], BOOT_IDS[:3])
+        self.assertEqual(boots[0][1].timestamp() * 10**6, BASE)
+        self.assertEqual(boots[0][2].timestamp() * 10**6, BASE + 299000)
+        self.assertEqual(journal.get_by_cursors([boots[1][3]])[0]["MESSAGE"],
+                         "300")
+
+    def test_matches_ignored(self):
+        journal = self.open()
+        expected = self.expected(journal)
+        journal.add_match(UNIT="u1")
+        journal.add_match(_BOOT_ID=BOOT_IDS[1])
+        self.assertEqual(journal.list_boots(), expected)
+
+    def test_boot(self):
+        journal = self.open()
+        for offset, boot, messages in ((0, 2, range(400, 500)),
+                                       (-1, 1, range(300, 400)),
+                                       (-2, 0, range(300)),
+                                       (1, 0, range(300)),
+                                       (3, 2, range(400, 500))):
+            with self.subTest(offset=offset):
+                journal.flush_matches()
+                journal.boot(offset)
+                self.assertEqual(self.messages(journal), list(messages))
+        journal.flush_matches()
+        journal.boot()
+        self.assertEqual(self.messages(journal), list(range(400, 500)))
+        journal.add_match(UNIT="u1")
+        self.assertEqual(self.messages(journal), list(range(401, 500, 2)))
+        for offset in (-3, 4, 1 << 40):
+            self.assertRaises(ValueError, journal.boot, offset)
+
+    def test_appended_entries(self):
+        journal = self.open()
+        journal.list_boots()
+        self.append(make_entries(500, 550, 2) + make_entries(550, 600, 3))
+        self.wait_for_change(journal)
+        boots = journal.list_boots()
+        self.assertEqual(boots, self.expected(journal))
+        self.assertEqual([b[0] for b in boots], BOOT_IDS)
+        journal.boot(-1)
+        self.assertEqual(self.messages(journal), list(range(400, 550)))
+
+    def test_added_and_removed_files(self):
+        journal = self.open()
+        before = journal.list_boots()
+        with tempfile.TemporaryDirectory() as staging:
+            path, = write_journal(staging, make_entries(-100, 0, 3))
+            os.rename(path, os.path.join(self.path, os.path.basename(path)))
+        self.wait_for_change(journal)
+        self.assertEqual(journal.list_boots(), self.expected(journal))
+        self.assertEqual([b[0] for b in journal.list_boots()],
+                         [BOOT_IDS[3]] + BOOT_IDS[:3])
+        journal.boot(1)
+        self.assertEqual(self.messages(journal), list(range(-100, 0)))
+
+        os.unlink(os.path.join(self.path, os.path.basename(path)))
+        self.wait_for_change(journal)
+        self.assertEqual(journal.list_boots(), before)
+
+    def test_empty(self):
+        with tempfile.TemporaryDirectory() as path:
+            journal = pyjournalctl.Journal(path=path)
+            self.assertEqual(journal.list_boots(), [])
+            self.assertRaises(ValueError, journal.boot)
+
+
+if __name__ == "__main__":
+    unittest.main()
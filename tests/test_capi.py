@@ -0,0 +1,145 @@
+import importlib.util
+import os
+import tempfile
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(TESTS)
+BASE = 1700000000000000
+BOOT_ID = uuid.UUID("0123456789abcdef0123456789abcdef")
+
+
+def build_consumer(directory):
+    """The test extension using the C API, built in directory"""
+    try:
+        from setuptools import Distribution, Extension
+    except ImportError:
+        raise unittest.SkipTest("setuptools is needed to build the consumer")
+    dist = Distribution({"ext_modules": [Extension(
+        "capi_consumer", [os.path.join(TESTS, "capi_consumer.c")],
+        include_dirs=[ROOT], depends=[os.path.join(ROOT, "pyjournalctl.h")])]})
+    dist.verbose = 0
+    cmd = dist.get_command_obj("build_ext")
+    cmd.build_lib = cmd.build_temp = directory
+    cmd.ensure_finalized()
+    cmd.run()
+    spec = importlib.util.spec_from_file_location(
+        "capi_consumer", cmd.get_ext_fullpath("capi_consumer"))
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def user_fields(fields):
+    """Fields as sent, without those added by the journal"""
+    return sorted(field for field in fields if not field.startswith(b"_"))
+
+
+def parse_cursor(cursor):
+    values = dict(item.split("=") for item in cursor.split(";"))
+    return (values["s"], int(values["i"], 16), values["b"],
+            int(values["m"], 16), int(values["t"], 16), int(values["x"], 16))
+
+
+class CAPITest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        cls.consumer = build_consumer(os.path.join(cls.tmpdir.name, "build"))
+        cls.path = os.path.join(cls.tmpdir.name, "journal")
+        cls.records = [{"MESSAGE": "m%d" % n, "PRIORITY": str(n % 8),
+                        "BINARY": b"\x00\xff%d" % n} for n in range(20)]
+        write_journal(cls.path, [(record, BASE + n * 1000)
+                                 for n, record in enumerate(cls.records)],
+                      files=2, boot_id=BOOT_ID)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.path)
+
+    def fields(self, record):
+        return sorted(b"%s=%s" % (name.encode(), value if isinstance(
+            value, bytes) else value.encode())
+            for name, value in record.items())
+
+    def test_read(self):
+        entries = self.consumer.read(self.journal, 1)
+        self.assertEqual([(realtime, boot_id, user_fields(fields))
+                          for realtime, _, boot_id, fields in entries],
+                         [(BASE + n * 1000, BOOT_ID.hex, self.fields(record))
+                          for n, record in enumerate(self.records)])
+        monotonic = [entry[1] for entry in entries]
+        self.assertEqual(monotonic, sorted(monotonic))
+        # Released, so the journal may be used again
+        self.journal.seek_head()
+        self.assertEqual(self.journal.get_next()["MESSAGE"], "m0")
+
+    def test_read_reverse(self):
+        self.assertEqual([user_fields(entry[3]) for entry in
+                          self.consumer.read(self.journal, -1)],
+                         [self.fields(record)
+                          for record in reversed(self.records)])
+        self.journal.seek_head()
+        self.journal.get_next(5)
+        self.assertEqual(len(self.consumer.read(self.journal, -2)), 2)
+
+    def test_read_filter(self):
+        self.journal.filter("PRIORITY<=2 and not MESSAGE=m1")
+        expected = [record["MESSAGE"].encode() for record in self.records
+                    if int(record["PRIORITY"]) <= 2 and
+                    record["MESSAGE"] != "m1"]
+        self.assertEqual(
+            [[field[8:] for field in entry[3]
+              if field.startswith(b"MESSAGE=")][0]
+             for entry in self.consumer.read(self.journal, 1)],
+            expected)
+        self.assertEqual(len(self.consumer.read(self.journal, -1)),
+                         len(expected) - 1)
+
+    def test_enumerate_stop(self):
+        result, fields = self.consumer.first_fields(self.journal, 2)
+        self.assertEqual(result, 1)
+        self.assertEqual(len(fields), 2)
+        result, fields = self.consumer.first_fields(self.journal, 0)
+        self.assertEqual(result, 0)
+        self.assertEqual(user_fields(fields), self.fields(self.records[1]))
+
+    def test_cursor_round_trip(self):
+        cursor, again = self.consumer.cursor_round_trip(self.journal, 13)
+        self.assertEqual(cursor, again)
+        other = pyjournalctl.Journal(path=self.path)
+        self.assertEqual(cursor, parse_cursor(other.get_next(13)["__CURSOR"]))
+        self.assertEqual(self.journal.get_next()["MESSAGE"], "m13")
+        self.journal.add_match(MESSAGE="none")
+        self.assertRaises(OSError, self.consumer.cursor_round_trip,
+                          self.journal, 1)
+
+    def test_acquire_type(self):
+        self.assertRaises(TypeError, self.consumer.read, object(), 1)
+        self.assertRaises(TypeError, self.consumer.first_fields, None, 1)
+
+    def test_version(self):
+        version = self.consumer.import_api()
+        self.assertGreaterEqual(version, 1)
+        api = pyjournalctl._C_API
+        try:
+            pyjournalctl._C_API = self.consumer.capsule(version - 1)
+            self.assertRaises(ImportError, self.consumer.import_api)
+            pyjournalctl._C_API = self.consumer.capsule(version + 1)
+            self.assertEqual(self.consumer.import_api(), version + 1)
+        finally:
+            pyjournalctl._C_API = api
+            self.consumer.import_api()
+
+
+if __name__ == "__main__":
+    unittest.main()
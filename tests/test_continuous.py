@@ -0,0 +1,122 @@
+import datetime
+import os
+import tempfile
+import time
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+SECOND = 10**6
+
+
+def now():
+    return int(time.time() * SECOND)
+
+
+class ContinuousQueryTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.staging = tempfile.TemporaryDirectory()
+        self.ids = {"seqnum_id": uuid.uuid4(), "machine_id": uuid.uuid4(),
+                    "boot_id": uuid.uuid4()}
+        self.seqnum = 1
+
+    def tearDown(self):
+        self.staging.cleanup()
+        self.tmpdir.cleanup()
+
+    def add_file(self, entries):
+        """Adds a journal file of entries, continuing the sequence"""
+        paths = write_journal(self.staging.name, entries, seqnum=self.seqnum,
+                              **self.ids)
+        self.seqnum += len(entries)
+        os.rename(paths[0], os.path.join(self.tmpdir.name,
+                                         os.path.basename(paths[0])))
+
+    def open(self):
+        return pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def test_window(self):
+        t = now()
+        self.add_file([({"UNIT": "old", "N": "100", "PRIORITY": "3"},
+                        t - 3600 * SECOND),
+                       ({"UNIT": "a", "N": "5", "PRIORITY": "3"},
+                        t - 120 * SECOND),
+                       ({"UNIT": "b", "N": "7", "PRIORITY": "6"},
+                        t - 10 * SECOND),
+                       ({"UNIT": "b", "N": "x", "PRIORITY": "2"}, t)])
+        journal = self.open()
+        journal.add_match(UNIT="none")
+        journal.add_continuous_query("count", "count", 300)
+        journal.add_continuous_query("recent", "count",
+                                     datetime.timedelta(minutes=1))
+        journal.add_continuous_query("units", ("count_by", "UNIT"), 300,
+                                     expression="PRIORITY<=3")
+        journal.add_continuous_query("sum", ("sum", "N"), 300)
+        self.assertEqual(journal.continuous_query("count"), 3)
+        self.assertEqual(journal.continuous_query("recent"), 2)
+        self.assertEqual(journal.continuous_query("units"), {"a": 1, "b": 1})
+        self.assertEqual(journal.continuous_query("sum"), 12)
+
+    def test_appended_entries(self):
+        self.add_file([({"UNIT": "a"}, now() - SECOND)])
+        journal = self.open()
+        journal.add_continuous_query("units", ("count_by", "UNIT"), 300)
+        self.assertEqual(journal.continuous_query("units"), {"a": 1})
+        self.add_file([({"UNIT": "b"}, now()), ({"UNIT": "a"}, now())])
+        self.assertEqual(journal.continuous_query("units"), {"a": 1})
+        deadline = time.monotonic() + 10
+        while (journal.continuous_query("units") != {"a": 2, "b": 1}
+               and time.monotonic() < deadline):
+            self.assertIn(journal.wait(1), (pyjournalctl.NOP,
+                                            pyjournalctl.APPEND,
+                                            pyjournalctl.INVALIDATE))
+        self.assertEqual(journal.continuous_query("units"), {"a": 2, "b": 1})
+
+    def test_expiry(self):
+        t = now()
+        self.add_file([({"UNIT": "a"}, t - 1500000), ({"UNIT": "b"}, t)])
+        journal = self.open()
+        journal.add_continuous_query("count", "count", 2)
+        journal.add_continuous_query("units", ("count_by", "UNIT"), 2)
+        self.assertEqual(journal.continuous_query("count"), 2)
+        time.sleep(max(0, (t + 700000 - now()) / SECOND))
+        self.assertEqual(journal.continuous_query("units"), {"b": 1})
+        self.assertEqual(journal.continuous_query("count"), 1)
+        time.sleep(max(0, (t + 2200000 - now()) / SECOND))
+        self.assertEqual(journal.continuous_query("units"), {})
+        self.assertEqual(journal.continuous_query("count"), 0)
+
+    def test_tumbling(self):
+        t = now()
+        hour = t // (3600 * SECOND) * 3600 * SECOND
+        self.add_file([({"UNIT": "a"}, hour - SECOND),
+                       ({"UNIT": "b"}, hour), ({"UNIT": "c"}, t)])
+        journal = self.open()
+        journal.add_continuous_query("hour", ("count_by", "UNIT"), 3600,
+                                     tumbling=True)
+        if now() < hour + 3600 * SECOND:
+            self.assertEqual(journal.continuous_query("hour"),
+                             {"b": 1, "c": 1})
+        self.assertRaises(ValueError, journal.add_continuous_query,
+                          "step", "count", 3600, step=60, tumbling=True)
+
+    def test_remove(self):
+        self.add_file([({"UNIT": "a"}, now())])
+        journal = self.open()
+        journal.add_continuous_query("count", "count", 60)
+        self.assertRaises(ValueError, journal.continuous_query, "other")
+        self.assertRaises(ValueError, journal.add_continuous_query,
+                          "bad", ("median", "UNIT"), 60)
+        self.assertRaises(ValueError, journal.add_continuous_query,
+                          "bad", "count", 60, expression="UNIT<")
+        journal.remove_continuous_query("count")
+        self.assertRaises(ValueError, journal.continuous_query, "count")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,105 @@
+import os
+import random
+import re
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+
+
+class GetByCursorsTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        # Two sequences of interleaved times, each over several files
+        self.paths = write_journal(
+            self.tmpdir.name,
+            [({"MESSAGE": "a%d" % n, "UNIT": "u%d" % (n % 3)},
+              BASE + n * 1000) for n in range(600)], files=4)
+        self.paths += write_journal(
+            self.tmpdir.name,
+            [({"MESSAGE": "b%d" % n, "UNIT": "u%d" % (n % 3)},
+              BASE + n * 1000 + 500) for n in range(300)], files=2,
+            archived=False)
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+        self.entries = list(self.journal)
+        self.cursors = [e["__CURSOR"] for e in self.entries]
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def test_all(self):
+        self.assertEqual(len(self.entries), 900)
+        self.assertEqual(self.journal.get_by_cursors(self.cursors),
+                         self.entries)
+        self.assertEqual(self.journal.get_by_cursors([]), [])
+
+    def test_order(self):
+        rng = random.Random(1)
+        for n in (1, 2, 10, 100, 900):
+            with self.subTest(n=n):
+                indices = rng.sample(range(len(self.cursors)), n)
+                self.assertEqual(
+                    self.journal.get_by_cursors(
+                        [self.cursors[i] for i in indices]),
+                    [self.entries[i] for i in indices])
+        # Near each other, from the end back, and far apart
+        for indices in (list(range(100, 140, 3)), list(range(899, 0, -7)),
+                        [0, 899, 1, 898, 450]):
+            with self.subTest(indices=indices):
+                self.assertEqual(
+                    self.journal.get_by_cursors(
+                        (self.cursors[i] for i in indices)),
+                    [self.entries[i] for i in indices])
+
+    def test_repeated(self):
+        result = self.journal.get_by_cursors(
+            [self.cursors[5], self.cursors[7], self.cursors[5]])
+        self.assertEqual(result, [self.entries[5], self.entries[7],
+                                  self.entries[5]])
+        result[0]["MESSAGE"] = "changed"
+        self.assertEqual(result[2], self.entries[5])
+
+    def test_not_found(self):
+        cursor = self.cursors[10]
+        missing = re.sub(r";i=[0-9a-f]+;", ";i=ffffff;", cursor)
+        other = re.sub(r"^s=[0-9a-f]+;", "s=%s;" % ("0" * 32), cursor)
+        result = self.journal.get_by_cursors(
+            ["not a cursor", missing, cursor, other, ""])
+        self.assertEqual(result, [None, None, self.entries[10], None, None])
+        self.assertRaises(TypeError, self.journal.get_by_cursors, [1])
+        self.assertRaises(TypeError, self.journal.get_by_cursors, None)
+
+    def test_removed_file(self):
+        os.unlink(self.paths[1])
+        journal = pyjournalctl.Journal(path=self.tmpdir.name)
+        remaining = {e["__CURSOR"] for e in journal}
+        self.assertEqual(len(remaining), 750)
+        self.assertEqual(
+            journal.get_by_cursors(self.cursors),
+            [e if e["__CURSOR"] in remaining else None
+             for e in self.entries])
+
+    def test_matches_and_filter(self):
+        self.journal.add_match(UNIT="u1")
+        self.journal.filter("MESSAGE startswith b")
+        self.assertEqual(
+            self.journal.get_by_cursors(self.cursors),
+            [e if e["UNIT"] == "u1" and e["MESSAGE"].startswith("b")
+             else None for e in self.entries])
+
+    def test_fields(self):
+        indices = [3, 600, 4, 899]
+        self.assertEqual(
+            self.journal.get_by_cursors([self.cursors[i] for i in indices],
+                                        fields=["MESSAGE", "__CURSOR"]),
+            [{"MESSAGE": self.entries[i]["MESSAGE"],
+              "__CURSOR": self.cursors[i]} for i in indices])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,115 @@
+import os
+import tempfile
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import JournalFile
+
+BASE = 1700000000000000
+SECOND = 10**6
+
+
+class DedupTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = self.tmpdir.name
+        self.machine_id = uuid.uuid4()
+        self.boot_id = uuid.uuid4()
+        self.seqnum_id = uuid.uuid4()
+        # Copies go in the machine's directory, as if from another source
+        self.copies = os.path.join(self.path, self.machine_id.hex)
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def write(self, directory, n=60, seqnum_id=None, seqnum=1, shift=0,
+              realtime_shift=0, message="m%d"):
+        """Entries one second apart, with monotonic times moved by shift"""
+        journal = JournalFile(seqnum_id=seqnum_id or self.seqnum_id,
+                              machine_id=self.machine_id,
+                              boot_id=self.boot_id, seqnum=seqnum)
+        for i in range(n):
+            journal.append({"MESSAGE": message % i},
+                           BASE + i * SECOND + realtime_shift,
+                           monotonic=1 + i * SECOND + shift)
+        os.makedirs(directory, exist_ok=True)
+        journal.write(os.path.join(directory, journal.default_name()))
+
+    def read(self, reverse=False, **kwargs):
+        journal = pyjournalctl.Journal(path=self.path)
+        if reverse:
+            journal.seek_tail()
+        iterator = journal.entries(reverse=reverse, **kwargs)
+        return [e["MESSAGE"] for e in iterator], iterator.duplicates
+
+    def test_rewritten_seqnums(self):
+        # As from journal-remote, under another sequence
+        self.write(self.path)
+        self.write(self.copies, seqnum_id=uuid.uuid4(), seqnum=1000, shift=7)
+        messages, duplicates = self.read()
+        self.assertEqual((len(messages), duplicates), (120, 0))
+        for reverse in (False, True):
+            with self.subTest(reverse=reverse):
+                messages, duplicates = self.read(reverse, dedup=True)
+                self.assertEqual(sorted(messages),
+                                 sorted("m%d" % i for i in range(60)))
+                self.assertEqual(duplicates, 60)
+
+    def test_same_seqnums(self):
+        # Of the same sequence, but with other times
+        self.write(self.path)
+        self.write(self.copies, shift=20 * SECOND,
+                   realtime_shift=20 * SECOND)
+        self.assertEqual(len(self.read()[0]), 120)
+        messages, duplicates = self.read(dedup=True)
+        self.assertEqual(messages, ["m%d" % i for i in range(60)])
+        self.assertEqual(duplicates, 60)
+
+    def test_window(self):
+        # Copies come about 20 entries after the original
+        self.write(self.path)
+        self.write(self.copies, seqnum_id=uuid.uuid4(), seqnum=1000,
+                   shift=20 * SECOND)
+        for reverse in (False, True):
+            with self.subTest(reverse=reverse):
+                messages, duplicates = self.read(reverse, dedup=30 * SECOND)
+                self.assertEqual((len(messages), duplicates), (60, 60))
+                # Only copies of the last 11 entries, once no entry is
+                # more than 10 seconds after them
+                messages, duplicates = self.read(reverse, dedup=True)
+                self.assertEqual((len(messages), duplicates), (109, 11))
+                edge = (["m%d" % i for i in range(11)] if reverse
+                        else ["m%d" % i for i in range(49, 60)])
+                self.assertEqual([messages.count(m) for m in edge], [1] * 11)
+                messages, duplicates = self.read(reverse, dedup=0)
+                self.assertEqual((len(messages), duplicates), (119, 1))
+
+    def test_distinct_entries_kept(self):
+        self.write(self.path)
+        # Same times, other data
+        self.write(self.copies, seqnum_id=uuid.uuid4(), shift=7,
+                   message="other%d")
+        messages, duplicates = self.read(dedup=30 * SECOND)
+        self.assertEqual((len(messages), duplicates), (120, 0))
+
+    def test_limit_and_fields(self):
+        self.write(self.path)
+        self.write(self.copies, seqnum_id=uuid.uuid4(), seqnum=1000, shift=7)
+        messages, duplicates = self.read(limit=50, dedup=True,
+                                         fields=["MESSAGE"])
+        self.assertEqual(sorted(messages),
+                         sorted("m%d" % i for i in range(50)))
+        self.assertEqual(duplicates, 49)
+        self.assertEqual(self.read(dedup=False), self.read())
+
+    def test_arguments(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        self.assertRaises(ValueError, journal.entries, dedup=-1)
+        self.assertRaises(TypeError, journal.entries, dedup="10s")
+
+
+if __name__ == "__main__":
+    unittest.main()
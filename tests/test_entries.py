@@ -0,0 +1,100 @@
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+
+
+class EntriesTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        write_journal(cls.tmpdir.name,
+                      [({"MESSAGE": "m%d" % n, "UNIT": "u%d" % (n % 2)},
+                        BASE + n * 1000) for n in range(10)], files=2)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def messages(self, entries):
+        return [entry["MESSAGE"] for entry in entries]
+
+    def test_forward(self):
+        self.assertEqual(self.messages(self.journal),
+                         ["m%d" % n for n in range(10)])
+
+    def test_reversed_unpositioned(self):
+        for engine in ("sd-journal", "mmap"):
+            with self.subTest(engine=engine):
+                journal = pyjournalctl.Journal(path=self.tmpdir.name,
+                                               engine=engine)
+                self.assertEqual(self.messages(reversed(journal)),
+                                 ["m%d" % n for n in range(9, -1, -1)])
+
+    def test_reversed_positioned(self):
+        self.journal.seek_head()
+        self.assertEqual(self.messages(reversed(self.journal)), [])
+        self.assertEqual(self.journal.get_previous(), {})
+        self.journal.get_next(3)
+        self.assertEqual(self.messages(reversed(self.journal)),
+                         ["m1", "m0"])
+        self.journal.seek_tail()
+        self.assertEqual(self.messages(reversed(self.journal)),
+                         ["m%d" % n for n in range(9, -1, -1)])
+
+    def test_reversed_with_match(self):
+        self.journal.add_match(UNIT="u1")
+        self.assertEqual(self.messages(reversed(self.journal)),
+                         ["m9", "m7", "m5", "m3", "m1"])
+
+    def test_get_previous_unpositioned(self):
+        self.assertEqual(self.journal.get_previous()["MESSAGE"], "m9")
+        self.assertEqual(self.journal.get_previous(2)["MESSAGE"], "m7")
+
+    def test_entries(self):
+        self.assertEqual(self.messages(self.journal.entries(limit=3)),
+                         ["m0", "m1", "m2"])
+        self.assertEqual(self.messages(self.journal.entries()),
+                         ["m%d" % n for n in range(3, 10)])
+        self.assertEqual(self.messages(self.journal.entries(reverse=True,
+                                                            limit=2)),
+                         ["m8", "m7"])
+        self.assertEqual(list(self.journal.entries(limit=0)), [])
+
+    def test_entries_reverse_unpositioned(self):
+        self.assertEqual(self.messages(self.journal.entries(True)),
+                         ["m%d" % n for n in range(9, -1, -1)])
+
+    def test_entries_fields(self):
+        entries = list(self.journal.entries(
+            limit=2, fields=["MESSAGE", "__CURSOR", "MISSING"]))
+        self.assertEqual([sorted(entry) for entry in entries],
+                         [["MESSAGE", "__CURSOR"]] * 2)
+        self.assertEqual(self.messages(entries), ["m0", "m1"])
+        self.assertEqual(list(self.journal.entries(
+            reverse=True, limit=1, fields=("UNIT",))), [{"UNIT": "u0"}])
+
+    def test_arguments(self):
+        self.assertRaises(ValueError, self.journal.entries, limit=-1)
+        self.assertRaises(TypeError, self.journal.entries, limit="1")
+        self.assertRaises(TypeError, self.journal.entries, fields=1)
+        self.assertRaises(TypeError, self.journal.entries,
+                          False, 1, None, None, None)
+        self.assertRaises(TypeError, self.journal.entries, reversed=True)
+        self.assertRaises(TypeError, self.journal.entries, True, reverse=True)
+        self.assertRaises(TypeError, self.journal.get_next, 1, 2)
+        self.assertRaises(ValueError, self.journal.get_next, 0)
+        self.assertRaises(TypeError, self.journal.seek_cursor)
+        self.assertRaises(TypeError, self.journal.seek_realtime, when=0)
+
+
+if __name__ == "__main__":
+    unittest.main()
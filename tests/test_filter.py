@@ -0,0 +1,130 @@
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+COMMS = ["cron", "crond", "sshd", "systemd"]
+TRANSPORTS = ["kernel", "journal", "syslog"]
+
+
+def make_records():
+    records = []
+    for n in range(400):
+        record = {"MESSAGE": "message %d" % n,
+                  "_COMM": COMMS[n % len(COMMS)],
+                  "_TRANSPORT": TRANSPORTS[n % len(TRANSPORTS)]}
+        if n % 11:
+            record["PRIORITY"] = str(n % 8)
+        records.append(record)
+    return records
+
+
+def priority(record):
+    return int(record["PRIORITY"]) if "PRIORITY" in record else None
+
+
+EXPRESSIONS = [
+    ("PRIORITY<=3",
+     lambda r: priority(r) is not None and priority(r) <= 3),
+    # FIELD!=value is not FIELD=value, so true where FIELD is absent
+    ("PRIORITY!=6", lambda r: priority(r) != 6),
+    ("PRIORITY>=2 and PRIORITY<5",
+     lambda r: priority(r) is not None and 2 <= priority(r) < 5),
+    ("_COMM startswith cron",
+     lambda r: r["_COMM"].startswith("cron")),
+    ("_COMM endswith d and not _TRANSPORT=kernel",
+     lambda r: r["_COMM"].endswith("d") and r["_TRANSPORT"] != "kernel"),
+    ("MESSAGE contains '7'",
+     lambda r: "7" in r["MESSAGE"]),
+    ("PRIORITY<=6 and not (_TRANSPORT=kernel or _COMM startswith cron)",
+     lambda r: priority(r) is not None and priority(r) <= 6
+     and not (r["_TRANSPORT"] == "kernel" or r["_COMM"].startswith("cron"))),
+    ("(PRIORITY=1 or PRIORITY=2) and (_COMM=sshd or _COMM=cron)",
+     lambda r: priority(r) in (1, 2) and r["_COMM"] in ("sshd", "cron")),
+    ("not PRIORITY<8",
+     lambda r: priority(r) is None),
+    ("__REALTIME_TIMESTAMP>=%d" % (BASE + 300 * 1000),
+     lambda r: int(r["MESSAGE"].split()[1]) >= 300),
+    # Comparisons with no PRIORITY in range expand to no matches
+    ("PRIORITY>7", lambda r: False),
+    ("PRIORITY<0", lambda r: False),
+    ("not PRIORITY>7", lambda r: True),
+    ("PRIORITY>7 or _COMM=cron", lambda r: r["_COMM"] == "cron"),
+    ("PRIORITY<0 or PRIORITY>=7",
+     lambda r: priority(r) is not None and priority(r) >= 7),
+    ("PRIORITY<2 and PRIORITY>5", lambda r: False),
+    ("PRIORITY<0 and _COMM=cron", lambda r: False),
+]
+
+
+class FilterTest(unittest.TestCase):
+
+    engine = "sd-journal"
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        cls.records = make_records()
+        write_journal(cls.tmpdir.name,
+                      [(r, BASE + n * 1000) for n, r in enumerate(cls.records)])
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name,
+                                            engine=self.engine)
+
+    def messages(self):
+        return [entry["MESSAGE"] for entry in self.journal]
+
+    def test_expressions(self):
+        for expression, predicate in EXPRESSIONS:
+            with self.subTest(expression=expression):
+                self.journal.flush_matches()
+                self.journal.seek_head()
+                self.journal.filter(expression)
+                self.assertEqual(
+                    self.messages(),
+                    [r["MESSAGE"] for r in self.records if predicate(r)])
+
+    def test_combined_with_matches(self):
+        self.journal.add_match(_COMM="sshd")
+        self.journal.filter("PRIORITY>7 or _TRANSPORT=syslog")
+        self.journal.add_match(PRIORITY="3")
+        self.assertEqual(
+            self.messages(),
+            [r["MESSAGE"] for r in self.records if r["_COMM"] == "sshd"
+             and r["_TRANSPORT"] == "syslog" and r.get("PRIORITY") == "3"])
+
+    def test_invalid_expression_keeps_matches(self):
+        self.journal.add_match(_COMM="cron")
+        for expression in ("PRIORITY<=", "(PRIORITY=1", "PRIORITY ~ 1", ""):
+            with self.subTest(expression=expression):
+                self.assertRaises(ValueError, self.journal.filter, expression)
+        self.assertEqual(
+            self.messages(),
+            [r["MESSAGE"] for r in self.records if r["_COMM"] == "cron"])
+
+    def test_flush_matches_clears_filter(self):
+        self.journal.filter("PRIORITY<0")
+        self.assertEqual(self.messages(), [])
+        self.journal.flush_matches()
+        self.journal.seek_head()
+        self.assertEqual(len(self.messages()), len(self.records))
+
+
+class MmapFilterTest(FilterTest):
+
+    engine = "mmap"
+
+    def test_engine(self):
+        self.assertEqual(self.journal.engine, "mmap")
+
+
+if __name__ == "__main__":
+    unittest.main()
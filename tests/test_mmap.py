@@ -0,0 +1,147 @@
+import os
+import tempfile
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import compressor, write_journal
+
+BASE = 1700000000000000
+
+
+def make_entries(prefix, offset=0):
+    return [({"MESSAGE": "%s%d" % (prefix, n), "UNIT": "u%d" % (n % 3),
+              "BINARY": b"\x00\x01%d" % n}, BASE + n * 1000 + offset)
+            for n in range(300)]
+
+
+class MmapTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = self.tmpdir.name
+        self.machine = uuid.uuid4()
+        self.machine_dir = os.path.join(self.path, self.machine.hex)
+        write_journal(self.machine_dir, make_entries("a"), files=3,
+                      archived=False, machine_id=self.machine)
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def open(self, engine, **kwargs):
+        return pyjournalctl.Journal(path=self.path, engine=engine, **kwargs)
+
+    def assertParity(self, engine="mmap"):
+        reference = self.open("sd-journal")
+        journal = self.open("mmap")
+        self.assertEqual(journal.engine, engine)
+        self.assertEqual(list(journal), list(reference))
+        journal.seek_head()
+        reference.seek_head()
+        self.assertEqual(list(journal.entries(fields=["MESSAGE", "UNIT"])),
+                         list(reference.entries(fields=["MESSAGE", "UNIT"])))
+        journal.seek_head()
+        reference.seek_head()
+        self.assertEqual(journal.get_next_raw(), reference.get_next_raw())
+        journal.seek_head()
+        return journal
+
+    def test_machine_directory(self):
+        self.assertParity()
+
+    def test_several_machines(self):
+        write_journal(os.path.join(self.path, uuid.uuid4().hex),
+                      make_entries("b", 500))
+        self.assertEqual(len(list(self.assertParity())), 600)
+
+    def test_files_in_path_and_subdirectory(self):
+        write_journal(self.path, make_entries("b", 500), files=2)
+        self.assertEqual(len(list(self.assertParity())), 600)
+
+    def test_other_directories_ignored(self):
+        write_journal(os.path.join(self.path, "other"), make_entries("b"))
+        write_journal(os.path.join(self.machine_dir, "deeper"),
+                      make_entries("c"))
+        self.assertEqual(len(list(self.assertParity())), 300)
+
+    def test_unreadable_file_falls_back(self):
+        with open(os.path.join(self.machine_dir, "broken.journal"), "wb") as f:
+            f.write(b"LPKSHHRH" + bytes(4088))
+        self.assertEqual(len(list(self.assertParity("sd-journal"))), 300)
+
+    def test_empty_directory(self):
+        self.tmpdir.cleanup()
+        os.mkdir(self.path)
+        journal = self.open("mmap")
+        self.assertEqual(journal.engine, "sd-journal")
+        self.assertEqual(list(journal), [])
+
+    def test_matches_and_seeking(self):
+        journal = self.assertParity()
+        reference = self.open("sd-journal")
+        for j in (journal, reference):
+            j.seek(10)
+            j.add_match(UNIT="u1")
+        self.assertEqual(list(journal), list(reference))
+        for j in (journal, reference):
+            j.flush_matches()
+            j.seek_tail()
+        self.assertEqual(list(reversed(journal)), list(reversed(reference)))
+        for j in (journal, reference):
+            j.seek_head()
+        self.assertEqual(list(journal), list(reference))
+
+    def compressed(self, compress):
+        if compressor(compress) is None:
+            self.skipTest("No library for %s compression" % compress)
+        # Long values compressed, in all but the first of the files
+        entries = [({"MESSAGE": "%s%d" % ("c" * (n % 5) * 200, n),
+                     "UNIT": "u%d" % (n % 3),
+                     "BINARY": b"\x00\xff" * 300 + b"%d" % n},
+                    BASE + 400000 + n * 1000) for n in range(60)]
+        write_journal(self.machine_dir, entries[:20], machine_id=self.machine)
+        write_journal(self.machine_dir, entries[20:], files=2,
+                      machine_id=self.machine, compress=compress)
+        journal = self.assertParity()
+        self.assertEqual(len(list(journal)), 360)
+        self.assertIn("c" * 800, [entry["MESSAGE"][:800] for entry in
+                                  self.open("mmap")])
+
+    def test_compressed_zstd(self):
+        self.compressed("zstd")
+
+    def test_compressed_lz4(self):
+        self.compressed("lz4")
+
+    def test_compressed_xz(self):
+        # Read by libsystemd from the first entry with compressed data
+        self.compressed("xz")
+
+    def test_compressed_after_fallback(self):
+        self.compressed("xz")
+        journal = self.open("mmap")
+        reference = self.open("sd-journal")
+        for j in (journal, reference):
+            j.get_next(310)
+        self.assertEqual(list(journal), list(reference))
+        for j in (journal, reference):
+            j.seek_head()
+        self.assertEqual(list(journal), list(reference))
+
+    def test_files_added_later(self):
+        journal = self.open("mmap")
+        write_journal(self.path, make_entries("b", 500))
+        self.assertEqual(journal.engine, "mmap")
+        self.assertEqual(len(list(journal)), 300)
+        self.assertEqual(len(list(self.open("mmap"))), 600)
+
+    def test_value_cache(self):
+        journal = self.open("mmap", value_cache=16)
+        reference = self.open("sd-journal")
+        self.assertEqual(list(journal), list(reference))
+        self.assertGreater(journal.value_cache_info()["hits"], 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,134 @@
+import collections
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+DAY = 86400 * 10**6
+N_ENTRIES = 3000
+WORKERS = (1, 2, 3, 4, 8)
+
+
+def make_entries(clock_jumps):
+    entries = []
+    for n in range(N_ENTRIES):
+        realtime = BASE + n * 1000
+        # Every other entry of the middle third from a clock 10 days behind
+        if clock_jumps and N_ENTRIES // 3 <= n < 2 * N_ENTRIES // 3 and n % 2:
+            realtime -= 10 * DAY
+        entries.append(({"MESSAGE": str(n), "UNIT": "u%d" % (n % 5),
+                         "PRIORITY": str(n % 8)}, realtime))
+    return entries
+
+
+class ParallelScanTest(unittest.TestCase):
+
+    clock_jumps = True
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        write_journal(cls.tmpdir.name, make_entries(cls.clock_jumps), files=3)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def serial(self):
+        self.journal.seek_head()
+        entries = list(self.journal)
+        self.journal.seek_head()
+        return entries
+
+    def test_count(self):
+        for workers in WORKERS:
+            with self.subTest(workers=workers):
+                self.assertEqual(
+                    self.journal.parallel_scan("count", workers=workers),
+                    N_ENTRIES)
+
+    def test_count_by(self):
+        expected = collections.Counter(e["UNIT"] for e in self.serial())
+        for workers in WORKERS:
+            with self.subTest(workers=workers):
+                self.assertEqual(self.journal.parallel_scan(
+                    ("count_by", "UNIT"), workers=workers), expected)
+
+    def test_timestamps(self):
+        times = [e["__REALTIME_TIMESTAMP"] for e in self.serial()]
+        for workers in WORKERS:
+            with self.subTest(workers=workers):
+                self.assertEqual(self.journal.parallel_scan(
+                    "min_timestamp", workers=workers), min(times))
+                self.assertEqual(self.journal.parallel_scan(
+                    "max_timestamp", workers=workers), max(times))
+
+    def test_callable(self):
+        expected = [e["MESSAGE"] for e in self.serial()
+                    if int(e["MESSAGE"]) % 7 == 0]
+        for workers in WORKERS:
+            with self.subTest(workers=workers):
+                self.assertEqual(self.journal.parallel_scan(
+                    lambda e: e["MESSAGE"] if int(e["MESSAGE"]) % 7 == 0
+                    else None, workers=workers), expected)
+
+    def test_callable_uses_journal(self):
+        units = self.journal.parallel_scan(
+            lambda e: len(self.journal.query_unique("UNIT")), workers=4)
+        self.assertEqual(units, [5] * N_ENTRIES)
+
+    def test_matches_and_filter(self):
+        self.journal.add_match(UNIT="u2")
+        self.journal.filter("PRIORITY<=3 or MESSAGE endswith 9")
+        expected = len(self.serial())
+        self.assertGreater(expected, 0)
+        for workers in WORKERS:
+            with self.subTest(workers=workers):
+                self.assertEqual(
+                    self.journal.parallel_scan("count", workers=workers),
+                    expected)
+
+    def test_position_unchanged(self):
+        self.journal.seek(100)
+        self.journal.parallel_scan("count", workers=2)
+        self.assertEqual(self.journal.get_next()["MESSAGE"], "100")
+
+    def test_distinct(self):
+        sketch = self.journal.parallel_scan(("distinct", "MESSAGE"), workers=4)
+        self.assertLess(abs(sketch.estimate() - N_ENTRIES),
+                        3 * sketch.error * N_ENTRIES)
+
+    def test_arguments(self):
+        self.assertRaises(ValueError, self.journal.parallel_scan, "sum")
+        self.assertRaises(ValueError, self.journal.parallel_scan, "count",
+                          workers=0)
+
+
+class MonotonicParallelScanTest(ParallelScanTest):
+
+    clock_jumps = False
+
+    def test_since_until(self):
+        times = [realtime for fields, realtime in make_entries(False)]
+        for since, until in ((times[0], times[-1]), (times[10], times[2500]),
+                             (times[1234], times[1235]), (BASE, BASE + 999)):
+            expected = sum(1 for t in times if since <= t < until)
+            for workers in WORKERS:
+                with self.subTest(since=since, until=until, workers=workers):
+                    self.assertEqual(self.journal.parallel_scan(
+                        "count", since=since, until=until, workers=workers),
+                        expected)
+        self.assertEqual(self.journal.parallel_scan(
+            "count", since=times[2990], workers=3), 10)
+        self.assertEqual(self.journal.parallel_scan(
+            "count", until=times[10], workers=3), 10)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,131 @@
+import struct
+import tempfile
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+BOOT_ID = uuid.UUID("0123456789abcdef0123456789abcdef")
+BINARY = b"\x00\xff\n=\x80"
+N = 6
+
+
+def record(n):
+    """Fields of entry n, as (field, value) pairs with TAG repeated"""
+    return [("MESSAGE", "m%d" % n), ("TAG", "a"), ("TAG", "b%d" % n),
+            ("BINARY", BINARY + bytes([n])), ("EMPTY", b"")]
+
+
+def parse_blob(blob):
+    """Items of a length prefixed blob"""
+    items = []
+    offset = 0
+    while offset < len(blob):
+        size, = struct.unpack_from("<Q", blob, offset)
+        offset += 8
+        items.append(blob[offset:offset + size])
+        offset += size
+    return tuple(items)
+
+
+def user_items(items):
+    """Items as sent, without those added by the journal"""
+    return sorted(item for item in items if not item.startswith(b"_"))
+
+
+class RawTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        write_journal(cls.tmpdir.name, [(record(n), BASE + n * 1000)
+                                        for n in range(N)],
+                      files=2, boot_id=BOOT_ID)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def expected(self, n):
+        return sorted(b"%s=%s" % (name.encode(), value if isinstance(
+            value, bytes) else value.encode()) for name, value in record(n))
+
+    def test_tuple(self):
+        for n in range(N):
+            with self.subTest(n=n):
+                entry = self.journal.get_next_raw()
+                self.assertIsInstance(entry, tuple)
+                self.assertTrue(all(isinstance(item, bytes)
+                                    for item in entry))
+                self.assertEqual(user_items(entry), self.expected(n))
+        self.assertEqual(self.journal.get_next_raw(), ())
+
+    def test_repeated_fields(self):
+        entry = self.journal.get_next_raw()
+        tags = [item for item in entry if item.startswith(b"TAG=")]
+        self.assertEqual(sorted(tags), [b"TAG=a", b"TAG=b0"])
+        # As get_next(), which gives the values as a list
+        self.journal.seek_head()
+        self.assertEqual(sorted(self.journal.get_next()["TAG"]), ["a", "b0"])
+
+    def test_binary(self):
+        entry = self.journal.get_next_raw(3)
+        self.assertIn(b"BINARY=" + BINARY + b"\x02", entry)
+        self.assertIn(b"EMPTY=", entry)
+
+    def test_timestamps_and_cursor(self):
+        entry = self.journal.get_next_raw()
+        self.journal.seek_head()
+        converted = self.journal.get_next()
+        fields = dict(item.split(b"=", 1) for item in entry
+                      if item.startswith(b"__"))
+        self.assertEqual(int(fields[b"__REALTIME_TIMESTAMP"]), BASE)
+        self.assertEqual(fields[b"__CURSOR"].decode(), converted["__CURSOR"])
+        self.assertIn(b"__MONOTONIC_TIMESTAMP", fields)
+        self.assertIn(b"_BOOT_ID=" + BOOT_ID.hex.encode(), entry)
+
+    def test_blob(self):
+        reference = pyjournalctl.Journal(path=self.tmpdir.name)
+        for n in range(N):
+            with self.subTest(n=n):
+                blob = self.journal.get_next_raw(blob=True)
+                self.assertIsInstance(blob, bytes)
+                self.assertEqual(parse_blob(blob),
+                                 reference.get_next_raw())
+        self.assertEqual(self.journal.get_next_raw(blob=True), b"")
+
+    def test_blob_binary(self):
+        # Lengths, not separators, delimit items holding "\n" and "\0"
+        items = parse_blob(self.journal.get_next_raw(1, True))
+        self.assertEqual(user_items(items), self.expected(0))
+        self.assertEqual(sum(item.startswith(b"TAG=") for item in items), 2)
+
+    def test_skip_and_previous(self):
+        self.assertEqual(user_items(self.journal.get_next_raw(4)),
+                         self.expected(3))
+        self.assertEqual(user_items(self.journal.get_next_raw(-2)),
+                         self.expected(1))
+        self.assertEqual(user_items(self.journal.get_next_raw(skip=1)),
+                         self.expected(2))
+        self.assertRaises(ValueError, self.journal.get_next_raw, 0)
+
+    def test_match(self):
+        self.journal.add_match(TAG="b4")
+        self.assertEqual(user_items(self.journal.get_next_raw()),
+                         self.expected(4))
+        self.assertEqual(self.journal.get_next_raw(blob=True), b"")
+
+    def test_arguments(self):
+        self.assertRaises(TypeError, self.journal.get_next_raw, "1")
+        self.assertRaises(TypeError, self.journal.get_next_raw, 1, True, 2)
+        self.assertRaises(TypeError, self.journal.get_next_raw, bad=1)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,205 @@
+import os
+import tempfile
+import time
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import JournalFile, write_journal
+
+BASE = 1700000000000000
+ARCHIVED = 200
+ACTIVE = 100
+
+
+def fields(n):
+    return {"MESSAGE": "m%d" % n, "UNIT": "u%d" % (n % 3),
+            "PRIORITY": str(n % 8)}
+
+
+class ResultCacheTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = self.tmpdir.name
+        ids = {"seqnum_id": uuid.uuid4(), "machine_id": uuid.uuid4(),
+               "boot_id": uuid.uuid4()}
+        write_journal(self.path, [(fields(n), BASE + n * 1000)
+                                  for n in range(ARCHIVED)], files=2, **ids)
+        # Still being written, from entry ARCHIVED on
+        self.active = JournalFile(seqnum=ARCHIVED + 1, **ids)
+        self.n = ARCHIVED
+        self.append(ACTIVE)
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def append(self, n):
+        for _ in range(n):
+            self.active.append(fields(self.n), BASE + self.n * 1000)
+            self.n += 1
+        self.active.write(os.path.join(self.path, "system.journal"),
+                          archived=False)
+
+    def open(self, **kwargs):
+        kwargs.setdefault("result_cache", 1 << 20)
+        journal = pyjournalctl.Journal(path=self.path, **kwargs)
+        # The first wait() reports INVALIDATE, as changes were not watched
+        journal.wait(0)
+        return journal
+
+    def expected(self, journal, since, until):
+        journal.seek_head()
+        return [e for e in journal
+                if since <= e["__REALTIME_TIMESTAMP"].timestamp() * 10**6
+                < until]
+
+    def wait_for(self, journal, change):
+        deadline = time.monotonic() + 10
+        while time.monotonic() < deadline:
+            r = journal.wait(1)
+            if r != pyjournalctl.NOP:
+                self.assertEqual(r, change)
+                return
+        self.fail("No change seen")
+
+    def test_between(self):
+        journal = self.open()
+        for since, until in ((BASE, BASE + 50000), (BASE + 150000,
+                                                    BASE + 250000),
+                             (BASE + 10500, BASE + 10500), (0, 1 << 62)):
+            with self.subTest(since=since, until=until):
+                self.assertEqual(journal.between(since, until),
+                                 self.expected(journal, since, until))
+        self.assertEqual(len(journal.between(0, 1 << 62)), ARCHIVED + ACTIVE)
+        self.assertIsNone(pyjournalctl.Journal(path=self.path)
+                          .result_cache_info())
+
+    def test_hits(self):
+        journal = self.open()
+        first = journal.between(BASE, BASE + 50000)
+        first[0]["MESSAGE"] = "changed"
+        second = journal.between(BASE, BASE + 50000)
+        self.assertEqual(second, self.expected(journal, BASE, BASE + 50000))
+        info = journal.result_cache_info()
+        self.assertEqual((info["hits"], info["misses"], info["size"]),
+                         (1, 1, 1))
+        self.assertGreater(info["bytes"], 0)
+
+    def test_key(self):
+        journal = self.open()
+        since, until = BASE, BASE + 90000
+        everything = journal.between(since, until)
+        self.assertEqual(
+            journal.between(since, until, fields=["MESSAGE"]),
+            [{"MESSAGE": e["MESSAGE"]} for e in everything])
+        self.assertEqual(len(journal.between(since, until - 1000)), 89)
+        journal.add_match(UNIT="u1")
+        self.assertEqual(journal.between(since, until),
+                         [e for e in everything if e["UNIT"] == "u1"])
+        journal.filter("PRIORITY<=3")
+        self.assertEqual(journal.between(since, until),
+                         [e for e in everything
+                          if e["UNIT"] == "u1" and e["PRIORITY"] <= 3])
+        journal.flush_matches()
+        self.assertEqual(journal.between(since, until), everything)
+        info = journal.result_cache_info()
+        self.assertEqual((info["hits"], info["misses"]), (1, 5))
+
+    def test_append_invalidates_live_results(self):
+        journal = self.open()
+        since, live_until = BASE, BASE + 10**9
+        archived = journal.between(since, BASE + ARCHIVED * 1000)
+        self.assertEqual(len(journal.between(since, live_until)),
+                         ARCHIVED + ACTIVE)
+        self.append(10)
+        # Not seen until wait() reports the change
+        self.assertEqual(len(journal.between(since, live_until)),
+                         ARCHIVED + ACTIVE)
+        self.wait_for(journal, pyjournalctl.APPEND)
+        self.assertEqual(journal.result_cache_info()["invalidations"], 1)
+        self.assertEqual(journal.between(since, live_until),
+                         self.expected(journal, since, live_until))
+        self.assertEqual(len(journal.between(since, live_until)),
+                         ARCHIVED + ACTIVE + 10)
+        self.assertEqual(journal.between(since, BASE + ARCHIVED * 1000),
+                         archived)
+        info = journal.result_cache_info()
+        self.assertEqual((info["hits"], info["misses"], info["size"]),
+                         (3, 3, 2))
+
+    def test_added_file_invalidates_live_results(self):
+        journal = self.open()
+        journal.between(BASE, BASE + 10**9)
+        journal.between(BASE, BASE + 1000)
+        with tempfile.TemporaryDirectory() as staging:
+            path, = write_journal(staging, [({"MESSAGE": "other"},
+                                             BASE + 500)])
+            os.rename(path, os.path.join(self.path, os.path.basename(path)))
+        self.wait_for(journal, pyjournalctl.INVALIDATE)
+        info = journal.result_cache_info()
+        self.assertEqual((info["invalidations"], info["size"]), (1, 1))
+        self.assertEqual([e["MESSAGE"]
+                          for e in journal.between(BASE, BASE + 2000)],
+                         ["m0", "other", "m1"])
+
+    def test_disk(self):
+        with tempfile.TemporaryDirectory() as cache_dir:
+            until = BASE + ARCHIVED * 1000
+            journal = self.open(result_cache_dir=cache_dir)
+            archived = journal.between(BASE, until)
+            journal.between(BASE, until + 1000)
+            self.assertEqual(len(os.listdir(cache_dir)), 1)
+            journal = self.open(result_cache_dir=cache_dir)
+            self.assertEqual(journal.between(BASE, until), archived)
+            journal.between(BASE, until + 1000)
+            journal.between(BASE, until, fields=["MESSAGE"])
+            info = journal.result_cache_info()
+            self.assertEqual((info["hits"], info["disk_hits"],
+                              info["misses"]), (0, 1, 2))
+
+    def test_call_dict(self):
+        journal = self.open()
+        journal.between(BASE, BASE + 10000)
+        journal.call_dict = dict(journal.call_dict,
+                                 MESSAGE=lambda value: value.upper())
+        self.assertEqual(journal.result_cache_info()["size"], 0)
+        self.assertEqual(journal.between(BASE, BASE + 2000)[1]["MESSAGE"],
+                         b"M1")
+        journal.default_call = lambda value: value
+        self.assertEqual(journal.between(BASE, BASE + 2000)[1]["UNIT"],
+                         b"u1")
+        info = journal.result_cache_info()
+        self.assertEqual((info["hits"], info["misses"], info["size"]),
+                         (0, 3, 1))
+
+    def test_eviction(self):
+        # Ranges of 10 entries m10 to m99, all of about the same size
+        def between(journal, n):
+            return journal.between(BASE + n * 10000, BASE + (n + 1) * 10000)
+        journal = self.open()
+        between(journal, 1)
+        max_bytes = journal.result_cache_info()["bytes"] * 7 // 2
+        journal = self.open(result_cache=max_bytes)
+        for n in range(1, 10):
+            between(journal, n)
+        info = journal.result_cache_info()
+        self.assertEqual(info["max_bytes"], max_bytes)
+        self.assertLessEqual(info["bytes"], max_bytes)
+        self.assertEqual((info["size"], info["evictions"]), (3, 6))
+        # Least recently used first
+        between(journal, 7)
+        between(journal, 1)
+        info = journal.result_cache_info()
+        self.assertEqual((info["hits"], info["evictions"]), (1, 7))
+        between(journal, 7)
+        self.assertEqual(journal.result_cache_info()["hits"], 2)
+        # Too large to be held at all
+        journal = self.open(result_cache=100)
+        self.assertEqual(len(between(journal, 1)), 10)
+        self.assertEqual(journal.result_cache_info()["size"], 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,105 @@
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+N_ENTRIES = 2000
+
+
+class SampleTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        write_journal(cls.tmpdir.name,
+                      [({"MESSAGE": str(n), "UNIT": "u%d" % (n % 4)},
+                        BASE + n * 1000) for n in range(N_ENTRIES)])
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def numbers(self, entries):
+        return [int(entry["MESSAGE"]) for entry in entries]
+
+    def test_every(self):
+        for every in (1, 3, 7, N_ENTRIES, N_ENTRIES + 1):
+            with self.subTest(every=every):
+                self.journal.seek_head()
+                self.assertEqual(
+                    self.numbers(self.journal.sample(every=every)),
+                    list(range(every - 1, N_ENTRIES, every)))
+
+    def test_every_with_match(self):
+        self.journal.add_match(UNIT="u1")
+        self.assertEqual(self.numbers(self.journal.sample(every=5)),
+                         list(range(1, N_ENTRIES, 4))[4::5])
+
+    def test_rate(self):
+        self.journal.seek_head()
+        self.assertEqual(self.numbers(self.journal.sample(rate=1.0)),
+                         list(range(N_ENTRIES)))
+        self.journal.seek_head()
+        sample = self.numbers(self.journal.sample(rate=0.25, seed=5))
+        self.assertEqual(sample, sorted(set(sample)))
+        # Within five standard deviations of the expected 500
+        self.assertLess(abs(len(sample) - N_ENTRIES / 4), 5 * 19.4)
+        self.journal.seek_head()
+        self.assertEqual(
+            self.numbers(self.journal.sample(rate=0.25, seed=5)), sample)
+        self.journal.seek_head()
+        self.assertNotEqual(
+            self.numbers(self.journal.sample(rate=0.25, seed=6)), sample)
+
+    def test_fields(self):
+        self.journal.seek_head()
+        self.assertEqual(
+            list(self.journal.sample(every=1000, fields=["UNIT"])),
+            [{"UNIT": "u3"}, {"UNIT": "u3"}])
+
+    def test_arguments(self):
+        self.assertRaises(TypeError, self.journal.sample)
+        self.assertRaises(TypeError, self.journal.sample, rate=0.5, every=2)
+        self.assertRaises(ValueError, self.journal.sample, rate=0.0)
+        self.assertRaises(ValueError, self.journal.sample, rate=1.5)
+        self.assertRaises(ValueError, self.journal.sample, every=0)
+        self.assertRaises(ValueError, self.journal.reservoir, -1)
+
+    def test_reservoir(self):
+        self.journal.seek_head()
+        sample = self.numbers(self.journal.reservoir(50, seed=1))
+        self.assertEqual(len(set(sample)), 50)
+        self.assertTrue(all(0 <= n < N_ENTRIES for n in sample))
+        self.journal.seek_head()
+        self.assertEqual(self.numbers(self.journal.reservoir(50, seed=1)),
+                         sample)
+        self.journal.seek_head()
+        self.assertEqual(sorted(self.numbers(
+            self.journal.reservoir(N_ENTRIES + 10))), list(range(N_ENTRIES)))
+
+    def test_reservoir_from_position(self):
+        self.journal.seek(N_ENTRIES - 10)
+        self.assertEqual(sorted(self.numbers(self.journal.reservoir(20))),
+                         list(range(N_ENTRIES - 10, N_ENTRIES)))
+        self.assertEqual(self.journal.reservoir(5), [])
+
+    def test_reservoir_uniform(self):
+        self.journal.add_match(UNIT="u2")
+        counts = dict.fromkeys(range(2, N_ENTRIES, 4), 0)
+        for seed in range(400):
+            self.journal.seek_head()
+            for n in self.numbers(self.journal.reservoir(25, seed=seed)):
+                counts[n] += 1
+        # Each of the 500 entries is expected 20 times
+        self.assertLess(max(counts.values()), 45)
+        self.assertGreater(min(counts.values()), 3)
+
+
+if __name__ == "__main__":
+    unittest.main()
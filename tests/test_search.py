@@ -0,0 +1,155 @@
+import os
+import tempfile
+import time
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import JournalFile, write_journal
+
+BASE = 1700000000000000
+MESSAGES = [
+    "Started Session 1 of user root.",
+    "started session 2 of USER alice",
+    "Connection from 10.0.0.1 port 22",
+    "sessionless restart of unit",
+    "Failed to start foo.service: unit not found",
+    "user-runtime-dir@1000.service: Succeeded",
+    "No message words: ...",
+    "Started session 3 of user root.",
+]
+
+
+class SearchTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.tmpdir.name, "journal")
+        self.index = os.path.join(self.tmpdir.name, "index")
+        self.ids = {"seqnum_id": uuid.uuid4(), "machine_id": uuid.uuid4(),
+                    "boot_id": uuid.uuid4()}
+        entries = [({"MESSAGE": message, "UNIT": "u%d" % (n % 2)},
+                    BASE + n * 1000) for n, message in enumerate(MESSAGES)]
+        # Entries without MESSAGE are indexed, but never found
+        entries.append(({"UNIT": "u0"}, BASE + len(MESSAGES) * 1000))
+        write_journal(self.path, entries, files=2, **self.ids)
+        self.journal = pyjournalctl.Journal(path=self.path)
+        self.assertEqual(self.journal.update_index(self.index),
+                         len(MESSAGES) + 1)
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def search(self, text, journal=None, **kwargs):
+        return [entry["MESSAGE"] for entry in
+                (journal or self.journal).search(text, **kwargs)]
+
+    def test_words(self):
+        self.assertEqual(self.search("started"),
+                         [MESSAGES[0], MESSAGES[1], MESSAGES[7]])
+        self.assertEqual(self.search("SESSION"),
+                         [MESSAGES[0], MESSAGES[1], MESSAGES[7]])
+        self.assertEqual(self.search("user root"),
+                         [MESSAGES[0], MESSAGES[7]])
+        self.assertEqual(self.search("missing"), [])
+
+    def test_tokenisation(self):
+        # Words are runs of letters, digits and non-ASCII bytes
+        self.assertEqual(self.search("10.0.0.1"), [MESSAGES[2]])
+        self.assertEqual(self.search("service"), [MESSAGES[4], MESSAGES[5]])
+        self.assertEqual(self.search("1000"), [MESSAGES[5]])
+        self.assertEqual(self.search("runtime-dir"), [MESSAGES[5]])
+        self.assertEqual(self.search("Session"),
+                         [MESSAGES[0], MESSAGES[1], MESSAGES[7]])
+
+    def test_phrase(self):
+        self.assertEqual(self.search("session 1 of"), [MESSAGES[0]])
+        # Both words are in the message, but not as a phrase
+        self.assertEqual(self.search("of session"), [])
+        self.assertEqual(self.search("foo.service: unit"), [MESSAGES[4]])
+        self.assertEqual(self.search("foo service"), [])
+
+    def test_word_boundaries(self):
+        self.assertEqual(self.search("session"),
+                         [MESSAGES[0], MESSAGES[1], MESSAGES[7]])
+        self.assertEqual(self.search("sessionless"), [MESSAGES[3]])
+        # A word of the text found in the index, but only within a longer
+        # word of the message
+        self.assertEqual(self.search("start"), [MESSAGES[4]])
+        # Text is matched as is, but for case, past the words it starts
+        # and ends with
+        self.assertEqual(self.search("user root."), [MESSAGES[0], MESSAGES[7]])
+        self.assertEqual(self.search("user root!"), [])
+        self.assertEqual(self.search("1 of"), [MESSAGES[0]])
+        self.assertEqual(self.search(".0.1 port"), [MESSAGES[2]])
+
+    def test_matches_and_filter(self):
+        self.journal.add_match(UNIT="u1")
+        self.assertEqual(self.search("started"), [MESSAGES[1], MESSAGES[7]])
+        self.journal.flush_matches()
+        self.journal.filter("UNIT=u0 and not MESSAGE contains Session")
+        self.assertEqual(self.search("user"), [])
+        self.assertEqual(self.search("unit"), [MESSAGES[4]])
+        self.journal.flush_matches()
+        self.assertEqual(self.search("user"),
+                         [MESSAGES[0], MESSAGES[1], MESSAGES[5], MESSAGES[7]])
+
+    def test_limit_and_fields(self):
+        self.assertEqual(self.search("started", limit=2),
+                         [MESSAGES[0], MESSAGES[1]])
+        self.assertEqual(self.search("started", limit=0), [])
+        self.assertEqual(self.journal.search("port", fields=["UNIT"]),
+                         [{"UNIT": "u0"}])
+        # Left on the last entry returned
+        self.assertEqual(self.journal.get_next()["MESSAGE"], MESSAGES[3])
+        self.assertRaises(ValueError, self.journal.search, "started",
+                          limit=-1)
+
+    def test_round_trip(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        self.assertEqual(journal.update_index(self.index), 0)
+        for text in ("started", "session 1 of", "10.0.0.1", "sessionless"):
+            with self.subTest(text=text):
+                self.assertEqual(self.search(text, journal),
+                                 self.search(text))
+        self.assertEqual(self.journal.update_index(self.index), 0)
+
+    def test_errors(self):
+        self.assertRaises(ValueError, self.journal.search, "...")
+        self.assertRaises(ValueError, self.journal.search, "")
+        journal = pyjournalctl.Journal(path=self.path)
+        self.assertRaises(RuntimeError, journal.search, "started")
+        with open(self.index, "r+b") as f:
+            f.write(b"garbage!")
+        self.assertRaises(ValueError, journal.update_index, self.index)
+        self.assertRaises(RuntimeError, journal.search, "started")
+
+    def test_wait(self):
+        active = JournalFile(seqnum=100, **self.ids)
+        active_path = os.path.join(self.path, "system.journal")
+        active.append({"MESSAGE": "first appended"}, BASE + 100000)
+        active.write(active_path, archived=False)
+        self.assertEqual(self.journal.update_index(self.index), 1)
+        # The first wait() reports INVALIDATE, as changes were not watched
+        self.journal.wait(0)
+        self.assertEqual(self.search("appended"), ["first appended"])
+
+        active.append({"MESSAGE": "second appended"}, BASE + 101000)
+        active.write(active_path, archived=False)
+        self.assertEqual(self.search("appended"), ["first appended"])
+        deadline = time.monotonic() + 10
+        while self.journal.wait(1) == pyjournalctl.NOP:
+            self.assertLess(time.monotonic(), deadline)
+        self.assertEqual(self.search("appended"),
+                         ["first appended", "second appended"])
+
+        # Saved by the next update_index(), with nothing else to add
+        self.assertEqual(self.journal.update_index(self.index), 0)
+        journal = pyjournalctl.Journal(path=self.path)
+        self.assertEqual(journal.update_index(self.index), 0)
+        self.assertEqual(self.search("second", journal), ["second appended"])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,222 @@
+import collections
+import os
+import random
+import tempfile
+import time
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import JournalFile, write_journal
+
+BASE = 1700000000000000
+SECOND = 10**6
+
+
+def model_sessions(entries, gap, max_sessions=1024, max_entries=100):
+    """Sessions of (value, start, end, count, messages) as documented,
+    with the number evicted, for entries of an old journal read in order
+    """
+    open_ = collections.OrderedDict()
+    done = []
+    evicted = 0
+
+    def end(value):
+        start, last, count, messages = open_.pop(value)
+        done.append((value, start, last, count, messages))
+
+    for fields, realtime in entries:
+        # Ended by the gap, least recently active first
+        while open_ and realtime - next(iter(open_.values()))[1] > gap:
+            end(next(iter(open_)))
+        value = fields.get("USER")
+        if value is None:
+            continue
+        if value in open_ and realtime - open_[value][1] > gap:
+            end(value)
+        if value not in open_:
+            if len(open_) >= max_sessions:
+                end(next(iter(open_)))
+                evicted += 1
+            open_[value] = [realtime, realtime, 0, []]
+        session = open_.pop(value)
+        open_[value] = session
+        session[1] = max(session[1], realtime)
+        session[2] += 1
+        if len(session[3]) < max_entries:
+            session[3].append(fields["MESSAGE"])
+    while open_:
+        end(next(iter(open_)))
+    return done, evicted
+
+
+def usec(timestamp):
+    return round(timestamp.timestamp() * SECOND)
+
+
+class SessionsTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = self.tmpdir.name
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def write(self, entries, files=1):
+        write_journal(self.path, entries, files=files)
+
+    def sessions(self, *args, **kwargs):
+        journal = pyjournalctl.Journal(path=self.path)
+        return journal.sessions(*args, **kwargs)
+
+    def summary(self, sessions):
+        return [(value, usec(start), usec(end), count,
+                 [e["MESSAGE"] for e in entries])
+                for value, start, end, count, entries in sessions]
+
+    def test_gap(self):
+        self.write([({"USER": "a", "MESSAGE": "a1"}, BASE),
+                    ({"USER": "b", "MESSAGE": "b1"}, BASE + SECOND),
+                    ({"USER": "a", "MESSAGE": "a2"}, BASE + 2 * SECOND),
+                    ({"MESSAGE": "none"}, BASE + 3 * SECOND),
+                    # Exactly the gap after a2 continues the session
+                    ({"USER": "a", "MESSAGE": "a3"}, BASE + 7 * SECOND),
+                    # More than the gap after b1 ends it
+                    ({"USER": "b", "MESSAGE": "b2"}, BASE + 6 * SECOND + 1),
+                    ({"USER": "a", "MESSAGE": "a4"}, BASE + 20 * SECOND)])
+        iterator = self.sessions("USER", 5 * SECOND)
+        self.assertEqual(self.summary(iterator), [
+            ("b", BASE + SECOND, BASE + SECOND, 1, ["b1"]),
+            ("a", BASE, BASE + 7 * SECOND, 3, ["a1", "a2", "a3"]),
+            ("b", BASE + 6 * SECOND + 1, BASE + 6 * SECOND + 1, 1, ["b2"]),
+            ("a", BASE + 20 * SECOND, BASE + 20 * SECOND, 1, ["a4"])])
+        self.assertEqual((iterator.open, iterator.evicted), (0, 0))
+
+    def test_entries_and_fields(self):
+        self.write([({"USER": "a", "MESSAGE": "a%d" % n, "N": str(n)},
+                     BASE + n * SECOND) for n in range(10)])
+        (value, start, end, count, entries), = self.sessions(
+            "USER", 5 * SECOND, max_entries=3, fields=["MESSAGE"])
+        self.assertEqual((value, count), ("a", 10))
+        self.assertEqual((usec(start), usec(end)), (BASE, BASE + 9 * SECOND))
+        self.assertEqual(entries, [{"MESSAGE": "a0"}, {"MESSAGE": "a1"},
+                                   {"MESSAGE": "a2"}])
+        (_, _, _, count, entries), = self.sessions("USER", SECOND,
+                                                   max_entries=0)
+        self.assertEqual((count, entries), (10, []))
+        (_, _, _, _, entries), = self.sessions("USER", SECOND)
+        self.assertEqual(entries[4]["N"], "4")
+        self.assertEqual(entries[4]["USER"], "a")
+
+    def test_eviction(self):
+        self.write([({"USER": "u%d" % (n % 3), "MESSAGE": str(n)},
+                     BASE + n * SECOND) for n in range(9)])
+        iterator = self.sessions("USER", 60 * SECOND, max_sessions=2)
+        self.assertEqual([(value, count) for value, _, _, count, _
+                          in iterator],
+                         [("u0", 1), ("u1", 1), ("u2", 1), ("u0", 1),
+                          ("u1", 1), ("u2", 1), ("u0", 1), ("u1", 1),
+                          ("u2", 1)])
+        self.assertEqual(iterator.evicted, 7)
+        iterator = self.sessions("USER", 60 * SECOND, max_sessions=3)
+        self.assertEqual([(value, count) for value, _, _, count, _
+                          in iterator], [("u0", 3), ("u1", 3), ("u2", 3)])
+        self.assertEqual(iterator.evicted, 0)
+
+    def test_out_of_order(self):
+        # The clock goes back by a minute and forward again
+        self.write([({"USER": "a", "MESSAGE": "a1"}, BASE),
+                    ({"USER": "b", "MESSAGE": "b1"}, BASE + SECOND),
+                    ({"USER": "a", "MESSAGE": "a2"}, BASE - 60 * SECOND),
+                    ({"USER": "b", "MESSAGE": "b2"}, BASE + 2 * SECOND),
+                    ({"USER": "a", "MESSAGE": "a3"}, BASE + 3 * SECOND)])
+        # a2 is within the gap, counting from the latest entry of a
+        self.assertEqual(self.summary(self.sessions("USER", 5 * SECOND)), [
+            ("b", BASE + SECOND, BASE + 2 * SECOND, 2, ["b1", "b2"]),
+            ("a", BASE, BASE + 3 * SECOND, 3, ["a1", "a2", "a3"])])
+
+    def test_model(self):
+        rng = random.Random(1)
+        entries = []
+        realtime = BASE
+        for n in range(2000):
+            realtime += rng.randrange(3 * SECOND)
+            if rng.random() < 0.01:
+                realtime -= rng.randrange(60 * SECOND)
+            fields = {"MESSAGE": str(n)}
+            if rng.random() < 0.9:
+                fields["USER"] = "u%d" % min(int(rng.expovariate(0.1)), 50)
+            entries.append((fields, realtime))
+        self.write(entries, files=3)
+        for gap, max_sessions, max_entries in ((10 * SECOND, 1024, 100),
+                                               (30 * SECOND, 5, 3),
+                                               (0, 1, 1)):
+            with self.subTest(gap=gap, max_sessions=max_sessions):
+                expected, evicted = model_sessions(entries, gap,
+                                                   max_sessions, max_entries)
+                iterator = self.sessions("USER", gap,
+                                         max_sessions=max_sessions,
+                                         max_entries=max_entries)
+                self.assertEqual(self.summary(iterator), expected)
+                self.assertEqual(iterator.evicted, evicted)
+
+    def test_matches_and_filter(self):
+        entries = [({"USER": "u%d" % (n % 4), "MESSAGE": str(n),
+                     "UNIT": "x" if n % 3 else "y"}, BASE + n * SECOND)
+                   for n in range(100)]
+        self.write(entries)
+        journal = pyjournalctl.Journal(path=self.path)
+        journal.add_match(UNIT="x")
+        journal.filter("USER!=u1")
+        expected, _ = model_sessions(
+            [e for e in entries
+             if e[0]["UNIT"] == "x" and e[0]["USER"] != "u1"], 5 * SECOND)
+        self.assertEqual(self.summary(journal.sessions("USER", 5 * SECOND)),
+                         expected)
+
+    def test_follow(self):
+        ids = {"seqnum_id": uuid.uuid4(), "machine_id": uuid.uuid4()}
+        active = JournalFile(**ids)
+        path = os.path.join(self.path, "system.journal")
+        now = int(time.time() * SECOND)
+        active.append({"USER": "old", "MESSAGE": "old"}, now - 120 * SECOND)
+        active.append({"USER": "a", "MESSAGE": "a1"}, now - SECOND)
+        active.append({"USER": "b", "MESSAGE": "b1"}, now)
+        active.write(path, archived=False)
+        journal = pyjournalctl.Journal(path=self.path)
+        journal.wait(0)
+        iterator = journal.sessions("USER", 60 * SECOND)
+        # Only the session whose gap has passed by the clock
+        self.assertEqual([s[0] for s in iterator], ["old"])
+        self.assertEqual(iterator.open, 2)
+        self.assertEqual(list(iterator), [])
+
+        active.append({"USER": "a", "MESSAGE": "a2"}, now + 1)
+        active.write(path, archived=False)
+        deadline = time.monotonic() + 10
+        while journal.wait(1) == pyjournalctl.NOP:
+            self.assertLess(time.monotonic(), deadline)
+        self.assertEqual(list(iterator), [])
+        self.assertEqual(iterator.open, 2)
+        flushed = iterator.flush()
+        self.assertEqual([(value, count, [e["MESSAGE"] for e in entries])
+                          for value, _, _, count, entries in flushed],
+                         [("b", 1, ["b1"]), ("a", 2, ["a1", "a2"])])
+        self.assertEqual(iterator.open, 0)
+        self.assertEqual(iterator.flush(), [])
+
+    def test_arguments(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        self.assertRaises(ValueError, journal.sessions, "USER", -1)
+        self.assertRaises(ValueError, journal.sessions, "USER", 1,
+                          max_sessions=0)
+        self.assertRaises(ValueError, journal.sessions, "USER", 1,
+                          max_entries=-1)
+        self.assertRaises(TypeError, journal.sessions, 1, 1)
+        self.assertEqual(list(journal.sessions("USER", 1)), [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,120 @@
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+DAY = 86400 * 10**6
+
+
+class ShardTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        # One sequence over several files, with clock jumps
+        write_journal(cls.tmpdir.name,
+                      [({"MESSAGE": "%s%d" % ("ab"[n % 2], n // 2),
+                         "UNIT": "u%d" % (n % 3)},
+                        BASE + n * 500 - (DAY if n % 100 == 7 else 0))
+                       for n in range(3000)], files=4)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def messages(self, start=None, end=None):
+        return [e["MESSAGE"] for e in self.journal.range(start, end)]
+
+    def assertCoverage(self, shards, n, expected):
+        self.assertEqual(len(shards), n)
+        for (_, end, _), (start, _, _) in zip(shards, shards[1:]):
+            self.assertEqual(end, start)
+        self.assertEqual(
+            [m for start, end, _ in shards for m in self.messages(start, end)],
+            expected)
+
+    def test_coverage(self):
+        expected = self.messages()
+        self.assertEqual(len(expected), 3000)
+        for n in (1, 2, 3, 5, 16, 100):
+            with self.subTest(n=n):
+                shards = self.journal.plan_shards(n)
+                self.assertIsNone(shards[-1][1])
+                self.assertCoverage(shards, n, expected)
+
+    def test_balance(self):
+        with tempfile.TemporaryDirectory() as path:
+            write_journal(path, [({"MESSAGE": str(n)}, BASE + n * 1000)
+                                 for n in range(4000)], files=3)
+            self.journal = pyjournalctl.Journal(path=path)
+            shards = self.journal.plan_shards(4)
+            self.assertLess(
+                abs(sum(count for _, _, count in shards) - 4000), 400)
+            for start, end, count in shards:
+                self.assertLess(abs(len(self.messages(start, end)) - 1000),
+                                200)
+
+    def test_matches_and_filter(self):
+        self.journal.add_match(UNIT="u1")
+        self.journal.filter("MESSAGE startswith b or MESSAGE endswith 3")
+        expected = self.messages()
+        self.assertGreater(len(expected), 0)
+        for n in (1, 4, 7):
+            with self.subTest(n=n):
+                self.assertCoverage(self.journal.plan_shards(n), n, expected)
+
+    def test_position_unchanged(self):
+        self.journal.seek(10)
+        self.journal.plan_shards(4)
+        self.assertEqual(self.journal.get_next()["MESSAGE"], "a5")
+
+    def test_empty(self):
+        with tempfile.TemporaryDirectory() as path:
+            journal = pyjournalctl.Journal(path=path)
+            self.assertEqual(journal.plan_shards(3), [(None, None, 0)] * 3)
+        self.journal.add_match(UNIT="none")
+        shards = self.journal.plan_shards(3)
+        self.assertEqual([count for _, _, count in shards], [0, 0, 0])
+        self.assertEqual([m for start, end, _ in shards
+                          for m in self.messages(start, end)], [])
+
+    def test_arguments(self):
+        self.assertRaises(ValueError, self.journal.plan_shards, 0)
+        self.assertRaises(ValueError, self.journal.plan_shards, 1 << 20)
+        self.assertRaises(ValueError, self.journal.range, None, "not a cursor")
+
+
+class SequencesShardTest(ShardTest):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        # Two sequences of interleaved times
+        write_journal(cls.tmpdir.name,
+                      [({"MESSAGE": "a%d" % n, "UNIT": "u%d" % (n % 3)},
+                        BASE + n * 1000) for n in range(2000)], files=4)
+        write_journal(cls.tmpdir.name,
+                      [({"MESSAGE": "b%d" % n, "UNIT": "u%d" % (n % 3)},
+                        BASE + n * 1000 + 500) for n in range(1000)], files=2)
+
+    def test_since_until(self):
+        since, until = BASE + 500 * 1000, BASE + 1500 * 1000
+        expected = [e["MESSAGE"] for e in self.journal
+                    if since <= e["__REALTIME_TIMESTAMP"].timestamp() * 10**6
+                    < until]
+        self.assertEqual(len(expected), 1500)
+        for n in (1, 3, 4):
+            with self.subTest(n=n):
+                shards = self.journal.plan_shards(n, since=since, until=until)
+                self.assertIsNotNone(shards[-1][1])
+                self.assertCoverage(shards, n, expected)
+
+
+if __name__ == "__main__":
+    unittest.main()
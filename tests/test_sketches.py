@@ -0,0 +1,203 @@
+import math
+import random
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+N_ENTRIES = 6000
+
+
+def make_entries(seed, offset=0):
+    """Entries with a long tailed value V, and a distinct ID each"""
+    rng = random.Random(seed)
+    return [({"V": "v%d" % min(int(rng.paretovariate(1.1)), 5000),
+              "ID": "id%d" % (n + offset), "UNIT": "u%d" % (n % 5)},
+             BASE + (n + offset) * 1000) for n in range(N_ENTRIES)]
+
+
+class SketchTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        cls.other = tempfile.TemporaryDirectory()
+        write_journal(cls.tmpdir.name, make_entries(1), files=3)
+        write_journal(cls.other.name, make_entries(2, N_ENTRIES), files=2)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.other.cleanup()
+        cls.tmpdir.cleanup()
+
+    def setUp(self):
+        self.journal = pyjournalctl.Journal(path=self.tmpdir.name)
+
+    def scan(self, aggregate, journal=None, **kwargs):
+        return (journal or self.journal).parallel_scan(aggregate, **kwargs)
+
+    def exact(self, field, journal=None):
+        return self.scan(("count_by", field), journal)
+
+    def assertTopK(self, sketch, exact):
+        total = sum(exact.values())
+        self.assertEqual(sketch.total, total)
+        self.assertAlmostEqual(sketch.error, total / sketch_k(sketch))
+        top = sketch.top()
+        self.assertLessEqual(len(top), sketch_k(sketch))
+        self.assertEqual([c for _, c, _ in top],
+                         sorted((c for _, c, _ in top), reverse=True))
+        for value, count, error in top:
+            self.assertLessEqual(count - error, exact.get(value, 0))
+            self.assertLessEqual(exact.get(value, 0), count)
+            self.assertLessEqual(count - exact.get(value, 0), sketch.error)
+        reported = {value for value, _, _ in top}
+        for value, count in exact.items():
+            if count > sketch.error:
+                self.assertIn(value, reported)
+            self.assertLessEqual(count, sketch.count(value))
+
+    def test_distinct(self):
+        n_ids = len(self.exact("ID"))
+        for precision in (4, 10, 14, 18):
+            with self.subTest(precision=precision):
+                sketch = self.scan(("distinct", "ID", precision))
+                self.assertEqual((sketch.kind, sketch.field, sketch.total),
+                                 ("distinct", "ID", N_ENTRIES))
+                self.assertAlmostEqual(sketch.error,
+                                       1.04 / 2 ** (precision / 2))
+                self.assertLess(abs(sketch.estimate() - n_ids),
+                                4 * sketch.error * n_ids)
+        # Few values are counted near exactly
+        self.assertLessEqual(abs(self.scan(("distinct", "UNIT")).estimate()
+                                 - 5), 1)
+        self.assertEqual(self.scan(("distinct", "V")).field, "V")
+
+    def test_distinct_workers(self):
+        estimates = {self.scan(("distinct", "V", 10), workers=w).estimate()
+                     for w in (1, 2, 4, 7)}
+        self.assertEqual(len(estimates), 1)
+
+    def test_frequency(self):
+        exact = self.exact("V")
+        for width, depth in ((2048, 5), (64, 3), (16, 1)):
+            with self.subTest(width=width, depth=depth):
+                sketch = self.scan(("frequency", "V", width, depth))
+                self.assertEqual(sketch.kind, "frequency")
+                self.assertAlmostEqual(sketch.error,
+                                       math.e * N_ENTRIES / width,
+                                       places=3)
+                over = 0
+                for value, count in exact.items():
+                    estimate = sketch.count(value)
+                    self.assertGreaterEqual(estimate, count)
+                    over += estimate - count > sketch.error
+                # Each within the bound with probability 1 - exp(-depth)
+                self.assertLessEqual(
+                    over, 2 * math.exp(-depth) * len(exact) + 2)
+                self.assertEqual(sketch.count(value.encode()), estimate)
+        sketch = self.scan(("frequency", "V", 1 << 20))
+        self.assertEqual(sketch.count("absent"), 0)
+        self.assertEqual(sketch.count("v1"), exact["v1"])
+        self.assertEqual(
+            self.scan(("frequency", "V"), workers=1).count("v2"),
+            self.scan(("frequency", "V"), workers=5).count("v2"))
+
+    def test_top_k(self):
+        exact = self.exact("V")
+        for k in (1, 10, 50, 1000):
+            for workers in (1, 4):
+                with self.subTest(k=k, workers=workers):
+                    sketch = self.scan(("top_k", "V", k), workers=workers)
+                    self.assertEqual(sketch.kind, "top_k")
+                    self.assertTopK(sketch, exact)
+        sketch = self.scan(("top_k", "V", 10))
+        self.assertEqual(sketch.top(3), sketch.top()[:3])
+        self.assertEqual(sketch.top(0), [])
+        self.assertEqual(sketch.top()[0][0], "v1")
+
+    def test_matches_and_filter(self):
+        self.journal.add_match(UNIT="u1")
+        self.journal.filter("V!=v1")
+        exact = self.exact("V")
+        self.assertNotIn("v1", exact)
+        self.assertTopK(self.scan(("top_k", "V", 20)), exact)
+        self.assertEqual(self.scan(("distinct", "ID")).total,
+                         sum(exact.values()))
+
+    def test_converted_values(self):
+        self.journal.call_dict = dict(self.journal.call_dict,
+                                      V=lambda value: value.upper())
+        self.assertEqual(self.scan(("top_k", "V", 5)).top(1)[0][0], b"V1")
+
+    def test_merge(self):
+        other = pyjournalctl.Journal(path=self.other.name)
+        exact = self.exact("V")
+        for value, count in self.exact("V", other).items():
+            exact[value] = exact.get(value, 0) + count
+
+        sketch = self.scan(("distinct", "ID"))
+        sketch.merge(self.scan(("distinct", "ID"), other))
+        self.assertEqual(sketch.total, 2 * N_ENTRIES)
+        self.assertLess(abs(sketch.estimate() - 2 * N_ENTRIES),
+                        4 * sketch.error * 2 * N_ENTRIES)
+
+        sketch = self.scan(("frequency", "V", 256))
+        sketch.merge(self.scan(("frequency", "V", 256), other))
+        for value, count in exact.items():
+            self.assertGreaterEqual(sketch.count(value), count)
+
+        for k in (5, 40):
+            with self.subTest(k=k):
+                sketch = self.scan(("top_k", "V", k))
+                sketch.merge(self.scan(("top_k", "V", k), other))
+                self.assertTopK(sketch, exact)
+
+        # Halves of one journal
+        half = BASE + N_ENTRIES // 2 * 1000
+        sketch = self.scan(("top_k", "V", 30), until=half)
+        sketch.merge(self.scan(("top_k", "V", 30), since=half))
+        self.assertTopK(sketch, self.exact("V"))
+
+    def test_merge_mismatch(self):
+        sketch = self.scan(("top_k", "V", 10))
+        for other in (("top_k", "V", 11), ("top_k", "ID", 10),
+                      ("frequency", "V"), ("distinct", "V")):
+            with self.subTest(other=other):
+                self.assertRaises(ValueError, sketch.merge, self.scan(other))
+        self.assertRaises(TypeError, sketch.merge, {})
+
+    def test_merge_self(self):
+        exact = {value: 2 * count for value, count in self.exact("V").items()}
+        sketch = self.scan(("frequency", "V", 1 << 20))
+        sketch.merge(sketch)
+        self.assertEqual(sketch.total, 2 * N_ENTRIES)
+        self.assertEqual(sketch.count("v1"), exact["v1"])
+        sketch = self.scan(("top_k", "V", 20))
+        sketch.merge(sketch)
+        self.assertTopK(sketch, exact)
+
+    def test_arguments(self):
+        for aggregate in (("distinct", "V", 3), ("distinct", "V", 19),
+                          ("frequency", "V", 0), ("frequency", "V", 8, 33),
+                          ("top_k", "V", 0), ("top_k", "V", 1 << 21),
+                          ("top_k", "V", 1, 2), ("median", "V")):
+            with self.subTest(aggregate=aggregate):
+                self.assertRaises(ValueError, self.scan, aggregate)
+        self.assertRaises(TypeError, self.scan, ("top_k", 1))
+        distinct = self.scan(("distinct", "V"))
+        self.assertRaises(ValueError, distinct.count, "v1")
+        self.assertRaises(ValueError, distinct.top)
+        self.assertRaises(ValueError, self.scan(("top_k", "V")).estimate)
+
+
+def sketch_k(sketch):
+    """k of a top_k sketch, from its error bound"""
+    return round(sketch.total / sketch.error)
+
+
+if __name__ == "__main__":
+    unittest.main()
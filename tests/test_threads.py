@@ -0,0 +1,127 @@
+import os
+import tempfile
+import threading
+import time
+import unittest
+import uuid
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+N_FILES = 4
+PER_FILE = 10
+
+
+class Waiter(threading.Thread):
+    """Thread calling wait(timeout) once, timing it"""
+
+    def __init__(self, journal, timeout):
+        super().__init__()
+        self.journal = journal
+        self.timeout = timeout
+        self.result = None
+
+    def run(self):
+        start = time.monotonic()
+        self.result = self.journal.wait(self.timeout)
+        self.elapsed = time.monotonic() - start
+
+
+class ThreadsTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.staging = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.tmpdir.name, "journal")
+        self.ids = {"seqnum_id": uuid.uuid4(), "machine_id": uuid.uuid4(),
+                    "boot_id": uuid.uuid4()}
+        entries = [({"MESSAGE": "m%d" % n, "UNIT": "u%d" % (n // PER_FILE)},
+                     BASE + n * 1000) for n in range(N_FILES * PER_FILE)]
+        write_journal(self.path, entries, files=N_FILES, **self.ids)
+
+    def tearDown(self):
+        self.staging.cleanup()
+        self.tmpdir.cleanup()
+
+    def start_waiter(self, journal, timeout=30):
+        # The first wait() returns at once, having started watching
+        self.assertEqual(journal.wait(1), pyjournalctl.INVALIDATE)
+        waiter = Waiter(journal, timeout)
+        waiter.start()
+        time.sleep(0.2)
+        self.assertTrue(waiter.is_alive())
+        return waiter
+
+    def test_used_while_waiting(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        waiter = self.start_waiter(journal)
+        start = time.monotonic()
+        self.assertEqual(len(list(journal)), N_FILES * PER_FILE)
+        journal.seek_head()
+        self.assertEqual(journal.get_next()["MESSAGE"], "m0")
+        self.assertLess(time.monotonic() - start, 5)
+        self.assertTrue(waiter.is_alive())
+
+        # Woken by a file added meanwhile
+        added, = write_journal(self.staging.name,
+                               [({"MESSAGE": "added"}, BASE + 10**6)],
+                               seqnum=1000, **self.ids)
+        os.rename(added, os.path.join(self.path, "added.journal"))
+        waiter.join(20)
+        self.assertFalse(waiter.is_alive())
+        self.assertIn(waiter.result, (pyjournalctl.APPEND,
+                                      pyjournalctl.INVALIDATE))
+        self.assertLess(waiter.elapsed, 20)
+
+    def test_timeout(self):
+        journal = pyjournalctl.Journal(path=self.path)
+        waiter = self.start_waiter(journal, 1)
+        journal.get_next()
+        waiter.join(10)
+        self.assertEqual(waiter.result, pyjournalctl.NOP)
+        self.assertGreaterEqual(waiter.elapsed, 0.9)
+
+    def test_handle_replaced(self):
+        sidecars = os.path.join(self.tmpdir.name, "sidecars")
+        os.mkdir(sidecars)
+        journal = pyjournalctl.Journal(path=self.path, bloom=sidecars)
+        waiter = self.start_waiter(journal)
+        # Reopened on the one file which may match
+        journal.add_match(UNIT="u1")
+        self.assertEqual([entry["MESSAGE"] for entry in journal],
+                         ["m%d" % n for n in range(PER_FILE, 2 * PER_FILE)])
+        self.assertEqual(journal.bloom_info()["pruned"], N_FILES - 1)
+        waiter.join(10)
+        self.assertFalse(waiter.is_alive())
+        self.assertEqual(waiter.result, pyjournalctl.INVALIDATE)
+        # Watching the new handle from the next wait()
+        self.assertEqual(journal.wait(1), pyjournalctl.INVALIDATE)
+        self.assertEqual(journal.wait(1), pyjournalctl.NOP)
+
+    def test_reentrant_converter(self):
+        errors = []
+
+        def convert(value):
+            try:
+                journal.get_next()
+            except RuntimeError as error:
+                errors.append(error)
+                raise
+            return value
+
+        journal = pyjournalctl.Journal(path=self.path,
+                                       call_dict={"UNIT": convert})
+        # Raised rather than deadlocking, and the value converted by
+        # default_call instead
+        self.assertEqual(journal.get_next()["UNIT"], "u0")
+        self.assertEqual(len(errors), 1)
+        self.assertEqual(journal.get_next()["MESSAGE"], "m1")
+
+        journal.default_call = lambda value: journal.value_cache_info()
+        self.assertEqual(journal.get_next()["MESSAGE"], b"m2")
+
+
+if __name__ == "__main__":
+    unittest.main()
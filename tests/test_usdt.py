@@ -0,0 +1,94 @@
+import os
+import struct
+import unittest
+
+import pyjournalctl
+
+# Probes and their number of arguments, as documented in pyjournalctl.c
+PROBES = {
+    "entry__start": 2,
+    "entry__done": 2,
+    "convert__start": 2,
+    "convert__done": 3,
+    "convert__fail": 3,
+    "wait__start": 2,
+    "wait__done": 2,
+    "seek__start": 2,
+    "seek__done": 3,
+    "match__change": 4,
+}
+NT_STAPSDT = 3
+
+
+def read_section(path, name):
+    """Contents of section `name` of 64-bit little endian ELF file `path`,
+    or None if there is no such section"""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:6] != b"\x7fELF\x02\x01":
+        raise unittest.SkipTest("not a 64-bit little endian ELF file")
+    shoff, = struct.unpack_from("<Q", data, 0x28)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x3a)
+    sections = [struct.unpack_from("<IIQQQQ", data, shoff + i * shentsize)
+                for i in range(shnum)]
+    names = sections[shstrndx][4]
+    for sh_name, _, _, _, offset, size in sections:
+        end = data.index(b"\0", names + sh_name)
+        if data[names + sh_name:end].decode() == name:
+            return data[offset:offset + size]
+    return None
+
+
+def parse_notes(section):
+    """(provider, name, semaphore, arguments) of each stapsdt note"""
+    notes = []
+    offset = 0
+    while offset < len(section):
+        namesz, descsz, kind = struct.unpack_from("<III", section, offset)
+        offset += 12
+        owner = section[offset:offset + namesz]
+        offset += (namesz + 3) & ~3
+        desc = section[offset:offset + descsz]
+        offset += (descsz + 3) & ~3
+        if owner != b"stapsdt\0" or kind != NT_STAPSDT:
+            continue
+        _, _, semaphore = struct.unpack_from("<QQQ", desc)
+        provider, name, arguments = desc[24:].split(b"\0")[:3]
+        notes.append((provider.decode(), name.decode(), semaphore,
+                      arguments.decode().split()))
+    return notes
+
+
+class USDTTest(unittest.TestCase):
+
+    def setUp(self):
+        section = read_section(pyjournalctl.__file__, ".note.stapsdt")
+        if section is None:
+            if os.environ.get("PYJOURNALCTL_USDT"):
+                self.fail("built without probes, though PYJOURNALCTL_USDT "
+                          "is set")
+            raise unittest.SkipTest("built without PYJOURNALCTL_USDT=1")
+        self.notes = parse_notes(section)
+
+    def test_probes(self):
+        self.assertEqual({provider for provider, _, _, _ in self.notes},
+                         {"pyjournalctl"})
+        self.assertEqual({name for _, name, _, _ in self.notes}, set(PROBES))
+        for _, name, _, arguments in self.notes:
+            with self.subTest(name=name):
+                self.assertEqual(len(arguments), PROBES[name])
+                for argument in arguments:
+                    self.assertRegex(argument, r"^-?[1248]@")
+
+    def test_semaphores(self):
+        # One per probe, shared by its call sites
+        semaphores = {}
+        for _, name, semaphore, _ in self.notes:
+            self.assertNotEqual(semaphore, 0)
+            self.assertEqual(semaphores.setdefault(name, semaphore),
+                             semaphore)
+        self.assertEqual(len(set(semaphores.values())), len(PROBES))
+
+
+if __name__ == "__main__":
+    unittest.main()
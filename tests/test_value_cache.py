@@ -0,0 +1,127 @@
+import tempfile
+import unittest
+
+import pyjournalctl
+
+from journalfile import write_journal
+
+BASE = 1700000000000000
+N = 30
+
+
+class Counter:
+    """Converter counting its calls"""
+
+    def __init__(self, func=lambda value: value.decode()):
+        self.func = func
+        self.calls = 0
+
+    def __call__(self, value):
+        self.calls += 1
+        return self.func(value)
+
+
+class ValueCacheTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+        write_journal(cls.tmpdir.name,
+                      [({"MESSAGE": "m%d" % n, "UNIT": "u%d" % (n % 3),
+                         "PRIORITY": str(n % 8)}, BASE + n * 1000)
+                       for n in range(N)], files=2)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def open(self, value_cache=4, **kwargs):
+        return pyjournalctl.Journal(path=self.tmpdir.name,
+                                    value_cache=value_cache, **kwargs)
+
+    def test_same_object(self):
+        unit = Counter(lambda value: [value.decode()])
+        journal = self.open(call_dict={"UNIT": unit})
+        entries = list(journal)
+        self.assertEqual(unit.calls, 3)
+        self.assertEqual(entries[0]["UNIT"], ["u0"])
+        self.assertIs(entries[0]["UNIT"], entries[3]["UNIT"])
+        self.assertIs(entries[1]["UNIT"], entries[N - 2]["UNIT"])
+        self.assertIsNot(entries[0]["UNIT"], entries[1]["UNIT"])
+        # Not converted again when read again
+        journal.seek_head()
+        self.assertIs(journal.get_next()["UNIT"], entries[0]["UNIT"])
+        self.assertEqual(unit.calls, 3)
+
+    def test_max_values(self):
+        priority = Counter(lambda value: [int(value)])
+        journal = self.open(call_dict={"PRIORITY": priority})
+        entries = list(journal)
+        # The first four values are held, the others converted each time
+        held = [n for n in range(N) if n % 8 < 4]
+        self.assertEqual(priority.calls, 4 + N - len(held))
+        self.assertIs(entries[0]["PRIORITY"], entries[8]["PRIORITY"])
+        self.assertIsNot(entries[4]["PRIORITY"], entries[12]["PRIORITY"])
+        self.assertEqual(entries[4]["PRIORITY"], entries[12]["PRIORITY"])
+        # Values are held per field
+        self.assertEqual(len({id(entry["MESSAGE"]) for entry in entries}), N)
+        self.assertIs(entries[0]["UNIT"], entries[3]["UNIT"])
+
+    def test_info(self):
+        journal = self.open()
+        self.assertEqual(journal.value_cache_info(),
+                         {"hits": 0, "misses": 0, "size": 0, "fields": 0,
+                          "max_values": 4})
+        list(journal)
+        # MESSAGE distinct, UNIT of 3 values, PRIORITY of 8 of which 4
+        # are held, and _BOOT_ID and _MACHINE_ID of 1 each
+        priority_held = len([n for n in range(N) if n % 8 < 4])
+        hits = (N - 3) + (priority_held - 4) + 2 * (N - 1)
+        self.assertEqual(journal.value_cache_info(),
+                         {"hits": hits, "misses": 5 * N - hits,
+                          "size": 4 + 3 + 4 + 1 + 1, "fields": 5,
+                          "max_values": 4})
+        # All held for the first entry, its MESSAGE being among the first
+        # four values
+        journal.seek_head()
+        journal.get_next()
+        info = journal.value_cache_info()
+        self.assertEqual(info["hits"], hits + 5)
+        self.assertEqual(info["misses"], 5 * N - hits)
+
+    def test_emptied_on_assignment(self):
+        journal = self.open()
+        first = list(journal)
+        for name, value in (("default_call", Counter()),
+                            ("call_dict", {"UNIT": bytes.upper})):
+            with self.subTest(name=name):
+                setattr(journal, name, value)
+                info = journal.value_cache_info()
+                self.assertEqual((info["size"], info["fields"]), (0, 0))
+                journal.seek_head()
+                again = journal.get_next()
+                self.assertIsNot(again["MESSAGE"], first[0]["MESSAGE"])
+                self.assertEqual(journal.value_cache_info()["size"], 5)
+        # Converted with the new call_dict, not from the cache
+        self.assertEqual(again["UNIT"], b"U0")
+
+    def test_call_dict_modified_in_place(self):
+        journal = self.open()
+        unit = list(journal)[0]["UNIT"]
+        journal.call_dict["UNIT"] = lambda value: value
+        journal.seek_head()
+        # Still from the cache, as documented
+        self.assertIs(journal.get_next()["UNIT"], unit)
+
+    def test_disabled(self):
+        journal = self.open(0)
+        entries = list(journal)
+        self.assertIsNot(entries[0]["UNIT"], entries[3]["UNIT"])
+        self.assertEqual(journal.value_cache_info(),
+                         {"hits": 0, "misses": 0, "size": 0, "fields": 0,
+                          "max_values": 0})
+        self.assertRaises(ValueError, self.open, -1)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,195 @@
+import array
+import fcntl
+import os
+import socket
+import struct
+import tempfile
+import threading
+import unittest
+
+import pyjournalctl
+
+
+def parse_entry(data):
+    """Fields of an entry in journald's native protocol"""
+    fields = []
+    while data:
+        end = data.index(b"\n")
+        if b"=" in data[:end]:
+            name, value = data[:end].split(b"=", 1)
+            data = data[end + 1:]
+        else:
+            name = data[:end]
+            size, = struct.unpack_from("<Q", data, end + 1)
+            value = data[end + 9:end + 9 + size]
+            if data[end + 9 + size:end + 10 + size] != b"\n":
+                raise ValueError("Binary field not terminated")
+            data = data[end + 10 + size:]
+        fields.append((name.decode(), value))
+    return fields
+
+
+class JournalSocket:
+    """Receives datagrams sent to a socket like journald's, in a thread
+
+    Entries passed as a file descriptor are read from it, and recorded
+    with the seals of the file.
+    """
+
+    def __init__(self, path):
+        self.path = path
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        self.sock.bind(path)
+        self.sock.settimeout(0.05)
+        self.entries = []
+        self.seals = []
+        self.cond = threading.Condition()
+        self.stopping = False
+        self.thread = threading.Thread(target=self.run)
+        self.thread.start()
+
+    def run(self):
+        fd_size = array.array("i").itemsize
+        while not self.stopping:
+            try:
+                data, ancdata, _, _ = self.sock.recvmsg(
+                    1 << 25, socket.CMSG_SPACE(fd_size))
+            except socket.timeout:
+                continue
+            for level, type_, cmsg in ancdata:
+                if level == socket.SOL_SOCKET and type_ == socket.SCM_RIGHTS:
+                    fd = array.array("i", cmsg[:fd_size])[0]
+                    try:
+                        data = os.pread(fd, os.fstat(fd).st_size, 0)
+                        self.seals.append(fcntl.fcntl(fd, fcntl.F_GET_SEALS))
+                    finally:
+                        os.close(fd)
+            with self.cond:
+                self.entries.append(parse_entry(data))
+                self.cond.notify_all()
+
+    def wait(self, n, timeout=10):
+        with self.cond:
+            self.cond.wait_for(lambda: len(self.entries) >= n, timeout)
+            return list(self.entries)
+
+    def close(self):
+        self.stopping = True
+        self.thread.join()
+        self.sock.close()
+
+
+class WriterTest(unittest.TestCase):
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.journald = JournalSocket(os.path.join(self.tmpdir.name, "socket"))
+
+    def tearDown(self):
+        self.journald.close()
+        self.tmpdir.cleanup()
+
+    def writer(self, batch_size=1):
+        return pyjournalctl.JournalWriter(path=self.journald.path,
+                                          batch_size=batch_size)
+
+    def test_fields(self):
+        class Value:
+            def __str__(self):
+                return "value"
+        with self.writer() as writer:
+            writer.send(MESSAGE="hello é", PRIORITY=6, BIG=2 ** 70,
+                        NEGATIVE=-5, FLOAT=1.5, OTHER=Value(),
+                        BINARY=b"\x00\xff", LINES="a\nb",
+                        REPEATED=["x", 1, b"y"], EMPTY="")
+        self.assertEqual(self.journald.wait(1), [[
+            ("MESSAGE", "hello é".encode()), ("PRIORITY", b"6"),
+            ("BIG", str(2 ** 70).encode()), ("NEGATIVE", b"-5"),
+            ("FLOAT", b"1.5"), ("OTHER", b"value"),
+            ("BINARY", b"\x00\xff"), ("LINES", b"a\nb"),
+            ("REPEATED", b"x"), ("REPEATED", b"1"), ("REPEATED", b"y"),
+            ("EMPTY", b"")]])
+
+    def test_mapping(self):
+        with self.writer() as writer:
+            writer.send({"MESSAGE": "from mapping", "CODE": 1}, EXTRA="kw")
+        self.assertEqual(self.journald.wait(1), [[
+            ("MESSAGE", b"from mapping"), ("CODE", b"1"), ("EXTRA", b"kw")]])
+
+    def test_invalid(self):
+        with self.writer(batch_size=8) as writer:
+            self.assertRaises(ValueError, writer.send, _PID=1)
+            self.assertRaises(ValueError, writer.send, message="lower")
+            self.assertRaises(ValueError, writer.send, {"1ST": "digit"})
+            self.assertRaises(ValueError, writer.send, {"A" * 65: "long"})
+            self.assertRaises(TypeError, writer.send, {1: "int"})
+            self.assertRaises(ValueError, writer.send)
+            self.assertRaises(ValueError, writer.send, MESSAGE=[])
+            self.assertRaises(ValueError, writer.send, MESSAGE="ok",
+                              BAD_={"1": 2}, bad="x")
+            writer.send(MESSAGE="valid")
+        self.assertEqual(self.journald.wait(1), [[("MESSAGE", b"valid")]])
+        self.assertEqual(len(self.journald.wait(2, timeout=0.2)), 1)
+        self.assertRaises(ValueError, pyjournalctl.JournalWriter,
+                          path=self.journald.path, batch_size=0)
+
+    def test_batches(self):
+        writer = self.writer(batch_size=4)
+        for n in range(3):
+            writer.send(N=n)
+        self.assertEqual(self.journald.wait(1, timeout=0.2), [])
+        writer.send(N=3)
+        self.assertEqual(len(self.journald.wait(4)), 4)
+        writer.send(N=4)
+        writer.flush()
+        self.assertEqual(len(self.journald.wait(5)), 5)
+        writer.send(N=5)
+        writer.close()
+        self.assertEqual(self.journald.wait(6),
+                         [[("N", str(n).encode())] for n in range(6)])
+        self.assertRaises(ValueError, writer.send, N=6)
+
+    def test_many(self):
+        with self.writer(batch_size=64) as writer:
+            for n in range(1000):
+                writer.send(MESSAGE="Request %d done" % n, REQUEST=n)
+        entries = self.journald.wait(1000)
+        self.assertEqual([dict(e)["REQUEST"] for e in entries],
+                         [str(n).encode() for n in range(1000)])
+
+    def test_memfd(self):
+        message = bytes(range(256)) * (1 << 17)
+        with self.writer(batch_size=2) as writer:
+            writer.send(MESSAGE="small")
+            writer.send(MESSAGE=message, CODE=1)
+            writer.send(MESSAGE="after")
+        self.assertEqual(self.journald.wait(3), [
+            [("MESSAGE", b"small")], [("MESSAGE", message), ("CODE", b"1")],
+            [("MESSAGE", b"after")]])
+        self.assertEqual(len(self.journald.seals), 1)
+        seals = (fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW |
+                 fcntl.F_SEAL_WRITE | fcntl.F_SEAL_SEAL)
+        self.assertEqual(self.journald.seals[0] & seals, seals)
+
+    def test_reentrant_values(self):
+        writer = self.writer()
+
+        class Value:
+            def __str__(self):
+                writer.send(MESSAGE="inner")
+                writer.flush()
+                return "outer"
+        writer.send(MESSAGE=Value())
+        writer.close()
+        self.assertEqual(self.journald.wait(2), [
+            [("MESSAGE", b"inner")], [("MESSAGE", b"outer")]])
+
+    def test_no_socket(self):
+        writer = pyjournalctl.JournalWriter(
+            path=os.path.join(self.tmpdir.name, "missing"))
+        writer.send(MESSAGE="lost")
+        self.assertRaises(OSError, writer.flush)
+
+
+if __name__ == "__main__":
+    unittest.main()